@@ -0,0 +1,24 @@
+/*
+ * Interface of the codec plugins that compress loads with dlopen. Each
+ * plugin exports codec(), which returns its table of functions.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+struct codec {
+  const char *name;
+  /* largest output of compress for n bytes */
+  size_t (*bound)(size_t n);
+  size_t (*compress)(const unsigned char *in, size_t n, unsigned char *out);
+  /* returns the decompressed size, or (size_t)-1 if in is corrupt or
+     does not fit in cap bytes */
+  size_t (*decompress)(const unsigned char *in, size_t n,
+                       unsigned char *out, size_t cap);
+};
+
+typedef const struct codec *(*codec_fn)(void);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Order-0 Huffman codec. The output starts with the input size and the
+ * 256 byte frequencies, from which the decoder rebuilds the same tree,
+ * followed by the codes, least significant bit first.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "codec.h"
+
+#define SYMBOLS 256
+#define NODES (2 * SYMBOLS - 1)
+#define HEADER (8 + 4 * SYMBOLS)
+
+struct tree {
+  uint64_t weight[NODES];
+  int child[NODES][2];
+  int parent[NODES];
+  int root;
+};
+
+/* the lightest node without a parent, lowest index first */
+static int lightest(struct tree *t, int n) {
+  int i, best = -1;
+  for (i = 0; i < n; i++)
+    if (t->parent[i] < 0 && t->weight[i] &&
+        (best < 0 || t->weight[i] < t->weight[best]))
+      best = i;
+  return best;
+}
+
+static void build(struct tree *t, const uint32_t *freq) {
+  int i, n = SYMBOLS;
+  for (i = 0; i < NODES; i++)
+    t->parent[i] = -1;
+  for (i = 0; i < SYMBOLS; i++)
+    t->weight[i] = freq[i];
+  t->root = -1;
+  for (;;) {
+    int a = lightest(t, n);
+    if (a < 0)
+      return;
+    t->parent[a] = n;
+    int b = lightest(t, n);
+    if (b < 0) {
+      t->parent[a] = -1;
+      t->root = a;
+      return;
+    }
+    t->parent[b] = n;
+    t->weight[n] = t->weight[a] + t->weight[b];
+    t->child[n][0] = a;
+    t->child[n][1] = b;
+    t->parent[n] = -1;
+    n++;
+  }
+}
+
+static size_t huff_bound(size_t n) {
+  /* codes of inputs below 2^32 bytes are shorter than 64 bits */
+  return HEADER + n * 8 + 8;
+}
+
+static size_t huff_compress(const unsigned char *in, size_t n,
+                            unsigned char *out) {
+  uint32_t freq[SYMBOLS] = {0};
+  uint64_t code[SYMBOLS];
+  int len[SYMBOLS];
+  struct tree t;
+  size_t i, o = HEADER;
+  uint64_t bits = 0;
+  int nbits = 0;
+
+  for (i = 0; i < n; i++)
+    freq[in[i]]++;
+  build(&t, freq);
+  for (i = 0; i < SYMBOLS; i++) {
+    uint64_t c = 0;
+    int node = i, l = 0;
+    if (freq[i] && node == t.root)
+      l = 1; /* a lone symbol still takes a bit */
+    else if (freq[i])
+      /* walking up from the leaf leaves the root's bit in bit 0, which is
+         the first one written */
+      for (; node != t.root; node = t.parent[node], l++)
+        c = (c << 1) | (t.child[t.parent[node]][1] == node);
+    code[i] = c;
+    len[i] = l;
+  }
+
+  memcpy(out, &n, 8);
+  memcpy(out + 8, freq, sizeof(freq));
+  for (i = 0; i < n; i++) {
+    int l = len[in[i]], k;
+    for (k = 0; k < l; k++) {
+      bits |= ((code[in[i]] >> k) & 1) << nbits;
+      if (++nbits == 64) {
+        memcpy(out + o, &bits, 8);
+        o += 8;
+        bits = 0;
+        nbits = 0;
+      }
+    }
+  }
+  if (nbits) {
+    memcpy(out + o, &bits, (nbits + 7) / 8);
+    o += (nbits + 7) / 8;
+  }
+  return o;
+}
+
+static size_t huff_decompress(const unsigned char *in, size_t n,
+                              unsigned char *out, size_t cap) {
+  uint32_t freq[SYMBOLS];
+  struct tree t;
+  size_t size, i, bit = 0, nbits;
+
+  if (n < HEADER)
+    return (size_t)-1;
+  memcpy(&size, in, 8);
+  memcpy(freq, in + 8, sizeof(freq));
+  if (size > cap)
+    return (size_t)-1;
+  build(&t, freq);
+  if (t.root < 0)
+    return size ? (size_t)-1 : 0;
+  in += HEADER;
+  nbits = (n - HEADER) * 8;
+  for (i = 0; i < size; i++) {
+    int node = t.root;
+    if (node < SYMBOLS)
+      bit++; /* the lone symbol's bit */
+    while (node >= SYMBOLS) {
+      if (bit >= nbits)
+        return (size_t)-1;
+      node = t.child[node][(in[bit / 8] >> (bit % 8)) & 1];
+      bit++;
+    }
+    out[i] = (unsigned char)node;
+  }
+  return size;
+}
+
+static const struct codec huff = {
+  "huffman", huff_bound, huff_compress, huff_decompress
+};
+
+const struct codec *codec(void) {
+  return &huff;
+}
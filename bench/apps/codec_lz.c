@@ -0,0 +1,134 @@
+/*
+ * LZ77 codec with hash chains over a 64KB window. The output is a list of
+ * sequences: the number of literals, the literals, the match length (0
+ * after the last literals) and the match offset, numbers being varints.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "codec.h"
+
+#define WINDOW (1 << 16)
+#define HASH_BITS 15
+#define MIN_MATCH 4
+#define MAX_CHAIN 32
+
+static unsigned hash4(const unsigned char *p) {
+  unsigned v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_varint(unsigned char *out, size_t v) {
+  while (v >= 0x80) {
+    *out++ = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  *out++ = (unsigned char)v;
+  return out;
+}
+
+static const unsigned char *get_varint(const unsigned char *in,
+                                       const unsigned char *end, size_t *v) {
+  size_t r = 0;
+  int shift = 0;
+  while (in < end && shift < 64) {
+    unsigned char b = *in++;
+    r |= (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *v = r;
+      return in;
+    }
+    shift += 7;
+  }
+  return 0;
+}
+
+static size_t lz_bound(size_t n) {
+  return n + n / 64 + 32;
+}
+
+static size_t lz_compress(const unsigned char *in, size_t n,
+                          unsigned char *out) {
+  long *head = malloc(sizeof(long) << HASH_BITS);
+  long *prev = malloc(sizeof(long) * WINDOW);
+  unsigned char *o = out;
+  size_t i = 0, lit = 0;
+
+  memset(head, -1, sizeof(long) << HASH_BITS);
+  while (i + MIN_MATCH <= n) {
+    unsigned h = hash4(in + i);
+    long cand = head[h];
+    size_t best = 0, best_off = 0;
+    int chain = MAX_CHAIN;
+    while (cand >= 0 && i - cand <= WINDOW - 1 && chain--) {
+      size_t len = 0;
+      while (i + len < n && in[cand + len] == in[i + len])
+        len++;
+      if (len > best) {
+        best = len;
+        best_off = i - cand;
+      }
+      cand = prev[cand % WINDOW];
+    }
+    prev[i % WINDOW] = head[h];
+    head[h] = i;
+    if (best < MIN_MATCH) {
+      i++;
+      continue;
+    }
+    o = put_varint(o, i - lit);
+    memcpy(o, in + lit, i - lit);
+    o += i - lit;
+    o = put_varint(o, best);
+    o = put_varint(o, best_off);
+    /* index the matched bytes too */
+    size_t end = i + best;
+    for (i++; i < end && i + MIN_MATCH <= n; i++) {
+      h = hash4(in + i);
+      prev[i % WINDOW] = head[h];
+      head[h] = i;
+    }
+    i = lit = end;
+  }
+  o = put_varint(o, n - lit);
+  memcpy(o, in + lit, n - lit);
+  o += n - lit;
+  o = put_varint(o, 0);
+  free(head);
+  free(prev);
+  return o - out;
+}
+
+static size_t lz_decompress(const unsigned char *in, size_t n,
+                            unsigned char *out, size_t cap) {
+  const unsigned char *end = in + n;
+  size_t o = 0;
+  for (;;) {
+    size_t lit, len, off;
+    if (!(in = get_varint(in, end, &lit)) || lit > (size_t)(end - in) ||
+        lit > cap - o)
+      return (size_t)-1;
+    memcpy(out + o, in, lit);
+    in += lit;
+    o += lit;
+    if (!(in = get_varint(in, end, &len)))
+      return (size_t)-1;
+    if (!len)
+      return o;
+    if (!(in = get_varint(in, end, &off)) || !off || off > o ||
+        len > cap - o)
+      return (size_t)-1;
+    /* byte by byte, matches may overlap their output */
+    for (; len; len--, o++)
+      out[o] = out[o - off];
+  }
+}
+
+static const struct codec lz = {
+  "lz", lz_bound, lz_compress, lz_decompress
+};
+
+const struct codec *codec(void) {
+  return &lz;
+}
@@ -0,0 +1,115 @@
+/*
+ * Compression workload. Loads the codec plugins given on the command line
+ * with dlopen and runs each of them, and all of them chained, over a
+ * generated text corpus, checking that every round trip gives the input
+ * back. Prints the compressed sizes, which do not depend on the toolchain.
+ *
+ *   compress [scale] plugin.so...
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "codec.h"
+
+#define MAX_CODECS 8
+
+static const char *words[] = {
+  "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "with",
+  "control", "flow", "integrity", "indirect", "branch", "target", "table",
+  "module", "runtime", "sandbox", "function", "pointer", "return", "call",
+  "virtual", "method", "class", "type", "signature", "equivalence", "id",
+  "version", "patch", "load", "library", "dynamic", "linking", "graph",
+  "compiler", "instrumentation", "check", "thread", "memory", "code"
+};
+
+/* about n bytes of text, words picked with a skewed distribution */
+static unsigned char *corpus(size_t n) {
+  unsigned char *text = malloc(n + 32);
+  unsigned long seed = 12345;
+  size_t len = 0, col = 0;
+  size_t nwords = sizeof(words) / sizeof(words[0]);
+  while (len < n) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    size_t r = (seed >> 33) % (nwords * nwords);
+    /* the square root makes low indices more likely */
+    size_t w = 0;
+    while ((w + 1) * (w + 1) <= r)
+      w++;
+    w = nwords - 1 - w;
+    size_t l = strlen(words[w]);
+    memcpy(text + len, words[w], l);
+    len += l;
+    col += l + 1;
+    text[len++] = col > 72 ? (col = 0, '\n') : ((seed >> 20) % 13 ? ' ' : ',');
+  }
+  return text;
+}
+
+int main(int argc, char **argv) {
+  const struct codec *codecs[MAX_CODECS];
+  int ncodecs = 0, i, round, rounds;
+  double scale = 1;
+
+  if (argc > 1 && !strstr(argv[1], ".so")) {
+    scale = atof(argv[1]);
+    argv++;
+    argc--;
+  }
+  for (i = 1; i < argc && ncodecs < MAX_CODECS; i++) {
+    void *h = dlopen(argv[i], RTLD_NOW);
+    codec_fn fn;
+    if (!h || !(fn = (codec_fn)dlsym(h, "codec"))) {
+      fprintf(stderr, "%s\n", dlerror());
+      return 1;
+    }
+    codecs[ncodecs++] = fn();
+  }
+  if (!ncodecs) {
+    fprintf(stderr, "compress [scale] plugin.so...\n");
+    return 1;
+  }
+
+  size_t n = 4 << 20;
+  rounds = (int)(4 * scale) > 0 ? (int)(4 * scale) : 1;
+  unsigned char *text = corpus(n);
+  size_t cap = n;
+  for (i = 0; i < ncodecs; i++)
+    cap = codecs[i]->bound(cap);
+  unsigned char *a = malloc(cap), *b = malloc(cap);
+
+  for (round = 0; round < rounds; round++) {
+    /* every codec alone, then all of them in a chain */
+    for (i = 0; i <= ncodecs; i++) {
+      int first = i < ncodecs ? i : 0;
+      int last = i < ncodecs ? i : ncodecs - 1;
+      int k;
+      size_t len = n;
+      memcpy(a, text, n);
+      for (k = first; k <= last; k++) {
+        len = codecs[k]->compress(a, len, b);
+        memcpy(a, b, len);
+      }
+      if (!round)
+        printf("%s%s: %zu -> %zu\n", codecs[first]->name,
+               first == last ? "" : "+...", n, len);
+      for (k = last; k >= first; k--) {
+        len = codecs[k]->decompress(a, len, b, cap);
+        if (len == (size_t)-1) {
+          fprintf(stderr, "%s failed to decompress\n", codecs[k]->name);
+          return 1;
+        }
+        memcpy(a, b, len);
+      }
+      if (len != n || memcmp(a, text, n)) {
+        fprintf(stderr, "%s did not round trip\n", codecs[first]->name);
+        return 1;
+      }
+    }
+  }
+  free(a);
+  free(b);
+  free(text);
+  return 0;
+}
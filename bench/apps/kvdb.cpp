@@ -0,0 +1,272 @@
+/*
+ * Database engine workload. A table of rows keyed by id, with a secondary
+ * index on one column, answers queries built from expression and operator
+ * class hierarchies, so every row a query touches costs a few virtual
+ * calls, while inserts, updates and deletes keep the maps allocating.
+ * Prints a checksum of the query results.
+ *
+ *   kvdb [scale]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace {
+
+const int COLUMNS = 4;
+
+struct Row {
+  long col[COLUMNS];
+};
+
+class Table {
+public:
+  typedef std::map<long, Row> Rows;
+  typedef std::multimap<long, long> Index;
+
+  // the secondary index is on column 1
+  void put(long id, const Row &row) {
+    Rows::iterator it = rows.find(id);
+    if (it != rows.end())
+      unindex(id, it->second);
+    rows[id] = row;
+    index.insert(std::make_pair(row.col[1], id));
+  }
+
+  bool remove(long id) {
+    Rows::iterator it = rows.find(id);
+    if (it == rows.end())
+      return false;
+    unindex(id, it->second);
+    rows.erase(it);
+    return true;
+  }
+
+  const Rows &all() const { return rows; }
+  const Index &by_col1() const { return index; }
+
+private:
+  void unindex(long id, const Row &row) {
+    std::pair<Index::iterator, Index::iterator> r =
+        index.equal_range(row.col[1]);
+    for (Index::iterator it = r.first; it != r.second; ++it)
+      if (it->second == id) {
+        index.erase(it);
+        return;
+      }
+  }
+
+  Rows rows;
+  Index index;
+};
+
+// expressions over a row
+
+class Expr {
+public:
+  virtual ~Expr() {}
+  virtual long eval(const Row &row) const = 0;
+};
+
+class Column : public Expr {
+public:
+  explicit Column(int i) : i(i) {}
+  long eval(const Row &row) const { return row.col[i]; }
+private:
+  int i;
+};
+
+class Const : public Expr {
+public:
+  explicit Const(long v) : v(v) {}
+  long eval(const Row &) const { return v; }
+private:
+  long v;
+};
+
+class Binary : public Expr {
+public:
+  Binary(Expr *l, Expr *r) : l(l), r(r) {}
+protected:
+  std::unique_ptr<Expr> l, r;
+};
+
+class Less : public Binary {
+public:
+  Less(Expr *l, Expr *r) : Binary(l, r) {}
+  long eval(const Row &row) const { return l->eval(row) < r->eval(row); }
+};
+
+class Equal : public Binary {
+public:
+  Equal(Expr *l, Expr *r) : Binary(l, r) {}
+  long eval(const Row &row) const { return l->eval(row) == r->eval(row); }
+};
+
+class And : public Binary {
+public:
+  And(Expr *l, Expr *r) : Binary(l, r) {}
+  long eval(const Row &row) const { return l->eval(row) && r->eval(row); }
+};
+
+class Add : public Binary {
+public:
+  Add(Expr *l, Expr *r) : Binary(l, r) {}
+  long eval(const Row &row) const { return l->eval(row) + r->eval(row); }
+};
+
+class Mod : public Binary {
+public:
+  Mod(Expr *l, Expr *r) : Binary(l, r) {}
+  long eval(const Row &row) const {
+    long d = r->eval(row);
+    return d ? l->eval(row) % d : 0;
+  }
+};
+
+// query operators, pulling rows one at a time
+
+class Operator {
+public:
+  virtual ~Operator() {}
+  virtual const Row *next() = 0;
+};
+
+class Scan : public Operator {
+public:
+  explicit Scan(const Table &t) : it(t.all().begin()), end(t.all().end()) {}
+  const Row *next() { return it == end ? 0 : &(it++)->second; }
+private:
+  Table::Rows::const_iterator it, end;
+};
+
+// rows whose column 1 is in [lo, hi)
+class IndexRange : public Operator {
+public:
+  IndexRange(const Table &t, long lo, long hi)
+    : table(t), it(t.by_col1().lower_bound(lo)),
+      end(t.by_col1().lower_bound(hi)) {}
+  const Row *next() {
+    if (it == end)
+      return 0;
+    return &table.all().find((it++)->second)->second;
+  }
+private:
+  const Table &table;
+  Table::Index::const_iterator it, end;
+};
+
+class Filter : public Operator {
+public:
+  Filter(Operator *in, Expr *pred) : in(in), pred(pred) {}
+  const Row *next() {
+    const Row *row;
+    while ((row = in->next()) && !pred->eval(*row))
+      ;
+    return row;
+  }
+private:
+  std::unique_ptr<Operator> in;
+  std::unique_ptr<Expr> pred;
+};
+
+class Accumulator {
+public:
+  virtual ~Accumulator() {}
+  virtual void add(long v) = 0;
+  virtual long result() const = 0;
+};
+
+class Count : public Accumulator {
+public:
+  Count() : n(0) {}
+  void add(long) { n++; }
+  long result() const { return n; }
+private:
+  long n;
+};
+
+class Sum : public Accumulator {
+public:
+  Sum() : s(0) {}
+  void add(long v) { s += v; }
+  long result() const { return s; }
+private:
+  long s;
+};
+
+class Max : public Accumulator {
+public:
+  Max() : m(0) {}
+  void add(long v) { if (v > m) m = v; }
+  long result() const { return m; }
+private:
+  long m;
+};
+
+long aggregate(Operator *in, Expr *value, Accumulator *acc) {
+  std::unique_ptr<Operator> op(in);
+  std::unique_ptr<Expr> e(value);
+  std::unique_ptr<Accumulator> a(acc);
+  const Row *row;
+  while ((row = op->next()))
+    a->add(e->eval(*row));
+  return a->result();
+}
+
+unsigned long seed = 42;
+
+long rnd(long n) {
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return (long)((seed >> 33) % n);
+}
+
+Row random_row() {
+  Row row;
+  for (int i = 0; i < COLUMNS; i++)
+    row.col[i] = rnd(1000);
+  return row;
+}
+
+}
+
+int main(int argc, char **argv) {
+  double scale = argc > 1 ? atof(argv[1]) : 1;
+  long rounds = (long)(100 * scale) > 0 ? (long)(100 * scale) : 1;
+  const long keys = 20000;
+  long checksum = 0;
+  Table t;
+
+  for (long id = 0; id < keys; id++)
+    t.put(id, random_row());
+  for (long round = 0; round < rounds; round++) {
+    // churn a tenth of the table
+    for (long i = 0; i < keys / 10; i++) {
+      long id = rnd(keys * 2);
+      if (rnd(3) == 0)
+        t.remove(id);
+      else
+        t.put(id, random_row());
+    }
+    long k = rnd(900);
+    checksum += aggregate(
+        new Filter(new Scan(t),
+                   new And(new Less(new Column(0), new Const(k)),
+                           new Equal(new Mod(new Column(2), new Const(7)),
+                                     new Const(round % 7)))),
+        new Add(new Column(3), new Column(1)), new Sum);
+    checksum += aggregate(new IndexRange(t, k, k + 100), new Column(3),
+                          new Max);
+    checksum += aggregate(
+        new Filter(new IndexRange(t, k / 2, k / 2 + 300),
+                   new Less(new Column(2), new Column(3))),
+        new Const(1), new Count);
+    checksum += aggregate(new Scan(t), new Mod(new Column(0), new Const(3)),
+                          new Sum);
+  }
+  printf("%ld %lu\n", checksum, (unsigned long)t.all().size());
+  return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * Scheme-like interpreter workload. Special forms and primitives are
+ * reached through function pointers hung off their symbols, the way
+ * embedded scripting languages dispatch, and cells are reclaimed by a
+ * mark-and-sweep collector that runs between calls from the host. The
+ * host loads the script below and calls (bench i) for i up to the scale,
+ * printing the sum of the results.
+ *
+ *   lisp [scale]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char script[] =
+  "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))\n"
+  "(define (range a b) (if (< a b) (cons a (range (+ a 1) b)) '()))\n"
+  "(define (map f l) (if (null? l) '() (cons (f (car l)) (map f (cdr l)))))\n"
+  "(define (filter p l)\n"
+  "  (cond ((null? l) '())\n"
+  "        ((p (car l)) (cons (car l) (filter p (cdr l))))\n"
+  "        (else (filter p (cdr l)))))\n"
+  "(define (append a b) (if (null? a) b (cons (car a) (append (cdr a) b))))\n"
+  "(define (qsort l)\n"
+  "  (if (null? l) l\n"
+  "      (let ((p (car l)) (r (cdr l)))\n"
+  "        (append (qsort (filter (lambda (x) (< x p)) r))\n"
+  "                (cons p (qsort (filter (lambda (x) (not (< x p))) r)))))))\n"
+  "(define (lcg seed n)\n"
+  "  (if (= n 0) '()\n"
+  "      (cons seed (lcg (remainder (+ (* seed 1103515245) 12345) 2147483648)\n"
+  "                      (- n 1)))))\n"
+  "(define (sum l acc) (if (null? l) acc (sum (cdr l) (+ acc (car l)))))\n"
+  "(define (nth l n) (if (= n 0) (car l) (nth (cdr l) (- n 1))))\n"
+  "(define (bench i)\n"
+  "  (let ((sorted (qsort (lcg i 2000))))\n"
+  "    (+ (fib 18)\n"
+  "       (nth sorted 1000)\n"
+  "       (sum (map (lambda (x) (* x x)) (range 0 1000)) 0))))\n";
+
+enum type { NUM, SYM, PAIR, PRIM, LAMBDA };
+
+typedef struct obj obj;
+typedef obj *(*prim_fn)(obj *args);
+/* a special form either returns its value or stores the expression to
+   evaluate in its place in *x and returns NULL */
+typedef obj *(*form_fn)(obj **x, obj **env);
+
+struct obj {
+  enum type type;
+  int mark;
+  union {
+    long num;
+    struct { obj *car, *cdr; } pair;
+    struct { const char *name; obj *value; form_fn form; obj *next; } sym;
+    prim_fn prim;
+    struct { obj *params, *body, *env; } lambda;
+  } u;
+};
+
+#define BLOCK 65536
+
+struct block {
+  obj cells[BLOCK];
+  struct block *next;
+};
+
+static struct block *blocks;
+static obj *free_cells;
+static obj *symbols;
+static obj nil_obj = { PAIR, 1, { 0 } };
+#define nil (&nil_obj)
+static obj *t_sym, *quote_sym, *else_sym, *begin_sym;
+
+static void fail(const char *msg, obj *x) {
+  fprintf(stderr, "lisp: %s", msg);
+  if (x && x->type == SYM)
+    fprintf(stderr, " %s", x->u.sym.name);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static obj *alloc(enum type type) {
+  obj *o;
+  if (!free_cells) {
+    struct block *b = malloc(sizeof(*b));
+    int i;
+    if (!b)
+      fail("out of memory", NULL);
+    for (i = 0; i < BLOCK; i++) {
+      b->cells[i].mark = 0;
+      b->cells[i].type = NUM;
+      b->cells[i].u.pair.cdr = i + 1 < BLOCK ? &b->cells[i + 1] : NULL;
+    }
+    free_cells = b->cells;
+    b->next = blocks;
+    blocks = b;
+  }
+  o = free_cells;
+  free_cells = o->u.pair.cdr;
+  o->type = type;
+  return o;
+}
+
+static obj *cons(obj *car, obj *cdr) {
+  obj *o = alloc(PAIR);
+  o->u.pair.car = car;
+  o->u.pair.cdr = cdr;
+  return o;
+}
+
+static obj *num(long n) {
+  obj *o = alloc(NUM);
+  o->u.num = n;
+  return o;
+}
+
+#define car(x) ((x)->u.pair.car)
+#define cdr(x) ((x)->u.pair.cdr)
+#define cadr(x) car(cdr(x))
+#define cddr(x) cdr(cdr(x))
+
+static obj *intern(const char *name, size_t len) {
+  obj *s;
+  for (s = symbols; s; s = s->u.sym.next)
+    if (strlen(s->u.sym.name) == len && !memcmp(s->u.sym.name, name, len))
+      return s;
+  /* symbols live for good, so they do not come from the collected heap */
+  s = calloc(1, sizeof(*s));
+  s->type = SYM;
+  s->mark = 1;
+  s->u.sym.name = strndup(name, len);
+  s->u.sym.next = symbols;
+  symbols = s;
+  return s;
+}
+
+/* garbage collection, only ever between top-level evaluations */
+
+static void mark(obj *o) {
+  while (o && !o->mark) {
+    o->mark = 1;
+    switch (o->type) {
+    case PAIR:
+      mark(car(o));
+      o = cdr(o);
+      break;
+    case LAMBDA:
+      mark(o->u.lambda.params);
+      mark(o->u.lambda.body);
+      o = o->u.lambda.env;
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+static void gc(void) {
+  struct block *b;
+  obj *s;
+  int i;
+  for (s = symbols; s; s = s->u.sym.next)
+    mark(s->u.sym.value);
+  free_cells = NULL;
+  for (b = blocks; b; b = b->next)
+    for (i = 0; i < BLOCK; i++) {
+      obj *o = &b->cells[i];
+      if (o->mark) {
+        o->mark = 0;
+      } else {
+        o->type = NUM;
+        o->u.pair.cdr = free_cells;
+        free_cells = o;
+      }
+    }
+}
+
+/* reader */
+
+static obj *read_expr(const char **p);
+
+static void skip_space(const char **p) {
+  while (**p == ' ' || **p == '\n' || **p == '\t' || **p == ';') {
+    if (**p == ';')
+      while (**p && **p != '\n')
+        (*p)++;
+    else
+      (*p)++;
+  }
+}
+
+static obj *read_list(const char **p) {
+  obj *head;
+  skip_space(p);
+  if (**p == ')') {
+    (*p)++;
+    return nil;
+  }
+  if (!**p)
+    fail("unterminated list", NULL);
+  head = read_expr(p);
+  return cons(head, read_list(p));
+}
+
+static obj *read_expr(const char **p) {
+  const char *start;
+  skip_space(p);
+  if (**p == '(') {
+    (*p)++;
+    return read_list(p);
+  }
+  if (**p == '\'') {
+    (*p)++;
+    return cons(quote_sym, cons(read_expr(p), nil));
+  }
+  start = *p;
+  while (**p && !strchr(" \n\t;()'", **p))
+    (*p)++;
+  if (*p == start)
+    fail("unexpected character", NULL);
+  if ((*start >= '0' && *start <= '9') ||
+      (*start == '-' && *p - start > 1))
+    return num(strtol(start, NULL, 10));
+  return intern(start, *p - start);
+}
+
+/* evaluator */
+
+static obj *eval(obj *x, obj *env);
+
+static obj *lookup(obj *s, obj *env) {
+  for (; env != nil; env = cdr(env))
+    if (car(car(env)) == s)
+      return cdr(car(env));
+  if (!s->u.sym.value)
+    fail("unbound variable", s);
+  return s->u.sym.value;
+}
+
+static obj *eval_list(obj *l, obj *env) {
+  obj *head;
+  if (l == nil)
+    return nil;
+  head = eval(car(l), env);
+  return cons(head, eval_list(cdr(l), env));
+}
+
+static obj *bind(obj *params, obj *args, obj *env) {
+  for (; params != nil; params = cdr(params), args = cdr(args)) {
+    if (args == nil)
+      fail("too few arguments", NULL);
+    env = cons(cons(car(params), car(args)), env);
+  }
+  return env;
+}
+
+static obj *eval(obj *x, obj *env) {
+  for (;;) {
+    obj *f, *args, *v;
+    if (x->type == NUM || x == nil)
+      return x;
+    if (x->type == SYM)
+      return lookup(x, env);
+    if (car(x)->type == SYM && car(x)->u.sym.form) {
+      if ((v = car(x)->u.sym.form(&x, &env)))
+        return v;
+      continue;
+    }
+    f = eval(car(x), env);
+    args = eval_list(cdr(x), env);
+    if (f->type == PRIM)
+      return f->u.prim(args);
+    if (f->type != LAMBDA)
+      fail("not a procedure", car(x));
+    env = bind(f->u.lambda.params, args, f->u.lambda.env);
+    x = f->u.lambda.body;
+  }
+}
+
+/* the body of lambdas and begins, all but the last expression */
+static obj *form_begin(obj **x, obj **env) {
+  obj *l = cdr(*x);
+  if (l == nil)
+    return nil;
+  for (; cdr(l) != nil; l = cdr(l))
+    eval(car(l), *env);
+  *x = car(l);
+  return NULL;
+}
+
+static obj *form_quote(obj **x, obj **env) {
+  (void)env;
+  return cadr(*x);
+}
+
+static obj *form_if(obj **x, obj **env) {
+  obj *l = cdr(*x);
+  if (eval(car(l), *env) != nil) {
+    *x = cadr(l);
+  } else if (cddr(l) != nil) {
+    *x = car(cddr(l));
+  } else {
+    return nil;
+  }
+  return NULL;
+}
+
+static obj *form_cond(obj **x, obj **env) {
+  obj *l;
+  for (l = cdr(*x); l != nil; l = cdr(l)) {
+    obj *clause = car(l);
+    if (car(clause) == else_sym || eval(car(clause), *env) != nil) {
+      *x = cons(NULL, cdr(clause));
+      return form_begin(x, env);
+    }
+  }
+  return nil;
+}
+
+static obj *make_lambda(obj *params, obj *body, obj *env) {
+  obj *o = alloc(LAMBDA);
+  o->u.lambda.params = params;
+  o->u.lambda.body = cons(begin_sym, body);
+  o->u.lambda.env = env;
+  return o;
+}
+
+static obj *form_lambda(obj **x, obj **env) {
+  return make_lambda(cadr(*x), cddr(*x), *env);
+}
+
+static obj *form_define(obj **x, obj **env) {
+  obj *target = cadr(*x);
+  if (target->type == PAIR) {
+    car(target)->u.sym.value = make_lambda(cdr(target), cddr(*x), *env);
+    return car(target);
+  }
+  target->u.sym.value = eval(car(cddr(*x)), *env);
+  return target;
+}
+
+static obj *form_let(obj **x, obj **env) {
+  obj *l, *e = *env;
+  for (l = cadr(*x); l != nil; l = cdr(l))
+    e = cons(cons(car(car(l)), eval(cadr(car(l)), *env)), e);
+  *env = e;
+  *x = cons(NULL, cddr(*x));
+  return form_begin(x, env);
+}
+
+/* primitives */
+
+static long arg_num(obj *a) {
+  if (a->type != NUM)
+    fail("not a number", a);
+  return a->u.num;
+}
+
+static obj *prim_add(obj *args) {
+  long r = 0;
+  for (; args != nil; args = cdr(args))
+    r += arg_num(car(args));
+  return num(r);
+}
+
+static obj *prim_mul(obj *args) {
+  long r = 1;
+  for (; args != nil; args = cdr(args))
+    r *= arg_num(car(args));
+  return num(r);
+}
+
+static obj *prim_sub(obj *args) {
+  long r = arg_num(car(args));
+  if (cdr(args) == nil)
+    return num(-r);
+  for (args = cdr(args); args != nil; args = cdr(args))
+    r -= arg_num(car(args));
+  return num(r);
+}
+
+static obj *prim_remainder(obj *args) {
+  long d = arg_num(cadr(args));
+  if (!d)
+    fail("division by zero", NULL);
+  return num(arg_num(car(args)) % d);
+}
+
+static obj *prim_lt(obj *args) {
+  return arg_num(car(args)) < arg_num(cadr(args)) ? t_sym : nil;
+}
+
+static obj *prim_eq(obj *args) {
+  return arg_num(car(args)) == arg_num(cadr(args)) ? t_sym : nil;
+}
+
+static obj *prim_cons(obj *args) {
+  return cons(car(args), cadr(args));
+}
+
+static obj *prim_car(obj *args) {
+  if (car(args)->type != PAIR || car(args) == nil)
+    fail("car of a non-pair", NULL);
+  return car(car(args));
+}
+
+static obj *prim_cdr(obj *args) {
+  if (car(args)->type != PAIR || car(args) == nil)
+    fail("cdr of a non-pair", NULL);
+  return cdr(car(args));
+}
+
+static obj *prim_null(obj *args) {
+  return car(args) == nil ? t_sym : nil;
+}
+
+static obj *prim_list(obj *args) {
+  return args;
+}
+
+static const struct { const char *name; form_fn form; } forms[] = {
+  { "quote", form_quote }, { "if", form_if }, { "cond", form_cond },
+  { "lambda", form_lambda }, { "define", form_define }, { "let", form_let },
+  { "begin", form_begin },
+};
+
+static const struct { const char *name; prim_fn prim; } prims[] = {
+  { "+", prim_add }, { "-", prim_sub }, { "*", prim_mul },
+  { "remainder", prim_remainder }, { "<", prim_lt }, { "=", prim_eq },
+  { "cons", prim_cons }, { "car", prim_car }, { "cdr", prim_cdr },
+  { "null?", prim_null }, { "not", prim_null }, { "list", prim_list },
+};
+
+static void init(void) {
+  size_t i;
+  for (i = 0; i < sizeof(forms) / sizeof(forms[0]); i++)
+    intern(forms[i].name, strlen(forms[i].name))->u.sym.form = forms[i].form;
+  for (i = 0; i < sizeof(prims) / sizeof(prims[0]); i++) {
+    obj *p = alloc(PRIM);
+    p->u.prim = prims[i].prim;
+    intern(prims[i].name, strlen(prims[i].name))->u.sym.value = p;
+  }
+  t_sym = intern("t", 1);
+  t_sym->u.sym.value = t_sym;
+  quote_sym = intern("quote", 5);
+  else_sym = intern("else", 4);
+  begin_sym = intern("begin", 5);
+}
+
+int main(int argc, char **argv) {
+  const char *p = script;
+  long i, iters = (long)(100 * (argc > 1 ? atof(argv[1]) : 1));
+  long checksum = 0;
+  obj *bench;
+
+  init();
+  for (skip_space(&p); *p; skip_space(&p)) {
+    eval(read_expr(&p), nil);
+    gc();
+  }
+  bench = intern("bench", 5);
+  for (i = 1; i <= iters; i++) {
+    obj *r = eval(cons(bench, cons(num(i), nil)), nil);
+    checksum += arg_num(r);
+    gc();
+  }
+  printf("%ld\n", checksum);
+  return 0;
+}
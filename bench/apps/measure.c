@@ -0,0 +1,122 @@
+/*
+ * Runs a program with its output discarded and prints its wall time, peak
+ * resident memory and, for MCFI programs, the runtime's trap and cfg
+ * generation counters, as "measurement<TAB>value" lines. Built with the host
+ * compiler, so that it is the same for every configuration.
+ *
+ *   measure program [argument]...
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* runtime/include/metrics.h */
+#define METRICS_MAGIC "MCFIMET1"
+#define METRICS_CALL_TRAPS  0x50
+#define METRICS_ENTRY_TRAPS 0x58
+#define METRICS_AT_TRAPS    0x60
+#define METRICS_GEN_CFGS    0x68
+#define METRICS_GEN_CFG_NS  0x70
+#define METRICS_VERSION     0x08
+/* from version 2 on */
+#define METRICS_LOAD_MAPPED_BYTES 0xd0
+#define METRICS_LOAD_COPIED_BYTES 0xd8
+#define METRICS_PREFIX      0xe0
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint64_t field(const char *m, int off) {
+  uint64_t v;
+  memcpy(&v, m + off, 8);
+  return v;
+}
+
+/* the runtime removes the segment's name when the program exits, so it is
+   mapped while the program runs, if it shows up before the program ends */
+static const char *map_metrics(pid_t pid) {
+  char path[64];
+  siginfo_t si;
+  snprintf(path, sizeof(path), "/dev/shm/mcfi-metrics.%d", (int)pid);
+  for (;;) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+      struct stat st;
+      const char *m = MAP_FAILED;
+      if (!fstat(fd, &st) && st.st_size >= METRICS_PREFIX)
+        m = mmap(0, METRICS_PREFIX, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      return m == MAP_FAILED ? NULL : m;
+    }
+    si.si_pid = 0;
+    if (waitid(P_PID, pid, &si, WEXITED | WNOHANG | WNOWAIT) || si.si_pid)
+      return NULL;
+    usleep(200);
+  }
+}
+
+int main(int argc, char **argv) {
+  struct rusage ru;
+  const char *m;
+  double start, end;
+  int status;
+  pid_t pid;
+
+  if (argc < 2) {
+    fprintf(stderr, "measure program [argument]...\n");
+    return 1;
+  }
+  start = now_ms();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (!pid) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    execv(argv[1], argv + 1);
+    perror(argv[1]);
+    _exit(127);
+  }
+  m = map_metrics(pid);
+  if (wait4(pid, &status, 0, &ru) < 0) {
+    perror("wait4");
+    return 1;
+  }
+  end = now_ms();
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "%s failed with status %#x\n", argv[1], status);
+    return 1;
+  }
+  printf("wall_ms\t%.2f\n", end - start);
+  printf("max_rss_kb\t%ld\n", ru.ru_maxrss);
+  if (m && !memcmp(m, METRICS_MAGIC, 8)) {
+    uint32_t version;
+    memcpy(&version, m + METRICS_VERSION, 4);
+    printf("traps\t%llu\n", (unsigned long long)(
+        field(m, METRICS_CALL_TRAPS) + field(m, METRICS_ENTRY_TRAPS) +
+        field(m, METRICS_AT_TRAPS)));
+    printf("cfg_gens\t%llu\n", (unsigned long long)field(m, METRICS_GEN_CFGS));
+    printf("cfg_ms\t%.2f\n", field(m, METRICS_GEN_CFG_NS) / 1e6);
+    if (version >= 2) {
+      printf("load_mapped_kb\t%llu\n", (unsigned long long)
+             field(m, METRICS_LOAD_MAPPED_BYTES) / 1024);
+      printf("load_copied_kb\t%llu\n", (unsigned long long)
+             field(m, METRICS_LOAD_COPIED_BYTES) / 1024);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Build the application workloads with each configuration in $CONFIGS, run
+# each of them $RUNS times under measure and report every configuration
+# against native. SCALE scales the work each of them does.
+
+cd "$(dirname "$0")"
+. ../config.sh
+
+RUNS=${RUNS:-5}
+SCALE=${SCALE:-1}
+APPS="lisp kvdb compress"
+RESULTS=$BENCH_OUT/apps/results.txt
+MEASURE=$BENCH_OUT/apps/measure
+
+mkdir -p $BENCH_OUT/apps
+: > $RESULTS
+cc -O2 -o $MEASURE measure.c || exit 1
+
+for config in $CONFIGS
+do
+    if ! config_env $config
+    then
+        echo "skipping $config" >&2
+        continue
+    fi
+    out=$BENCH_OUT/apps/$config
+    if ! make -s OUT=$out CC="$CC" CXX="$CXX" CFLAGS="$CFLAGS" LDFLAGS="$LDFLAGS"
+    then
+        echo "skipping $config, the build failed" >&2
+        continue
+    fi
+    for app in $APPS
+    do
+        args=$SCALE
+        [ $app = compress ] && args="$SCALE $out/libcodec_lz.so $out/libcodec_huff.so"
+        for run in $(seq $RUNS)
+        do
+            run_accepted $MEASURE $out/$app $args | sed "s/^/$config\t$app\t/" >> $RESULTS
+        done
+    done
+done
+
+python ../report.py $RESULTS
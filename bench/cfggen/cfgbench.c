@@ -0,0 +1,691 @@
+/*
+ * Offline benchmark of the cfg generation.
+ *
+ * Runs the cfggen.h code that generate_cfg in runtime/src/runtime.c runs,
+ * outside of the sandbox, on the MCFI metadata of ELF modules or on
+ * synthetic modules, and reports the time and the resident memory growth
+ * of every phase. Like the runtime, it is built without libc, against the
+ * runtime's headers, allocator and string functions.
+ */
+
+#include <elf.h>
+#include <mm.h>
+#include <io.h>
+#include <string.h>
+#include <syscall.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <cfggen/cfggen.h>
+#include <time.h>
+
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args);
+int snprintf(char *buf, size_t size, const char *fmt, ...);
+
+/* what cfggen.h expects from the runtime */
+int COMPAT_MODE = 0;
+int ACTIVATION_GRANULARITY = ACTIVATE_SITE;
+const char *MCFI_PROFILE = 0;
+const char *MCFI_PROFILE_OUT = 0;
+int INLINE_CACHE = FALSE;
+const char *MCFI_IIB_OUT = 0;
+
+static str *stringpool = 0;
+static dict *vtabletaken = 0;
+
+/* runtime/src/main.c loads the executable at X64ABIBASE; libraries are
+   placed one after the other from LIB_BASE here */
+#define X64ABIBASE 0x400000UL
+#define LIB_BASE 0x40000000UL
+
+#define STDOUT_FILENO 1
+
+#define RoundToPage(x) ((((unsigned long)x) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE)
+
+static code_module *modules = 0;
+static unsigned int bid_slot = BID_SLOT_START;
+static uintptr_t lib_end = LIB_BASE;
+static uintptr_t exe_end = 0;
+
+static void die(const char *fmt, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  write(STDERR_FILENO, buf, n);
+  quit(1);
+}
+
+/* resident memory in KB, from /proc/self/statm */
+static size_t rss_kb(void) {
+  char buf[128];
+  int fd = open("/proc/self/statm", O_RDONLY, 0);
+  if (fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  /* size resident ... in pages */
+  char *p = buf;
+  while (*p && *p != ' ')
+    p++;
+  size_t pages = 0;
+  while (*++p >= '0' && *p <= '9')
+    pages = pages * 10 + (*p - '0');
+  return pages * (PAGE_SIZE / 1024);
+}
+
+/* eat a hex number and an underscore */
+static char *eat_hex_and_udscore(char *c) {
+  while (isalnum(*c))
+    c++;
+  if (*c == '_')
+    c++;
+  return c;
+}
+
+struct section {
+  const char *name;
+  char *data;
+  size_t size;
+};
+
+/**
+ * Build a code module from the MCFI sections and the symbol table of a
+ * module, the way load_mcfi_metadata in runtime/src/main.c does, leaving
+ * out what only matters to the loaded code: online patching, the PLT and
+ * the .dynsym functions. Symbol values minus bias are module offsets.
+ */
+static code_module *load_module(struct section *secs, size_t nsecs,
+                                Elf64_Sym *sym, size_t numsym, char *strtab,
+                                int is_exe, uintptr_t bias, size_t sz) {
+  icf *icfs = 0;
+  function *functions = 0;
+  dict *classes = 0;
+  dict *cha = 0;
+  dict *aliases = 0;
+  dict *fats_in_code = 0;
+  dict *fats_in_data = 0;
+  dict *ctor = 0;
+  dict *vtable = 0;
+  graph *vtable_regions = 0;
+  code_module *cm = alloc_code_module();
+  size_t cnt;
+
+  for (cnt = 0; cnt < nsecs; cnt++) {
+    char *content = secs[cnt].data;
+    char *end = content + secs[cnt].size;
+    const char *shname = secs[cnt].name;
+    if (0 == strcmp(shname, ".MCFIIndirectCalls"))
+      parse_icfs(content, end, &icfs, &stringpool);
+    else if (0 == strcmp(shname, ".MCFIFuncInfo"))
+      parse_functions(content, end, &functions, &ctor, &stringpool);
+    else if (0 == strcmp(shname, ".MCFICHA"))
+      parse_cha(content, end, &classes, &cha, &stringpool);
+    else if (0 == strcmp(shname, ".MCFIAliases"))
+      parse_aliases(content, end, &aliases, &stringpool);
+    else if (0 == strcmp(shname, ".MCFIAddrTaken"))
+      parse_fats(content, end, &fats_in_data, &stringpool);
+    else if (0 == strcmp(shname, ".MCFIAddrTakenInCode"))
+      parse_fats(content, end, &fats_in_code, &stringpool);
+    else if (0 == strcmp(shname, ".MCFIVtable"))
+      parse_vtable(content, end, &vtable, &stringpool);
+    else if (0 == strcmp(shname, ".MCFIVtableRegions"))
+      parse_vtable_regions(content, end, &vtable_regions, &stringpool);
+    else
+      continue;
+    cm->instrumented = 1;
+  }
+
+  if (is_exe) {
+    if (exe_end)
+      die("only one executable can be given\n");
+    exe_end = X64ABIBASE + sz;
+    cm->base_addr = X64ABIBASE;
+    cm->is_exe = TRUE;
+    /* the fake functions of load_mcfi_metadata */
+    function *f = alloc_function();
+    f->name = sp_intern_string(&stringpool, "__exe_elf_entry");
+    f->type = sp_intern_string(&stringpool, "ExeElfEntry");
+    DL_APPEND(functions, f);
+    dict_add(&fats_in_data, f->name, 0);
+    f = alloc_function();
+    f->name = sp_intern_string(&stringpool, "__gxx_personality_v0");
+    f->type = sp_intern_string(&stringpool,
+                "i32!i32@i32@i64@%struct._Unwind_Exception*@%struct._Unwind_Context*@");
+    DL_APPEND(functions, f);
+    dict_add(&fats_in_data, "__gxx_personality_v0", 0);
+  } else {
+    cm->base_addr = lib_end;
+    lib_end = RoundToPage(lib_end + sz);
+  }
+  cm->icfs = icfs;
+  cm->functions = functions;
+  cm->classes = classes;
+  cm->cha = cha;
+  cm->aliases = aliases;
+  cm->fats_in_code = fats_in_code;
+  cm->fats_in_data = fats_in_data;
+  merge_dicts(&(cm->fats), cm->fats_in_code);
+  merge_dicts(&(cm->fats), cm->fats_in_data);
+  cm->vtable = vtable;
+  cm->vtable_regions = vtable_regions;
+  cm->sz = sz;
+
+  for (cnt = 0; cnt < numsym; cnt++) {
+    char *symname = strtab + sym[cnt].st_name;
+    size_t offset = sym[cnt].st_value - bias;
+    if (0 == strncmp(symname, "__mcfi_dcj_", 11)) {
+      symbol *dcjsym = alloc_sym();
+      dcjsym->name = sp_intern_string(&stringpool, eat_hex_and_udscore(symname + 11));
+      dcjsym->offset = offset;
+      DL_APPEND(cm->rad, dcjsym);
+    } else if (0 == strncmp(symname, "__mcfi_icj_", 11)) {
+      symbol *icjsym = alloc_sym();
+      icjsym->name = sp_intern_string(&stringpool, eat_hex_and_udscore(symname + 11));
+      icjsym->offset = offset;
+      DL_APPEND(cm->rai, icjsym);
+    } else if (0 == strncmp(symname, "__mcfi_lp_", 10)) {
+      symbol *lpsym = alloc_sym();
+      lpsym->offset = offset;
+      DL_APPEND(cm->lp, lpsym);
+    } else if (0 == strncmp(symname, "__mcfi_bary_", 12)) {
+      symbol *icfsym = alloc_sym();
+      icfsym->name = sp_intern_string(&stringpool, symname + 12);
+      if (bid_slot + 8 > X64ABIBASE)
+        die("too many indirect branches for the Bary slots\n");
+      icfsym->offset = bid_slot;
+      icfsym->site = offset;
+      bid_slot += 8;
+      DL_APPEND(cm->icfsyms, icfsym);
+    } else if (ELF64_ST_TYPE(sym[cnt].st_info) == STT_FUNC &&
+               sym[cnt].st_shndx != SHN_UNDEF) {
+      symbol *funcsym = alloc_sym();
+      funcsym->name = sp_intern_string(&stringpool, symname);
+      funcsym->offset = offset;
+      DL_APPEND(cm->funcsyms, funcsym);
+
+      keyvalue *kv = dict_find(ctor, funcsym->name);
+      if (kv && dict_find(vtable, kv->value) &&
+          !dict_find(cm->defined_ctors, kv->value))
+        dict_add(&(cm->defined_ctors), kv->value, 0);
+    }
+  }
+  dict_clear(&ctor);
+  DL_APPEND(modules, cm);
+  return cm;
+}
+
+/* the sections and symbols of an ELF module */
+static void load_elf_file(const char *path) {
+  int fd = open(path, O_RDONLY, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+    die("cannot open %s\n", path);
+  /* the parsers write into the sections, hence a private mapping */
+  char *elf = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (elf == MAP_FAILED)
+    die("cannot map %s\n", path);
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr *)elf;
+  if (st.st_size < sizeof(*ehdr) || memcmp(elf, ELFMAG, SELFMAG))
+    die("%s is not an ELF file\n", path);
+  Elf64_Shdr *shdr = (Elf64_Shdr *)(elf + ehdr->e_shoff);
+  Elf64_Phdr *phdr = (Elf64_Phdr *)(elf + ehdr->e_phoff);
+  char *shstrpool = elf + shdr[ehdr->e_shstrndx].sh_offset;
+  struct section *secs = malloc(ehdr->e_shnum * sizeof(*secs));
+  if (!secs)
+    oom();
+  Elf64_Sym *sym = 0;
+  size_t numsym = 0;
+  char *strtab = 0;
+  size_t cnt, nsecs = 0;
+
+  for (cnt = 0; cnt < ehdr->e_shnum; cnt++) {
+    char *shname = shstrpool + shdr[cnt].sh_name;
+    if (0 == strcmp(shname, ".symtab")) {
+      sym = (Elf64_Sym *)(elf + shdr[cnt].sh_offset);
+      numsym = shdr[cnt].sh_size / sizeof(*sym);
+      strtab = elf + shdr[shdr[cnt].sh_link].sh_offset;
+    } else if (0 == strncmp(shname, ".MCFI", 5)) {
+      secs[nsecs].name = shname;
+      secs[nsecs].data = elf + shdr[cnt].sh_offset;
+      secs[nsecs].size = shdr[cnt].sh_size;
+      nsecs++;
+    }
+  }
+  if (!nsecs)
+    die("%s has no MCFI metadata\n", path);
+  if (!sym)
+    die("%s has no symbol table\n", path);
+
+  int is_exe = ehdr->e_type == ET_EXEC;
+  uintptr_t bias = is_exe ? X64ABIBASE : 0;
+  size_t sz = 0;
+  for (cnt = 0; cnt < ehdr->e_phnum; cnt++) {
+    if (phdr[cnt].p_type == PT_LOAD &&
+        phdr[cnt].p_vaddr + phdr[cnt].p_memsz - bias > sz)
+      sz = phdr[cnt].p_vaddr + phdr[cnt].p_memsz - bias;
+  }
+  load_module(secs, nsecs, sym, numsym, strtab, is_exe, bias, RoundToPage(sz));
+  free(secs);
+}
+
+/* growable buffer */
+struct buf {
+  char *p;
+  size_t len, cap;
+};
+
+static void *buf_reserve(struct buf *b, size_t n) {
+  if (b->len + n > b->cap) {
+    b->cap = (b->len + n) * 2;
+    b->p = realloc(b->p, b->cap);
+    if (!b->p)
+      oom();
+  }
+  return b->p + b->len;
+}
+
+static void vappend(struct buf *b, const char *fmt, va_list args) {
+  char line[256];
+  int n = vsnprintf(line, sizeof(line), fmt, args);
+  memcpy(buf_reserve(b, n), line, n);
+  b->len += n;
+}
+
+static void append(struct buf *b, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vappend(b, fmt, args);
+  va_end(args);
+}
+
+/* append a NUL-terminated record, the way each metadata string of a
+   section is emitted, and return its offset */
+static size_t rec(struct buf *b, const char *fmt, ...) {
+  size_t off = b->len;
+  va_list args;
+  va_start(args, fmt);
+  vappend(b, fmt, args);
+  va_end(args);
+  *(char*)buf_reserve(b, 1) = '\0';
+  b->len++;
+  return off;
+}
+
+/* synthetic program, split evenly into modules */
+struct synth {
+  unsigned long functions;  /* global functions */
+  unsigned long types;      /* distinct function types */
+  unsigned long classes;
+  unsigned long hierarchy;  /* classes per inheritance tree */
+  unsigned long methods;    /* virtual methods per class */
+  unsigned long icfs;       /* indirect calls, a fourth of them virtual */
+  unsigned long modules;
+  unsigned long taken;      /* percentage of address-taken functions */
+};
+
+/* spreads indirect calls over types and classes */
+static unsigned long pick(unsigned long i, unsigned long n) {
+  return n ? (i * 2654435761UL) % n : 0;
+}
+
+struct synth_module {
+  struct buf secs[5];
+  struct buf syms;
+  struct buf strtab;
+  size_t offset;  /* of the next symbol in the module */
+};
+
+enum { FUNCINFO, ICFS, CHA, TAKEN, TAKEN_IN_CODE };
+static const char *synth_sections[] = {
+  ".MCFIFuncInfo", ".MCFIIndirectCalls", ".MCFICHA",
+  ".MCFIAddrTaken", ".MCFIAddrTakenInCode"
+};
+
+static void synth_sym(struct synth_module *sm, int type, const char *fmt, ...) {
+  char name[128];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(name, sizeof(name), fmt, args);
+  va_end(args);
+  Elf64_Sym *s = buf_reserve(&sm->syms, sizeof(*s));
+  memset(s, 0, sizeof(*s));
+  s->st_name = rec(&sm->strtab, "%s", name);
+  s->st_info = ELF64_ST_INFO(STB_GLOBAL, type);
+  s->st_shndx = 1;
+  s->st_value = sm->offset;
+  sm->syms.len += sizeof(*s);
+  sm->offset += 8;
+}
+
+/* a function, its return and a direct call to callee */
+static void synth_function(struct synth_module *sm, unsigned long *bary,
+                           const char *name, const char *method,
+                           unsigned long type, const char *callee) {
+  unsigned long ret = (*bary)++;
+  if (method)
+    rec(&sm->secs[FUNCINFO], "{ %s\nN %s\nY i32!t%lu@\nR %lx\n}",
+        name, method, type, ret);
+  else
+    rec(&sm->secs[FUNCINFO], "{ %s\nY i32!t%lu@\nR %lx\n}", name, type, ret);
+  synth_sym(sm, STT_FUNC, "%s", name);
+  synth_sym(sm, STT_NOTYPE, "__mcfi_bary_%lx", ret);
+  synth_sym(sm, STT_NOTYPE, "__mcfi_dcj_%lx_%s", ret, callee);
+}
+
+static void synth_load(const struct synth *s) {
+  unsigned long bary = 1;
+  unsigned long m;
+  char name[64], method[64], callee[64];
+
+  for (m = 0; m < s->modules; m++) {
+    struct synth_module sm;
+    unsigned long i, j;
+    memset(&sm, 0, sizeof(sm));
+    rec(&sm.strtab, "");
+
+    for (i = s->functions * m / s->modules;
+         i < s->functions * (m + 1) / s->modules; i++) {
+      snprintf(name, sizeof(name), "f%lu", i);
+      snprintf(callee, sizeof(callee), "f%lu", (i + 1) % s->functions);
+      synth_function(&sm, &bary, name, 0, i % s->types, callee);
+      if (i % 100 < s->taken)
+        rec(&sm.secs[i % 4 ? TAKEN : TAKEN_IN_CODE], "%s", name);
+    }
+
+    for (i = s->classes * m / s->modules;
+         i < s->classes * (m + 1) / s->modules; i++) {
+      struct buf *cha = &sm.secs[CHA];
+      unsigned long root = i - i % s->hierarchy;
+      if (i != root)
+        rec(cha, "I#C%lu#C%lu", i, root + (i - root - 1) / 2);
+      append(cha, "M#C%lu", i);
+      for (j = 0; j < s->methods; j++)
+        append(cha, "#m%lu@v", j);
+      rec(cha, "");
+      for (j = 0; j < s->methods; j++) {
+        snprintf(name, sizeof(name), "C%lu_m%lu", i, j);
+        snprintf(method, sizeof(method), "C%lu#m%lu", i, j);
+        snprintf(callee, sizeof(callee), "f%lu", pick(i + j, s->functions));
+        synth_function(&sm, &bary, name, method, root % s->types, callee);
+      }
+    }
+
+    for (i = s->icfs * m / s->modules;
+         i < s->icfs * (m + 1) / s->modules; i++) {
+      unsigned long id = bary++;
+      if (s->classes && s->methods && i % 4 == 0)
+        rec(&sm.secs[ICFS], "%lx#V#C%lu#m%lu", id,
+            pick(i, s->classes), i % s->methods);
+      else
+        rec(&sm.secs[ICFS], "%lx#N#i32!t%lu@", id, pick(i, s->types));
+      synth_sym(&sm, STT_NOTYPE, "__mcfi_bary_%lx", id);
+      synth_sym(&sm, STT_NOTYPE, "__mcfi_icj_%lx_%lx", id, id);
+    }
+
+    struct section secs[5];
+    size_t nsecs = 0;
+    for (i = 0; i < 5; i++) {
+      if (!sm.secs[i].len)
+        continue;
+      secs[nsecs].name = synth_sections[i];
+      secs[nsecs].data = sm.secs[i].p;
+      secs[nsecs].size = sm.secs[i].len;
+      nsecs++;
+    }
+    load_module(secs, nsecs, (Elf64_Sym*)sm.syms.p,
+                sm.syms.len / sizeof(Elf64_Sym), sm.strtab.p,
+                FALSE, 0, RoundToPage(sm.offset));
+    /* the parsers intern every string they keep */
+    for (i = 0; i < 5; i++)
+      free(sm.secs[i].p);
+    free(sm.syms.p);
+    free(sm.strtab.p);
+  }
+}
+
+enum { MERGE, CALL_GRAPH, CALL_EQC, RET_GRAPH, RET_EQC, IDS, TARY, BARY,
+       PHASES };
+static const char *phase_names[PHASES] = {
+  "merge_mcfi_metainfo", "build_callgraph", "callgraph eqcs",
+  "build_retgraph", "retgraph eqcs", "gen_mcfi_id", "gen_tary", "gen_bary"
+};
+
+struct sample {
+  uint64_t ns;
+  size_t kb;  /* resident memory growth */
+};
+
+static uint64_t phase_ns;
+static size_t phase_kb;
+
+static void phase_begin(void) {
+  phase_kb = rss_kb();
+  phase_ns = monotonic_ns();
+}
+
+static void phase_end(struct sample *s) {
+  s->ns = monotonic_ns() - phase_ns;
+  s->kb = rss_kb() - phase_kb;
+}
+
+/* one cfg generation, as generate_cfg does it */
+static void generate(struct sample *samples, unsigned int *call_eqcs,
+                     unsigned int *ret_eqcs, char *table) {
+  icf *icfs = 0;
+  function *functions = 0;
+  dict *classes = 0;
+  graph *cha = 0;
+  dict *fats = 0;
+  dict *fats_in_data = 0;
+  dict *fats_in_code = 0;
+  dict *defined_ctors = 0;
+  graph *aliases = 0;
+  dict *vmtd = 0;
+  code_module *m;
+  node *n;
+
+  phase_begin();
+  merge_mcfi_metainfo(modules, &icfs, &functions, &classes,
+                      &cha, &fats, &fats_in_data, &fats_in_code, &aliases,
+                      &defined_ctors);
+  DL_FOREACH(modules, m) {
+    dict *d = get_all_vmtd(m->vtable, defined_ctors, vtabletaken);
+    merge_dicts(&vmtd, d);
+    dict_clear(&d);
+  }
+  dict_clear(&defined_ctors);
+  phase_end(&samples[MERGE]);
+
+  graph *all_funcs_grouped_by_name = 0;
+  phase_begin();
+  graph *callgraph =
+    build_callgraph(icfs, functions, classes, cha,
+                    fats, aliases, &all_funcs_grouped_by_name);
+  icfs_clear(&icfs);
+  dict_clear(&classes);
+  g_dtor(&cha);
+  dict_clear(&fats);
+  g_dtor(&aliases);
+  graph *aliases_tc = g_transitive_closure(&aliases);
+  compute_fic(&fats_in_code, &fats_in_data, aliases_tc);
+  g_dtor(&fats_in_data);
+  compute_tc_vmtd(&vmtd, aliases_tc);
+  g_free_transitive_closure(&aliases_tc);
+  phase_end(&samples[CALL_GRAPH]);
+
+  phase_begin();
+  node *lcg = g_get_lcc(&callgraph);
+  phase_end(&samples[CALL_EQC]);
+  DL_COUNT(lcg, n, *call_eqcs);
+
+  /* every module is new to the cfg, so they need no snapshot */
+  phase_begin();
+  build_retgraph(&callgraph, all_funcs_grouped_by_name, modules);
+  g_dtor(&all_funcs_grouped_by_name);
+  functions_clear(&functions);
+  phase_end(&samples[RET_GRAPH]);
+
+  phase_begin();
+  node *lrt = g_get_lcc(&callgraph);
+  g_dtor(&callgraph);
+  phase_end(&samples[RET_EQC]);
+  DL_COUNT(lrt, n, *ret_eqcs);
+
+  unsigned long version = 0;
+  unsigned long id_for_others;
+  dict *callids = 0, *retids = 0;
+  phase_begin();
+  gen_mcfi_id(&lcg, &lrt, &version, &id_for_others, &callids, &retids);
+  phase_end(&samples[IDS]);
+
+  phase_begin();
+  DL_FOREACH(modules, m)
+    gen_tary(m, callids, retids, table, &fats_in_code, &vmtd);
+  phase_end(&samples[TARY]);
+
+  phase_begin();
+  DL_FOREACH(modules, m)
+    gen_bary(m, callids, retids, table, id_for_others);
+  phase_end(&samples[BARY]);
+
+  dict_clear(&callids);
+  dict_clear(&retids);
+  g_dtor(&fats_in_code);
+  g_dtor(&vmtd);
+}
+
+static void sort_samples(struct sample *s, size_t n) {
+  size_t i, j;
+  for (i = 1; i < n; i++)
+    for (j = i; j > 0 && s[j - 1].ns > s[j].ns; j--) {
+      struct sample t = s[j];
+      s[j] = s[j - 1];
+      s[j - 1] = t;
+    }
+}
+
+static unsigned long number(const char *s) {
+  unsigned long n = 0;
+  const char *c = s;
+  if (!*c)
+    die("missing number\n");
+  for (; *c; c++) {
+    if (!isdigit(*c))
+      die("invalid number %s\n", s);
+    n = n * 10 + (*c - '0');
+  }
+  return n;
+}
+
+static void usage(void) {
+  die("usage: cfgbench [-r runs] module...\n"
+      "       cfgbench [-r runs] -s [-f functions] [-t types] [-c classes]\n"
+      "                [-h classes per hierarchy] [-v virtual methods]\n"
+      "                [-i indirect calls] [-m modules] [-a %% address taken]\n");
+}
+
+#define MAX_RUNS 64
+
+int main(int argc, char **argv) {
+  struct synth s = {10000, 200, 200, 8, 4, 4000, 4, 25};
+  unsigned long runs = 5;
+  int synthetic = FALSE;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    if (0 == strcmp(a, "-s")) {
+      synthetic = TRUE;
+      continue;
+    }
+    if (a[0] != '-' || !a[1] || a[2])
+      break;
+    if (i + 1 == argc)
+      usage();
+    unsigned long v = number(argv[++i]);
+    switch (a[1]) {
+    case 'r': runs = v; break;
+    case 'f': s.functions = v; break;
+    case 't': s.types = v; break;
+    case 'c': s.classes = v; break;
+    case 'h': s.hierarchy = v; break;
+    case 'v': s.methods = v; break;
+    case 'i': s.icfs = v; break;
+    case 'm': s.modules = v; break;
+    case 'a': s.taken = v; break;
+    default: usage();
+    }
+  }
+  if (runs < 1 || runs > MAX_RUNS)
+    die("runs must be between 1 and %d\n", MAX_RUNS);
+  if (synthetic == (i < argc))
+    usage();
+  if (synthetic && (!s.functions || !s.types || !s.hierarchy || !s.modules))
+    die("functions, types, classes per hierarchy and modules must not be 0\n");
+
+  size_t kb = rss_kb();
+  uint64_t ns = monotonic_ns();
+  if (synthetic)
+    synth_load(&s);
+  else
+    for (; i < argc; i++)
+      load_elf_file(argv[i]);
+  ns = monotonic_ns() - ns;
+  kb = rss_kb() - kb;
+
+  size_t mods = 0, functions = 0, icfsyms = 0;
+  uintptr_t table_size = lib_end > LIB_BASE ? lib_end : exe_end;
+  code_module *m;
+  DL_FOREACH(modules, m) {
+    function *f;
+    symbol *sym;
+    mods++;
+    DL_FOREACH(m->functions, f)
+      functions++;
+    DL_FOREACH(m->icfsyms, sym)
+      icfsyms++;
+  }
+  static struct sample samples[PHASES][MAX_RUNS];
+  unsigned int call_eqcs = 0, ret_eqcs = 0;
+  unsigned long r;
+  int p;
+  for (r = 0; r < runs; r++) {
+    struct sample run[PHASES];
+    /* untouched table pages cost nothing */
+    char *table = mmap(0, table_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED)
+      die("cannot map a %lx byte table\n", table_size);
+    generate(run, &call_eqcs, &ret_eqcs, table);
+    munmap(table, table_size);
+    for (p = 0; p < PHASES; p++)
+      samples[p][r] = run[p];
+  }
+
+  dprintf(STDOUT_FILENO, "%lu modules, %lu functions, %lu indirect branches, "
+          "%u call eqcs, %u return eqcs\n",
+          mods, functions, icfsyms, call_eqcs, ret_eqcs);
+  dprintf(STDOUT_FILENO, "%-20s %12s %12s\n", "phase", "median ms",
+          "first run KB");
+  dprintf(STDOUT_FILENO, "%-20s %8lu.%03lu %12lu\n", "metadata parsing",
+          ns / 1000000, ns / 1000 % 1000, kb);
+  uint64_t total = 0;
+  size_t total_kb = 0;
+  for (p = 0; p < PHASES; p++) {
+    size_t first_kb = samples[p][0].kb;
+    sort_samples(samples[p], runs);
+    uint64_t median = samples[p][runs / 2].ns;
+    total += median;
+    total_kb += first_kb;
+    dprintf(STDOUT_FILENO, "%-20s %8lu.%03lu %12lu\n", phase_names[p],
+            median / 1000000, median / 1000 % 1000, first_kb);
+  }
+  dprintf(STDOUT_FILENO, "%-20s %8lu.%03lu %12lu\n", "cfg generation",
+          total / 1000000, total / 1000 % 1000, total_kb);
+  return 0;
+}
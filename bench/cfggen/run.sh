@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Build cfgbench and run it on the MCFI modules given as arguments, or else
+# on synthetic programs of growing size: each scale in $SCALES (1 2 4 8 by
+# default) multiplies 10000 functions, 4000 indirect calls and 200 classes.
+# Every phase is timed over $RUNS cfg generations.
+
+cd "$(dirname "$0")"
+. ../config.sh
+
+RUNS=${RUNS:-5}
+SCALES=${SCALES:-"1 2 4 8"}
+OUT=$BENCH_OUT/cfggen
+
+make -s OUT=$OUT || exit 1
+
+if [ $# -gt 0 ]
+then
+    exec $OUT/cfgbench -r $RUNS "$@"
+fi
+
+mkdir -p $OUT
+: > $OUT/results.txt
+for scale in $SCALES
+do
+    echo "scale $scale"
+    $OUT/cfgbench -r $RUNS -s -f $((10000 * scale)) -i $((4000 * scale)) \
+                  -c $((200 * scale)) | tee -a $OUT/results.txt
+    echo
+done
+
+# the whole cfg generation per scale
+echo "scale    median ms  first run KB"
+awk -v scales="$SCALES" 'BEGIN { n = split(scales, s) }
+     /^cfg generation/ { printf "%-8s %10s %13s\n", s[++i], $3, $4 }' \
+    $OUT/results.txt
@@ -0,0 +1,93 @@
+# Toolchain configurations shared by the benchmark scripts. Source this file,
+# then call config_env <configuration> to set CC, CXX, CFLAGS and LDFLAGS for
+# one of the configurations in $CONFIGS:
+#
+#   native  the native toolchain built by native/build_native_toolchain.sh
+#   picfi   the default MCFI toolchain and runtime
+#   mcfi    -Xclang -mdisable-picfi, runtime built with MCFI=1
+#   shadow  -fmcfi-return=shadow, default runtime
+#   vtable  -mllvm -mcfi-vtable-layout, range checks of virtual calls on
+#           laid out vtables, default runtime
+#   nocfi   default code, runtime built with NOCFI=1, which patches the
+#           checks to nops, i.e. the cost of the sandbox alone
+#
+# Each MCFI configuration links its programs against its own build of the
+# runtime in $BENCH_OUT/rock/<configuration>, so the installed rock is left
+# alone.
+
+BENCH="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+MCFI="$(dirname "$BENCH")"
+
+if [ -z "$MCFI_SDK" ]
+then
+    export MCFI_SDK=$HOME/MCFI/toolchain
+fi
+
+if [ -z "$NATIVE_SDK" ]
+then
+    export NATIVE_SDK=$HOME/native/toolchain
+fi
+
+BENCH_OUT=${BENCH_OUT:-$BENCH/out}
+CONFIGS=${CONFIGS:-"native picfi mcfi shadow vtable nocfi"}
+BENCH_CFLAGS=${BENCH_CFLAGS:-"-O2"}
+RETRIES=${RETRIES:-2}
+
+# run "$@" again after a failure, at most $RETRIES times, and print the
+# output of the run that succeeded only, so that the measurements a failed
+# run printed before failing are not counted along with those of its retry
+run_accepted() {
+    local out try
+    for try in $(seq $((RETRIES + 1)))
+    do
+        if out=$("$@")
+        then
+            [ -n "$out" ] && echo "$out"
+            return 0
+        fi
+        echo "$* failed (attempt $try)" >&2
+    done
+    return 1
+}
+
+# runtime make options of configuration $1
+rock_flags() {
+    case $1 in
+        mcfi) echo MCFI=1;;
+        nocfi) echo NOCFI=1;;
+    esac
+}
+
+# build the runtime of configuration $1 into $BENCH_OUT/rock/$1/bin/rock
+build_rock() {
+    local dir=$BENCH_OUT/rock/$1
+    [ -x $dir/bin/rock ] && return 0
+    rm -rf $dir && mkdir -p $dir && cp -r $MCFI/runtime $dir/src || return 1
+    make -C $dir/src $(rock_flags $1) SDK=$dir > $dir/build.log 2>&1
+}
+
+config_env() {
+    case $1 in
+        native)
+            CC=$NATIVE_SDK/bin/clang
+            CXX=$NATIVE_SDK/bin/clang++
+            CFLAGS="$BENCH_CFLAGS"
+            LDFLAGS=""
+            return 0;;
+        picfi|nocfi) CFLAGS="$BENCH_CFLAGS";;
+        mcfi) CFLAGS="$BENCH_CFLAGS -Xclang -mdisable-picfi";;
+        shadow) CFLAGS="$BENCH_CFLAGS -fmcfi-return=shadow";;
+        vtable) CFLAGS="$BENCH_CFLAGS -mllvm -mcfi-vtable-layout";;
+        *)
+            echo "unknown configuration $1" >&2
+            return 1;;
+    esac
+    CC=$MCFI_SDK/bin/clang
+    CXX=$MCFI_SDK/bin/clang++
+    if ! build_rock $1
+    then
+        echo "cannot build the runtime of $1, see $BENCH_OUT/rock/$1/build.log" >&2
+        return 1
+    fi
+    LDFLAGS="-Wl,--dynamic-linker=$BENCH_OUT/rock/$1/bin/rock"
+}
@@ -0,0 +1,35 @@
+/*
+ * Timing helpers of the micro-benchmarks. Each benchmark takes an optional
+ * scale for its iteration counts and prints one line per measurement:
+ * the measurement's name, a tab, and the nanoseconds per operation.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* n scaled by the first argument, if any */
+static long iterations(int argc, char **argv, long n) {
+  if (argc > 1)
+    n = (long)(n * atof(argv[1]));
+  return n > 0 ? n : 1;
+}
+
+static void report(const char *name, double ns, long ops) {
+  printf("%s\t%.2f\n", name, ns / ops);
+  fflush(stdout);
+}
+
+/* results stored here cannot be optimized away */
+static volatile long sink;
+
+#endif
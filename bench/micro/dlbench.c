@@ -0,0 +1,5 @@
+/* the library dlopen.c loads */
+
+long dlbench(long x) {
+  return x + 1;
+}
@@ -0,0 +1,50 @@
+/*
+ * dlopen and dlsym latency. The first dlopen of libdlbench.so, which sits
+ * next to this program, loads the library and, under MCFI, regenerates the
+ * CFG; later ones find it loaded. dlsym and the call through its result
+ * are timed in a loop.
+ */
+
+#include <dlfcn.h>
+#include <string.h>
+#include "bench.h"
+
+int main(int argc, char **argv) {
+  long n = iterations(argc, argv, 100000);
+  char path[4096];
+  char *slash = strrchr(argv[0], '/');
+  long i, x = 0;
+  double t;
+  void *h;
+
+  if (slash)
+    snprintf(path, sizeof(path), "%.*s/libdlbench.so",
+             (int)(slash - argv[0]), argv[0]);
+  else
+    snprintf(path, sizeof(path), "./libdlbench.so");
+
+  t = now_ns();
+  h = dlopen(path, RTLD_NOW);
+  if (!h) {
+    fprintf(stderr, "%s\n", dlerror());
+    return 1;
+  }
+  report("dlopen first", now_ns() - t, 1);
+
+  t = now_ns();
+  for (i = 0; i < n; i++) {
+    void *g = dlopen(path, RTLD_NOW);
+    dlclose(g);
+  }
+  report("dlopen loaded", now_ns() - t, n);
+
+  t = now_ns();
+  for (i = 0; i < n; i++) {
+    long (*f)(long) = (long (*)(long))dlsym(h, "dlbench");
+    x = f(x);
+  }
+  report("dlsym+call", now_ns() - t, n);
+
+  sink = x;
+  return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * C++ exceptions thrown and caught one frame up and eight frames up. The
+ * unwinder's indirect jumps into landing pads are checked under MCFI.
+ */
+
+#include "bench.h"
+
+__attribute__((noinline)) static long thrower(long depth, long x) {
+  if (depth == 0)
+    throw x;
+  return thrower(depth - 1, x) + 1;
+}
+
+static double run(long depth, long n) {
+  long i, x = 0;
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    try {
+      x += thrower(depth, i);
+    } catch (long e) {
+      x += e;
+    }
+  }
+  sink = x;
+  return now_ns() - t;
+}
+
+int main(int argc, char **argv) {
+  long n = iterations(argc, argv, 200000);
+  report("throw+catch", run(0, n), n);
+  report("throw+catch depth 8", run(8, n), n);
+  return 0;
+}
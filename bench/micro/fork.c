@@ -0,0 +1,29 @@
+/*
+ * fork latency: the parent forks a child that exits at once and waits for
+ * it. Under MCFI, rock_fork saves and restores the patched code around the
+ * fork and gives the child its own runtime state.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bench.h"
+
+int main(int argc, char **argv) {
+  long n = iterations(argc, argv, 500);
+  long i;
+  int status;
+
+  double t = now_ns();
+  for (i = 0; i < n; i++) {
+    pid_t pid = fork();
+    if (pid == 0)
+      _exit(0);
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    waitpid(pid, &status, 0);
+  }
+  report("fork+exit+wait", now_ns() - t, n);
+  return 0;
+}
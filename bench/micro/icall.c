@@ -0,0 +1,36 @@
+/*
+ * Indirect calls through a table of function pointers, which pay for the
+ * Bary/Tary check of the call and of the callee's return, and direct calls,
+ * which pay for the return check only.
+ */
+
+#include "bench.h"
+
+typedef long (*op)(long);
+
+__attribute__((noinline)) long op_add(long x) { return x + 3; }
+__attribute__((noinline)) long op_sub(long x) { return x - 1; }
+__attribute__((noinline)) long op_xor(long x) { return x ^ 5; }
+__attribute__((noinline)) long op_shl(long x) { return (x << 1) >> 1; }
+
+/* volatile so that the calls cannot be devirtualized */
+static op volatile ops[4] = { op_add, op_sub, op_xor, op_shl };
+
+int main(int argc, char **argv) {
+  long n = iterations(argc, argv, 50000000);
+  long i, x = 0;
+  double t;
+
+  t = now_ns();
+  for (i = 0; i < n; i++)
+    x = ops[i & 3](x);
+  report("indirect call+return", now_ns() - t, n);
+
+  t = now_ns();
+  for (i = 0; i < n; i++)
+    x = op_add(x);
+  report("direct call+return", now_ns() - t, n);
+
+  sink = x;
+  return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Round trips of sandboxed memory management calls, which the runtime
+ * checks and records in its memory map (rock_mmap, rock_munmap and
+ * rock_mprotect).
+ */
+
+#include <sys/mman.h>
+#include "bench.h"
+
+#define SIZE (64 * 1024)
+
+int main(int argc, char **argv) {
+  long n = iterations(argc, argv, 100000);
+  long i;
+  double t;
+  char *p;
+
+  t = now_ns();
+  for (i = 0; i < n; i++) {
+    p = mmap(0, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+    }
+    p[i % SIZE] = 1;
+    munmap(p, SIZE);
+  }
+  report("mmap+munmap", now_ns() - t, n);
+
+  p = mmap(0, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  t = now_ns();
+  for (i = 0; i < n; i++) {
+    mprotect(p, SIZE, PROT_READ);
+    mprotect(p, SIZE, PROT_READ | PROT_WRITE);
+  }
+  report("mprotect", now_ns() - t, 2 * n);
+  munmap(p, SIZE);
+  return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Build the micro-benchmarks with each configuration in $CONFIGS, run each
+# of them $RUNS times and report every configuration against native.
+# SCALE scales the iteration counts.
+
+cd "$(dirname "$0")"
+. ../config.sh
+
+RUNS=${RUNS:-5}
+SCALE=${SCALE:-1}
+BENCHES="icall vcall trap mmap fork dlopen exception"
+RESULTS=$BENCH_OUT/micro/results.txt
+
+mkdir -p $BENCH_OUT/micro
+: > $RESULTS
+
+for config in $CONFIGS
+do
+    if ! config_env $config
+    then
+        echo "skipping $config" >&2
+        continue
+    fi
+    out=$BENCH_OUT/micro/$config
+    if ! make -s OUT=$out CC="$CC" CXX="$CXX" CFLAGS="$CFLAGS" LDFLAGS="$LDFLAGS"
+    then
+        echo "skipping $config, the build failed" >&2
+        continue
+    fi
+    for bench in $BENCHES
+    do
+        for run in $(seq $RUNS)
+        do
+            run_accepted $out/$bench $SCALE | sed "s/^/$config\t$bench\t/" >> $RESULTS
+        done
+    done
+done
+
+python ../report.py $RESULTS
@@ -0,0 +1,61 @@
+/*
+ * Cost of the first execution of call sites and address-taking sites.
+ * With PICFI, the return address after each call and each address-taking
+ * site traps into the runtime (patch_call and patch_at) the first time it
+ * runs; the second pass over the same sites measures them without traps.
+ * Every site runs once per pass, so the scale argument is ignored.
+ */
+
+#include "bench.h"
+
+#define D16(M, p) M(p##0) M(p##1) M(p##2) M(p##3) M(p##4) M(p##5) M(p##6) \
+  M(p##7) M(p##8) M(p##9) M(p##a) M(p##b) M(p##c) M(p##d) M(p##e) M(p##f)
+#define D256(M) D16(M, 0) D16(M, 1) D16(M, 2) D16(M, 3) D16(M, 4) D16(M, 5) \
+  D16(M, 6) D16(M, 7) D16(M, 8) D16(M, 9) D16(M, a) D16(M, b) D16(M, c)   \
+  D16(M, d) D16(M, e) D16(M, f)
+#define SITES 256
+
+#define CALLEE(n) __attribute__((noinline)) long callee_##n(long x) { \
+    return x + 1;                                                     \
+  }
+#define CALLER(n) __attribute__((noinline)) long caller_##n(long x) { \
+    return callee_##n(x) + 1;                                         \
+  }
+#define TAKER(n) __attribute__((noinline)) void *taker_##n(void) { \
+    return (void*)callee_##n;                                      \
+  }
+#define CALLER_PTR(n) caller_##n,
+#define TAKER_PTR(n) taker_##n,
+
+D256(CALLEE)
+D256(CALLER)
+D256(TAKER)
+
+static long (* volatile callers[SITES])(long) = { D256(CALLER_PTR) };
+static void *(* volatile takers[SITES])(void) = { D256(TAKER_PTR) };
+
+static void run_callers(const char *name) {
+  long i, x = 0;
+  double t = now_ns();
+  for (i = 0; i < SITES; i++)
+    x = callers[i](x);
+  report(name, now_ns() - t, SITES);
+  sink = x;
+}
+
+static void run_takers(const char *name) {
+  long i, x = 0;
+  double t = now_ns();
+  for (i = 0; i < SITES; i++)
+    x += (long)takers[i]();
+  report(name, now_ns() - t, SITES);
+  sink = x;
+}
+
+int main(void) {
+  run_callers("call site first run");
+  run_callers("call site warm");
+  run_takers("address taking site first run");
+  run_takers("address taking site warm");
+  return 0;
+}
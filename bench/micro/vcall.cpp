@@ -0,0 +1,95 @@
+/*
+ * Virtual calls on objects of two classes, alternating so that the calls
+ * cannot be devirtualized or predicted into a single target, then on
+ * objects of the four classes of a deeper tree, through its root.
+ *
+ * The classes have out-of-line key functions, so that their vtables are
+ * defined once, here, rather than emitted as linkonce_odr copies: only
+ * those can be laid out for the range checks of the vtable configuration.
+ */
+
+#include "bench.h"
+
+struct Shape {
+  virtual ~Shape();
+  virtual long area(long x) const = 0;
+};
+
+struct Square : Shape {
+  long area(long x) const;
+};
+
+struct Rect : Shape {
+  long w;
+  Rect(long w) : w(w) {}
+  long area(long x) const;
+};
+
+Shape::~Shape() {}
+long Square::area(long x) const { return x * x; }
+long Rect::area(long x) const { return x * w; }
+
+struct Node {
+  virtual ~Node();
+  virtual long eval(long x) const;
+};
+
+struct Neg : Node {
+  long eval(long x) const;
+};
+
+struct Add : Node {
+  long eval(long x) const;
+};
+
+struct Add2 : Add {
+  long eval(long x) const;
+};
+
+Node::~Node() {}
+long Node::eval(long x) const { return x; }
+long Neg::eval(long x) const { return -x; }
+long Add::eval(long x) const { return x + 1; }
+long Add2::eval(long x) const { return x + 2; }
+
+__attribute__((noinline)) static Shape *make(int i) {
+  if (i & 1)
+    return new Rect(i);
+  return new Square;
+}
+
+__attribute__((noinline)) static Node *make_node(int i) {
+  switch (i & 3) {
+  case 0: return new Node;
+  case 1: return new Neg;
+  case 2: return new Add;
+  default: return new Add2;
+  }
+}
+
+int main(int argc, char **argv) {
+  long n = iterations(argc, argv, 50000000);
+  Shape *shapes[2] = { make(argc), make(argc + 1) };
+  Node *nodes[4];
+  long i, x = 0;
+
+  for (i = 0; i < 4; i++)
+    nodes[i] = make_node(argc + i);
+
+  double t = now_ns();
+  for (i = 0; i < n; i++)
+    x += shapes[i & 1]->area(i);
+  report("virtual call", now_ns() - t, n);
+
+  t = now_ns();
+  for (i = 0; i < n; i++)
+    x += nodes[i & 3]->eval(i);
+  report("virtual call, 4 classes", now_ns() - t, n);
+
+  sink = x;
+  delete shapes[0];
+  delete shapes[1];
+  for (i = 0; i < 4; i++)
+    delete nodes[i];
+  return 0;
+}
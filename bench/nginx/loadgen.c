@@ -0,0 +1,216 @@
+/*
+ * HTTP/1.1 keep-alive load generator. Keeps a number of connections to a
+ * server busy with GET requests for a fixed time, each thread driving its
+ * share of them with epoll, and prints the throughput and latency
+ * percentiles as "measurement<TAB>value" lines. Built with the host
+ * compiler, so that it is the same for every configuration.
+ *
+ *   loadgen [-c connections] [-t threads] [-d seconds] [-w warmup seconds]
+ *           port path
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUF_SIZE 65536
+
+struct conn {
+  int fd;
+  double sent;   /* when the request in flight was sent */
+  size_t got;    /* bytes of the response in buf */
+};
+
+struct worker {
+  pthread_t thread;
+  int conns;
+  /* latencies in microseconds of the responses after the warmup */
+  double *lat;
+  size_t nlat, cap;
+  unsigned long errors;
+};
+
+static struct sockaddr_in addr;
+static char request[512];
+static size_t request_len;
+static double warm_end, end;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int send_request(struct conn *c) {
+  c->got = 0;
+  c->sent = now();
+  return write(c->fd, request, request_len) == (ssize_t)request_len ? 0 : -1;
+}
+
+static int open_conn(int ep, struct conn *c) {
+  struct epoll_event ev;
+  int one = 1;
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)))
+    return -1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev))
+    return -1;
+  return send_request(c);
+}
+
+/* the length of the response in buf, 0 if it is not complete yet and -1 if
+   it is not one this program understands */
+static long response_len(const char *buf, size_t n) {
+  const char *hdr_end = memmem(buf, n, "\r\n\r\n", 4);
+  const char *cl;
+  if (!hdr_end)
+    return n >= BUF_SIZE ? -1 : 0;
+  cl = memmem(buf, hdr_end - buf, "Content-Length:", 15);
+  if (!cl || strncmp(buf, "HTTP/1.1 200", 12))
+    return -1;
+  long len = hdr_end + 4 - buf + strtol(cl + 15, NULL, 10);
+  if (len > BUF_SIZE)
+    return -1;
+  return (size_t)len <= n ? len : 0;
+}
+
+static void *run(void *arg) {
+  struct worker *w = arg;
+  struct epoll_event events[64];
+  struct conn *conns = calloc(w->conns, sizeof(*conns));
+  char *buf = malloc((size_t)w->conns * BUF_SIZE);
+  int ep = epoll_create1(0), i;
+
+  for (i = 0; i < w->conns; i++)
+    if (open_conn(ep, &conns[i])) {
+      perror("connect");
+      exit(1);
+    }
+  while (now() < end) {
+    int n = epoll_wait(ep, events, 64, 100);
+    for (i = 0; i < n; i++) {
+      struct conn *c = events[i].data.ptr;
+      char *b = buf + (c - conns) * (size_t)BUF_SIZE;
+      ssize_t r = read(c->fd, b + c->got, BUF_SIZE - c->got);
+      long len;
+      if (r <= 0) {
+        /* the server closed the connection, open another one */
+        close(c->fd);
+        w->errors++;
+        if (open_conn(ep, c)) {
+          perror("connect");
+          exit(1);
+        }
+        continue;
+      }
+      c->got += r;
+      len = response_len(b, c->got);
+      if (len < 0) {
+        fprintf(stderr, "unexpected response: %.*s\n",
+                (int)(c->got < 80 ? c->got : 80), b);
+        exit(1);
+      }
+      if (!len)
+        continue;
+      double t = now();
+      if (c->sent >= warm_end && t < end) {
+        if (w->nlat == w->cap) {
+          w->cap = w->cap ? w->cap * 2 : 65536;
+          w->lat = realloc(w->lat, w->cap * sizeof(double));
+        }
+        w->lat[w->nlat++] = (t - c->sent) * 1e6;
+      }
+      if (send_request(c)) {
+        close(c->fd);
+        w->errors++;
+        if (open_conn(ep, c)) {
+          perror("connect");
+          exit(1);
+        }
+      }
+    }
+  }
+  for (i = 0; i < w->conns; i++)
+    close(conns[i].fd);
+  close(ep);
+  free(buf);
+  free(conns);
+  return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+  int conns = 16, threads = 1, opt, i;
+  double duration = 5, warmup = 1;
+  struct worker *w;
+  double *lat;
+  size_t n = 0;
+  unsigned long errors = 0;
+
+  while ((opt = getopt(argc, argv, "c:t:d:w:")) != -1) {
+    switch (opt) {
+    case 'c': conns = atoi(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 'w': warmup = atof(optarg); break;
+    default: optind = argc + 1;
+    }
+  }
+  if (optind + 2 != argc || conns < 1 || threads < 1) {
+    fprintf(stderr, "loadgen [-c connections] [-t threads] [-d seconds] "
+                    "[-w warmup seconds] port path\n");
+    return 1;
+  }
+  if (threads > conns)
+    threads = conns;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(argv[optind]));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  request_len = snprintf(request, sizeof(request),
+                         "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                         argv[optind + 1]);
+
+  warm_end = now() + warmup;
+  end = warm_end + duration;
+  w = calloc(threads, sizeof(*w));
+  for (i = 0; i < threads; i++) {
+    w[i].conns = conns / threads + (i < conns % threads);
+    pthread_create(&w[i].thread, NULL, run, &w[i]);
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_join(w[i].thread, NULL);
+    n += w[i].nlat;
+    errors += w[i].errors;
+  }
+  lat = malloc((n ? n : 1) * sizeof(double));
+  for (n = 0, i = 0; i < threads; i++) {
+    memcpy(lat + n, w[i].lat, w[i].nlat * sizeof(double));
+    n += w[i].nlat;
+  }
+  qsort(lat, n, sizeof(double), cmp_double);
+  printf("reqs_per_s\t%.0f\n", n / duration);
+  if (n) {
+    printf("p50_us\t%.1f\n", lat[n / 2]);
+    printf("p99_us\t%.1f\n", lat[n * 99 / 100]);
+  }
+  if (errors)
+    fprintf(stderr, "%lu connections closed by the server\n", errors);
+  return 0;
+}
@@ -0,0 +1,120 @@
+#!/bin/bash
+
+# Start each nginx build on loopback in turn, drive it with loadgen at each
+# concurrency level in $CONCURRENCY, RUNS times, then measure its workers'
+# memory and respawn time, and report every build against native.
+#
+#   run.sh [configuration=prefix]...
+#
+# A prefix is an nginx installation made by porting/nginx-1.4.0/nginx.sh.
+# By default, native is $NATIVE_SDK/../server and picfi $MCFI_SDK/../server.
+
+cd "$(dirname "$0")"
+. ../config.sh
+
+RUNS=${RUNS:-3}
+WORKERS=${WORKERS:-4}
+CONCURRENCY=${CONCURRENCY:-"1 16 64 256"}
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+RESPAWNS=${RESPAWNS:-10}
+PORT=${PORT:-18080}
+RESULTS=$BENCH_OUT/nginx/results.txt
+
+BUILDS="$@"
+if [ -z "$BUILDS" ]
+then
+    BUILDS="native=$(dirname $NATIVE_SDK)/server picfi=$(dirname $MCFI_SDK)/server"
+fi
+
+mkdir -p $BENCH_OUT/nginx
+: > $RESULTS
+cc -O2 -pthread -o $BENCH_OUT/nginx/loadgen loadgen.c || exit 1
+cc -O2 -o $BENCH_OUT/nginx/workers workers.c || exit 1
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+port_open() {
+    (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null
+}
+
+stop() {
+    local pid
+    [ -f $dir/logs/nginx.pid ] || return
+    pid=$(cat $dir/logs/nginx.pid)
+    # a graceful shutdown, then a fast one after ten seconds
+    kill -QUIT $pid 2>/dev/null
+    for i in $(seq 100)
+    do
+        kill -0 $pid 2>/dev/null || break
+        sleep 0.1
+    done
+    kill -TERM $pid 2>/dev/null
+    rm -f $dir/logs/nginx.pid
+}
+
+trap stop EXIT
+
+for build in $BUILDS
+do
+    config=${build%%=*}
+    nginx=${build#*=}/sbin/nginx
+    if [ ! -x $nginx ]
+    then
+        echo "skipping $config, there is no $nginx" >&2
+        continue
+    fi
+    if port_open
+    then
+        echo "port $PORT is taken, set PORT" >&2
+        exit 1
+    fi
+
+    dir=$BENCH_OUT/nginx/$config
+    mkdir -p $dir/conf $dir/html $dir/logs
+    head -c 4096 /dev/zero | tr '\0' x > $dir/html/index.html
+    cat > $dir/conf/nginx.conf <<CONF
+worker_processes $WORKERS;
+error_log logs/error.log;
+pid logs/nginx.pid;
+events {
+    worker_connections 4096;
+}
+http {
+    access_log off;
+    keepalive_requests 1000000;
+    server {
+        listen 127.0.0.1:$PORT;
+        root html;
+    }
+}
+CONF
+
+    start=$(now_ms)
+    if ! $nginx -p $dir/ -c conf/nginx.conf
+    then
+        echo "skipping $config, nginx did not start, see $dir/logs/error.log" >&2
+        continue
+    fi
+    until port_open
+    do
+        sleep 0.01
+    done
+    echo -e "$config\tstartup\tready_ms\t$(($(now_ms) - start))" >> $RESULTS
+
+    for run in $(seq $RUNS)
+    do
+        for c in $CONCURRENCY
+        do
+            run_accepted $BENCH_OUT/nginx/loadgen -c $c -t $THREADS -d $DURATION $PORT /index.html |
+                sed "s/^/$config\tc$c\t/" >> $RESULTS
+        done
+    done
+    run_accepted $BENCH_OUT/nginx/workers $(cat $dir/logs/nginx.pid) $RESPAWNS |
+        sed "s/^/$config\tworkers\t/" >> $RESULTS
+    stop
+done
+
+python ../report.py $RESULTS
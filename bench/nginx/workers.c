@@ -0,0 +1,126 @@
+/*
+ * Measures the worker processes of a running nginx master: prints their
+ * average resident memory, then kills one worker at a time and times how
+ * long the master takes to fork its replacement, as "measurement<TAB>value"
+ * lines. Built with the host compiler.
+ *
+ *   workers master-pid [respawns]
+ */
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 256
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* the children of master, at most MAX_WORKERS of them */
+static int children(int master, int *pids) {
+  DIR *d = opendir("/proc");
+  struct dirent *e;
+  int n = 0;
+  while (d && (e = readdir(d)) && n < MAX_WORKERS) {
+    char path[64], buf[512], *p;
+    FILE *f;
+    int pid = atoi(e->d_name), ppid;
+    if (pid <= 0)
+      continue;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (!(f = fopen(path, "r")))
+      continue;
+    p = fgets(buf, sizeof(buf), f) ? strrchr(buf, ')') : NULL;
+    fclose(f);
+    /* ") state ppid" */
+    if (p && sscanf(p + 2, "%*c %d", &ppid) == 1 && ppid == master)
+      pids[n++] = pid;
+  }
+  if (d)
+    closedir(d);
+  return n;
+}
+
+static long rss_kb(int pid) {
+  char path[64], line[256];
+  long kb = -1;
+  FILE *f;
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  if (!(f = fopen(path, "r")))
+    return -1;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+      break;
+  fclose(f);
+  return kb;
+}
+
+static int contains(const int *pids, int n, int pid) {
+  int i;
+  for (i = 0; i < n; i++)
+    if (pids[i] == pid)
+      return 1;
+  return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+  int pids[MAX_WORKERS], now[MAX_WORKERS];
+  int master, respawns, n, i, r;
+  double *times;
+  long total = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "workers master-pid [respawns]\n");
+    return 1;
+  }
+  master = atoi(argv[1]);
+  respawns = argc > 2 ? atoi(argv[2]) : 10;
+  n = children(master, pids);
+  if (!n) {
+    fprintf(stderr, "%d has no workers\n", master);
+    return 1;
+  }
+  for (i = 0; i < n; i++)
+    total += rss_kb(pids[i]);
+  printf("worker_rss_kb\t%ld\n", total / n);
+
+  times = malloc((respawns ? respawns : 1) * sizeof(double));
+  for (r = 0; r < respawns; r++) {
+    int victim = pids[r % n], found = 0, m;
+    double start = now_us();
+    kill(victim, SIGKILL);
+    while (!found) {
+      if (now_us() - start > 5e6) {
+        fprintf(stderr, "%d did not replace worker %d\n", master, victim);
+        return 1;
+      }
+      m = children(master, now);
+      for (i = 0; i < m; i++)
+        if (!contains(pids, n, now[i])) {
+          pids[r % n] = now[i];
+          found = 1;
+          break;
+        }
+    }
+    times[r] = now_us() - start;
+    /* let the new worker settle before the next kill */
+    usleep(100000);
+  }
+  if (respawns) {
+    qsort(times, respawns, sizeof(double), cmp_double);
+    printf("respawn_us\t%.1f\n", times[respawns / 2]);
+  }
+  return 0;
+}
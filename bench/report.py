@@ -0,0 +1,66 @@
+#!/usr/bin/python
+
+# This python script summarizes benchmark results, given as lines of
+# "configuration<TAB>benchmark<TAB>measurement<TAB>value", into one row per
+# measurement with the median value of each configuration and its overhead
+# over the native configuration.
+
+from __future__ import print_function
+import sys
+
+def median(values):
+    values = sorted(values)
+    n = len(values)
+    if n % 2:
+        return values[n // 2]
+    return (values[n // 2 - 1] + values[n // 2]) / 2
+
+def load(path):
+    """the values as {(benchmark, measurement): {configuration: [value]}},
+    and the configurations and rows in their first order"""
+    values = {}
+    configs = []
+    rows = []
+    with open(path) as f:
+        for line in f:
+            fields = line.rstrip('\n').split('\t')
+            if len(fields) != 4:
+                continue
+            config, bench, name, value = fields
+            row = (bench, name)
+            if config not in configs:
+                configs.append(config)
+            if row not in values:
+                rows.append(row)
+                values[row] = {}
+            values[row].setdefault(config, []).append(float(value))
+    return values, configs, rows
+
+def cell(value, base):
+    if value is None:
+        return 'n/a'
+    if not base:
+        return '%.2f' % value
+    return '%.2f (%+.1f%%)' % (value, (value / base - 1) * 100)
+
+def main(path, baseline = 'native'):
+    values, configs, rows = load(path)
+    width = max([len('%s/%s' % row) for row in rows] + [11])
+    print('%-*s' % (width, 'measurement'), end='')
+    for config in configs:
+        print(' %20s' % config, end='')
+    print()
+    for row in rows:
+        medians = dict((c, median(v)) for c, v in values[row].items())
+        base = medians.get(baseline)
+        print('%-*s' % (width, '%s/%s' % row), end='')
+        for config in configs:
+            print(' %20s' % cell(medians.get(config),
+                                 None if config == baseline else base), end='')
+        print()
+
+if __name__=='__main__':
+    if len(sys.argv) < 2:
+        print('report.py [results] [baseline configuration, native by default]')
+        sys.exit(1)
+    main(*sys.argv[1:3])
@@ -95,6 +95,10 @@ class MachineBasicBlock : public ilist_node<MachineBasicBlock> {
   /// target of an indirect branch.
   bool AddressTaken;
 
+  /// MCFICold - Indicate that this basic block is an MCFI slow path, which
+  /// is emitted out of line.
+  bool MCFICold;
+
   /// \brief since getSymbol is a relatively heavy-weight operation, the symbol
   /// is only computed once and is cached.
   mutable MCSymbol *CachedMCSymbol;
@@ -357,6 +361,13 @@ public:
   /// this basic block is entered via an exception handler.
   void setIsLandingPad(bool V = true) { IsLandingPad = V; }
 
+  /// isMCFICold - Returns true if the block is an MCFI slow path.
+  bool isMCFICold() const { return MCFICold; }
+
+  /// setMCFICold - Indicates the block is an MCFI slow path, which is only
+  /// reached when the ids of an indirect branch and its target differ.
+  void setMCFICold(bool V = true) { MCFICold = V; }
+
   /// getLandingPadSuccessor - If this block has a successor that is a landing
   /// pad, return it. Otherwise return NULL.
   const MachineBasicBlock *getLandingPadSuccessor() const;
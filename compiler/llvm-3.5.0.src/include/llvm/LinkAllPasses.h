@@ -161,6 +161,9 @@ namespace {
       (void) llvm::createScalarizerPass();
       (void) llvm::createSeparateConstOffsetFromGEPPass();
       (void) llvm::createFuncAddrTakenPass();
+      (void) llvm::createIndirectCallPromotionPass();
+      (void) llvm::createWholeProgramDevirtPass();
+      (void) llvm::createVtableLayoutPass();
       (void)new llvm::IntervalPartition();
       (void)new llvm::FindUsedTypes();
       (void)new llvm::ScalarEvolution();
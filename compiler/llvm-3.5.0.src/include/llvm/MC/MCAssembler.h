@@ -262,10 +262,19 @@ class MCCompactEncodedInstFragment : public MCEncodedFragment {
   /// \brief Should this fragment be aligned to the end of a bundle?
   bool AlignToBundleEnd;
 
+  /// PaddingPrefix - Redundant prefix byte that may be put in front of the
+  /// instruction to absorb the padding of a following code alignment.
+  uint8_t PaddingPrefix;
+
+  /// MaxPaddingPrefixes - The maximum number of PaddingPrefix bytes, 0 if the
+  /// instruction must be emitted as is.
+  uint8_t MaxPaddingPrefixes;
+
   SmallVector<char, 4> Contents;
 public:
   MCCompactEncodedInstFragment(MCSectionData *SD = nullptr)
-    : MCEncodedFragment(FT_CompactEncodedInst, SD), AlignToBundleEnd(false)
+    : MCEncodedFragment(FT_CompactEncodedInst, SD), AlignToBundleEnd(false),
+      PaddingPrefix(0), MaxPaddingPrefixes(0)
   {
   }
 
@@ -279,6 +288,13 @@ public:
   bool alignToBundleEnd() const override { return AlignToBundleEnd; }
   void setAlignToBundleEnd(bool V) override { AlignToBundleEnd = V; }
 
+  uint8_t getPaddingPrefix() const { return PaddingPrefix; }
+  unsigned getMaxPaddingPrefixes() const { return MaxPaddingPrefixes; }
+  void setPaddingPrefix(uint8_t Prefix, unsigned Max) {
+    PaddingPrefix = Prefix;
+    MaxPaddingPrefixes = Max;
+  }
+
   static bool classof(const MCFragment *F) {
     return F->getKind() == MCFragment::FT_CompactEncodedInst;
   }
@@ -96,6 +96,10 @@ public:
   void ChangeSection(const MCSection *Section,
                      const MCExpr *Subsection) override;
   void EmitInstruction(const MCInst &Inst, const MCSubtargetInfo& STI) override;
+  void EmitInstructionWithPaddingPrefix(const MCInst &Inst,
+                                        const MCSubtargetInfo &STI,
+                                        uint8_t Prefix,
+                                        unsigned MaxPrefixes) override;
 
   /// \brief Emit an instruction to a special fragment, because this instruction
   /// can change its size during relaxation.
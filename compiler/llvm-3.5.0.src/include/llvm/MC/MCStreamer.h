@@ -718,6 +718,16 @@ public:
   /// section.
   virtual void EmitInstruction(const MCInst &Inst, const MCSubtargetInfo &STI);
 
+  /// EmitInstructionWithPaddingPrefix - Emit @p Inst, which is immediately
+  /// followed by a code alignment. The streamer may prepend up to
+  /// @p MaxPrefixes copies of the redundant prefix byte @p Prefix to the
+  /// instruction so that the alignment needs fewer nop bytes. The default
+  /// implementation just emits the instruction.
+  virtual void EmitInstructionWithPaddingPrefix(const MCInst &Inst,
+                                                const MCSubtargetInfo &STI,
+                                                uint8_t Prefix,
+                                                unsigned MaxPrefixes);
+
   /// \brief Set the bundle alignment mode from now on in the section.
   /// The argument is the power of 2 to which the alignment is set. The
   /// value 0 means turn the bundle alignment off.
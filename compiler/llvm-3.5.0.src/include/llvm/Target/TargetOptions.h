@@ -60,7 +60,8 @@ namespace llvm {
           NoZerosInBSS(false), JITEmitDebugInfo(false),
           JITEmitDebugInfoToDisk(false), GuaranteedTailCallOpt(false),
           DisableTailCalls(false), DisableCFI(false), DisablePICFI(false),
-          CountInstrumentedIB(false),
+          CountInstrumentedIB(false), ProfileInstrumentedIB(false),
+          ProfileIBPeriod(1),
           StackAlignmentOverride(0),
           EnableFastISel(false), PositionIndependentExecutable(false),
           UseInitArray(false), DisableIntegratedAS(false),
@@ -162,6 +163,14 @@ namespace llvm {
     /// CountInstrumentedIB
     unsigned CountInstrumentedIB : 1;
 
+    /// ProfileInstrumentedIB - Count the executions of each instrumented
+    /// indirect branch in a counter next to its Bary slot.
+    unsigned ProfileInstrumentedIB : 1;
+
+    /// ProfileIBPeriod - Count one out of every ProfileIBPeriod executions
+    /// per thread, a power of two; 1 counts all of them.
+    unsigned ProfileIBPeriod;
+
     /// StackAlignmentOverride - Override default stack alignment for target.
     unsigned StackAlignmentOverride;
 
@@ -255,6 +264,8 @@ inline bool operator==(const TargetOptions &LHS,
     ARE_EQUAL(DisableCFI) &&
     ARE_EQUAL(DisablePICFI) &&
     ARE_EQUAL(CountInstrumentedIB) &&
+    ARE_EQUAL(ProfileInstrumentedIB) &&
+    ARE_EQUAL(ProfileIBPeriod) &&
     ARE_EQUAL(StackAlignmentOverride) &&
     ARE_EQUAL(EnableFastISel) &&
     ARE_EQUAL(PositionIndependentExecutable) &&
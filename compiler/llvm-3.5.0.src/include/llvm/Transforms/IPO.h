@@ -72,6 +72,26 @@ ModulePass *createGlobalDCEPass();
 
 ModulePass *createFuncAddrTakenPass();
 
+//===----------------------------------------------------------------------===//
+/// createIndirectCallPromotionPass - This pass promotes the hot targets of
+/// profiled indirect calls (mcfi.icp metadata) to guarded direct calls.
+///
+ModulePass *createIndirectCallPromotionPass();
+
+//===----------------------------------------------------------------------===//
+/// createWholeProgramDevirtPass - This pass turns virtual calls with a single
+/// reachable implementation into direct calls, using the MCFI class
+/// hierarchy metadata. It assumes the module holds the whole program.
+///
+ModulePass *createWholeProgramDevirtPass();
+
+//===----------------------------------------------------------------------===//
+/// createVtableLayoutPass - This pass lays out the vtables of each
+/// single-inheritance class tree contiguously, so that MCFI can check
+/// virtual calls with a range check on the vtable pointer.
+///
+ModulePass *createVtableLayoutPass();
+
 //===----------------------------------------------------------------------===//
 /// createGVExtractionPass - If deleteFn is true, this pass deletes
 /// the specified global values. Otherwise, it deletes as much of the module as
@@ -37,8 +37,10 @@
 #include "llvm/MC/MCExpr.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCSection.h"
+#include "llvm/MC/MCSectionELF.h"
 #include "llvm/MC/MCStreamer.h"
 #include "llvm/MC/MCSymbol.h"
+#include "llvm/Support/ELF.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/Format.h"
 #include "llvm/Support/MathExtras.h"
@@ -732,6 +734,26 @@ void AsmPrinter::emitCFIInstruction(const MachineInstr &MI) {
   emitCFIInstruction(CFI);
 }
 
+/// getMCFIColdSection - Return the section the MCFI slow paths of a function
+/// in FnSection are emitted to, or null if they stay in FnSection. The
+/// ".text.unlikely." prefix makes the default linker script gather them at
+/// the start of .text, away from the hot code. A function in a comdat group
+/// keeps them in the same group, so that they are discarded together.
+static const MCSection *getMCFIColdSection(MCContext &Ctx,
+                                           const MCSection *FnSection) {
+  const MCSectionELF *ES = dyn_cast_or_null<MCSectionELF>(FnSection);
+  if (!ES)
+    return nullptr;
+  unsigned Flags = ELF::SHF_ALLOC | ELF::SHF_EXECINSTR;
+  StringRef Group;
+  if (const MCSymbol *G = ES->getGroup()) {
+    Flags |= ELF::SHF_GROUP;
+    Group = G->getName();
+  }
+  return Ctx.getELFSection(".text.unlikely.mcfi.cold", ELF::SHT_PROGBITS,
+                           Flags, SectionKind::getText(), 0, Group);
+}
+
 /// EmitFunctionBody - This method emits the body and trailer for a
 /// function.
 void AsmPrinter::EmitFunctionBody() {
@@ -745,20 +767,34 @@ void AsmPrinter::EmitFunctionBody() {
   const MachineInstr *LastMI = nullptr;
   const MachineInstr *LastRealMI = nullptr;
 
-  for (auto &MBB : *MF) {
+  // MCFI slow paths are moved out of the function's section. They are
+  // emitted after the function, each run of them with the number of CFI
+  // instructions the hot code had emitted before it.
+  const MCSection *ColdSection = nullptr;
+  for (const auto &MBB : *MF)
+    if (MBB.isMCFICold()) {
+      ColdSection =
+        getMCFIColdSection(OutContext, OutStreamer.getCurrentSection().first);
+      break;
+    }
+  SmallVector<unsigned, 8> HotCFIIndices;
+  SmallVector<std::pair<const MachineBasicBlock *, unsigned>, 8> ColdMBBs;
+
+  auto EmitMBB = [&](const MachineBasicBlock &MBB, bool Hot) {
     // Print a label for the basic block.
     EmitBasicBlockStart(MBB);
     for (auto &MI : MBB) {
-      LastMI = &MI;
+      if (Hot)
+        LastMI = &MI;
 
       // Print the assembly for the instruction.
       if (!MI.isPosition() && !MI.isImplicitDef() && !MI.isKill() &&
           !MI.isDebugValue()) {
-        HasAnyRealCode = true;
+        HasAnyRealCode |= Hot;
         ++EmittedInsts;
       }
 
-      if (ShouldPrintDebugScopes) {
+      if (ShouldPrintDebugScopes && Hot) {
         for (const HandlerInfo &HI : Handlers) {
           NamedRegionTimer T(HI.TimerName, HI.TimerGroupName,
                              TimePassesIsEnabled);
@@ -771,6 +807,8 @@ void AsmPrinter::EmitFunctionBody() {
 
       switch (MI.getOpcode()) {
       case TargetOpcode::CFI_INSTRUCTION:
+        if (Hot)
+          HotCFIIndices.push_back(MI.getOperand(0).getCFIIndex());
         emitCFIInstruction(MI);
         break;
 
@@ -794,12 +832,13 @@ void AsmPrinter::EmitFunctionBody() {
         if (isVerbose()) emitKill(&MI, *this);
         break;
       default:
-        LastRealMI = &MI;
+        if (Hot)
+          LastRealMI = &MI;
         EmitInstruction(&MI);
         break;
       }
 
-      if (ShouldPrintDebugScopes) {
+      if (ShouldPrintDebugScopes && Hot) {
         for (const HandlerInfo &HI : Handlers) {
           NamedRegionTimer T(HI.TimerName, HI.TimerGroupName,
                              TimePassesIsEnabled);
@@ -807,6 +846,13 @@ void AsmPrinter::EmitFunctionBody() {
         }
       }
     }
+  };
+
+  for (auto &MBB : *MF) {
+    if (ColdSection && MBB.isMCFICold())
+      ColdMBBs.push_back(std::make_pair(&MBB, HotCFIIndices.size()));
+    else
+      EmitMBB(MBB, true);
   }
 
   EmitMCFIPadding(LastRealMI);
@@ -866,6 +912,32 @@ void AsmPrinter::EmitFunctionBody() {
     NamedRegionTimer T(HI.TimerName, HI.TimerGroupName, TimePassesIsEnabled);
     HI.Handler->endFunction(MF);
   }
+
+  // Emit the MCFI slow paths once the function's frame is closed. A run of
+  // them gets a frame of its own, which starts out with the CFI instructions
+  // the hot code had at the run, so that the unwinder and debuggers can walk
+  // out of a slow path. Runs with the same CFI state share a frame.
+  if (!ColdMBBs.empty()) {
+    bool EmitFrames =
+      MAI->getExceptionHandlingType() == ExceptionHandling::DwarfCFI &&
+      needsCFIMoves() != CFI_M_None;
+    const std::vector<MCCFIInstruction> &Instrs = MMI->getFrameInstructions();
+    OutStreamer.PushSection();
+    OutStreamer.SwitchSection(ColdSection);
+    for (unsigned I = 0, E = ColdMBBs.size(); I != E;) {
+      unsigned NumCFIs = ColdMBBs[I].second;
+      if (EmitFrames) {
+        OutStreamer.EmitCFIStartProc(/*IsSimple=*/false);
+        for (unsigned J = 0; J != NumCFIs; ++J)
+          emitCFIInstruction(Instrs[HotCFIIndices[J]]);
+      }
+      for (; I != E && ColdMBBs[I].second == NumCFIs; ++I)
+        EmitMBB(*ColdMBBs[I].first, false);
+      if (EmitFrames)
+        OutStreamer.EmitCFIEndProc();
+    }
+    OutStreamer.PopSection();
+  }
   MMI->EndFunction();
 
   // Print out jump tables referenced by the function.
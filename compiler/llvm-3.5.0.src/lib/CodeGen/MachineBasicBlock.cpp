@@ -39,7 +39,7 @@ using namespace llvm;
 
 MachineBasicBlock::MachineBasicBlock(MachineFunction &mf, const BasicBlock *bb)
   : BB(bb), Number(-1), xParent(&mf), Alignment(0), IsLandingPad(false),
-    AddressTaken(false), CachedMCSymbol(nullptr) {
+    AddressTaken(false), MCFICold(false), CachedMCSymbol(nullptr) {
   Insts.Parent = this;
 }
 
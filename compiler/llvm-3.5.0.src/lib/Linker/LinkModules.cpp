@@ -1262,6 +1262,7 @@ bool ModuleLinker::linkNamedMDNodes() {
     if (I->getName().equals("MCFIDtorCxaThrow")) continue;
     if (I->getName().equals("MCFILargeSandbox")) continue;
     if (I->getName().equals("MCFILargeID")) continue;
+    if (I->getName().equals("MCFIShadowStack")) continue;
     if (I->getName().equals("llvm.ident")) continue; // do not link ident
     NamedMDNode *DestNMD = DstM->getOrInsertNamedMetadata(I->getName());
     // Add Src elements into Dest node.
@@ -1287,6 +1288,12 @@ bool ModuleLinker::linkNamedMDNodes() {
        DstM->getNamedMetadata("MCFILargeID"))) {
     return emitError("Linking two different MCFI ID bit-lengths.");
   }
+  // Both return protection modes keep the shadow stack balanced within each
+  // function, so they may be mixed; the linked module uses the shadow stack
+  // only if all of its parts asked for it.
+  if (!SrcM->getNamedMetadata("MCFIShadowStack"))
+    if (NamedMDNode *SS = DstM->getNamedMetadata("MCFIShadowStack"))
+      DstM->eraseNamedMetadata(SS);
   return false;
 }
 
@@ -48,6 +48,10 @@ STATISTIC(EmittedFillFragments,
           "Number of emitted assembler fragments - fill");
 STATISTIC(EmittedOrgFragments,
           "Number of emitted assembler fragments - org");
+STATISTIC(EmittedAlignNopBytes,
+          "Number of nop bytes emitted for code alignment");
+STATISTIC(EmittedAlignPrefixBytes,
+          "Number of code alignment bytes emitted as instruction prefixes");
 STATISTIC(evaluateFixup, "Number of evaluated fixups");
 STATISTIC(FragmentLayouts, "Number of fragment layouts");
 STATISTIC(ObjectBytes, "Number of emitted object file bytes");
@@ -519,13 +523,44 @@ bool MCAssembler::evaluateFixup(const MCAsmLayout &Layout,
   return IsResolved;
 }
 
+/// \brief Compute the padding of the alignment fragment \p AF when placed at
+///        \p Offset.
+static uint64_t computeAlignSize(const MCAssembler &Asm,
+                                 const MCAlignFragment &AF, uint64_t Offset) {
+  unsigned Size = OffsetToAlignment(Offset, AF.getAlignment(), AF.getExtra());
+  // If we are padding with nops, force the padding to be larger than the
+  // minimum nop size.
+  if (Size > 0 && AF.hasEmitNops()) {
+    while (Size % Asm.getBackend().getMinimumNopSize())
+      Size += AF.getAlignment();
+  }
+  if (Size > AF.getMaxBytesToEmit())
+    return 0;
+  return Size;
+}
+
 uint64_t MCAssembler::computeFragmentSize(const MCAsmLayout &Layout,
                                           const MCFragment &F) const {
   switch (F.getKind()) {
   case MCFragment::FT_Data:
   case MCFragment::FT_Relaxable:
-  case MCFragment::FT_CompactEncodedInst:
     return cast<MCEncodedFragment>(F).getContents().size();
+
+  case MCFragment::FT_CompactEncodedInst: {
+    // An instruction right before a code alignment may take over (part of)
+    // the padding as redundant prefixes, so fewer nops have to be decoded.
+    const MCCompactEncodedInstFragment &CEIF =
+      cast<MCCompactEncodedInstFragment>(F);
+    uint64_t Size = CEIF.getContents().size();
+    const MCAlignFragment *AF =
+      dyn_cast_or_null<MCAlignFragment>(CEIF.getNextNode());
+    if (!CEIF.getMaxPaddingPrefixes() || !AF || !AF->hasEmitNops())
+      return Size;
+    uint64_t Padding =
+      computeAlignSize(*this, *AF, Layout.getFragmentOffset(&F) + Size);
+    return Size + std::min<uint64_t>(Padding, CEIF.getMaxPaddingPrefixes());
+  }
+
   case MCFragment::FT_Fill:
     return cast<MCFillFragment>(F).getSize();
 
@@ -534,17 +569,7 @@ uint64_t MCAssembler::computeFragmentSize(const MCAsmLayout &Layout,
 
   case MCFragment::FT_Align: {
     const MCAlignFragment &AF = cast<MCAlignFragment>(F);
-    unsigned Offset = Layout.getFragmentOffset(&AF);
-    unsigned Size = OffsetToAlignment(Offset, AF.getAlignment(), AF.getExtra());
-    // If we are padding with nops, force the padding to be larger than the
-    // minimum nop size.
-    if (Size > 0 && AF.hasEmitNops()) {
-      while (Size % getBackend().getMinimumNopSize())
-        Size += AF.getAlignment();
-    }
-    if (Size > AF.getMaxBytesToEmit())
-      return 0;
-    return Size;
+    return computeAlignSize(*this, AF, Layout.getFragmentOffset(&AF));
   }
 
   case MCFragment::FT_Org: {
@@ -695,6 +720,7 @@ static void writeFragment(const MCAssembler &Asm, const MCAsmLayout &Layout,
     // bytes left to fill use the Value and ValueSize to fill the rest.
     // If we are aligning with nops, ask that target to emit the right data.
     if (AF.hasEmitNops()) {
+      stats::EmittedAlignNopBytes += Count;
       if (!Asm.getBackend().writeNopData(Count, OW))
         report_fatal_error("unable to write nop sequence of " +
                           Twine(Count) + " bytes");
@@ -724,10 +750,17 @@ static void writeFragment(const MCAssembler &Asm, const MCAsmLayout &Layout,
     writeFragmentContents(F, OW);
     break;
 
-  case MCFragment::FT_CompactEncodedInst:
+  case MCFragment::FT_CompactEncodedInst: {
     ++stats::EmittedCompactEncodedInstFragments;
+    const MCCompactEncodedInstFragment &CEIF =
+      cast<MCCompactEncodedInstFragment>(F);
+    uint64_t Prefixes = FragmentSize - CEIF.getContents().size();
+    stats::EmittedAlignPrefixBytes += Prefixes;
+    for (uint64_t i = 0; i != Prefixes; ++i)
+      OW->Write8(CEIF.getPaddingPrefix());
     writeFragmentContents(F, OW);
     break;
+  }
 
   case MCFragment::FT_Fill: {
     ++stats::EmittedFillFragments;
@@ -1186,6 +1219,9 @@ void MCFragment::dump() {
       OS << hexdigit((Contents[i] >> 4) & 0xF) << hexdigit(Contents[i] & 0xF);
     }
     OS << "] (" << Contents.size() << " bytes)";
+    if (CEIF->getMaxPaddingPrefixes())
+      OS << " PaddingPrefix:" << unsigned(CEIF->getPaddingPrefix())
+         << " MaxPaddingPrefixes:" << CEIF->getMaxPaddingPrefixes();
     break;
   }
   case MCFragment::FT_Fill:  {
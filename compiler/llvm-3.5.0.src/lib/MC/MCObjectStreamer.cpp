@@ -221,6 +221,43 @@ void MCObjectStreamer::EmitInstruction(const MCInst &Inst,
   EmitInstToFragment(Inst, STI);
 }
 
+void MCObjectStreamer::EmitInstructionWithPaddingPrefix(
+    const MCInst &Inst, const MCSubtargetInfo &STI, uint8_t Prefix,
+    unsigned MaxPrefixes) {
+  // No instruction may be longer than 15 bytes, prefixes included.
+  const unsigned MaxInstLength = 15;
+
+  MCAssembler &Assembler = getAssembler();
+  if (!MaxPrefixes || Assembler.isBundlingEnabled() ||
+      Assembler.getBackend().mayNeedRelaxation(Inst)) {
+    EmitInstruction(Inst, STI);
+    return;
+  }
+
+  SmallVector<MCFixup, 4> Fixups;
+  SmallString<16> Code;
+  raw_svector_ostream VecOS(Code);
+  Assembler.getEmitter().EncodeInstruction(Inst, VecOS, Fixups, STI);
+  VecOS.flush();
+  if (!Fixups.empty() || Code.size() >= MaxInstLength) {
+    EmitInstruction(Inst, STI);
+    return;
+  }
+
+  MCStreamer::EmitInstruction(Inst, STI);
+  getCurrentSectionData()->setHasInstructions(true);
+  MCLineEntry::Make(this, getCurrentSection().first);
+
+  // The instruction gets a fragment of its own; its size is settled during
+  // layout, once the padding of the alignment that follows it is known.
+  MCCompactEncodedInstFragment *CEIF = new MCCompactEncodedInstFragment();
+  insert(CEIF);
+  CEIF->getContents().append(Code.begin(), Code.end());
+  CEIF->setPaddingPrefix(Prefix,
+                         std::min<unsigned>(MaxPrefixes,
+                                            MaxInstLength - Code.size()));
+}
+
 void MCObjectStreamer::EmitInstToFragment(const MCInst &Inst,
                                           const MCSubtargetInfo &STI) {
   // Always create a new, separate fragment here, because its size can change
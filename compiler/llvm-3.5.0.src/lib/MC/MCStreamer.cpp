@@ -655,6 +655,13 @@ void MCStreamer::EmitInstruction(const MCInst &Inst,
       visitUsedExpr(*Inst.getOperand(i).getExpr());
 }
 
+void MCStreamer::EmitInstructionWithPaddingPrefix(const MCInst &Inst,
+                                                  const MCSubtargetInfo &STI,
+                                                  uint8_t Prefix,
+                                                  unsigned MaxPrefixes) {
+  EmitInstruction(Inst, STI);
+}
+
 void MCStreamer::EmitAssemblerFlag(MCAssemblerFlag Flag) {}
 void MCStreamer::EmitThumbFunc(MCSymbol *Func) {}
 void MCStreamer::EmitSymbolDesc(MCSymbol *Symbol, unsigned DescValue) {}
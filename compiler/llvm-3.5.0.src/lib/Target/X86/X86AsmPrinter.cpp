@@ -776,14 +776,25 @@ void X86AsmPrinter::EmitEndOfAsmFile(Module &M) {
     EmitMCFIInfo(".MCFIDtorCxaThrow", M);
     EmitMCFIInfo(".MCFIFuncInfo", M);
     EmitMCFIInfo(".MCFIIndirectCalls", M);
+    // tells the runtime to allocate shadow stacks for all threads
+    if (M.getNamedMetadata("MCFIShadowStack")) {
+      OutStreamer.SwitchSection(
+        OutContext.getELFSection(".MCFIShadowStack", ELF::SHT_PROGBITS, 0,
+                                 SectionKind::getReadOnly()));
+      OutStreamer.EmitIntValue(1, 1);
+    }
     // Aliases
     NamedMDNode *MD = M.getOrInsertNamedMetadata("MCFIAliases");
     for (const auto &Alias : M.aliases()) {
       //Alias.dump();
+      // vtables laid out by VtableLayout alias into the middle of a region
+      const Value *Aliasee = Alias.getAliasee()->stripPointerCasts();
+      if (!isa<GlobalValue>(Aliasee))
+        continue;
       std::string AliasStr;
       const MCSymbol *Name = getSymbol(&Alias);
       AliasStr += Name->getName().str() + ' ';
-      AliasStr += Alias.getAliasee()->stripPointerCasts()->getName().str();
+      AliasStr += Aliasee->getName().str();
       MD->addOperand(MDNode::get(M.getContext(),
                                  MDString::get(M.getContext(), AliasStr.c_str())));
     }
@@ -803,6 +814,7 @@ void X86AsmPrinter::EmitEndOfAsmFile(Module &M) {
     }
     EmitMCFIInfo(".MCFIAddrTakenInCode", M);
     EmitMCFIInfo(".MCFIVtable", M);
+    EmitMCFIInfo(".MCFIVtableRegions", M);
   }
 }
 
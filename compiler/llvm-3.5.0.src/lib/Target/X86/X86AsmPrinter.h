@@ -65,6 +65,21 @@ class LLVM_LIBRARY_VISIBILITY X86AsmPrinter : public AsmPrinter {
     return false;
   }
 
+  // Is MI followed by a direct call whose return address gets aligned, and
+  // may MI carry redundant segment prefixes in place of that padding?
+  bool isFollowedByAlignedCall(const MachineInstr *MI) {
+    if (MI->isPseudo() || MI->isInlineAsm() || MI->mayLoad() ||
+        MI->mayStore() || MI->isBranch() || MI->isCall() || MI->isReturn() ||
+        MI->hasUnmodeledSideEffects())
+      return false;
+    MachineBasicBlock::const_instr_iterator I = MI;
+    MachineBasicBlock::const_instr_iterator E = MI->getParent()->instr_end();
+    for (++I; I != E && I->isDebugValue(); ++I)
+      ;
+    return I != E && I->getOpcode() == X86::CALL64pcrel32 &&
+      !isNoReturnFunction(I->getOperand(0));
+  }
+
  public:
   explicit X86AsmPrinter(TargetMachine &TM, MCStreamer &Streamer)
     : AsmPrinter(TM, Streamer), SM(*this) {
@@ -27,6 +27,8 @@
 #include "llvm/CodeGen/Passes.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/raw_ostream.h"
@@ -44,6 +46,31 @@ using namespace llvm;
 
 STATISTIC(NumIndirectCall, "Number of instrumented indirect calls");
 STATISTIC(NumReturns, "Number of instrumented returns");
+STATISTIC(NumVtableRangeChecks,
+          "Number of virtual calls with a vtable range check");
+
+// The interop, validity and version checks and the violation report are
+// only reached when the ids of a branch and its target differ. Out of line
+// they no longer share i-cache lines and pages with the hot code; the price
+// is the rel32 form of the jne leaving the id comparison.
+static cl::opt<bool>
+MCFIColdSlowPaths("mcfi-cold-slow-paths", cl::init(true), cl::Hidden,
+                  cl::desc("Emit MCFI slow paths to .text.unlikely.mcfi.cold"));
+
+// Modules compiled with -fmcfi-return=shadow keep a per-thread shadow stack
+// of (return address, stack pointer after the return) pairs. The runtime
+// allocates it for all threads once such a module is loaded, and stores its
+// top at this offset as a %fs-relative offset (TCB::shadow_sp). A call site
+// pushes its entry before the call and pops it after; the return address is
+// a label of the call site rather than the copy on the writable sandbox
+// stack, which other threads may overwrite. A return whose address and stack
+// pointer match the top entry thus goes back to the call that pushed it and
+// skips the Tary lookup. Otherwise the entries of frames that were unwound
+// by longjmp or an exception are dropped, and the return falls back to the
+// ID check, which also covers swapcontext, tail calls through other modules
+// and returns to callers that pushed nothing. Every function pops what it
+// pushes, so modules in both modes can call each other.
+static const int64_t ShadowSPOffset = 0x110;
 
 namespace {
 struct MCFI : public MachineFunctionPass {
@@ -65,6 +92,12 @@ struct MCFI : public MachineFunctionPass {
 private:
   bool SmallSandbox;
   bool SmallID;
+  bool ShadowStack;       // the module asked for shadow stack returns
+  bool UseShadowStack;    // the current function uses the shadow stack
+  MachineBasicBlock *RetSlowPathMBB; // slow path shared by the returns
+  MachineBasicBlock *RetResyncMBB;   // shadow stack resync of the returns
+  unsigned RetResyncSlot;            // Bary slot of the check it leads to
+  MCSymbol *ShadowRetSym; // return address of the indirect call being checked
   Module *M;
   unsigned long ModuleID;
   std::set<StringRef> GlobalCtors;
@@ -288,10 +321,24 @@ private:
                    MachineBasicBlock *&VerCheckMBB,
                    MachineBasicBlock *&ReportMBB,
                    DebugLoc &DL,
-                   bool isReturn);
+                   bool isReturn,
+                   MachineBasicBlock *SlowPathMBB = nullptr);
 
   void MCFIx64Ret(MachineFunction &MF, MachineBasicBlock *MBB,
                   MachineBasicBlock::iterator &MI);
+  bool MCFIx64ShadowStackCall(MachineFunction &MF, MachineBasicBlock *MBB,
+                              MachineBasicBlock::iterator &MI);
+  MachineBasicBlock::iterator
+  MCFIx64ShadowStackPop(MachineFunction &MF, MachineBasicBlock *MBB,
+                        MachineBasicBlock::iterator I, MCSymbol *RetSym,
+                        DebugLoc &DL);
+  void MCFIx64ShadowStackLandingPad(MachineFunction &MF,
+                                    MachineBasicBlock *MBB);
+  void MCFIx64ShadowStackRet(MachineFunction &MF,
+                             MachineBasicBlock *MBB,
+                             MachineBasicBlock *IDCmpMBB,
+                             MachineBasicBlock *ICJMBB,
+                             DebugLoc &DL);
   void MCFIx64IndirectCall(MachineFunction &MF, MachineBasicBlock *MBB,
                            MachineBasicBlock::iterator &MI);
 
@@ -383,6 +430,7 @@ bool MCFI::runOnMachineFunction(MachineFunction &MF) {
     M = newM;
     SmallSandbox = !M->getNamedMetadata("MCFILargeSandbox");
     SmallID = !M->getNamedMetadata("MCFILargeID");
+    ShadowStack = M->getNamedMetadata("MCFIShadowStack");
     
     std::random_device rd;
     std::mt19937_64 e2(rd());
@@ -473,6 +521,10 @@ void MCFI::MCFIx64ICJ(MachineFunction &MF, MachineBasicBlock* MBB,
   auto I = std::begin(*MBB);
   BuildMI(*MBB, I, DL, TII->get(CJOp)).addReg(TargetReg);
   std::prev(I)->setBarySlot(ModuleID + BarySlot);
+  if (ShadowRetSym && CJOp == X86::CALL64r) {
+    MCFIx64ShadowStackPop(MF, MBB, MBB->end(), ShadowRetSym, DL);
+    ShadowRetSym = nullptr;
+  }
 }
 
 void MCFI::MCFIx64InteropCheck(MachineFunction &MF,
@@ -605,7 +657,8 @@ void MCFI::MCFIx64MBBs(MachineFunction &MF,
                        MachineBasicBlock *&VerCheckMBB,
                        MachineBasicBlock *&ReportMBB,
                        DebugLoc &DL,
-                       bool isReturn) {
+                       bool isReturn,
+                       MachineBasicBlock *SlowPathMBB) {
   MachineFunction::iterator MBBI;
   
   IDCmpMBB = MF.CreateMachineBasicBlock();
@@ -620,6 +673,18 @@ void MCFI::MCFIx64MBBs(MachineFunction &MF,
   IDCmpMBB->addSuccessor(ICJMBB);
   MCFIx64ICJ(MF, ICJMBB, CJOp, TargetReg, DL); // fill ICJMBB
 
+  // The slow path of an earlier branch of the same class is as good as a
+  // new one, so this branch only gets its ID comparison.
+  if (SlowPathMBB) {
+    IDCmpMBB->addSuccessor(SlowPathMBB, UINT_MAX);
+    ICJMBB->transferSuccessors(MBB);
+    MBB->addSuccessor(IDCmpMBB);
+    MachineInstrBuilder(MF, &IDCmpMBB->instr_back()).addMBB(SlowPathMBB);
+    InteropCheckMBB = SlowPathMBB;
+    IDValidityCheckMBB = VerCheckMBB = ReportMBB = nullptr;
+    return;
+  }
+
   InteropCheckMBB = MF.CreateMachineBasicBlock();
   MF.push_back(InteropCheckMBB);
   MCFIx64InteropCheck(MF, InteropCheckMBB, BIDReg, TIDReg, TargetReg, DL);
@@ -659,6 +724,13 @@ void MCFI::MCFIx64MBBs(MachineFunction &MF,
   MachineInstrBuilder(MF, &InteropCheckMBB->instr_back()).addMBB(ICJMBB);
   MachineInstrBuilder(MF, &IDValidityCheckMBB->instr_back()).addMBB(ReportMBB);
   MachineInstrBuilder(MF, &VerCheckMBB->instr_back()).addMBB(IDCmpMBB);
+
+  if (MCFIColdSlowPaths) {
+    InteropCheckMBB->setMCFICold();
+    IDValidityCheckMBB->setMCFICold();
+    VerCheckMBB->setMCFICold();
+    ReportMBB->setMCFICold();
+  }
 }
 
 void MCFI::MCFIx64Ret(MachineFunction &MF, MachineBasicBlock *MBB,
@@ -695,15 +767,302 @@ void MCFI::MCFIx64Ret(MachineFunction &MF, MachineBasicBlock *MBB,
   // remove the return instruction
   MI = MBB->erase(MI); // MI points std::end(MBB)
 
+  // the ID check of an earlier return is reached through its resync
+  if (UseShadowStack && RetResyncMBB) {
+    MCFIx64ShadowStackRet(MF, MBB, nullptr, nullptr, DL);
+    return;
+  }
+
   MachineBasicBlock *IDCmpMBB, *ICJMBB, *InteropCheckMBB,
     *IDValidityCheckMBB, *VerCheckMBB, *ReportMBB;
 
+  // All returns of a function check against its return class, so they can
+  // share one slow path; a violation is then reported at the first return.
   MCFIx64MBBs(MF, MBB, BIDReg, TIDReg, TargetReg, IDCmpMBB, ICJMBB, X86::JMP64r,
-              InteropCheckMBB, IDValidityCheckMBB, VerCheckMBB, ReportMBB, DL, true);
+              InteropCheckMBB, IDValidityCheckMBB, VerCheckMBB, ReportMBB, DL, true,
+              RetSlowPathMBB);
+  if (MCFIColdSlowPaths)
+    RetSlowPathMBB = InteropCheckMBB;
+  if (UseShadowStack)
+    MCFIx64ShadowStackRet(MF, MBB, IDCmpMBB, ICJMBB, DL);
   Returns.push_back(to_hex(ModuleID + BarySlot));
   BarySlot++;
 }
 
+// Push the entry of a call and pop it once the call returns:
+//   subq $16, %fs:ShadowSPOffset
+//   movq %fs:ShadowSPOffset, %A
+//   leaq Lret(%rip), %B
+//   movq %B, %fs:(%A)
+//   movq %rsp, %fs:8(%A)
+//   call ...
+// Lret:
+//   ...                                       ; the pop, see below
+// %A and %B are caller-saved registers that the call does not read. Without
+// two of them nothing is pushed, and the callee returns through its ID check.
+// An indirect call is replaced by its checked call later; MCFIx64ICJ puts
+// Lret and the pop after that one.
+bool MCFI::MCFIx64ShadowStackCall(MachineFunction &MF, MachineBasicBlock *MBB,
+                                  MachineBasicBlock::iterator &MI) {
+  const TargetInstrInfo *TII = MF.getTarget().getInstrInfo();
+  const TargetRegisterInfo *TRI = MF.getTarget().getRegisterInfo();
+  DebugLoc DL = MI->getDebugLoc();
+
+  SmallVector<unsigned, 2> Regs;
+  for (unsigned Reg : {X86::R11, X86::R10, X86::RAX})
+    if (Regs.size() < 2 && !MI->readsRegister(Reg, TRI))
+      Regs.push_back(Reg);
+  if (Regs.size() < 2)
+    return false;
+
+  MCSymbol *RetSym = MF.getContext().CreateTempSymbol();
+  BuildMI(*MBB, MI, DL, TII->get(X86::SUB64mi8))
+    .addReg(0).addImm(1).addReg(0).addImm(ShadowSPOffset).addReg(X86::FS)
+    .addImm(16);
+  BuildMI(*MBB, MI, DL, TII->get(X86::MOV64rm))
+    .addReg(Regs[0], RegState::Define)
+    .addReg(0).addImm(1).addReg(0).addImm(ShadowSPOffset).addReg(X86::FS);
+  BuildMI(*MBB, MI, DL, TII->get(X86::LEA64r))
+    .addReg(Regs[1], RegState::Define)
+    .addReg(X86::RIP).addImm(1).addReg(0).addSym(RetSym).addReg(0);
+  BuildMI(*MBB, MI, DL, TII->get(X86::MOV64mr))
+    .addReg(Regs[0]).addImm(1).addReg(0).addImm(0).addReg(X86::FS)
+    .addReg(Regs[1]);
+  BuildMI(*MBB, MI, DL, TII->get(X86::MOV64mr))
+    .addReg(Regs[0]).addImm(1).addReg(0).addImm(8).addReg(X86::FS)
+    .addReg(X86::RSP);
+
+  if (MI->getOpcode() == X86::CALL64pcrel32)
+    MI = MCFIx64ShadowStackPop(MF, MBB, std::next(MI), RetSym, DL);
+  else
+    ShadowRetSym = RetSym;
+  return true;
+}
+
+// The pop before I, which returns its last instruction:
+//   Lret:  movq %fs:ShadowSPOffset, %r11
+//          leaq 16(%r11), %r10
+//          cmpq $-1, %fs:8(%r11)
+//          cmoveq %r11, %r10                  ; the sentinel is never popped
+//          movq %r10, %fs:ShadowSPOffset
+// %r10, %r11 and the flags are dead after a call. A resync may already have
+// dropped the entry of the call, e.g. after swapcontext, and the pop then
+// takes the next one; at the sentinel it stays. So the top never passes the
+// sentinel, and pushes stop at the guard page at the low end.
+MachineBasicBlock::iterator
+MCFI::MCFIx64ShadowStackPop(MachineFunction &MF, MachineBasicBlock *MBB,
+                            MachineBasicBlock::iterator I, MCSymbol *RetSym,
+                            DebugLoc &DL) {
+  const TargetInstrInfo *TII = MF.getTarget().getInstrInfo();
+  BuildMI(*MBB, I, DL, TII->get(TargetOpcode::EH_LABEL)).addSym(RetSym);
+  BuildMI(*MBB, I, DL, TII->get(X86::MOV64rm))
+    .addReg(X86::R11, RegState::Define)
+    .addReg(0).addImm(1).addReg(0).addImm(ShadowSPOffset).addReg(X86::FS);
+  BuildMI(*MBB, I, DL, TII->get(X86::LEA64r))
+    .addReg(X86::R10, RegState::Define)
+    .addReg(X86::R11).addImm(1).addReg(0).addImm(16).addReg(0);
+  BuildMI(*MBB, I, DL, TII->get(X86::CMP64mi8))
+    .addReg(X86::R11).addImm(1).addReg(0).addImm(8).addReg(X86::FS)
+    .addImm(-1);
+  BuildMI(*MBB, I, DL, TII->get(X86::CMOVE64rr), X86::R10)
+    .addReg(X86::R10).addReg(X86::R11);
+  BuildMI(*MBB, I, DL, TII->get(X86::MOV64mr))
+    .addReg(0).addImm(1).addReg(0).addImm(ShadowSPOffset).addReg(X86::FS)
+    .addReg(X86::R10);
+  return std::prev(I);
+}
+
+// The calls whose frames an exception unwound did not pop their entries;
+// a landing pad drops every entry pushed at or below its stack pointer:
+//   MBB:       movq %fs:ShadowSPOffset, %r11
+//   Lloop:     cmpq %rsp, %fs:8(%r11)
+//              ja Ldone
+//              addq $16, %r11
+//              jmp Lloop
+//   Ldone:     movq %r11, %fs:ShadowSPOffset
+//              ...                            ; the rest of the landing pad
+// Only %rax and %rdx are live on entry to a landing pad.
+void MCFI::MCFIx64ShadowStackLandingPad(MachineFunction &MF,
+                                        MachineBasicBlock *MBB) {
+  const TargetInstrInfo *TII = MF.getTarget().getInstrInfo();
+  const unsigned SPReg = X86::R11;
+  DebugLoc DL;
+
+  // keep the landing pad's labels in front
+  auto I = std::begin(*MBB);
+  while (I != std::end(*MBB) && I->isLabel())
+    ++I;
+
+  MachineBasicBlock *LoopMBB = MF.CreateMachineBasicBlock();
+  MachineBasicBlock *PopMBB = MF.CreateMachineBasicBlock();
+  MachineBasicBlock *DoneMBB = MF.CreateMachineBasicBlock();
+  MachineFunction::iterator MBBI = MBB;
+  ++MBBI;
+  MF.insert(MBBI, LoopMBB);
+  MF.insert(MBBI, PopMBB);
+  MF.insert(MBBI, DoneMBB);
+  DoneMBB->splice(std::begin(*DoneMBB), MBB, I, std::end(*MBB));
+  DoneMBB->transferSuccessors(MBB);
+  for (auto LI = MBB->livein_begin(); LI != MBB->livein_end(); ++LI) {
+    LoopMBB->addLiveIn(*LI);
+    PopMBB->addLiveIn(*LI);
+    DoneMBB->addLiveIn(*LI);
+  }
+
+  // MBB
+  BuildMI(*MBB, MBB->end(), DL, TII->get(X86::MOV64rm))
+    .addReg(SPReg, RegState::Define)
+    .addReg(0).addImm(1).addReg(0).addImm(ShadowSPOffset).addReg(X86::FS);
+  MBB->addSuccessor(LoopMBB);
+
+  // LoopMBB
+  LoopMBB->addLiveIn(SPReg);
+  BuildMI(*LoopMBB, LoopMBB->end(), DL, TII->get(X86::CMP64mr))
+    .addReg(SPReg).addImm(1).addReg(0).addImm(8).addReg(X86::FS)
+    .addReg(X86::RSP);
+  BuildMI(*LoopMBB, LoopMBB->end(), DL, TII->get(X86::JA_1)).addMBB(DoneMBB);
+  LoopMBB->addSuccessor(DoneMBB);
+  LoopMBB->addSuccessor(PopMBB);
+
+  // PopMBB
+  PopMBB->addLiveIn(SPReg);
+  BuildMI(*PopMBB, PopMBB->end(), DL, TII->get(X86::ADD64ri8), SPReg)
+    .addReg(SPReg).addImm(16);
+  BuildMI(*PopMBB, PopMBB->end(), DL, TII->get(X86::JMP_1)).addMBB(LoopMBB);
+  PopMBB->addSuccessor(LoopMBB);
+
+  // DoneMBB
+  DoneMBB->addLiveIn(SPReg);
+  BuildMI(*DoneMBB, std::begin(*DoneMBB), DL, TII->get(X86::MOV64mr))
+    .addReg(0).addImm(1).addReg(0).addImm(ShadowSPOffset).addReg(X86::FS)
+    .addReg(SPReg);
+}
+
+// Put the shadow stack check in front of the ID check of a return. MBB ends
+// with "popq %rcx; movl %ecx, %ecx" and was followed by IDCmpMBB and ICJMBB;
+// the layout becomes
+//
+//   MBB:       movq %fs:ShadowSPOffset, %rdi
+//              cmpq %rcx, %fs:(%rdi)
+//              jne Lresync
+//   SlotMBB:   cmpq %rsp, %fs:8(%rdi)
+//              jne Lresync
+//   FastMBB:   jmpq *%rcx                     ; the caller pops the entry
+//   ...
+//   Lresync:   cmpq %rsp, %fs:8(%rdi)
+//              jae Lfound
+//              addq $16, %rdi                 ; entry of an unwound frame
+//              jmp Lresync
+//   Lfound:    movq %rdi, %fs:ShadowSPOffset
+//   IDCmpMBB:  ...                            ; the ID check
+//   ICJMBB:    jmpq *%rcx
+//
+// The entry found is either ours, whose address did not match, or one of a
+// caller further up, if ours pushed nothing; either is left for its caller
+// to pop. The sentinel at the bottom of the shadow stack has the highest
+// possible stack pointer, and the pops never move the top past it, so
+// Lresync ends there at the latest and only reads entries of the shadow
+// stack; the runtime keeps a guard page on either side of it. The later
+// returns of a function share the resync and ID check of the first one,
+// when IDCmpMBB is null.
+void MCFI::MCFIx64ShadowStackRet(MachineFunction &MF,
+                                 MachineBasicBlock *MBB,
+                                 MachineBasicBlock *IDCmpMBB,
+                                 MachineBasicBlock *ICJMBB,
+                                 DebugLoc &DL) {
+  const TargetInstrInfo *TII = MF.getTarget().getInstrInfo();
+  const unsigned TargetReg = X86::RCX;
+  const unsigned SPReg = X86::RDI;
+
+  MachineBasicBlock *SlotMBB = MF.CreateMachineBasicBlock();
+  MachineBasicBlock *FastMBB = MF.CreateMachineBasicBlock();
+  MachineFunction::iterator MBBI = MBB;
+  ++MBBI;
+  MF.insert(MBBI, SlotMBB);
+  MF.insert(MBBI, FastMBB);
+
+  MachineBasicBlock *ResyncMBB = RetResyncMBB;
+  unsigned Slot = RetResyncSlot;
+  if (IDCmpMBB) {
+    ResyncMBB = MF.CreateMachineBasicBlock();
+    MachineBasicBlock *PopMBB = MF.CreateMachineBasicBlock();
+    MachineBasicBlock *FoundMBB = MF.CreateMachineBasicBlock();
+    MF.push_back(ResyncMBB);
+    MF.push_back(PopMBB);
+    MF.push_back(FoundMBB);
+    // the ID check becomes the slow path and falls through from FoundMBB
+    MF.splice(MF.end(), IDCmpMBB, ++MachineFunction::iterator(ICJMBB));
+    MBB->removeSuccessor(IDCmpMBB);
+    Slot = BarySlot;
+
+    // ResyncMBB
+    ResyncMBB->addLiveIn(TargetReg);
+    ResyncMBB->addLiveIn(SPReg);
+    BuildMI(*ResyncMBB, ResyncMBB->end(), DL, TII->get(X86::CMP64mr))
+      .addReg(SPReg).addImm(1).addReg(0).addImm(8).addReg(X86::FS)
+      .addReg(X86::RSP);
+    BuildMI(*ResyncMBB, ResyncMBB->end(), DL, TII->get(X86::JAE_1))
+      .addMBB(FoundMBB);
+    ResyncMBB->addSuccessor(FoundMBB);
+    ResyncMBB->addSuccessor(PopMBB);
+
+    // PopMBB
+    PopMBB->addLiveIn(TargetReg);
+    PopMBB->addLiveIn(SPReg);
+    BuildMI(*PopMBB, PopMBB->end(), DL, TII->get(X86::ADD64ri8), SPReg)
+      .addReg(SPReg).addImm(16);
+    BuildMI(*PopMBB, PopMBB->end(), DL, TII->get(X86::JMP_1))
+      .addMBB(ResyncMBB);
+    PopMBB->addSuccessor(ResyncMBB);
+
+    // FoundMBB
+    FoundMBB->addLiveIn(TargetReg);
+    FoundMBB->addLiveIn(SPReg);
+    BuildMI(*FoundMBB, FoundMBB->end(), DL, TII->get(X86::MOV64mr))
+      .addReg(0).addImm(1).addReg(0).addImm(ShadowSPOffset).addReg(X86::FS)
+      .addReg(SPReg);
+    FoundMBB->addSuccessor(IDCmpMBB);
+
+    if (MCFIColdSlowPaths) {
+      ResyncMBB->setMCFICold();
+      PopMBB->setMCFICold();
+      FoundMBB->setMCFICold();
+      IDCmpMBB->setMCFICold();
+      ICJMBB->setMCFICold();
+      RetResyncMBB = ResyncMBB;
+      RetResyncSlot = Slot;
+    }
+  }
+
+  // MBB
+  BuildMI(*MBB, MBB->end(), DL, TII->get(X86::MOV64rm))
+    .addReg(SPReg, RegState::Define)
+    .addReg(0).addImm(1).addReg(0).addImm(ShadowSPOffset).addReg(X86::FS);
+  BuildMI(*MBB, MBB->end(), DL, TII->get(X86::CMP64mr))
+    .addReg(SPReg).addImm(1).addReg(0).addImm(0).addReg(X86::FS)
+    .addReg(TargetReg);
+  BuildMI(*MBB, MBB->end(), DL, TII->get(X86::JNE_1)).addMBB(ResyncMBB);
+  MBB->addSuccessor(SlotMBB);
+  MBB->addSuccessor(ResyncMBB, UINT_MAX);
+
+  // SlotMBB
+  SlotMBB->addLiveIn(TargetReg);
+  SlotMBB->addLiveIn(SPReg);
+  BuildMI(*SlotMBB, SlotMBB->end(), DL, TII->get(X86::CMP64mr))
+    .addReg(SPReg).addImm(1).addReg(0).addImm(8).addReg(X86::FS)
+    .addReg(X86::RSP);
+  BuildMI(*SlotMBB, SlotMBB->end(), DL, TII->get(X86::JNE_1))
+    .addMBB(ResyncMBB);
+  SlotMBB->addSuccessor(FastMBB);
+  SlotMBB->addSuccessor(ResyncMBB, UINT_MAX);
+
+  // FastMBB
+  FastMBB->addLiveIn(TargetReg);
+  BuildMI(*FastMBB, FastMBB->end(), DL, TII->get(X86::JMP64r))
+    .addReg(TargetReg);
+  std::prev(FastMBB->end())->setBarySlot(ModuleID + Slot);
+}
+
 // get a general register that is neither Reg1 nor Reg2
 static unsigned getX64ScratchReg(const unsigned Reg1, const unsigned Reg2) {
   static const std::set<unsigned> GRegs = {
@@ -764,6 +1123,8 @@ void MCFI::MCFIx64IndirectCall(MachineFunction &MF, MachineBasicBlock *MBB,
   // R11 must be available even if no other GRegs are available
   ScratchRegs.insert(X86::R11);
 
+  // register holding the vtable pointer the target was loaded from
+  unsigned VPtrReg = 0;
   unsigned TargetReg;
   if (MI->getOpcode() == X86::JMP64r ||
       MI->getOpcode() == X86::TAILJMPr64 ||
@@ -795,6 +1156,15 @@ void MCFI::MCFIx64IndirectCall(MachineFunction &MF, MachineBasicBlock *MBB,
     if (DefFound) {
       MachineBasicBlock::iterator DefI(*RIT);
       if (DefI->getOpcode() == X86::MOV64rm) {
+        const unsigned BaseReg = DefI->getOperand(1).getReg();
+        if (DefMBB == MBB && BaseReg && BaseReg != X86::RIP &&
+            BaseReg != TargetReg && !DefI->getOperand(3).getReg() &&
+            !DefI->getOperand(5).getReg()) {
+          VPtrReg = BaseReg;
+          for (auto It = std::next(DefI); It != MI; ++It)
+            if (It->modifiesRegister(BaseReg, TRI))
+              VPtrReg = 0;
+        }
         auto &MIB = BuildMI(*DefMBB, DefI, DL, TII->get(X86::MOV32rm))
           .addReg(getX86SubSuperRegister(TargetReg, MVT::i32, true), RegState::Define);
         for (auto idx = 1; idx < 6; idx++) // 5 machineoperands
@@ -822,6 +1192,10 @@ void MCFI::MCFIx64IndirectCall(MachineFunction &MF, MachineBasicBlock *MBB,
     */
     for (auto idx = 0; idx < 5; idx++) // a memory operand consists of 5 machineoperands
       MIB.addOperand(MI->getOperand(idx));
+    if (MI->getOperand(0).isReg() && MI->getOperand(0).getReg() &&
+        MI->getOperand(0).getReg() != X86::RIP &&
+        !MI->getOperand(2).getReg() && !MI->getOperand(4).getReg())
+      VPtrReg = MI->getOperand(0).getReg();
   }
   // remove IBMI
   MI = MBB->erase(MI);
@@ -852,6 +1226,41 @@ void MCFI::MCFIx64IndirectCall(MachineFunction &MF, MachineBasicBlock *MBB,
   MCFIx64MBBs(MF, MBB, BIDReg, TIDReg, TargetReg, IDCmpMBB, ICJMBB, CJOp,
               InteropCheckMBB, IDValidityCheckMBB, VerCheckMBB, ReportMBB, DL, false);
 
+  // A virtual call laid out by the VtableLayout pass skips the ID check if
+  // its vtable pointer is the address point of a vtable of the static class
+  // or of a subclass:
+  //   lea AP(%rip), %s; sub %vptr, %s; neg %s; ror $Shift, %s
+  //   cmp $(Count-1), %s; jbe ICJ
+  // The slot was loaded from a read-only vtable in that range, so the target
+  // is one the CFG allows. Everything else falls through to the ID check.
+  const MDNode *VR = I ? I->getMetadata("MCFIVtableRange") : nullptr;
+  if (VR && VPtrReg && !BIDRegSpill && !TIDRegSpill) {
+    const GlobalVariable *Region =
+      dyn_cast_or_null<GlobalVariable>(VR->getOperand(0));
+    const ConstantInt *Offset = dyn_cast_or_null<ConstantInt>(VR->getOperand(1));
+    const ConstantInt *Count = dyn_cast_or_null<ConstantInt>(VR->getOperand(2));
+    const ConstantInt *Shift = dyn_cast_or_null<ConstantInt>(VR->getOperand(3));
+    if (Region && Offset && Count && Shift &&
+        Count->getZExtValue() - 1 < (1ULL << 31)) {
+      const unsigned S = BIDReg != VPtrReg ? BIDReg : TIDReg;
+      const int64_t Last = Count->getZExtValue() - 1;
+      BuildMI(*MBB, MBB->end(), DL, TII->get(X86::LEA64r), S)
+        .addReg(X86::RIP).addImm(1).addReg(0)
+        .addGlobalAddress(Region, Offset->getZExtValue()).addReg(0);
+      BuildMI(*MBB, MBB->end(), DL, TII->get(X86::SUB64rr), S)
+        .addReg(S).addReg(VPtrReg);
+      BuildMI(*MBB, MBB->end(), DL, TII->get(X86::NEG64r), S).addReg(S);
+      BuildMI(*MBB, MBB->end(), DL, TII->get(X86::ROR64ri), S)
+        .addReg(S).addImm(Shift->getZExtValue());
+      BuildMI(*MBB, MBB->end(), DL,
+              TII->get(isInt<8>(Last) ? X86::CMP64ri8 : X86::CMP64ri32))
+        .addReg(S).addImm(Last);
+      BuildMI(*MBB, MBB->end(), DL, TII->get(X86::JBE_1)).addMBB(ICJMBB);
+      MBB->addSuccessor(ICJMBB);
+      ++NumVtableRangeChecks;
+    }
+  }
+
   if (BIDRegSpill)
     BuildMI(*MBB, MI, DL, TII->get(X86::PUSH64r)).addReg(BIDReg);
 
@@ -1132,6 +1541,21 @@ bool MCFI::MCFIx64(MachineFunction &MF) {
   const TargetMachine& TM = MF.getTarget();
   const TargetRegisterInfo *TRI = TM.getRegisterInfo();
 
+  UseShadowStack = ShadowStack &&
+    !MF.getFunction()->hasFnAttribute(Attribute::Naked);
+  RetSlowPathMBB = nullptr;
+  RetResyncMBB = nullptr;
+  ShadowRetSym = nullptr;
+
+  if (UseShadowStack) {
+    std::vector<MachineBasicBlock*> LandingPads;
+    for (auto &MBB : MF)
+      if (MBB.isLandingPad())
+        LandingPads.push_back(&MBB);
+    for (auto LP : LandingPads)
+      MCFIx64ShadowStackLandingPad(MF, LP);
+  }
+
   for (auto MBB = std::begin(MF); MBB != std::end(MF); MBB++) {
     for (auto MI = std::begin(*MBB); MI != std::end(*MBB); MI++) {
       if (MI->getOpcode() == X86::RETQ) { // return instruction
@@ -1146,8 +1570,20 @@ bool MCFI::MCFIx64(MachineFunction &MF) {
           fn = std::string(MOP.getSymbolName());
         }
         if (fn != __report_cfi_violation &&
-            fn != __report_cfi_violation_for_return)
+            fn != __report_cfi_violation_for_return) {
           DirectTailCalls.push_back(fn);
+        }
+      } else if (UseShadowStack && MI->getOpcode() == X86::CALL64pcrel32) {
+        // calls that do not return and the address-taking calls the runtime
+        // patches need no entry
+        const MachineOperand &MOP = MI->getOperand(0);
+        const Function *Callee = MOP.isGlobal() ?
+          dyn_cast<Function>(MOP.getGlobal()) : nullptr;
+        StringRef fn = MOP.isGlobal() ? MOP.getGlobal()->getName() :
+          MOP.isSymbol() ? StringRef(MOP.getSymbolName()) : StringRef();
+        if (!(Callee && Callee->doesNotReturn()) &&
+            !fn.startswith("__patch_at"))
+          MCFIx64ShadowStackCall(MF, MBB, MI);
       } else if (MI->getIRInst()) {
         const unsigned op = MI->getOpcode();
         switch (op) {
@@ -1165,6 +1601,8 @@ bool MCFI::MCFIx64(MachineFunction &MF) {
             MBB->addSuccessor(newMBB);
             newMBB->splice(std::begin(*newMBB), MBB, tmpMI, std::end(*MBB));
           }
+          if (UseShadowStack)
+            MCFIx64ShadowStackCall(MF, MBB, MI);
         }
         case X86::JMP64m:
         case X86::JMP64r:
@@ -1172,6 +1610,7 @@ bool MCFI::MCFIx64(MachineFunction &MF) {
         case X86::TAILJMPr64:
         {
           MCFIx64IndirectCall(MF, MBB, MI);
+          assert(!ShadowRetSym && "shadow stack entry of a call not popped");
           break;
         }
         }
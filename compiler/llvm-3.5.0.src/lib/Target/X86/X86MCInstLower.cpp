@@ -41,6 +41,12 @@ static cl::opt<bool> DisableDS("disable-ds", cl::Hidden,
 
 static cl::opt<bool> EnableLoadDS("enable-memory-load-sandboxing", cl::NotHidden,
                                   cl::desc("Enable memory read sandboxing"));
+
+static cl::opt<unsigned>
+MaxPaddingPrefixes("mcfi-max-padding-prefixes", cl::init(3), cl::Hidden,
+                   cl::desc("Maximum number of segment prefixes put on the "
+                            "instruction before an aligned call to replace "
+                            "nop padding"));
 namespace {
 
 /// X86MCInstLower - This class is used to lower an MachineInstr into an MCInst.
@@ -236,7 +242,7 @@ MCOperand X86MCInstLower::LowerSymbolOperand(const MachineOperand &MO,
   if (!Expr)
     Expr = MCSymbolRefExpr::Create(Sym, RefKind, Ctx);
 
-  if (!MO.isJTI() && !MO.isMBB() && MO.getOffset())
+  if (!MO.isJTI() && !MO.isMBB() && !MO.isMCSymbol() && MO.getOffset())
     Expr = MCBinaryExpr::CreateAdd(Expr,
                                    MCConstantExpr::Create(MO.getOffset(), Ctx),
                                    Ctx);
@@ -378,6 +384,9 @@ void X86MCInstLower::Lower(const MachineInstr *MI, MCInst &OutMI) const {
     case MachineOperand::MO_JumpTableIndex:
       MCOp = LowerSymbolOperand(MO, AsmPrinter.GetJTISymbol(MO.getIndex()));
       break;
+    case MachineOperand::MO_MCSymbol:
+      MCOp = LowerSymbolOperand(MO, MO.getMCSymbol());
+      break;
     case MachineOperand::MO_ConstantPoolIndex:
       MCOp = LowerSymbolOperand(MO, AsmPrinter.GetCPISymbol(MO.getIndex()));
       break;
@@ -1086,7 +1095,14 @@ void X86AsmPrinter::EmitInstruction(const MachineInstr *MI) {
       }
     }
   }
-  EmitToStreamer(OutStreamer, TmpInst);
+  if (!TM.Options.DisableCFI && MaxPaddingPrefixes &&
+      isFollowedByAlignedCall(MI))
+    // The CS segment override is ignored in 64-bit mode; each one takes the
+    // place of a nop byte before the call.
+    OutStreamer.EmitInstructionWithPaddingPrefix(TmpInst, getSubtargetInfo(),
+                                                 0x2e, MaxPaddingPrefixes);
+  else
+    EmitToStreamer(OutStreamer, TmpInst);
   switch (MI->getOpcode()) {
     // MCFI instrumentation completeness validation
   case X86::RETW:
@@ -1138,6 +1154,36 @@ void X86AsmPrinter::EmitInstruction(const MachineInstr *MI) {
           OutContext.GetOrCreateSymbol(StringRef("__mcfi_bary_") + to_hex(MCFIID));
         OutStreamer.EmitSymbolAttribute(MCFIIDSym, MCSymbolAttr::MCSA_Hidden);
         OutStreamer.EmitLabel(MCFIIDSym);
+        if (TM.Options.ProfileInstrumentedIB) {
+          // Per-branch count. The runtime recognizes the following
+          // instructions right after the label and patches the zero
+          // displacement to the address of the counter of this Bary slot.
+          unsigned CountOp = X86::ADD64mi8;
+          if (TM.Options.ProfileIBPeriod > 1) {
+            // addl $(2^32/period), %fs:0x118 carries once every period
+            // executions of this thread, and the adc adds the carry.
+            MCInst SampleInst;
+            SampleInst.setOpcode(X86::ADD32mi);
+            SampleInst.addOperand(MCOperand::CreateReg(0));
+            SampleInst.addOperand(MCOperand::CreateImm(1));
+            SampleInst.addOperand(MCOperand::CreateReg(0));
+            SampleInst.addOperand(MCOperand::CreateImm(0x118));
+            SampleInst.addOperand(MCOperand::CreateReg(X86::FS));
+            SampleInst.addOperand(MCOperand::CreateImm(
+              (int32_t)(0x100000000ULL / TM.Options.ProfileIBPeriod)));
+            EmitToStreamer(OutStreamer, SampleInst);
+            CountOp = X86::ADC64mi8;
+          }
+          MCInst CountInst;
+          CountInst.setOpcode(CountOp);
+          CountInst.addOperand(MCOperand::CreateReg(0));
+          CountInst.addOperand(MCOperand::CreateImm(1));
+          CountInst.addOperand(MCOperand::CreateReg(0));
+          CountInst.addOperand(MCOperand::CreateImm(0));
+          CountInst.addOperand(MCOperand::CreateReg(X86::GS));
+          CountInst.addOperand(MCOperand::CreateImm(CountOp == X86::ADD64mi8));
+          EmitToStreamer(OutStreamer, CountInst);
+        }
         if (TM.Options.CountInstrumentedIB) { // count of indirect branches
           MCInst CountInst;
           CountInst.setOpcode(X86::ADD64mi8);
@@ -6,12 +6,14 @@
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/CallingConv.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
@@ -19,6 +21,7 @@
 #include "llvm/IR/Operator.h"
 #include "llvm/IR/ValueHandle.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/MathExtras.h"
@@ -34,6 +37,19 @@ using namespace llvm;
 
 #define DEBUG_TYPE "funcaddrtaken"
 
+STATISTIC(NumPatchAtSites, "Number of function address taking sites");
+STATISTIC(NumPatchAtCalls, "Number of __patch_at calls inserted");
+STATISTIC(NumPreActivated, "Number of functions activated statically");
+
+// Every __patch_at call traps into the runtime once and stays behind as a
+// 5-byte nop. All the sites of a function taking the same address are
+// replaced with a single call at their nearest common dominator, hoisted
+// out of loops; calls that would end up in a global constructor, which
+// runs at load time anyway, become static activations.
+static cl::opt<bool>
+HoistPatchAt("mcfi-hoist-patch-at", cl::init(true), cl::Hidden,
+             cl::desc("Merge and hoist __patch_at calls"));
+
 namespace {
   struct FuncAddrTaken : public ModulePass {
     void getAnalysisUsage(AnalysisUsage &AU) const override {
@@ -45,10 +61,19 @@ namespace {
 
     bool runOnModule(Module &M) override;
   private:
+    // address taken function name -> sites that take it, in one function
+    typedef std::map<std::string, std::vector<Instruction*> > SiteMap;
+
+    // functions whose addresses are taken in data or at load time
+    std::set<std::string> StaticAddrTaken;
+    std::set<Function*> GlobalCtors;
+
     Value *InnerMost(Value *V);
-    void addPatchAt(Module &M, FunctionType *FT,
-                    Value *V, Instruction *MI,
-                    std::map<BasicBlock*, std::set<std::string> >&);
+    void addPatchAt(Value *V, Instruction *MI, SiteMap &Sites);
+    void collectStaticAddrTaken(Module &M);
+    void collectConstant(const Constant *C, std::set<const Constant*> &Visited);
+    void insertPatchAt(Module &M, FunctionType *FT, Function &F,
+                       SiteMap &Sites);
 
     const std::string CXXDemangledName(const char* MangledName) const {
       int status = 0;
@@ -93,27 +118,127 @@ Value *FuncAddrTaken::InnerMost(Value *V) {
   return V;
 }
 
-void FuncAddrTaken::addPatchAt(Module &M, FunctionType *FT,
-                               Value *V, Instruction *MI,
-                               std::map<BasicBlock*, std::set<std::string> >& UniqPatchAt) {
+void FuncAddrTaken::addPatchAt(Value *V, Instruction *MI, SiteMap &Sites) {
   if (isa<Function>(V) && cast<Function>(V)->hasName()) {
     StringRef fn = cast<Function>(V)->getName();
     if (fn.startswith("_GLOBAL__D_") || fn.startswith("_GLOBAL__E_"))
       return;
-    std::string patchname = std::string("__patch_at") + fn.str();
-    BasicBlock* BB = MI->getParent();
-    if (UniqPatchAt.find(BB) == UniqPatchAt.end())
-      UniqPatchAt[BB] = std::set<std::string>();
-    if (UniqPatchAt[BB].find(patchname) != UniqPatchAt[BB].end())
+    ++NumPatchAtSites;
+    if (StaticAddrTaken.count(fn.str()))
       return;
-    UniqPatchAt[BB].insert(patchname);
-    IRBuilder<> Builder(M.getContext());
-    Constant* PatchAtHere =
-      M.getOrInsertFunction(
-        std::string("__patch_at") + fn.str(), FT);
-    CallInst *PatchAtCI =
-      Builder.CreateCall(PatchAtHere);
-    PatchAtCI->insertBefore(MI);
+    std::vector<Instruction*> &S = Sites[fn.str()];
+    if (std::find(S.begin(), S.end(), MI) == S.end())
+      S.push_back(MI);
+  }
+}
+
+void FuncAddrTaken::collectConstant(const Constant *C,
+                                    std::set<const Constant*> &Visited) {
+  if (!Visited.insert(C).second)
+    return;
+  if (const Function *F = dyn_cast<Function>(C)) {
+    if (F->hasName())
+      StaticAddrTaken.insert(F->getName().str());
+    return;
+  }
+  if (isa<GlobalValue>(C))
+    return;
+  for (unsigned i = 0; i < C->getNumOperands(); i++)
+    collectConstant(cast<Constant>(C->getOperand(i)), Visited);
+}
+
+// A function whose address is in the initializer of a global is emitted
+// into .MCFIAddrTaken anyway (see MCELFStreamer::EmitValueImpl), so its
+// address is valid from load time on and __patch_at calls for it only cost
+// a trap. Record such functions in MCFIAddrTaken as well, so that they stay
+// activated even if the global is removed after this pass.
+void FuncAddrTaken::collectStaticAddrTaken(Module &M) {
+  std::set<const Constant*> Visited;
+  for (auto G = M.global_begin(); G != M.global_end(); G++) {
+    if (!G->hasInitializer() || G->hasAvailableExternallyLinkage() ||
+        G->getName().startswith("llvm."))
+      continue;
+    collectConstant(G->getInitializer(), Visited);
+  }
+
+  if (GlobalVariable *GV = M.getGlobalVariable("llvm.global_ctors")) {
+    if (ConstantArray *CA = dyn_cast_or_null<ConstantArray>(
+          GV->hasInitializer() ? GV->getInitializer() : nullptr)) {
+      for (unsigned i = 0; i < CA->getNumOperands(); i++) {
+        ConstantStruct *CS = dyn_cast<ConstantStruct>(CA->getOperand(i));
+        if (!CS || CS->getNumOperands() < 2)
+          continue;
+        if (Function *F =
+            dyn_cast<Function>(CS->getOperand(1)->stripPointerCasts()))
+          GlobalCtors.insert(F);
+      }
+    }
+  }
+}
+
+// Insert one __patch_at call per address taken function of F, at a block
+// that dominates all of its sites and is outside of any loop.
+void FuncAddrTaken::insertPatchAt(Module &M, FunctionType *FT, Function &F,
+                                  SiteMap &Sites) {
+  if (Sites.empty())
+    return;
+
+  DominatorTree DT;
+  LoopInfoBase<BasicBlock, Loop> LI;
+  if (HoistPatchAt) {
+    DT.recalculate(F);
+    LI.Analyze(DT);
+  }
+
+  for (auto &S : Sites) {
+    SmallVector<Instruction*, 4> InsertPts;
+    if (!HoistPatchAt) {
+      // one call per basic block
+      std::set<BasicBlock*> Seen;
+      for (Instruction *I : S.second)
+        if (Seen.insert(I->getParent()).second)
+          InsertPts.push_back(I);
+    } else {
+      BasicBlock *Dom = nullptr;
+      for (Instruction *I : S.second) {
+        if (!DT.isReachableFromEntry(I->getParent()))
+          continue; // never executed
+        Dom = Dom ? DT.findNearestCommonDominator(Dom, I->getParent())
+          : I->getParent();
+      }
+      if (!Dom)
+        continue;
+      BasicBlock *Hoisted = Dom;
+      while (Loop *L = LI.getLoopFor(Hoisted)) {
+        Hoisted = L->getLoopPreheader();
+        if (!Hoisted)
+          Hoisted = DT.getNode(L->getHeader())->getIDom()->getBlock();
+      }
+      if (GlobalCtors.count(&F)) {
+        // runs at load time
+        StaticAddrTaken.insert(S.first);
+        ++NumPreActivated;
+        continue;
+      }
+      Instruction *Pt = Hoisted->getTerminator();
+      if (Hoisted == Dom) {
+        // stay in front of the first site of the block
+        for (auto I = Dom->begin(); &*I != Pt; I++)
+          if (std::find(S.second.begin(), S.second.end(), &*I) !=
+              S.second.end()) {
+            Pt = I;
+            break;
+          }
+      }
+      InsertPts.push_back(Pt);
+    }
+
+    for (Instruction *Pt : InsertPts) {
+      Constant *PatchAtHere =
+        M.getOrInsertFunction(std::string("__patch_at") + S.first, FT);
+      CallInst::Create(PatchAtHere, "", Pt);
+      ++NumPatchAtCalls;
+    }
   }
 }
 
@@ -130,25 +255,24 @@ bool FuncAddrTaken::runOnModule(Module &M) {
   }
   Changed = true;
 
-  // Simple optimization so that no function address will be taken twice
-  // in the same basic block.
-  std::map<BasicBlock*, std::set<std::string> > UniqPatchAt;
+  collectStaticAddrTaken(M);
 
   // before each store instruction that manipulates a function, create a call
   // to __patch_at
   for (auto F = M.getFunctionList().begin(); F != M.getFunctionList().end(); F++) {
+    SiteMap Sites;
     for (auto BB = F->begin(); BB != F->end(); BB++) {
       for (auto MI = BB->begin(); MI != BB->end(); MI++) {
         if (isa<StoreInst>(MI)) {
           // check if the store inst moves a function to a variable
           Value *V = InnerMost(cast<StoreInst>(MI)->getValueOperand());
-          addPatchAt(M, FT, V, MI, UniqPatchAt);
+          addPatchAt(V, MI, Sites);
           if (isa<ConstantVector>(V)) {
             std::set<Value*> patched;
             for (unsigned i = 0; i < cast<ConstantVector>(V)->getNumOperands(); i++) {
               Value *VV = InnerMost(cast<ConstantVector>(V)->getOperand(i));
               if (patched.find(VV) == patched.end()) {
-                addPatchAt(M, FT, VV, MI, UniqPatchAt);
+                addPatchAt(VV, MI, Sites);
                 patched.insert(VV);
               }
             }
@@ -157,7 +281,7 @@ bool FuncAddrTaken::runOnModule(Module &M) {
             for (unsigned i = 0; i < cast<ConstantStruct>(V)->getNumOperands(); i++) {
               Value *VV = InnerMost(cast<ConstantStruct>(V)->getOperand(i));
               if (patched.find(VV) == patched.end()) {
-                addPatchAt(M, FT, VV, MI, UniqPatchAt);
+                addPatchAt(VV, MI, Sites);
                 patched.insert(VV);
               }
             }
@@ -166,44 +290,52 @@ bool FuncAddrTaken::runOnModule(Module &M) {
             for (unsigned i = 0; i < cast<ConstantArray>(V)->getNumOperands(); i++) {
               Value *VV = InnerMost(cast<ConstantArray>(V)->getOperand(i));
               if (patched.find(VV) == patched.end()) {
-                addPatchAt(M, FT, VV, MI, UniqPatchAt);
+                addPatchAt(VV, MI, Sites);
                 patched.insert(VV);
               }
             }
           }
         } else if (isa<SelectInst>(MI)) {
           Value *V = InnerMost(cast<SelectInst>(MI)->getTrueValue());
-          addPatchAt(M, FT, V, MI, UniqPatchAt);
+          addPatchAt(V, MI, Sites);
           V = InnerMost(cast<SelectInst>(MI)->getFalseValue());
-          addPatchAt(M, FT, V, MI, UniqPatchAt);
+          addPatchAt(V, MI, Sites);
         } else if (isa<CallInst>(MI)) {
           CallInst* CI = cast<CallInst>(MI);
           for (unsigned i = 0; i < CI->getNumArgOperands(); i++) {
             Value *V = InnerMost(CI->getArgOperand(i));
-            addPatchAt(M, FT, V, MI, UniqPatchAt);
+            addPatchAt(V, MI, Sites);
           }
         } else if (isa<InvokeInst>(MI)) {
           InvokeInst* CI = cast<InvokeInst>(MI);
           for (unsigned i = 0; i < CI->getNumArgOperands(); i++) {
             Value *V = InnerMost(CI->getArgOperand(i));
-            addPatchAt(M, FT, V, MI, UniqPatchAt);
+            addPatchAt(V, MI, Sites);
           }
         } else if (isa<ReturnInst>(MI)) {
           Value *V = cast<ReturnInst>(MI)->getReturnValue();
           if (V) {
             V = InnerMost(V);
-            addPatchAt(M, FT, V, MI, UniqPatchAt);
+            addPatchAt(V, MI, Sites);
           }
         } else if (isa<PHINode>(MI)) {
           for (unsigned i = 0; i < cast<PHINode>(MI)->getNumIncomingValues(); i++) {
             Value *V = InnerMost(cast<PHINode>(MI)->getIncomingValue(i));
             BasicBlock* BB = cast<PHINode>(MI)->getIncomingBlock(i);
             // right before the last (maybe terminator) instruction.
-            addPatchAt(M, FT, V, &(BB->back()), UniqPatchAt);
+            addPatchAt(V, &(BB->back()), Sites);
           }
         }
       }
     }
+    insertPatchAt(M, FT, *F, Sites);
+  }
+
+  if (!StaticAddrTaken.empty()) {
+    NamedMDNode *MD = M.getOrInsertNamedMetadata("MCFIAddrTaken");
+    for (const auto &FN : StaticAddrTaken)
+      MD->addOperand(MDNode::get(M.getContext(),
+                                 MDString::get(M.getContext(), FN)));
   }
 
   // TODO: separate the following virtual table traversal code into another pass
@@ -0,0 +1,168 @@
+//===- IndirectCallPromotion.cpp - Promote hot indirect calls -------------===//
+//
+//                      The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This pass promotes hot indirect calls to guarded direct calls. Every
+// indirect call pays for the MCFI check sequence (two %gs table loads and
+// a compare), even if it almost always reaches the same callee. Using the
+// call targets attached by the sample profile loader (mcfi.icp metadata),
+// each hot target T of a call site is turned into
+//
+//   if (fp == @T) T(args) else <next target or original indirect call>
+//
+// The direct calls need no table lookup; only the fallback keeps the full
+// MCFI check.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/IPO.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "mcfi-icp"
+
+STATISTIC(NumPromotedSites, "Number of indirect call sites promoted");
+STATISTIC(NumPromotedTargets, "Number of direct calls created by promotion");
+
+static cl::opt<unsigned>
+ICPThreshold("mcfi-icp-threshold", cl::init(30), cl::Hidden,
+             cl::desc("Minimum percentage of the remaining samples of an "
+                      "indirect call a target needs to be promoted"));
+
+static cl::opt<unsigned>
+ICPMaxTargets("mcfi-icp-max-targets", cl::init(2), cl::Hidden,
+              cl::desc("Maximum number of targets promoted per indirect "
+                       "call site"));
+
+namespace {
+  struct IndirectCallPromotion : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+    IndirectCallPromotion() : ModulePass(ID) {}
+
+    bool runOnModule(Module &M) override;
+  private:
+    bool promoteCallSite(Module &M, CallInst *CI, MDNode *Targets);
+    void promoteTarget(CallInst *CI, Function *Target,
+                       unsigned Count, unsigned Remaining);
+  };
+}
+
+char IndirectCallPromotion::ID = 0;
+ModulePass *llvm::createIndirectCallPromotionPass() {
+  return new IndirectCallPromotion();
+}
+
+// Guard CI with "fp == Target" and call Target directly when it holds.
+// CI itself is moved into the else block, so it can be guarded again
+// for the next target.
+void IndirectCallPromotion::promoteTarget(CallInst *CI, Function *Target,
+                                          unsigned Count, unsigned Remaining) {
+  IRBuilder<> Builder(CI);
+  Value *Cond = Builder.CreateICmpEQ(CI->getCalledValue(), Target);
+  MDBuilder MDB(CI->getContext());
+  TerminatorInst *ThenTerm, *ElseTerm;
+  SplitBlockAndInsertIfThenElse(Cond, CI, &ThenTerm, &ElseTerm,
+                                MDB.createBranchWeights(Count,
+                                                        Remaining - Count));
+  BasicBlock *Tail = CI->getParent();
+
+  CallInst *Direct = cast<CallInst>(CI->clone());
+  Direct->setCalledFunction(Target);
+  Direct->insertBefore(ThenTerm);
+  CI->moveBefore(ElseTerm);
+
+  if (!CI->getType()->isVoidTy()) {
+    PHINode *PN = PHINode::Create(CI->getType(), 2, "", Tail->begin());
+    CI->replaceAllUsesWith(PN);
+    PN->addIncoming(Direct, Direct->getParent());
+    PN->addIncoming(CI, CI->getParent());
+  }
+  ++NumPromotedTargets;
+}
+
+bool IndirectCallPromotion::promoteCallSite(Module &M, CallInst *CI,
+                                            MDNode *Targets) {
+  // The metadata is a list of (name, count) pairs, hottest first.
+  unsigned Remaining = 0;
+  for (unsigned i = 1; i < Targets->getNumOperands(); i += 2)
+    if (ConstantInt *C = dyn_cast_or_null<ConstantInt>(Targets->getOperand(i)))
+      Remaining += C->getZExtValue();
+
+  bool Changed = false;
+  unsigned Promoted = 0;
+  for (unsigned i = 0; i + 1 < Targets->getNumOperands() &&
+         Promoted < ICPMaxTargets; i += 2) {
+    MDString *Name = dyn_cast_or_null<MDString>(Targets->getOperand(i));
+    ConstantInt *C = dyn_cast_or_null<ConstantInt>(Targets->getOperand(i + 1));
+    if (!Name || !C)
+      break;
+    unsigned Count = C->getZExtValue();
+    if (Count == 0 || (uint64_t)Count * 100 < (uint64_t)Remaining * ICPThreshold)
+      break;
+
+    // Only promote to a callee of exactly the called type; the fallback
+    // would catch a mismatch anyway, but a direct call through a cast
+    // would defeat the type matching done by the CFG generator.
+    Function *Target = M.getFunction(Name->getString());
+    if (!Target || Target->getType() != CI->getCalledValue()->getType()) {
+      Remaining -= Count;
+      continue;
+    }
+
+    DEBUG(dbgs() << "MCFI-ICP: promoting " << Target->getName() << " ("
+                 << Count << "/" << Remaining << ") in "
+                 << CI->getParent()->getParent()->getName() << "\n");
+    promoteTarget(CI, Target, Count, Remaining);
+    Remaining -= Count;
+    ++Promoted;
+    Changed = true;
+  }
+  return Changed;
+}
+
+bool IndirectCallPromotion::runOnModule(Module &M) {
+  unsigned ICPKind = M.getContext().getMDKindID("mcfi.icp");
+
+  // Collect the call sites first; promotion splits their blocks.
+  SmallVector<CallInst*, 16> Sites;
+  for (auto F = M.begin(); F != M.end(); F++)
+    for (auto BB = F->begin(); BB != F->end(); BB++)
+      for (auto MI = BB->begin(); MI != BB->end(); MI++)
+        if (CallInst *CI = dyn_cast<CallInst>(MI))
+          if (CI->getMetadata(ICPKind))
+            Sites.push_back(CI);
+
+  bool Changed = false;
+  for (unsigned i = 0; i < Sites.size(); i++) {
+    CallInst *CI = Sites[i];
+    MDNode *Targets = CI->getMetadata(ICPKind);
+    CI->setMetadata(ICPKind, nullptr);
+    // Earlier passes may have resolved the callee, and musttail calls
+    // must stay immediately before their return.
+    if (CI->getCalledFunction() || CI->isInlineAsm() || CI->isMustTailCall())
+      continue;
+    if (promoteCallSite(M, CI, Targets)) {
+      ++NumPromotedSites;
+      Changed = true;
+    }
+  }
+  return Changed;
+}
@@ -57,6 +57,16 @@ static cl::opt<bool> RunLoadCombine("combine-loads", cl::init(false),
                                     cl::Hidden,
                                     cl::desc("Run the load combining pass"));
 
+static cl::opt<bool>
+RunWholeProgramDevirt("mcfi-whole-program-devirt", cl::init(false), cl::Hidden,
+  cl::desc("Devirtualize single-implementation virtual calls during LTO; "
+           "the linked modules must contain the whole class hierarchy"));
+
+static cl::opt<bool>
+RunVtableLayout("mcfi-vtable-layout", cl::init(false), cl::Hidden,
+  cl::desc("Lay out vtables contiguously and check virtual calls with a "
+           "range check on the vtable pointer"));
+
 PassManagerBuilder::PassManagerBuilder() {
     OptLevel = 2;
     SizeLevel = 0;
@@ -169,6 +179,10 @@ void PassManagerBuilder::populateModulePassManager(PassManagerBase &MPM) {
     MPM.add(createCFGSimplificationPass());   // Clean up after IPCP & DAE
   }
 
+  // Promote profiled hot indirect calls to direct calls before inlining,
+  // so the inliner can see the promoted callees.
+  MPM.add(createIndirectCallPromotionPass());
+
   // Start of CallGraph SCC passes.
   if (!DisableUnitAtATime)
     MPM.add(createPruneEHPass());             // Remove dead EH info
@@ -284,6 +298,9 @@ void PassManagerBuilder::populateModulePassManager(PassManagerBase &MPM) {
   }
   if (!DisablePICFI && !DisableCFI)
     MPM.add(createFuncAddrTakenPass()); // register function address taken events
+  // after FuncAddrTaken, which reads the vtables before they become aliases
+  if (RunVtableLayout && !DisableCFI)
+    MPM.add(createVtableLayoutPass());
   addExtensionsToPM(EP_OptimizerLast, MPM);
 }
 
@@ -322,6 +339,11 @@ void PassManagerBuilder::populateLTOPassManager(PassManagerBase &PM,
   PM.add(createInstructionCombiningPass());
   addExtensionsToPM(EP_Peephole, PM);
 
+  // Turn virtual calls with a single implementation into direct calls,
+  // which need no MCFI check.
+  if (RunWholeProgramDevirt)
+    PM.add(createWholeProgramDevirtPass());
+
   // Inline small functions
   if (RunInliner)
     PM.add(createFunctionInliningPass());
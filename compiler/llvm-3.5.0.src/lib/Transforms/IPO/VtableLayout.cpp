@@ -0,0 +1,332 @@
+//===- VtableLayout.cpp - Lay out vtables for MCFI range checks -----------===//
+//
+//                      The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This pass lets the MCFI backend check a virtual call by looking at the
+// vtable pointer instead of the ID tables. The vtables of each
+// single-inheritance tree of classes are moved into one private region in
+// pre-order, every vtable padded to the same power-of-two stride, and the
+// original vtable symbols become aliases into the region. The vtables of a
+// class and all of its subclasses are then the contiguous range
+//
+//   AP(Class) + k * Stride, 0 <= k < Count(Class)
+//
+// where AP is the address point, and a call through Class is annotated with
+// MCFIVtableRange metadata (region, offset of AP(Class), Count, log2 Stride).
+// A vtable pointer in that range (a subtract, a rotate and a compare) can
+// only reach implementations the CHA-based CFG already allows for the call,
+// so X86MCFI skips the table check for it. Any other vtable pointer, e.g.
+// of a subclass defined in another module, takes the usual check.
+//
+// Only vtables with a single address point at index 2 are laid out, which
+// excludes secondary vtables and virtual bases. Vtables the linker may
+// replace with another module's copy (linkonce_odr, weak) are left alone.
+// The regions are recorded in the MCFIVtableRegions metadata
+// ("Root#Class#Class...") for the runtime, which verifies them against the
+// merged class hierarchy at load time.
+//
+// Since the range check trusts the contents of the regions, they are placed
+// in the __mcfi_vtables section, page aligned and padded to whole pages. The
+// runtime maps that section read-only in the sandbox when it loads the
+// module, applies its relative relocations itself and checks the symbolic
+// ones the dynamic linker asks it to bind, and refuses any later mapping or
+// protection change of it.
+//
+// With online patching (PICFI), a virtual method only becomes a target of
+// the table check once a constructor of its class has run, while the range
+// check accepts every vtable of the subtree as soon as the module is loaded.
+// The targets this adds are implementations the static CFG already allows
+// for the call, reachable only through a vtable pointer into the region,
+// i.e. through an object whose class was never constructed. That is the
+// price of not loading the tables; calls without MCFIVtableRange metadata
+// keep lazy activation.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/IPO.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+#include <map>
+#include <set>
+#include <cxxabi.h>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "mcfi-vtable-layout"
+
+STATISTIC(NumRegions, "Number of vtable regions created");
+STATISTIC(NumLaidOut, "Number of vtables moved into regions");
+STATISTIC(NumRangeChecked, "Number of virtual calls annotated for range checks");
+
+// the runtime protects __mcfi_vtables by pages
+static const unsigned RegionAlign = 4096;
+
+namespace {
+  struct VtableLayout : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+    VtableLayout() : ModulePass(ID) {}
+
+    bool runOnModule(Module &M) override;
+  private:
+    // position of a class in its region
+    struct RegionSlot {
+      GlobalVariable *Region;
+      unsigned Index; // index of the class's vtable in the region
+      unsigned Count; // number of vtables of the class and its subclasses
+      unsigned Shift; // log2 of the stride in bytes
+    };
+
+    // class name -> vtable with a single address point
+    std::map<std::string, GlobalVariable*> Vtables;
+    // class name -> direct bases
+    std::map<std::string, std::vector<std::string> > Bases;
+    // class name -> subclasses placed in its region
+    std::map<std::string, std::set<std::string> > Children;
+    std::map<std::string, RegionSlot> Layout;
+
+    void collect(Module &M);
+    std::string parentOf(const std::string &Class);
+    void preorder(const std::string &Class, std::vector<std::string> &Order,
+                  std::map<std::string, unsigned> &Count);
+    void layoutTree(Module &M, const std::string &Root);
+
+    const std::string CXXDemangledName(const char* MangledName) const {
+      int status = 0;
+      char* result = abi::__cxa_demangle(MangledName, 0, 0, &status);
+
+      if (result) {
+        const std::string DemangledName(result);
+        free(result);
+        return DemangledName;
+      }
+      return std::string("");
+    }
+  };
+}
+
+char VtableLayout::ID = 0;
+ModulePass *llvm::createVtableLayoutPass() {
+  return new VtableLayout();
+}
+
+// Whether every use of GV is the address point at index 2, i.e. GV holds a
+// single primary vtable without virtual base offsets.
+static bool hasSingleAddressPoint(const GlobalVariable *GV) {
+  for (auto U = GV->user_begin(); U != GV->user_end(); ++U) {
+    const ConstantExpr *CE = dyn_cast<ConstantExpr>(*U);
+    if (!CE || CE->getOpcode() != Instruction::GetElementPtr ||
+        CE->getNumOperands() != 3)
+      return false;
+    const ConstantInt *I0 = dyn_cast<ConstantInt>(CE->getOperand(1));
+    const ConstantInt *I1 = dyn_cast<ConstantInt>(CE->getOperand(2));
+    if (!I0 || !I1 || !I0->isZero() || I1->getZExtValue() != 2)
+      return false;
+  }
+  return true;
+}
+
+void VtableLayout::collect(Module &M) {
+  if (NamedMDNode *CHA = M.getNamedMetadata("MCFICHA")) {
+    for (unsigned i = 0; i < CHA->getNumOperands(); i++) {
+      MDNode *N = CHA->getOperand(i);
+      if (N->getNumOperands() == 0 || !isa<MDString>(N->getOperand(0)))
+        continue;
+      StringRef Entry = cast<MDString>(N->getOperand(0))->getString();
+      if (!Entry.startswith("I@"))
+        continue;
+      SmallVector<StringRef, 4> Names;
+      Entry.substr(2).split(Names, "#");
+      std::string Class = Names[0].str();
+      if (!Bases[Class].empty())
+        continue; // duplicated entry from another module
+      for (unsigned j = 1; j < Names.size(); j++)
+        Bases[Class].push_back(Names[j].str());
+    }
+  }
+
+  Type *Int8PtrTy = Type::getInt8PtrTy(M.getContext());
+  for (auto G = M.global_begin(); G != M.global_end(); G++) {
+    if (!G->hasInitializer() || !G->getName().startswith("_ZTV") ||
+        !G->isConstant() || G->isWeakForLinker() || G->hasSection() ||
+        G->isThreadLocal() || G->hasAvailableExternallyLinkage())
+      continue;
+    ArrayType *ATy = dyn_cast<ArrayType>(G->getType()->getElementType());
+    if (!ATy || ATy->getElementType() != Int8PtrTy ||
+        ATy->getNumElements() < 2 || !hasSingleAddressPoint(G))
+      continue;
+    std::string VTName = CXXDemangledName(G->getName().data());
+    if (VTName.find("vtable for ") == 0)
+      Vtables[VTName.substr(11)] = G;
+  }
+}
+
+// The class whose region Class is placed in, or "" for a root. A laid out
+// class has at most one polymorphic base, which is its primary base.
+std::string VtableLayout::parentOf(const std::string &Class) {
+  std::string Parent;
+  auto B = Bases.find(Class);
+  if (B == Bases.end())
+    return Parent;
+  for (auto &Base : B->second) {
+    if (Vtables.find(Base) == Vtables.end())
+      continue;
+    if (!Parent.empty())
+      return ""; // not expected for a single address point; stay separate
+    Parent = Base;
+  }
+  return Parent;
+}
+
+void VtableLayout::preorder(const std::string &Class,
+                            std::vector<std::string> &Order,
+                            std::map<std::string, unsigned> &Count) {
+  unsigned First = Order.size();
+  Order.push_back(Class);
+  for (auto &C : Children[Class])
+    preorder(C, Order, Count);
+  Count[Class] = Order.size() - First;
+}
+
+void VtableLayout::layoutTree(Module &M, const std::string &Root) {
+  std::vector<std::string> Order;
+  std::map<std::string, unsigned> Count;
+  preorder(Root, Order, Count);
+
+  uint64_t MaxEntries = 0;
+  unsigned Align = 8;
+  for (auto &C : Order) {
+    GlobalVariable *GV = Vtables[C];
+    MaxEntries = std::max(MaxEntries,
+                          cast<ArrayType>(GV->getType()->getElementType())
+                            ->getNumElements());
+    Align = std::max(Align, GV->getAlignment());
+  }
+  const uint64_t Stride = 1ULL << Log2_64_Ceil(MaxEntries); // in entries
+
+  Type *Int8PtrTy = Type::getInt8PtrTy(M.getContext());
+  Constant *Null = Constant::getNullValue(Int8PtrTy);
+  std::vector<Constant*> Entries;
+  for (auto &C : Order) {
+    GlobalVariable *GV = Vtables[C];
+    Constant *Init = GV->getInitializer();
+    uint64_t N = cast<ArrayType>(Init->getType())->getNumElements();
+    for (uint64_t i = 0; i < N; i++)
+      Entries.push_back(Init->getAggregateElement(i));
+    Entries.resize(Entries.size() + Stride - N, Null);
+  }
+  const uint64_t PageEntries = RegionAlign / 8;
+  Entries.resize(RoundUpToAlignment(Entries.size(), PageEntries), Null);
+  ArrayType *RTy = ArrayType::get(Int8PtrTy, Entries.size());
+  GlobalVariable *Region =
+    new GlobalVariable(M, RTy, true, GlobalValue::PrivateLinkage,
+                       ConstantArray::get(RTy, Entries), "__mcfi_vtables");
+  Region->setAlignment(std::max(Align, RegionAlign));
+  Region->setSection("__mcfi_vtables");
+
+  Type *Int64Ty = Type::getInt64Ty(M.getContext());
+  std::string Info;
+  for (unsigned i = 0; i < Order.size(); i++) {
+    const std::string &C = Order[i];
+    GlobalVariable *GV = Vtables[C];
+    Constant *Idx[] = { ConstantInt::get(Int64Ty, 0),
+                        ConstantInt::get(Int64Ty, i * Stride) };
+    Constant *Addr = ConstantExpr::getBitCast(
+      ConstantExpr::getInBoundsGetElementPtr(Region, Idx), GV->getType());
+    GlobalAlias *GA =
+      GlobalAlias::create(GV->getType()->getElementType(),
+                          GV->getType()->getAddressSpace(),
+                          GV->getLinkage(), "", Addr, &M);
+    GA->setVisibility(GV->getVisibility());
+    GA->setDLLStorageClass(GV->getDLLStorageClass());
+    GA->takeName(GV);
+    GV->replaceAllUsesWith(GA);
+    GV->eraseFromParent();
+    Vtables[C] = nullptr;
+
+    RegionSlot S = { Region, i, Count[C], Log2_64(Stride * 8) };
+    Layout[C] = S;
+    Info += (i ? "#" : "") + C;
+    ++NumLaidOut;
+    DEBUG(dbgs() << "MCFI-VTABLE: " << C << " at " << i << "/" << Count[C]
+                 << " in the region of " << Root << "\n");
+  }
+  NamedMDNode *MD = M.getOrInsertNamedMetadata("MCFIVtableRegions");
+  MD->addOperand(MDNode::get(M.getContext(),
+                             MDString::get(M.getContext(), Info)));
+  ++NumRegions;
+}
+
+bool VtableLayout::runOnModule(Module &M) {
+  collect(M);
+  if (Vtables.empty())
+    return false;
+
+  // Virtual calls through a class whose vtable can be laid out.
+  std::vector<std::pair<Instruction*, std::string> > Sites;
+  for (auto F = M.begin(); F != M.end(); F++) {
+    for (auto BB = F->begin(); BB != F->end(); BB++) {
+      for (auto MI = BB->begin(); MI != BB->end(); MI++) {
+        CallSite CS(&*MI);
+        if (!CS || CS.getCalledFunction())
+          continue;
+        MDNode *MD = MI->getMetadata("CXXVirtual");
+        if (!MD || !isa<MDString>(MD->getOperand(0)))
+          continue;
+        StringRef VStr = cast<MDString>(MD->getOperand(0))->getString();
+        if (!VStr.startswith("V#"))
+          continue;
+        std::string Class = VStr.substr(2).split('#').first.str();
+        if (Vtables.find(Class) != Vtables.end())
+          Sites.push_back(std::make_pair(&*MI, Class));
+      }
+    }
+  }
+  if (Sites.empty())
+    return false;
+
+  std::map<std::string, std::string> Parent;
+  for (auto &V : Vtables) {
+    Parent[V.first] = parentOf(V.first);
+    if (!Parent[V.first].empty())
+      Children[Parent[V.first]].insert(V.first);
+  }
+
+  // Only the trees with virtual calls through them are laid out.
+  std::set<std::string> Roots;
+  for (auto &S : Sites) {
+    std::string C = S.second;
+    while (!Parent[C].empty())
+      C = Parent[C];
+    Roots.insert(C);
+  }
+  for (auto &R : Roots)
+    layoutTree(M, R);
+
+  Type *Int64Ty = Type::getInt64Ty(M.getContext());
+  for (auto &S : Sites) {
+    const RegionSlot &RS = Layout[S.second];
+    uint64_t Offset = ((uint64_t)RS.Index << RS.Shift) + 16; // address point
+    Value *Ops[] = { RS.Region,
+                     ConstantInt::get(Int64Ty, Offset),
+                     ConstantInt::get(Int64Ty, RS.Count),
+                     ConstantInt::get(Int64Ty, RS.Shift) };
+    S.first->setMetadata("MCFIVtableRange", MDNode::get(M.getContext(), Ops));
+    ++NumRangeChecked;
+  }
+  return true;
+}
@@ -0,0 +1,267 @@
+//===- WholeProgramDevirt.cpp - Devirtualize calls using MCFI CHA ---------===//
+//
+//                      The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This pass turns virtual calls into direct calls when the whole program is
+// known (LTO over a closed set of modules). Clang tags every virtual call
+// with CXXVirtual metadata ("V#Class#method") and records the class
+// hierarchy in the MCFICHA named metadata ("I@Derived#Base1#Base2...").
+// A call through Class can be devirtualized when exactly one implementation
+// of the method is reachable from Class:
+//
+//  - Class defines the method and none of its subclasses overrides it
+//    (this covers final classes and single-implementation hierarchies), or
+//  - neither Class nor its subclasses define it, and it is inherited along
+//    a single-inheritance chain.
+//
+// Every class involved must have its vtable defined in the module, which is
+// how we check that the hierarchy is closed. Devirtualized calls are direct
+// calls, so they carry no MCFI check and no .MCFIIndirectCalls record.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/IPO.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <map>
+#include <set>
+#include <cxxabi.h>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "mcfi-devirt"
+
+STATISTIC(NumDevirtualized, "Number of virtual calls devirtualized");
+
+namespace {
+  struct WholeProgramDevirt : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+    WholeProgramDevirt() : ModulePass(ID) {}
+
+    bool runOnModule(Module &M) override;
+  private:
+    // class name -> direct subclasses / direct bases
+    std::map<std::string, std::set<std::string> > Derived;
+    std::map<std::string, std::vector<std::string> > Bases;
+    // classes whose vtable is defined in this module
+    std::set<std::string> Vtables;
+    // "Class#method" -> implementation
+    std::map<std::string, Function*> Methods;
+    // "Class#method" of methods reached through a this-adjusting thunk
+    std::set<std::string> Thunked;
+    // cached results of resolve()
+    std::map<std::string, Function*> Resolved;
+
+    void collect(Module &M);
+    Function *resolve(const std::string &Class, const std::string &Method);
+
+    const std::string CXXDemangledName(const char* MangledName) const {
+      int status = 0;
+      char* result = abi::__cxa_demangle(MangledName, 0, 0, &status);
+
+      if (result) {
+        const std::string DemangledName(result);
+        free(result);
+        size_t Start = 0;
+        const std::string VirtualThunk("virtual thunk to ");
+        const std::string NonVirtualThunk("non-virtual thunk to ");
+        // for thunks, we don't output the annoying "virtual thunk to" things
+        // we match the longer NonVirtualThunk first.
+        if (DemangledName.find(NonVirtualThunk) != std::string::npos) {
+          Start = NonVirtualThunk.size();
+        } else if (DemangledName.find(VirtualThunk) != std::string::npos) {
+          Start = VirtualThunk.size();
+        }
+        return DemangledName.substr(Start);
+      }
+      return std::string("");
+    }
+
+    // "ns::Foo::bar(int) const" -> "ns::Foo#bar(int) const", or "" if the
+    // name cannot be split safely.
+    static std::string methodKey(const std::string &Name) {
+      size_t i = Name.rfind(')');
+      if (i == std::string::npos)
+        return "";
+      // skip back over the parameter list
+      int Depth = 0;
+      for (;; i--) {
+        if (Name[i] == ')')
+          ++Depth;
+        else if (Name[i] == '(' && --Depth == 0)
+          break;
+        if (i == 0)
+          return "";
+      }
+      // find the last "::" outside of template arguments
+      int TDepth = 0;
+      while (i >= 2) {
+        --i;
+        if (Name[i] == '>')
+          ++TDepth;
+        else if (Name[i] == '<')
+          --TDepth;
+        else if (Name[i] == ':' && Name[i-1] == ':' && TDepth == 0)
+          return Name.substr(0, i-1) + "#" + Name.substr(i+1);
+      }
+      return "";
+    }
+  };
+}
+
+char WholeProgramDevirt::ID = 0;
+ModulePass *llvm::createWholeProgramDevirtPass() {
+  return new WholeProgramDevirt();
+}
+
+void WholeProgramDevirt::collect(Module &M) {
+  if (NamedMDNode *CHA = M.getNamedMetadata("MCFICHA")) {
+    for (unsigned i = 0; i < CHA->getNumOperands(); i++) {
+      MDNode *N = CHA->getOperand(i);
+      if (N->getNumOperands() == 0 || !isa<MDString>(N->getOperand(0)))
+        continue;
+      StringRef Entry = cast<MDString>(N->getOperand(0))->getString();
+      if (!Entry.startswith("I@"))
+        continue;
+      SmallVector<StringRef, 4> Names;
+      Entry.substr(2).split(Names, "#");
+      std::string Class = Names[0].str();
+      if (!Bases[Class].empty())
+        continue; // duplicated entry from another module
+      for (unsigned j = 1; j < Names.size(); j++) {
+        Bases[Class].push_back(Names[j].str());
+        Derived[Names[j].str()].insert(Class);
+      }
+    }
+  }
+
+  for (auto G = M.global_begin(); G != M.global_end(); G++) {
+    if (!G->hasInitializer() || !G->getName().startswith("_ZTV"))
+      continue;
+    std::string VTName = CXXDemangledName(G->getName().data());
+    if (VTName.find("vtable for ") == 0)
+      Vtables.insert(VTName.substr(11));
+  }
+
+  for (auto F = M.begin(); F != M.end(); F++) {
+    if (!F->getName().startswith("_Z"))
+      continue;
+    std::string Key = methodKey(CXXDemangledName(F->getName().data()));
+    if (Key.empty())
+      continue;
+    if (F->getName().startswith("_ZTh") || F->getName().startswith("_ZTv") ||
+        F->getName().startswith("_ZTc"))
+      Thunked.insert(Key);
+    else
+      Methods[Key] = F;
+  }
+}
+
+Function *WholeProgramDevirt::resolve(const std::string &Class,
+                                      const std::string &Method) {
+  // Gather Class and all of its subclasses.
+  std::set<std::string> Sub;
+  std::vector<std::string> Work(1, Class);
+  while (!Work.empty()) {
+    std::string C = Work.back();
+    Work.pop_back();
+    if (!Sub.insert(C).second)
+      continue;
+    if (Vtables.find(C) == Vtables.end())
+      return nullptr; // part of the hierarchy is outside of this module
+    auto D = Derived.find(C);
+    if (D != Derived.end())
+      Work.insert(Work.end(), D->second.begin(), D->second.end());
+  }
+
+  Function *Impl = nullptr;
+  std::string ImplKey;
+  for (auto &C : Sub) {
+    std::string Key = C + "#" + Method;
+    auto I = Methods.find(Key);
+    if (I == Methods.end())
+      continue;
+    if (C != Class)
+      return nullptr; // overridden by a subclass
+    Impl = I->second;
+    ImplKey = Key;
+  }
+
+  // Not defined anywhere below Class; look it up along a
+  // single-inheritance chain.
+  for (std::string C = Class; !Impl; ) {
+    auto B = Bases.find(C);
+    if (B == Bases.end() || B->second.size() != 1)
+      return nullptr;
+    C = B->second[0];
+    auto I = Methods.find(C + "#" + Method);
+    if (I != Methods.end()) {
+      Impl = I->second;
+      ImplKey = I->first;
+    }
+  }
+
+  // A this-adjusting thunk means some vtable does not call Impl directly.
+  if (Thunked.find(ImplKey) != Thunked.end())
+    return nullptr;
+  return Impl;
+}
+
+bool WholeProgramDevirt::runOnModule(Module &M) {
+  collect(M);
+
+  bool Changed = false;
+  for (auto F = M.begin(); F != M.end(); F++) {
+    for (auto BB = F->begin(); BB != F->end(); BB++) {
+      for (auto MI = BB->begin(); MI != BB->end(); MI++) {
+        CallSite CS(&*MI);
+        if (!CS || CS.getCalledFunction())
+          continue;
+        MDNode *MD = MI->getMetadata("CXXVirtual");
+        if (!MD || !isa<MDString>(MD->getOperand(0)))
+          continue;
+        // only "V#Class#method"; destructors and member pointers are left
+        // alone
+        StringRef VStr = cast<MDString>(MD->getOperand(0))->getString();
+        if (!VStr.startswith("V#"))
+          continue;
+        std::pair<StringRef, StringRef> CM = VStr.substr(2).split('#');
+        if (CM.second.empty())
+          continue;
+
+        std::string Key = VStr.substr(2).str();
+        auto R = Resolved.find(Key);
+        if (R == Resolved.end())
+          R = Resolved.insert(std::make_pair(Key, resolve(CM.first.str(),
+                                                          CM.second.str()))).first;
+        Function *Impl = R->second;
+        if (!Impl)
+          continue;
+
+        DEBUG(dbgs() << "MCFI-DEVIRT: " << VStr << " -> " << Impl->getName()
+                     << " in " << F->getName() << "\n");
+        Value *Callee = Impl;
+        if (Impl->getType() != CS.getCalledValue()->getType())
+          Callee = ConstantExpr::getBitCast(Impl, CS.getCalledValue()->getType());
+        CS.setCalledFunction(Callee);
+        MI->setMetadata("CXXVirtual", nullptr);
+        ++NumDevirtualized;
+        Changed = true;
+      }
+    }
+  }
+  return Changed;
+}
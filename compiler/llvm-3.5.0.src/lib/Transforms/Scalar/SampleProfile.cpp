@@ -20,6 +20,11 @@
 //      that edge. The weight of a block B is computed as the maximum
 //      number of samples found in B.
 //
+// - mcfi.icp: Represents the call targets sampled at an indirect call.
+//      This annotation is added to indirect calls and lists the sampled
+//      callees, hottest first, as pairs of (name, number of samples).
+//      It is consumed by the MCFI indirect call promotion pass.
+//
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Transforms/Scalar.h"
@@ -48,6 +53,7 @@
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Regex.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <cctype>
 
 using namespace llvm;
@@ -111,6 +117,8 @@ typedef DenseMap<BasicBlock *, BasicBlock *> EquivalenceClassMap;
 typedef std::pair<BasicBlock *, BasicBlock *> Edge;
 typedef DenseMap<Edge, unsigned> EdgeWeightMap;
 typedef DenseMap<BasicBlock *, SmallVector<BasicBlock *, 8>> BlockEdgeMap;
+typedef SmallVector<std::pair<std::string, unsigned>, 4> CallTargetList;
+typedef DenseMap<InstructionLocation, CallTargetList> CallTargetMap;
 
 /// \brief Representation of the runtime profile for a function.
 ///
@@ -134,6 +142,9 @@ public:
     assert(LineOffset >= 0);
     BodySamples[InstructionLocation(LineOffset, Discriminator)] += Num;
   }
+  void addCalledTarget(int LineOffset, unsigned Discriminator, StringRef FName,
+                       unsigned Num);
+  bool emitCallTargets(Function &F);
   void print(raw_ostream &OS);
   void printEdgeWeight(raw_ostream &OS, Edge E);
   void printBlockWeight(raw_ostream &OS, BasicBlock *BB);
@@ -173,6 +184,12 @@ protected:
   /// are an offset from the start of the function.
   BodySampleMap BodySamples;
 
+  /// \brief Map line offsets to the call targets sampled there.
+  ///
+  /// Each entry lists the callees observed at a call instruction
+  /// together with the number of samples collected for each one.
+  CallTargetMap CallTargets;
+
   /// \brief Map basic blocks to their computed weights.
   ///
   /// The weight of a basic block is defined to be the maximum
@@ -433,8 +450,9 @@ void SampleModuleProfile::dump() {
 ///    call instruction that calls one of foo(), bar() and baz(). With
 ///    baz() being the relatively more frequent call target.
 ///
-///    FIXME: This is currently unhandled, but it has a lot of
-///           potential for aiding the inliner.
+///    The targets are attached to indirect calls at that location
+///    (see SampleFunctionProfile::emitCallTargets), so that hot
+///    callees can be promoted to guarded direct calls.
 ///
 ///
 /// Since this is a flat profile, a function that shows up more than
@@ -511,7 +529,19 @@ bool SampleModuleProfile::loadText() {
         Matches[2].getAsInteger(10, Discriminator);
       Matches[3].getAsInteger(10, NumSamples);
 
-      // FIXME: Handle called targets (in Matches[4]).
+      SmallVector<StringRef, 4> Targets;
+      Matches[4].split(Targets, " ", -1, false);
+      for (unsigned I = 0, E = Targets.size(); I != E; ++I) {
+        std::pair<StringRef, StringRef> Target = Targets[I].rsplit(':');
+        unsigned NumCalls;
+        if (Target.first.empty() || Target.second.getAsInteger(10, NumCalls)) {
+          reportParseError(LineIt.line_number(),
+                           "Expected 'mangled_name:NUM', found " + Targets[I]);
+          return false;
+        }
+        FProfile.addCalledTarget(LineOffset, Discriminator, Target.first,
+                                 NumCalls);
+      }
 
       // When dealing with instruction weights, we use the value
       // zero to indicate the absence of a sample. If we read an
@@ -527,6 +557,77 @@ bool SampleModuleProfile::loadText() {
   return true;
 }
 
+/// \brief Record \p Num samples of a call to \p FName at a line offset.
+///
+/// \param LineOffset Line offset of the call, relative to the function header.
+/// \param Discriminator Discriminator of the call.
+/// \param FName Name of the called function.
+/// \param Num Number of samples collected for the call.
+void SampleFunctionProfile::addCalledTarget(int LineOffset,
+                                            unsigned Discriminator,
+                                            StringRef FName, unsigned Num) {
+  assert(LineOffset >= 0);
+  CallTargetList &Targets =
+      CallTargets[InstructionLocation(LineOffset, Discriminator)];
+  for (unsigned I = 0, E = Targets.size(); I != E; ++I) {
+    if (Targets[I].first == FName) {
+      Targets[I].second += Num;
+      return;
+    }
+  }
+  Targets.push_back(std::make_pair(FName.str(), Num));
+}
+
+/// \brief Annotate the indirect calls in \p F with their sampled targets.
+///
+/// Every indirect call whose location has call targets in the profile
+/// gets an mcfi.icp node holding the targets sorted by decreasing
+/// number of samples. Direct calls and inline assembly are left alone.
+///
+/// \param F The function to annotate.
+///
+/// \returns true if \p F was modified. Returns false, otherwise.
+bool SampleFunctionProfile::emitCallTargets(Function &F) {
+  bool Changed = false;
+  if (CallTargets.empty())
+    return false;
+
+  unsigned ICPKind = Ctx->getMDKindID("mcfi.icp");
+  Type *Int32Ty = Type::getInt32Ty(*Ctx);
+  for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    CallInst *CI = dyn_cast<CallInst>(&*I);
+    if (!CI || CI->getCalledFunction() || CI->isInlineAsm())
+      continue;
+
+    DebugLoc DLoc = CI->getDebugLoc();
+    unsigned Lineno = DLoc.getLine();
+    if (Lineno < HeaderLineno)
+      continue;
+    DILocation DIL(DLoc.getAsMDNode(*Ctx));
+    CallTargetMap::iterator T = CallTargets.find(
+        InstructionLocation(Lineno - HeaderLineno, DIL.getDiscriminator()));
+    if (T == CallTargets.end())
+      continue;
+
+    CallTargetList Targets = T->second;
+    std::stable_sort(Targets.begin(), Targets.end(),
+                     [](const std::pair<std::string, unsigned> &A,
+                        const std::pair<std::string, unsigned> &B) {
+      return A.second > B.second;
+    });
+    SmallVector<Value *, 8> Ops;
+    for (unsigned J = 0, JE = Targets.size(); J != JE; ++J) {
+      Ops.push_back(MDString::get(*Ctx, Targets[J].first));
+      Ops.push_back(ConstantInt::get(Int32Ty, Targets[J].second));
+    }
+    DEBUG(dbgs() << "Call targets for " << *CI << ": " << Targets.size()
+                 << "\n");
+    CI->setMetadata(ICPKind, MDNode::get(*Ctx, Ops));
+    Changed = true;
+  }
+  return Changed;
+}
+
 /// \brief Get the weight for an instruction.
 ///
 /// The "weight" of an instruction \p Inst is the number of samples
@@ -1061,6 +1162,9 @@ bool SampleFunctionProfile::emitAnnotations(Function &F, DominatorTree *DomTree,
     propagateWeights(F);
   }
 
+  // Record the sampled targets of indirect calls.
+  Changed |= emitCallTargets(F);
+
   return Changed;
 }
 
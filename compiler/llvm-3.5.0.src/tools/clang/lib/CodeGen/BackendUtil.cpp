@@ -472,6 +472,8 @@ TargetMachine *EmitAssemblyHelper::CreateTargetMachine(bool MustCreateTM) {
   Options.DisableCFI = CodeGenOpts.DisableCFI;
   Options.DisablePICFI = CodeGenOpts.DisablePICFI;
   Options.CountInstrumentedIB = CodeGenOpts.CountInstrumentedIB;
+  Options.ProfileInstrumentedIB = CodeGenOpts.ProfileInstrumentedIB;
+  Options.ProfileIBPeriod = CodeGenOpts.ProfileIBPeriod;
   Options.TrapFuncName = CodeGenOpts.TrapFuncName;
   Options.PositionIndependentExecutable = LangOpts.PIELevel != 0;
   Options.FunctionSections = CodeGenOpts.FunctionSections;
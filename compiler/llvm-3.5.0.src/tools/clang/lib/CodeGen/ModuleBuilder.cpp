@@ -79,6 +79,8 @@ namespace {
           assert(M->getOrInsertNamedMetadata("MCFILargeSandbox"));
         if (!CodeGenOpts.MCFISmallID)
           assert(M->getOrInsertNamedMetadata("MCFILargeID"));
+        if (CodeGenOpts.MCFIShadowStack)
+          M->getOrInsertNamedMetadata("MCFIShadowStack");
       }
       return M.release();
     }
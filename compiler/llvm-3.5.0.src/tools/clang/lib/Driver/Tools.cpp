@@ -3939,6 +3939,22 @@ void Clang::ConstructJob(Compilation &C, const JobAction &JA,
       CmdArgs.push_back("-fmcfi-id=large");
   }
 
+  // fmcfi-return=id is default
+  if (Args.hasArg(options::OPT_fmcfi_return)) {
+    const Arg *MCFIReturn = Args.getLastArg(options::OPT_fmcfi_return);
+    std::string Ret;
+    if (MCFIReturn)
+      Ret = MCFIReturn->getValue();
+
+    if (!Ret.empty()) {
+      if (Ret != "id" && Ret != "shadow")
+        D.Diag(diag::err_drv_invalid_value)
+          << Ret << "id or shadow";
+      CmdArgs.push_back(Args.MakeArgString("-fmcfi-return=" + Ret));
+    } else
+      CmdArgs.push_back("-fmcfi-return=id");
+  }
+
   // -fms-compatibility-version=17.00 is default.
   if (Args.hasFlag(options::OPT_fms_extensions, options::OPT_fno_ms_extensions,
                    IsWindowsMSVC) || Args.hasArg(options::OPT_fmsc_version) ||
@@ -341,6 +341,9 @@ static bool ParseCodeGenArgs(CodeGenOptions &Opts, ArgList &Args, InputKind IK,
     Opts.MCFISmallSandbox = Args.getLastArgValue(OPT_fmcfi_sandbox).equals("small");
   if (Args.hasArg(OPT_fmcfi_id))
     Opts.MCFISmallID = Args.getLastArgValue(OPT_fmcfi_id).equals("small");
+  if (Args.hasArg(OPT_fmcfi_return))
+    Opts.MCFIShadowStack =
+      Args.getLastArgValue(OPT_fmcfi_return).equals("shadow");
 
   // We must always run at least the always inlining pass.
   Opts.setInlining(
@@ -417,6 +420,18 @@ static bool ParseCodeGenArgs(CodeGenOptions &Opts, ArgList &Args, InputKind IK,
   Opts.DisableCFI = Args.hasArg(OPT_mdisable_cfi);
   Opts.DisablePICFI = Args.hasArg(OPT_mdisable_picfi);
   Opts.CountInstrumentedIB = Args.hasArg(OPT_mcount_iib);
+  Opts.ProfileInstrumentedIB = Args.hasArg(OPT_mprofile_iib);
+  if (Arg *A = Args.getLastArg(OPT_mprofile_iib_period)) {
+    unsigned Period = getLastArgIntValue(Args, OPT_mprofile_iib_period, 1,
+                                         Diags);
+    if (Period == 0 || (Period & (Period - 1))) {
+      Diags.Report(diag::err_drv_invalid_value)
+        << A->getAsString(Args) << A->getValue();
+      Success = false;
+    } else {
+      Opts.ProfileIBPeriod = Period;
+    }
+  }
   Opts.FloatABI = Args.getLastArgValue(OPT_mfloat_abi);
   Opts.LessPreciseFPMAD = Args.hasArg(OPT_cl_mad_enable);
   Opts.LimitFloatPrecision = Args.getLastArgValue(OPT_mlimit_float_precision);
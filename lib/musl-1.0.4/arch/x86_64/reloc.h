@@ -15,10 +15,14 @@ static inline void do_single_reloc(
 {
 	switch(type) {
         case R_X86_64_JUMP_SLOT: /* .got.plt */
-          trampoline_set_gotplt(reloc_addr, sym_val + addend);
+          set_gotplt(reloc_addr, sym_val + addend);
           break;
 	case R_X86_64_GLOB_DAT:
 	case R_X86_64_64:
+		if (in_vtables(self, reloc_addr)) {
+			set_vtable_slot(reloc_addr, sym_val + addend);
+			break;
+		}
 		*reloc_addr = sym_val + addend;
 		break;
 	case R_X86_64_32:
@@ -28,6 +32,8 @@ static inline void do_single_reloc(
 		*reloc_addr = sym_val + addend - (size_t)reloc_addr + (size_t)base_addr;
 		break;
 	case R_X86_64_RELATIVE:
+		/* the runtime applied these when it loaded the module */
+		if (in_vtables(self, reloc_addr)) break;
 		*reloc_addr = (size_t)base_addr + addend;
 		break;
 	case R_X86_64_COPY:
@@ -19,6 +19,7 @@
 #define ROCK_FREE_TCB     0x80
 #define ROCK_LOAD_NATIVE_CODE 0x88
 #define ROCK_GEN_CFG      0x90
+#define ROCK_UNLOAD_NATIVE_CODE 0x98
 #define ROCK_CREATE_CODE_HEAP 0xA0
 #define ROCK_CODE_HEAP_FILL 0xA8
 #define ROCK_TAKE_ADDR_AND_GEN_CFG 0xD0
@@ -28,6 +29,12 @@
 #define ROCK_REG_CFG_METADATA 0xF0
 #define ROCK_DELETE_CODE 0xF8
 #define ROCK_MOVE_CODE   0x100
+#define ROCK_FREEZE_CFG  0x118
+#define ROCK_SET_GOTPLT_BATCH 0x120
+#define ROCK_TAKE_ADDRS_AND_GEN_CFG 0x128
+#define ROCK_LOAD_NATIVE_CODE_BATCH 0x130
+#define ROCK_SET_VTABLE_SLOTS 0x138
+#define ROCK_VTABLE_REGION 0x140
 #define STRING(x) #x
 #define XSTR(x) STRING(x)
 
@@ -132,6 +139,24 @@ long trampoline_load_native_code(unsigned long n1) {
   return ret;
 }
 
+static __attribute__((noinline))
+long trampoline_load_native_code_batch(unsigned long n1, unsigned long n2) {
+  long ret;
+  __asm__ __volatile__(TRAMP_CALL(ROCK_LOAD_NATIVE_CODE_BATCH)
+                       "D"(n1), "S"(n2):
+                       "memory");
+  return ret;
+}
+
+static __attribute__((noinline))
+long trampoline_unload_native_code(unsigned long n1) {
+  long ret;
+  __asm__ __volatile__(TRAMP_CALL(ROCK_UNLOAD_NATIVE_CODE)
+                       "D"(n1):
+                       "memory");
+  return ret;
+}
+
 static __attribute__((noinline))
 long trampoline_gen_cfg(void) {
   long ret;
@@ -139,6 +164,13 @@ long trampoline_gen_cfg(void) {
   return ret;
 }
 
+static __attribute__((noinline))
+long trampoline_freeze_cfg(void) {
+  long ret;
+  __asm__ __volatile__(TRAMP_CALL(ROCK_FREEZE_CFG):"memory");
+  return ret;
+}
+
 static __attribute__((noinline))
 long trampoline_take_addr_and_gen_cfg(unsigned long n1) {
   long ret;
@@ -148,6 +180,15 @@ long trampoline_take_addr_and_gen_cfg(unsigned long n1) {
   return ret;
 }
 
+static __attribute__((noinline))
+long trampoline_take_addrs_and_gen_cfg(unsigned long n1, unsigned long n2) {
+  long ret;
+  __asm__ __volatile__(TRAMP_CALL(ROCK_TAKE_ADDRS_AND_GEN_CFG)
+                       "D"(n1), "S"(n2):
+                       "memory");
+  return ret;
+}
+
 static __attribute__((noinline))
 long trampoline_set_gotplt(unsigned long n1, unsigned long n2) {
   long ret;
@@ -157,6 +198,33 @@ long trampoline_set_gotplt(unsigned long n1, unsigned long n2) {
   return ret;
 }
 
+static __attribute__((noinline))
+long trampoline_set_gotplt_batch(unsigned long n1, unsigned long n2) {
+  long ret;
+  __asm__ __volatile__(TRAMP_CALL(ROCK_SET_GOTPLT_BATCH)
+                       "D"(n1), "S"(n2):
+                       "memory");
+  return ret;
+}
+
+static __attribute__((noinline))
+long trampoline_set_vtable_slots(unsigned long n1, unsigned long n2) {
+  long ret;
+  __asm__ __volatile__(TRAMP_CALL(ROCK_SET_VTABLE_SLOTS)
+                       "D"(n1), "S"(n2):
+                       "memory");
+  return ret;
+}
+
+static __attribute__((noinline))
+long trampoline_vtable_region(unsigned long n1, unsigned long n2) {
+  long ret;
+  __asm__ __volatile__(TRAMP_CALL(ROCK_VTABLE_REGION)
+                       "D"(n1), "S"(n2):
+                       "memory");
+  return ret;
+}
+
 static __attribute__((noinline))
 long trampoline_fork(void) {
   long ret;
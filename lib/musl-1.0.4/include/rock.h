@@ -25,6 +25,9 @@ extern "C" {
   void rock_move_code(const void *h, const void *target, const void *source, unsigned long length);
   void rock_code_heap_fill(void *h, void *dst, const void *src,
                            unsigned long len, const void *extra);
+  int rock_freeze_cfg(void);
+  unsigned long rock_dlsym_batch(void *h, const char *const *names, void **syms,
+                                 unsigned long n);
 #ifdef __cplusplus
 }
 #endif
@@ -1,6 +1,10 @@
 #include "trampolines.h"
+#include <stddef.h>
 #include <rock.h>
 
+size_t __dlsym_batch(void *restrict, const char *const *, void **,
+                     size_t, void *restrict);
+
 void *rock_create_code_heap(void **ph, unsigned long sz, const void* verifier) {
   return trampoline_create_code_heap((unsigned long)ph, sz, verifier);
 }
@@ -22,3 +26,13 @@ void rock_delete_code(const void *h,
 void rock_move_code(const void *h, const void *target, const void *source, unsigned long length) {
   trampoline_move_code(h, target, source, length);
 }
+
+int rock_freeze_cfg(void) {
+  return trampoline_freeze_cfg();
+}
+
+unsigned long rock_dlsym_batch(void *h, const char *const *names, void **syms,
+                               unsigned long n) {
+  /* like dlsym, RTLD_NEXT is resolved relative to the caller */
+  return __dlsym_batch(h, names, syms, n, __builtin_return_address(0));
+}
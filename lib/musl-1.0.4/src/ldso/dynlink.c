@@ -65,6 +65,7 @@ struct dso {
 	char *strings;
 	unsigned char *map;
 	size_t map_len;
+	unsigned long vtables[2];
 	dev_t dev;
 	ino_t ino;
 	signed char global;
@@ -88,6 +89,58 @@ struct symdef {
 	struct dso *dso;
 };
 
+/* .got.plt entries can only be written by the runtime. While a module's
+ * JUMP_SLOT relocations are processed, the entries are queued and bound
+ * with one escape per batch instead of one escape per symbol. */
+#define GOTPLT_BATCH 512
+static unsigned long gotplt_batch[2*GOTPLT_BATCH];
+static size_t gotplt_batch_cnt;
+static int gotplt_batching;
+
+static void flush_gotplt(void)
+{
+	if (!gotplt_batch_cnt) return;
+	trampoline_set_gotplt_batch((unsigned long)gotplt_batch, gotplt_batch_cnt);
+	gotplt_batch_cnt = 0;
+}
+
+static void set_gotplt(size_t *reloc_addr, size_t val)
+{
+	if (!gotplt_batching) {
+		trampoline_set_gotplt((unsigned long)reloc_addr, val);
+		return;
+	}
+	gotplt_batch[2*gotplt_batch_cnt] = (unsigned long)reloc_addr;
+	gotplt_batch[2*gotplt_batch_cnt+1] = val;
+	if (++gotplt_batch_cnt == GOTPLT_BATCH) flush_gotplt();
+}
+
+/* __mcfi_vtables, whose address and size are in dso->vtables, is
+ * read-only in the sandbox. The runtime applies the relative relocations
+ * in it, and the symbolic ones are queued and bound in batches, like
+ * .got.plt entries. */
+static unsigned long vtslot_batch[2*GOTPLT_BATCH];
+static size_t vtslot_batch_cnt;
+
+static int in_vtables(struct dso *p, size_t *reloc_addr)
+{
+	return (unsigned long)reloc_addr - p->vtables[0] < p->vtables[1];
+}
+
+static void flush_vtable_slots(void)
+{
+	if (!vtslot_batch_cnt) return;
+	trampoline_set_vtable_slots((unsigned long)vtslot_batch, vtslot_batch_cnt);
+	vtslot_batch_cnt = 0;
+}
+
+static void set_vtable_slot(size_t *reloc_addr, size_t val)
+{
+	vtslot_batch[2*vtslot_batch_cnt] = (unsigned long)reloc_addr;
+	vtslot_batch[2*vtslot_batch_cnt+1] = val;
+	if (++vtslot_batch_cnt == GOTPLT_BATCH) flush_vtable_slots();
+}
+
 #include "reloc.h"
 
 void __init_ssp(size_t *);
@@ -306,6 +359,45 @@ static void reclaim_gaps(unsigned char *base, Phdr *ph, size_t phent, size_t phc
 	}
 }
 
+/* The DT_NEEDED libraries of a module are loaded by the runtime with one
+ * escape for all of them. preload_deps maps them before load_library goes
+ * through them one by one, and map_library picks up the mapping of its
+ * file here instead of loading it again. Those that are not picked up are
+ * unloaded by drop_preloaded. */
+#define LOAD_BATCH 64
+static struct {
+	dev_t dev;
+	ino_t ino;
+	unsigned char *map;
+} preloaded[LOAD_BATCH];
+static size_t preloaded_cnt;
+
+static unsigned char *take_preloaded(struct dso *dso)
+{
+	unsigned char *map;
+	size_t i;
+	for (i=0; i<preloaded_cnt; i++) {
+		if (!preloaded[i].map || preloaded[i].dev != dso->dev
+		    || preloaded[i].ino != dso->ino) continue;
+		map = preloaded[i].map;
+		preloaded[i].map = 0;
+		return map;
+	}
+	return 0;
+}
+
+/* The runtime registered the preloaded libraries when it loaded them, so
+ * those that load_library did not use, e.g. because an earlier one failed
+ * to load, are unloaded through it rather than forgotten. */
+static void drop_preloaded(void)
+{
+	size_t i;
+	for (i=0; i<preloaded_cnt; i++)
+		if (preloaded[i].map)
+			trampoline_unload_native_code((unsigned long)preloaded[i].map);
+	preloaded_cnt = 0;
+}
+
 static void *map_library(int fd, struct dso *dso)
 {
 	Ehdr buf[(896+sizeof(Ehdr))/sizeof(Ehdr)];
@@ -375,7 +467,8 @@ static void *map_library(int fd, struct dso *dso)
 	 * use the invalid part; we just need to reserve the right
 	 * amount of virtual address space to map over later. */
 	//map = mmap((void *)addr_min, map_len, prot, MAP_PRIVATE, fd, off_start);
-        map = trampoline_load_native_code(fd);
+        map = take_preloaded(dso);
+        if (!map) map = trampoline_load_native_code(fd);
         //dprintf(2, "Initial map: map = %lx, addr_min = %x, len = %x\n", map, addr_min, map_len);
 	if (map==0) goto error;
 	/* If the loaded file is not relocatable and the requested address is
@@ -534,6 +627,70 @@ static void decode_dyn(struct dso *p)
 		p->versym = (void *)(p->base + *dyn);
 }
 
+static const char reserved[] = "c\0pthread\0rt\0m\0dl\0util\0xnet\0";
+
+/* Loads of the implementation itself, libc.so, libpthread.so and so on,
+ * resolve to ldso. Return the name's entry in reserved, if it is one. */
+static const char *reserved_name(const char *name)
+{
+	const char *rp;
+	char *z;
+	if (name[0]!='l' || name[1]!='i' || name[2]!='b') return 0;
+	z = strchr(name, '.');
+	if (!z) return 0;
+	size_t l = z-name;
+	for (rp=reserved; *rp && strncmp(name+3, rp, l-3); rp+=strlen(rp)+1);
+	return *rp ? rp : 0;
+}
+
+/* Open the library name, found through $LD_LIBRARY_PATH, the rpaths of
+ * needed_by and its users or the system path, leaving its path in buf. */
+static int search_library(const char *name, struct dso *needed_by, char *buf, size_t buf_size)
+{
+	struct dso *p;
+	int fd = -1;
+	if (env_path) fd = path_open(name, env_path, buf, buf_size);
+	for (p=needed_by; fd < 0 && p; p=p->needed_by)
+		if (!fixup_rpath(p, buf, buf_size))
+			fd = path_open(name, p->rpath, buf, buf_size);
+	if (fd < 0) {
+		if (!sys_path) {
+			char *prefix = 0;
+			size_t prefix_len;
+			if (ldso->name[0]=='/') {
+				char *s, *t, *z;
+				for (s=t=z=ldso->name; *s; s++)
+					if (*s=='/') z=t, t=s;
+				prefix_len = z-ldso->name;
+				if (prefix_len < PATH_MAX)
+					prefix = ldso->name;
+			}
+			if (!prefix) {
+				prefix = "";
+				prefix_len = 0;
+			}
+			char etc_ldso_path[prefix_len + 1
+				+ sizeof "/etc/ld-musl-" LDSO_ARCH ".path"];
+			snprintf(etc_ldso_path, sizeof etc_ldso_path,
+				"%.*s/etc/ld-musl-" LDSO_ARCH ".path",
+				(int)prefix_len, prefix);
+			FILE *f = fopen(etc_ldso_path, "rbe");
+			if (f) {
+				if (getdelim(&sys_path, (size_t[1]){0}, 0, f) <= 0) {
+					free(sys_path);
+					sys_path = "";
+				}
+				fclose(f);
+			} else if (errno != ENOENT) {
+				sys_path = "";
+			}
+		}
+		if (!sys_path) sys_path = "/lib:/usr/local/lib:/usr/lib";
+		fd = path_open(name, sys_path, buf, buf_size);
+	}
+	return fd;
+}
+
 static struct dso *load_library(const char *name, struct dso *needed_by)
 {
 	char buf[2*NAME_MAX+2];
@@ -547,29 +704,21 @@ static struct dso *load_library(const char *name, struct dso *needed_by)
 	int is_self = 0;
 
 	/* Catch and block attempts to reload the implementation itself */
-	if (name[0]=='l' && name[1]=='i' && name[2]=='b') {
-		static const char *rp, reserved[] =
-			"c\0pthread\0rt\0m\0dl\0util\0xnet\0";
-		char *z = strchr(name, '.');
-		if (z) {
-			size_t l = z-name;
-			for (rp=reserved; *rp && strncmp(name+3, rp, l-3); rp+=strlen(rp)+1);
-			if (*rp) {
-				if (ldd_mode) {
-					/* Track which names have been resolved
-					 * and only report each one once. */
-					static unsigned reported;
-					unsigned mask = 1U<<(rp-reserved);
-					if (!(reported & mask)) {
-						reported |= mask;
-						dprintf(1, "\t%s => %s (%p)\n",
-							name, ldso->name,
-							ldso->base);
-					}
-				}
-				is_self = 1;
+	const char *rp = reserved_name(name);
+	if (rp) {
+		if (ldd_mode) {
+			/* Track which names have been resolved
+			 * and only report each one once. */
+			static unsigned reported;
+			unsigned mask = 1U<<(rp-reserved);
+			if (!(reported & mask)) {
+				reported |= mask;
+				dprintf(1, "\t%s => %s (%p)\n",
+					name, ldso->name,
+					ldso->base);
 			}
 		}
+		is_self = 1;
 	}
 	if (!strcmp(name, ldso->name)) is_self = 1;
 	if (is_self) {
@@ -593,46 +742,7 @@ static struct dso *load_library(const char *name, struct dso *needed_by)
 			}
 		}
 		if (strlen(name) > NAME_MAX) return 0;
-		fd = -1;
-		if (env_path) fd = path_open(name, env_path, buf, sizeof buf);
-		for (p=needed_by; fd < 0 && p; p=p->needed_by)
-			if (!fixup_rpath(p, buf, sizeof buf))
-				fd = path_open(name, p->rpath, buf, sizeof buf);
-		if (fd < 0) {
-			if (!sys_path) {
-				char *prefix = 0;
-				size_t prefix_len;
-				if (ldso->name[0]=='/') {
-					char *s, *t, *z;
-					for (s=t=z=ldso->name; *s; s++)
-						if (*s=='/') z=t, t=s;
-					prefix_len = z-ldso->name;
-					if (prefix_len < PATH_MAX)
-						prefix = ldso->name;
-				}
-				if (!prefix) {
-					prefix = "";
-					prefix_len = 0;
-				}
-				char etc_ldso_path[prefix_len + 1
-					+ sizeof "/etc/ld-musl-" LDSO_ARCH ".path"];
-				snprintf(etc_ldso_path, sizeof etc_ldso_path,
-					"%.*s/etc/ld-musl-" LDSO_ARCH ".path",
-					(int)prefix_len, prefix);
-				FILE *f = fopen(etc_ldso_path, "rbe");
-				if (f) {
-					if (getdelim(&sys_path, (size_t[1]){0}, 0, f) <= 0) {
-						free(sys_path);
-						sys_path = "";
-					}
-					fclose(f);
-				} else if (errno != ENOENT) {
-					sys_path = "";
-				}
-			}
-			if (!sys_path) sys_path = "/lib:/usr/local/lib:/usr/lib";
-			fd = path_open(name, sys_path, buf, sizeof buf);
-		}
+		fd = search_library(name, needed_by, buf, sizeof buf);
                 //dprintf(2, "%s\n", name);
 		pathname = buf;
 	}
@@ -653,6 +763,8 @@ static struct dso *load_library(const char *name, struct dso *needed_by)
 			return p;
 		}
 	}
+	temp_dso.dev = st.st_dev;
+	temp_dso.ino = st.st_ino;
 	map = noload ? 0 : map_library(fd, &temp_dso);
 	close(fd);
 	if (!map) return 0;
@@ -717,11 +829,67 @@ static struct dso *load_library(const char *name, struct dso *needed_by)
 	return p;
 }
 
+/* Map the DT_NEEDED libraries of p that load_library would map, with one
+ * runtime escape. The runtime reads the files in parallel, then parses
+ * their metadata in the same escape. What is skipped here, because it is
+ * loaded, missing or not a library, is left to load_library. */
+static void preload_deps(struct dso *p)
+{
+	char buf[2*NAME_MAX+2];
+	unsigned long slots[LOAD_BATCH];
+	const char *name;
+	struct dso *q;
+	struct stat st;
+	Ehdr eh;
+	size_t i, j, n=0;
+	int fd;
+
+	drop_preloaded();
+	if (noload) return;
+	for (i=0; p->dynv[i] && n < LOAD_BATCH; i+=2) {
+		if (p->dynv[i] != DT_NEEDED) continue;
+		name = p->strings + p->dynv[i+1];
+		if (reserved_name(name) || !strcmp(name, ldso->name)) continue;
+		if (strchr(name, '/')) {
+			fd = open(name, O_RDONLY|O_CLOEXEC);
+		} else {
+			for (q=head->next; q; q=q->next)
+				if (q->shortname && !strcmp(q->shortname, name))
+					break;
+			if (q || strlen(name) > NAME_MAX) continue;
+			fd = search_library(name, p, buf, sizeof buf);
+		}
+		if (fd < 0) continue;
+		if (fstat(fd, &st) < 0 || pread(fd, &eh, sizeof eh, 0) != sizeof eh
+		    || memcmp(eh.e_ident, ELFMAG, SELFMAG) || eh.e_type != ET_DYN)
+			goto skip;
+		for (q=head->next; q; q=q->next)
+			if (q->dev == st.st_dev && q->ino == st.st_ino)
+				goto skip;
+		for (j=0; j<n; j++)
+			if (preloaded[j].dev == st.st_dev && preloaded[j].ino == st.st_ino)
+				goto skip;
+		preloaded[n].dev = st.st_dev;
+		preloaded[n].ino = st.st_ino;
+		/* the runtime closes it */
+		slots[n++] = fd;
+		continue;
+skip:
+		close(fd);
+	}
+	if (!n) return;
+	trampoline_load_native_code_batch((unsigned long)slots, n);
+	for (j=0; j<n; j++)
+		preloaded[j].map = (void *)slots[j];
+	preloaded_cnt = n;
+}
+
 static void load_deps(struct dso *p)
 {
 	size_t i, ndeps=0;
 	struct dso ***deps = &p->deps, **tmp, *dep;
 	for (; p; p=p->next) {
+		preload_deps(p);
 		for (i=0; p->dynv[i]; i+=2) {
 			if (p->dynv[i] != DT_NEEDED) continue;
 			dep = load_library(p->strings + p->dynv[i+1], p);
@@ -742,6 +910,7 @@ static void load_deps(struct dso *p)
 				*deps = tmp;
 			}
 		}
+		drop_preloaded();
 	}
 }
 
@@ -773,10 +942,20 @@ static void reloc_all(struct dso *p)
 #ifdef NEED_ARCH_RELOCS
 		do_arch_relocs(p, head);
 #endif
+		/* bind all the PLT slots of this module in batches; a
+		 * failed relocation may have left stale entries behind */
+		gotplt_batch_cnt = 0;
+		gotplt_batching = 1;
 		do_relocs(p, (void *)(p->base+dyn[DT_JMPREL]), dyn[DT_PLTRELSZ],
 			2+(dyn[DT_PLTREL]==DT_RELA));
+		flush_gotplt();
+		gotplt_batching = 0;
+		trampoline_vtable_region((unsigned long)p->dynv,
+			(unsigned long)p->vtables);
+		vtslot_batch_cnt = 0;
 		do_relocs(p, (void *)(p->base+dyn[DT_REL]), dyn[DT_RELSZ], 2);
 		do_relocs(p, (void *)(p->base+dyn[DT_RELA]), dyn[DT_RELASZ], 3);
+		flush_vtable_slots();
 		p->relocated = 1;
 	}
 }
@@ -1239,9 +1418,16 @@ void *dlopen(const char *file, int mode)
 		if (p && p->deps) for (i=0; p->deps[i]; i++)
 			if (p->deps[i]->global < 0)
 				p->deps[i]->global = 0;
+		drop_preloaded();
+		/* a relocation failure may have left the batches open */
+		gotplt_batching = 0;
+		gotplt_batch_cnt = 0;
+		vtslot_batch_cnt = 0;
 		for (p=orig_tail->next; p; p=next) {
 			next = p->next;
-			munmap(p->map, p->map_len);
+			/* the runtime frees the library unless a cfg already
+			 * covers it, in which case it has to stay mapped */
+			trampoline_unload_native_code((unsigned long)p->map);
 			free(p->deps);
 			free(p);
 		}
@@ -1311,7 +1497,7 @@ static int invalid_dso_handle(void *h)
 	return 1;
 }
 
-static void *do_dlsym(struct dso *p, const char *s, void *ra)
+static void *find_dlsym(struct dso *p, const char *s, void *ra)
 {
 	size_t i;
 	uint32_t h = 0, gh = 0;
@@ -1373,11 +1559,41 @@ static void *do_dlsym(struct dso *p, const char *s, void *ra)
 	snprintf(errbuf, sizeof errbuf, "Symbol not found: %s", s);
 	return 0;
  succeeded:
-        /* explicitly make the function's address taken */
-        trampoline_take_addr_and_gen_cfg(v);
         return v;
 }
 
+static void *do_dlsym(struct dso *p, const char *s, void *ra)
+{
+	void *v = find_dlsym(p, s, ra);
+	/* explicitly make the function's address taken */
+	if (v) trampoline_take_addr_and_gen_cfg(v);
+	return v;
+}
+
+/* Look up n symbols at once. The runtime is told about the taken
+ * addresses in batches, so that they cost at most one cfg generation
+ * per batch instead of one per symbol. */
+#define DLSYM_BATCH 256
+size_t __dlsym_batch(void *restrict p, const char *const *names, void **syms, size_t n, void *restrict ra)
+{
+	unsigned long addrs[DLSYM_BATCH];
+	size_t i, cnt = 0, found = 0;
+	pthread_rwlock_rdlock(&lock);
+	for (i=0; i<n; i++) {
+		syms[i] = find_dlsym(p, names[i], ra);
+		if (!syms[i]) continue;
+		found++;
+		addrs[cnt++] = (unsigned long)syms[i];
+		if (cnt == DLSYM_BATCH) {
+			trampoline_take_addrs_and_gen_cfg((unsigned long)addrs, cnt);
+			cnt = 0;
+		}
+	}
+	if (cnt) trampoline_take_addrs_and_gen_cfg((unsigned long)addrs, cnt);
+	pthread_rwlock_unlock(&lock);
+	return found;
+}
+
 int __dladdr(const void *addr, Dl_info *info)
 {
 	struct dso *p;
@@ -1488,6 +1704,10 @@ void *__dlsym(void *restrict p, const char *restrict s, void *restrict ra)
 {
 	return 0;
 }
+size_t __dlsym_batch(void *restrict p, const char *const *names, void **syms, size_t n, void *restrict ra)
+{
+	return 0;
+}
 int __dladdr (const void *addr, Dl_info *info)
 {
 	return 0;
@@ -38,6 +38,30 @@ typedef struct sym_t sym;
 /* if any native module is loaded, COMPAT_MODE is set to 1 */
 extern int COMPAT_MODE;
 
+/* how many sites are activated when one online patching site traps,
+   selected by the MCFI_ACTIVATION environment variable */
+enum Activation_Granularity {
+  ACTIVATE_SITE = 0,     /* only the trapping site (default) */
+  ACTIVATE_FUNCTION = 1, /* all sites in the same function */
+  ACTIVATE_PAGE = 2      /* all sites in the same code page */
+};
+extern int ACTIVATION_GRANULARITY;
+
+/* activation profile to replay and to dump, from MCFI_PROFILE and
+   MCFI_PROFILE_OUT respectively */
+extern const char *MCFI_PROFILE;
+extern const char *MCFI_PROFILE_OUT;
+
+/* whether checks of single-target classes are specialized into inline
+   caches, from MCFI_INLINE_CACHE */
+extern int INLINE_CACHE;
+
+/* per-branch counts of -mprofile-iib modules to dump, from MCFI_IIB_OUT */
+extern const char *MCFI_IIB_OUT;
+
+/* longest build id kept for a module, enough for a sha1 build id */
+#define BUILD_ID_MAX 20
+
 struct icf_t {
   UT_hash_handle hh;  
   char *id;
@@ -113,6 +137,7 @@ static void functions_clear(function **functions) {
 typedef struct symbol_t {
   char *name;           /* return address of a direct call */
   size_t offset;        /* offset in the elf's executable segment */
+  size_t site;          /* end of the bary load of an icf, 0 if unknown */
   struct symbol_t *next, *prev;
 } symbol;
 
@@ -150,6 +175,7 @@ struct code_module_t {
   uintptr_t osb_base_addr; /* out of sandbox base addr */
   int      is_exe;
   size_t   sz;         /* size of this module's executable program segment */
+  size_t   map_sz;     /* size of all of its segments, from base_addr */
   icf      *icfs;      /* indirect call instructions */
   function *functions; /* functions */
   dict     *classes;   /* classes */  
@@ -169,18 +195,26 @@ struct code_module_t {
   dict     *func_orig; /* original values of function's entries */
   dict     *ctor;      /* mangled c++ constructor offset and their demangled class names */
   dict     *vtable;    /* c++ constructor's demangled name and its mangled virtual methods */
+  graph    *vtable_regions; /* root class -> classes laid out in its vtable region */
   dict     *defined_ctors; /* c++ constructors which have function bodies */
   graph    *dynfuncs;  /* map from position of to a couple of functions */
   graph    *weakfuncs; /* weak functions symbols */
   uintptr_t gotplt;    /* offset of .got.plt */
   uintptr_t osb_gotplt;/* out of sandbox base addr for .got.plt */
   size_t   gotpltsz;   /* .got.plt size */
+  uintptr_t vtables;   /* address of __mcfi_vtables, the laid out vtables,
+                          which the sandbox only sees read-only */
+  size_t   vtablessz;  /* __mcfi_vtables size */
+  uintptr_t osb_vtables;/* out of sandbox base addr for __mcfi_vtables */
+  dict     *vtslots;   /* symbolic relocations in __mcfi_vtables not yet
+                          bound, from offset to the function or 0 */
   dict     *gpfuncs;   /* map from .got.plt entry to the function */
   int      cfggened;   /* the cfg has been generated for this module before */
   int      deleted;    /* whether this module has been deleted */
   void     *code;      /* contents of the code during fork */
   void     *gotpltcontent; /* contents of the gotplt during fork */
   int      activated;     /* whether indirect branch targets are activated by default */
+  int      shadow_stack; /* compiled with -fmcfi-return=shadow */
   int      code_heap;  /* whether this code module is a code_heap created for allowing changing */
   unsigned char* code_data_bitmap;/* remembers what areas are code and what areas are data */
   unsigned char* internal_dbt_bitmap; /* remembers internal direct branch targets */
@@ -189,6 +223,15 @@ struct code_module_t {
   dict     *bid_slot_in_codeheap;/* remembers bid slots needed for instructions in the codeheap */
   struct verifier_t *verifier; /* pointer to the verifier */
   int      instrumented; /* if the module has been mcfi-instrumented */
+  graph    *ra_batches;    /* call sites grouped by activation batch */
+  graph    *at_batches;    /* address-taking sites grouped by activation batch */
+  graph    *entry_batches; /* patched function entries grouped by activation batch */
+  size_t   *batch_funcs; /* sorted function offsets for function batches */
+  size_t   batch_funcs_count;
+  int      batched;      /* whether the activation batches have been built */
+  unsigned char build_id[BUILD_ID_MAX]; /* identifies the module in activation profiles */
+  unsigned int build_id_len;
+  int      replayed;     /* whether the activation profile has been replayed */
 };
 
 static code_module *alloc_code_module(void) {
@@ -680,6 +723,28 @@ static void parse_vtable(char *content, const char *end,
   }
 }
 
+/**
+ * parse vtable regions, "Root#Class#Class..." in pre-order. Each object
+ * file lays out its own regions, so a root may appear more than once.
+ */
+static void parse_vtable_regions(char *content, const char *end,
+                                 /*out*/graph **regions,
+                                 /*out*/str **sp) {
+  char *cursor = content;
+
+  int stop;
+
+  while (cursor < end) {
+    char *root = sp_intern_string(sp, _get_string_before_symbol(&cursor, '#', &stop, 0));
+    g_add_vertex(regions, root);
+    while (!stop) {
+      char *class_name =
+        sp_intern_string(sp, _get_string_before_symbol(&cursor, '#', &stop, 0));
+      g_add_directed_edge(regions, root, class_name);
+    }
+  }
+}
+
 /**
  * Test whether a function is a C++ instance method (non-static member method),
  * and set the attributes if it is.
@@ -928,6 +993,116 @@ static void merge_mcfi_metainfo(code_module *modules,
   }
 }
 
+/**
+ * Check the vtable regions of a module against the merged class hierarchy.
+ * A range check compiled against a region accepts every vtable in it for a
+ * virtual call through its root, which the CFG allows only if the classes
+ * of the region are in one inheritance group. Returns the first class that
+ * is not connected to the root of its region, or 0.
+ */
+static char *check_vtable_regions(graph *regions, graph *cha) {
+  vertex *r, *rtmp;
+  HASH_ITER(hh, regions, r, rtmp) {
+    dict *reached = 0;
+    int changed = TRUE;
+    vertex *c, *ctmp;
+    char *missing = 0;
+
+    dict_add(&reached, r->key, 0);
+    while (changed) {
+      changed = FALSE;
+      HASH_ITER(hh, (graph*)r->value, c, ctmp) {
+        if (dict_in(reached, c->key))
+          continue;
+        vertex *adj = dict_find(cha, c->key);
+        vertex *a, *atmp;
+        if (!adj)
+          continue;
+        HASH_ITER(hh, (graph*)adj->value, a, atmp) {
+          if (dict_in(reached, a->key)) {
+            dict_add(&reached, c->key, 0);
+            changed = TRUE;
+            break;
+          }
+        }
+      }
+    }
+    HASH_ITER(hh, (graph*)r->value, c, ctmp) {
+      if (!dict_in(reached, c->key)) {
+        missing = c->key;
+        break;
+      }
+    }
+    dict_clear(&reached);
+    if (missing)
+      return missing;
+  }
+  return 0;
+}
+
+/* extend the functions whose addresses are taken in code and in data with
+   their aliases, and keep only those taken in code alone in fats_in_code */
+static void compute_fic(dict **fats_in_code,
+                        dict **fats_in_data,
+                        graph *aliases_tc) {
+#define ADD(fats, v) do {                               \
+    if (dict_find(fats, v->key)) {                      \
+      vertex *a, *atmp;                                 \
+      HASH_ITER(hh, (graph*)(v->value), a, atmp) {      \
+        dict_add(&fats, a->key, 0);                     \
+      }                                                 \
+    }                                                   \
+  } while (0);
+  keyvalue *v, *tmp;
+  HASH_ITER(hh, aliases_tc, v, tmp) {
+    ADD(*fats_in_code, v);
+    ADD(*fats_in_data, v);
+  }
+#undef ADD
+  /* for any function whose address is taken in data, remove
+     its name from the set where each function's address is taken in code*/
+  HASH_ITER(hh, *fats_in_code, v, tmp) {
+    if (dict_find(*fats_in_data, v->key)) {
+      HASH_DEL(*fats_in_code, v);
+      free(v);
+    }
+  }
+}
+
+/* virtual methods of the classes whose constructors are defined and whose
+   vtables are not taken */
+static dict *get_all_vmtd(dict *vtable, dict *defined_ctors,
+                          dict *vtabletaken) {
+  dict *all_vmtd = 0;
+  keyvalue *kv, *tmp;
+  HASH_ITER(hh, vtable, kv, tmp) {
+    node *n;
+    if (!dict_find(vtabletaken, kv->key) &&
+        dict_find(defined_ctors, kv->key)) {
+      //dprintf(STDERR_FILENO, "%s\n", kv->key);
+      DL_FOREACH((node*)kv->value, n) {
+        if (!dict_find(all_vmtd, n->val))
+          dict_add(&all_vmtd, n->val, 0);
+      }
+    }
+  }
+  return all_vmtd;
+}
+
+/* vmtd should already contain the virtual destructors of all modules */
+static void compute_tc_vmtd(dict **vmtd,
+                            graph *aliases_tc) {
+  keyvalue *v, *tmp;
+  HASH_ITER(hh, aliases_tc, v, tmp) {
+    if (dict_find(*vmtd, v->key)) {
+      vertex *a, *atmp;
+      HASH_ITER(hh, (graph*)(v->value), a, atmp) {
+        dict_add(vmtd, a->key, 0);
+      }
+    }
+  }
+}
+
 /* test whether a function or any of its alias's address is taken */
 static int _func_or_alias_addr_taken(dict *fats, char *name, graph *aliases_tc) {
   keyvalue *kv = dict_find(fats, name);
@@ -1430,4 +1605,35 @@ static void populate_landingpads(code_module *m, char *table) {
    holds the trampolines */
 #define BID_SLOT_START 0x11000
 
+/* -mprofile-iib code counts the executions of the indirect branch of a
+   Bary slot in the 8 bytes at %gs:slot + IIB_COUNTERS_OFFSET. No code is
+   loaded below 4MB, so the table region up to there is free, but the Bary
+   slots have to stay below the counters once a profiled module is loaded */
+#define IIB_COUNTERS_OFFSET 0x200000
+
+/* Return the length of the -mprofile-iib counter instructions at p, which
+   is right after a __mcfi_bary_ label, or 0 if there are none. The offset
+   of the counter's displacement is stored to *disp and the sampling period
+   to *period. */
+static size_t iib_counter(const unsigned char *p, size_t *disp,
+                          unsigned long *period) {
+  /* addq $1, %gs:disp32 */
+  if (p[0] == 0x65 && p[1] == 0x48 && p[2] == 0x83 && p[3] == 0x04 &&
+      p[4] == 0x25 && p[9] == 0x01) {
+    *disp = 5;
+    *period = 1;
+    return 10;
+  }
+  /* addl $(2^32/period), %fs:0x118; adcq $0, %gs:disp32 */
+  if (p[0] == 0x64 && p[1] == 0x81 && p[2] == 0x04 && p[3] == 0x25 &&
+      *(const unsigned int*)(p + 4) == 0x118 && *(const unsigned int*)(p + 8) &&
+      p[12] == 0x65 && p[13] == 0x48 && p[14] == 0x83 && p[15] == 0x14 &&
+      p[16] == 0x25 && p[21] == 0x00) {
+    *disp = 17;
+    *period = 0x100000000UL / *(const unsigned int*)(p + 8);
+    return 22;
+  }
+  return 0;
+}
+
 #endif
@@ -0,0 +1,295 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include "cfggen.h"
+
+/* Inline caches
+ * When the class of an indirect branch has exactly one activated target T,
+ * the first instruction of its check
+ *
+ *   mov %gs:BID, %rB; mov %gs:(%rT), %rI; cmp %rB, %rI; jne Lcheck; ICJ *%rT
+ *
+ * is replaced with a jump to a stub in the inline cache area:
+ *
+ *   cmp $T, %eT; je ICJ; <the check up to ICJ, jne Lcheck>; jmp ICJ
+ *
+ * Any other target runs the original check, so the stub never accepts what
+ * the tables reject as long as T itself stays valid. A site is reverted as
+ * soon as its class gains another target, since the stub would then only
+ * add a comparison, and before the tary entry of T is cleared or moved,
+ * which only happens to jitted code: the runtime calls ic_revert for every
+ * range of a code heap that it deletes, moves away or unregisters.
+ * Enabled by MCFI_INLINE_CACHE=1.
+ */
+#define IC_AREA_SIZE 0x100000
+#define IC_STUB_SIZE 48
+
+/* what icache.h expects from the runtime: ic_map_area maps size bytes of
+   executable memory in the sandbox, returns their address or 0 and stores
+   the address of a writable alias in *osb; ic_serialize serializes the
+   instruction fetch of the calling core after code has been modified */
+unsigned long ic_map_area(size_t size, unsigned long *osb);
+void ic_serialize(void);
+
+typedef struct ic_site_t {
+  code_module *m;
+  unsigned long addr;   /* first byte of the check */
+  unsigned int jcc;     /* offset of the jne to the full check */
+  unsigned int icj;     /* offset of the indirect branch */
+  unsigned long check;  /* target of the jne */
+  int reg;              /* register holding the target */
+  unsigned char orig[5];
+  unsigned long target; /* target the installed stub compares against */
+  unsigned long stub;   /* last stub built for the site, reused for target */
+  unsigned long stub_target;
+} ic_site;
+
+static dict *ic_sites = 0; /* check address -> ic_site, 0 if unsupported */
+static unsigned long ic_area = 0;
+static unsigned long osb_ic_area = 0;
+static size_t ic_area_used = 0;
+
+/* decode the check ending with the bary load at site, returns 0 if the
+   code does not have the expected shape */
+static ic_site *ic_parse(code_module *m, size_t site) {
+  const unsigned char *s, *p;
+  int len, rex = 0;
+
+  if (site < 9 || site + 32 > m->sz)
+    return 0;
+  s = (const unsigned char*)(m->base_addr + site - 9);
+  /* the five bytes have to be written by at most two aligned stores */
+  if ((unsigned long)s % 8 == 7)
+    return 0;
+  /* mov %gs:disp32, BID */
+  if (s[0] != 0x65 || (s[1] & 0xfb) != 0x48 || s[2] != 0x8b ||
+      (s[3] & 0xc7) != 0x04 || s[4] != 0x25)
+    return 0;
+  /* mov %gs:(T), TID */
+  p = s + 9;
+  if (p[0] != 0x65 || (p[1] & 0xf8) != 0x48 || p[2] != 0x8b ||
+      (p[3] >> 6) > 1 || ((p[3] >> 6) == 0 && (p[3] & 7) == 5))
+    return 0;
+  p += 4 + ((p[3] & 7) == 4) + ((p[3] >> 6) == 1);
+  /* cmp BID, TID */
+  if ((p[0] & 0xf8) != 0x48 || (p[1] != 0x39 && p[1] != 0x3b) ||
+      (p[2] & 0xc0) != 0xc0)
+    return 0;
+  p += 3;
+
+  ic_site *ic = malloc(sizeof(*ic));
+  if (!ic) oom();
+  memset(ic, 0, sizeof(*ic));
+  ic->m = m;
+  ic->addr = (unsigned long)s;
+  ic->jcc = p - s;
+  if (p[0] == 0x75) {
+    len = 2;
+    ic->check = (unsigned long)p + len + (signed char)p[1];
+  } else if (p[0] == 0x0f && p[1] == 0x85) {
+    len = 6;
+    ic->check = (unsigned long)p + len + *(const int*)(p + 2);
+  } else {
+    free(ic);
+    return 0;
+  }
+  p += len;
+  /* call/jmp *T, spilled registers are not handled */
+  ic->icj = p - s;
+  if (p[0] == 0x41) {
+    rex = 1;
+    ++p;
+  }
+  if (p[0] != 0xff || (p[1] & 0xc0) != 0xc0 ||
+      (((p[1] >> 3) & 7) != 2 && ((p[1] >> 3) & 7) != 4)) {
+    free(ic);
+    return 0;
+  }
+  ic->reg = (p[1] & 7) | (rex << 3);
+  memcpy(ic->orig, s, 5);
+  return ic;
+}
+
+/* rel32 from the end of a branch at end to to, FALSE if out of range */
+static int ic_rel32(unsigned long end, unsigned long to, unsigned char *p) {
+  long d = (long)to - (long)end;
+  if (d != (long)(int)d)
+    return FALSE;
+  *(int*)p = (int)d;
+  return TRUE;
+}
+
+/* build the stub of ic for target, returns 0 on failure */
+static unsigned long ic_build_stub(ic_site *ic, unsigned long target) {
+  unsigned char code[IC_STUB_SIZE];
+  unsigned long stub, icj = ic->addr + ic->icj;
+  int n = 0;
+
+  if (ic->stub && ic->stub_target == target)
+    return ic->stub;
+  if (!ic_area) {
+    ic_area = ic_map_area(IC_AREA_SIZE, &osb_ic_area);
+    if (!ic_area)
+      return 0;
+  }
+  if (ic_area_used + IC_STUB_SIZE > IC_AREA_SIZE)
+    return 0;
+  stub = ic_area + ic_area_used;
+
+  /* cmp $target, %eT */
+  if (ic->reg >= 8)
+    code[n++] = 0x41;
+  code[n++] = 0x81;
+  code[n++] = 0xf8 | (ic->reg & 7);
+  *(unsigned int*)(code + n) = (unsigned int)target;
+  n += 4;
+  /* je ICJ */
+  code[n++] = 0x0f;
+  code[n++] = 0x84;
+  n += 4;
+  if (!ic_rel32(stub + n, icj, code + n - 4))
+    return 0;
+  /* the original loads and comparison */
+  memcpy(code + n, (void*)ic->addr, ic->jcc);
+  n += ic->jcc;
+  /* jne Lcheck */
+  code[n++] = 0x0f;
+  code[n++] = 0x85;
+  n += 4;
+  if (!ic_rel32(stub + n, ic->check, code + n - 4))
+    return 0;
+  /* jmp ICJ */
+  code[n++] = 0xe9;
+  n += 4;
+  if (!ic_rel32(stub + n, icj, code + n - 4))
+    return 0;
+
+  memcpy((void*)(osb_ic_area + ic_area_used), code, n);
+  ic_area_used += IC_STUB_SIZE;
+  ic->stub = stub;
+  ic->stub_target = target;
+  return stub;
+}
+
+/* replace the first five bytes of the check of ic while other threads may
+   be executing it. Either they fit in an aligned quadword, or threads
+   reaching the check spin on a two-byte self jump meanwhile. */
+static void ic_write(ic_site *ic, const unsigned char *code) {
+  unsigned char *p = (unsigned char*)(ic->m->osb_base_addr +
+                                      (ic->addr - ic->m->base_addr));
+  unsigned long *w = (unsigned long*)((unsigned long)p & ~7UL);
+  if (p + 5 <= (unsigned char*)(w + 1)) {
+    unsigned long v = *w;
+    memcpy((unsigned char*)&v + (p - (unsigned char*)w), code, 5);
+    *(volatile unsigned long*)w = v;
+    return;
+  }
+  *(volatile unsigned short*)p = 0xfeeb;
+  ic_serialize();
+  memcpy(p + 2, code + 2, 3);
+  ic_serialize();
+  *(volatile unsigned short*)p = *(const unsigned short*)code;
+}
+
+static void ic_install(ic_site *ic, unsigned long target) {
+  unsigned char jmp[5];
+  unsigned long stub;
+
+  if (ic->target == target)
+    return;
+  if (ic->target) {
+    ic_write(ic, ic->orig);
+    ic->target = 0;
+  }
+  if (!target)
+    return;
+  stub = ic_build_stub(ic, target);
+  if (!stub)
+    return;
+  jmp[0] = 0xe9;
+  if (!ic_rel32(ic->addr + 5, stub, jmp + 1))
+    return;
+  ic_write(ic, jmp);
+  ic->target = target;
+}
+
+static void ic_count_targets(code_module *m, symbol *syms, dict *ids,
+                             void* (*mark)(void*),
+                             dict **single, dict **multi) {
+  symbol *sym;
+  DL_FOREACH(syms, sym) {
+    keyvalue *id = dict_find(ids, mark(sym->name));
+    if (!id)
+      continue;
+    void *target = (void*)(m->base_addr + sym->offset);
+    keyvalue *kv = dict_find(*single, id->value);
+    if (!kv)
+      dict_add(single, id->value, target);
+    else if (kv->value != target && !dict_find(*multi, id->value))
+      dict_add(multi, id->value, 0);
+  }
+}
+
+/* specialize the checks whose class has a single activated target and
+   revert those whose class no longer has */
+static void ic_update(char *table, code_module *modules,
+                      dict *callids, dict *retids) {
+  dict *single = 0, *multi = 0;
+  code_module *m;
+  symbol *s;
+
+  if (!INLINE_CACHE)
+    return;
+
+  DL_FOREACH(modules, m) {
+    if (!m->instrumented || !m->cfggened)
+      continue;
+    ic_count_targets(m, m->funcsyms, callids, _mark_func, &single, &multi);
+    ic_count_targets(m, m->rad, retids, _mark_ra_dc, &single, &multi);
+    ic_count_targets(m, m->rai, retids, _mark_ra_ic, &single, &multi);
+  }
+
+  DL_FOREACH(modules, m) {
+    if (!m->instrumented || !m->cfggened || m->code_heap)
+      continue;
+    DL_FOREACH(m->icfsyms, s) {
+      if (!s->site)
+        continue;
+      unsigned long addr = m->base_addr + s->site - 9;
+      keyvalue *kv = dict_find(ic_sites, (void*)addr);
+      if (!kv)
+        kv = dict_add(&ic_sites, (void*)addr, ic_parse(m, s->site));
+      ic_site *ic = kv->value;
+      if (!ic)
+        continue;
+
+      unsigned long target = 0;
+      unsigned long bid = *(unsigned long*)(table + s->offset);
+      keyvalue *t = dict_find(single, (void*)bid);
+      if ((bid & 1) && t && !dict_find(multi, (void*)bid) &&
+          (*(unsigned long*)(table + (unsigned long)t->value) & 1))
+        target = (unsigned long)t->value;
+      ic_install(ic, target);
+    }
+  }
+
+  dict_dtor(&single, 0, 0);
+  dict_dtor(&multi, 0, 0);
+}
+
+/* revert the sites whose stub jumps to [start, start + len), returns how
+   many were reverted */
+static unsigned int ic_revert(unsigned long start, size_t len) {
+  unsigned int n = 0;
+  keyvalue *kv, *tmp;
+  HASH_ITER(hh, ic_sites, kv, tmp) {
+    ic_site *ic = kv->value;
+    if (ic && ic->target >= start && ic->target < start + len) {
+      ic_install(ic, 0);
+      ++n;
+    }
+  }
+  return n;
+}
+
+#endif
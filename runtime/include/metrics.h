@@ -0,0 +1,78 @@
+/*
+ * Runtime counters, always on.
+ *
+ * The runtime keeps them in a shared memory segment, /dev/shm/mcfi-metrics.<pid>,
+ * created read-only for everybody else, which utils/mcfistat.py samples
+ * while the program runs. Updating a counter is a plain memory increment
+ * done under the runtime lock.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <def.h>
+
+/* offsets of the runtime lock counters, which runtime_interface.S updates */
+#define METRICS_LOCK_WAITS    0x30
+#define METRICS_LOCK_WAIT_TSC 0x38
+
+#define METRICS_MAGIC "MCFIMET1"
+#define METRICS_VERSION 2
+
+/* the layout is mirrored in utils/mcfistat.py */
+struct metrics {
+  char magic[8];
+  uint32_t version;
+  uint32_t pid;
+  /* tsc readings with the CLOCK_MONOTONIC nanoseconds taken along, at
+     start and at the last cfg generation, to scale the *_tsc counters */
+  uint64_t tsc0, ns0;
+  uint64_t tsc1, ns1;
+  /* contended acquisitions of the runtime lock and the cfg generation
+     lock, and the tsc ticks spent waiting for them */
+  uint64_t lock_waits;
+  uint64_t lock_wait_tsc;
+  uint64_t cfg_lock_waits;
+  uint64_t cfg_lock_wait_tsc;
+  /* online patching traps */
+  uint64_t call_traps;
+  uint64_t entry_traps;
+  uint64_t at_traps;
+  /* cfg generations */
+  uint64_t gen_cfgs;
+  uint64_t gen_cfg_ns;      /* in total */
+  uint64_t gen_cfg_ns_last;
+  uint64_t gen_cfg_ns_max;
+  /* equivalence classes of the last cfg */
+  uint64_t call_eqcs;
+  uint64_t ret_eqcs;
+  /* sandbox memory calls */
+  uint64_t mmaps;
+  uint64_t mmap_bytes;
+  uint64_t munmaps;
+  uint64_t munmap_bytes;
+  uint64_t mprotects;
+  /* loaded modules and code heaps, and the Bary and Tary bytes covering
+     them */
+  uint64_t modules;
+  uint64_t table_bytes;
+  /* PT_LOAD file bytes mapped from the file and copied by load_elf */
+  uint64_t load_mapped_bytes;
+  uint64_t load_copied_bytes;
+};
+
+typedef char metrics_lock_waits_offset
+[__builtin_offsetof(struct metrics, lock_waits) == METRICS_LOCK_WAITS ? 1 : -1];
+typedef char metrics_lock_wait_tsc_offset
+[__builtin_offsetof(struct metrics, lock_wait_tsc) == METRICS_LOCK_WAIT_TSC ? 1 : -1];
+
+/* set by metrics_init, to private memory if the segment cannot be made */
+extern struct metrics *metrics;
+
+void metrics_init(void);
+/* give a forked child its own segment */
+void metrics_fork_child(void);
+/* remove the segment's name at exit */
+void metrics_exit(void);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <def.h>
+
+/* symbol outputs for Linux perf, selected by the MCFI_PERF environment
+   variable */
+#define PERF_MAP     1 /* /tmp/perf-<pid>.map */
+#define PERF_JITDUMP 2 /* /tmp/jit-<pid>.dump, for perf inject --jit */
+
+extern int PERF_OUTPUT;
+
+/* function symbols of a module whose code was just loaded at base */
+void perf_module_loaded(char *elf, uintptr_t base, uintptr_t osb_base,
+                        size_t sz, int is_exe);
+
+/* drop the symbols of the module loaded at base, which is being unloaded */
+void perf_module_unloaded(uintptr_t base);
+
+/* jit code installed in, moved within and deleted from a code heap */
+void perf_code_load(uintptr_t addr, const void *code, size_t size);
+void perf_code_name(uintptr_t addr, const void *code, const char *name);
+void perf_code_move(uintptr_t target, uintptr_t source, size_t size);
+void perf_code_delete(uintptr_t addr, size_t size);
+
+/* write out the buffered records */
+void perf_flush(void);
+
+#endif
@@ -20,6 +20,8 @@
 #define SYS_unlink      87
 #define SYS_gettimeofday 96
 #define SYS_arch_prctl  158
+#define SYS_gettid      186
+#define SYS_clock_gettime 228
 #define SYS_exit_group  231
 
 #define ARCH_SET_GS 0x1001
@@ -8,6 +8,9 @@
 #include <def.h>
 
 #define STACK_SIZE 0x10000
+/* per-thread shadow stack of the -fmcfi-return=shadow modules, 16 bytes
+   per frame (return address, address of the return address slot) */
+#define SHADOW_STACK_SIZE 0x800000
 
 struct Context {
   unsigned long rax;                 /* 0x00 */
@@ -61,14 +64,23 @@ typedef struct TCB_t {
   /* application context */
   struct Context user_ctx;           /* 0x30 */
   unsigned long plt;                 /* 0x100 = 0x30 + 0xd0*/
-  /* How many indirect branches have been executed */
-#ifdef COLLECT_STAT
+  /* How many indirect branches have been executed, only counted
+     with COLLECT_STAT */
   unsigned long icj_count;           /* 0x108 */
-#endif
+  /* top of the shadow stack, as an offset from this tcb so that
+     instrumented code reaches it through %fs:(reg) */
+  unsigned long shadow_sp;           /* 0x110 */
+  /* sampling phase of -mprofile-iib-period code, whose indirect branches
+     add 2^32/period to it and count on the carry */
+  unsigned long iib_sample;          /* 0x118 */
   /* next tcb in the tcb list */
   struct TCB_t *next;
   /* this tcb is marked removed and should be reclaimed */
   int remove;
+  /* the shadow stack mapping */
+  void *shadow_stack;
+  /* the trace ring of this thread, mapped on its first event */
+  void *trace;
 } TCB;
 
 static TCB* thread_self(void) {
@@ -91,5 +103,6 @@ static bool thread_in_syscall(void) {
 
 TCB* alloc_tcb(void);
 void dealloc_tcb(TCB *);
+void alloc_shadow_stack(TCB *);
 void set_tcb_pointer(TCB *);
 #endif
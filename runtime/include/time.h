@@ -3,6 +3,8 @@
 
 #include <syscall.h>
 
+#define CLOCK_MONOTONIC 1
+
 struct timeval {
   time_t tv_sec;
   suseconds_t tv_usec;
@@ -12,18 +14,17 @@ static int gettimeofday(struct timeval *tv) {
   return __syscall2(SYS_gettimeofday, (long)tv, 0);
 }
 
-static  struct timeval tv1, tv2;
-
-#ifdef PROFILING
-#define start_timer(str) gettimeofday(&tv1);
-
-#define stop_timer(str) gettimeofday(&tv2);                             \
-  dprintf(STDERR_FILENO, "%s (us): %u\n", str,                          \
-          (tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec));
+/* nanoseconds of CLOCK_MONOTONIC, the clock of perf record -k mono */
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  __syscall2(SYS_clock_gettime, CLOCK_MONOTONIC, (long)&ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-#else
-#define start_timer(str)
-#define stop_timer(str)
-#endif
+static inline uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
 
 #endif
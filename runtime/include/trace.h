@@ -0,0 +1,98 @@
+/*
+ * Binary event trace of the runtime.
+ *
+ * With MCFI_TRACE=<prefix>, each thread appends fixed-size records to its
+ * own ring, a file <prefix>.<pid>.<tid> mapped shared into the runtime.
+ * Only the owning thread writes a ring, so recording takes no lock and no
+ * syscall; the kernel writes the pages back to the file in the background.
+ * utils/mcfitrace.py reads the rings back.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <def.h>
+
+#define TRACE_MAGIC "MCFITRC1"
+#define TRACE_VERSION 1
+/* bytes of a ring including its one-page header, a power of two */
+#define TRACE_RING_SIZE 0x400000
+/* the tsc/clock pair of a ring is refreshed every that many records */
+#define TRACE_SYNC_INTERVAL 4096
+
+/* event types, mirrored in utils/mcfitrace.py */
+enum Trace_Event {
+  TRACE_START = 0,         /* the application is about to run */
+  TRACE_END = 1,           /* the application exits */
+  TRACE_PHASE_BEGIN = 2,   /* a: Trace_Phase */
+  TRACE_PHASE_END = 3,     /* a: Trace_Phase */
+  TRACE_TRAP_CALL = 4,     /* b: patch point */
+  TRACE_TRAP_ENTRY = 5,    /* b: patch point */
+  TRACE_ACTIVATE_FUNC = 6, /* b: function address */
+  TRACE_ACTIVATE_VMTD = 7, /* b: virtual method address */
+  TRACE_ACTIVATE_LP = 8,   /* b: landing pad address */
+  TRACE_ACTIVATE_RET = 9,  /* b: return address */
+  TRACE_MMAP = 10,         /* a: prot, b: address, c: length */
+  TRACE_MUNMAP = 11,       /* b: address, c: length */
+  TRACE_MPROTECT = 12,     /* a: prot, b: address, c: length */
+  TRACE_JIT_FILL = 13,     /* a: flags, b: address, c: length */
+  TRACE_JIT_MOVE = 14,     /* b: target, c: source */
+  TRACE_JIT_DELETE = 15,   /* b: address, c: length */
+  TRACE_JIT_REG = 16,      /* a: metadata type, b: metadata, c: extra */
+  TRACE_METADATA = 17,     /* c: bytes of MCFI metadata processed */
+  TRACE_REPLAY = 18        /* b: sites replayed, c: sites skipped */
+};
+
+/* timed runtime phases, mirrored in utils/mcfitrace.py */
+enum Trace_Phase {
+  TRACE_PHASE_METADATA = 0,    /* processing the metadata of a module */
+  TRACE_PHASE_GEN_CFG = 1,
+  TRACE_PHASE_MERGE = 2,       /* merging the metadata of all modules */
+  TRACE_PHASE_CALL_GRAPH = 3,
+  TRACE_PHASE_CALL_EQC = 4,
+  TRACE_PHASE_RET_GRAPH = 5,
+  TRACE_PHASE_RET_EQC = 6,
+  TRACE_PHASE_ID_GEN = 7,      /* id generation and table filling */
+  TRACE_PHASE_REPLAY = 8,      /* activation profile replay */
+  TRACE_PHASE_FREEZE = 9
+};
+
+struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t capacity;       /* records in the ring */
+  volatile uint64_t head;  /* records ever written */
+  /* two tsc readings with the CLOCK_MONOTONIC nanoseconds taken along,
+     from which the reader scales the tsc */
+  uint64_t tsc0, ns0;
+  uint64_t tsc1, ns1;
+};
+
+struct trace_record {
+  uint64_t tsc;
+  uint32_t type;
+  uint32_t a;
+  uint64_t b;
+  uint64_t c;
+};
+
+extern const char *MCFI_TRACE;
+
+void trace_record(uint32_t type, uint32_t a, uint64_t b, uint64_t c);
+/* unmap the ring of a thread that is gone */
+void trace_close(void *ring);
+/* drop the parent's ring of the calling thread in a forked child */
+void trace_fork_child(void);
+
+static inline void trace(uint32_t type, uint32_t a, uint64_t b, uint64_t c) {
+  if (MCFI_TRACE)
+    trace_record(type, a, b, c);
+}
+
+#define trace_begin(phase) trace(TRACE_PHASE_BEGIN, phase, 0, 0)
+#define trace_end(phase) trace(TRACE_PHASE_END, phase, 0, 0)
+
+#endif
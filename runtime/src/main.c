@@ -9,6 +9,9 @@
 #include <cfggen/cfggen.h>
 #include "pager.h"
 #include <time.h>
+#include <perf.h>
+#include <trace.h>
+#include <metrics.h>
 
 #define MAX_PATH 256
 
@@ -41,6 +44,20 @@ int COMPAT_MODE = 0; /* compatibility mode */
 const char *MCFI_SDK = 0;
 const char *HOME = 0;
 const char MCFI_SDK_NAME[] = "MCFI_SDK";
+const char MCFI_ACTIVATION_NAME[] = "MCFI_ACTIVATION=";
+int ACTIVATION_GRANULARITY = ACTIVATE_SITE;
+const char MCFI_PROFILE_NAME[] = "MCFI_PROFILE=";
+const char MCFI_PROFILE_OUT_NAME[] = "MCFI_PROFILE_OUT=";
+const char *MCFI_PROFILE = 0;
+const char *MCFI_PROFILE_OUT = 0;
+const char MCFI_INLINE_CACHE_NAME[] = "MCFI_INLINE_CACHE=";
+int INLINE_CACHE = FALSE;
+const char MCFI_PERF_NAME[] = "MCFI_PERF=";
+int PERF_OUTPUT = 0;
+const char MCFI_TRACE_NAME[] = "MCFI_TRACE=";
+const char *MCFI_TRACE = 0;
+const char MCFI_IIB_OUT_NAME[] = "MCFI_IIB_OUT=";
+const char *MCFI_IIB_OUT = 0;
 
 
 #ifdef NOCFI
@@ -187,6 +204,12 @@ void install_trampolines(void) {
     void *move_code;
     void *patch_at;
     void *patch_entry;
+    void *freeze_cfg;
+    void *set_gotplt_batch;
+    void *take_addrs_and_gen_cfg;
+    void *load_native_code_batch;
+    void *set_vtable_slots;
+    void *vtable_region;
   } *tp = (struct trampolines*)(tramp_page);
   extern unsigned long runtime_rock_mmap;
   extern unsigned long runtime_rock_mprotect;
@@ -215,6 +238,12 @@ void install_trampolines(void) {
   extern unsigned long runtime_reg_cfg_metadata;
   extern unsigned long runtime_delete_code;
   extern unsigned long runtime_move_code;
+  extern unsigned long runtime_freeze_cfg;
+  extern unsigned long runtime_set_gotplt_batch;
+  extern unsigned long runtime_take_addrs_and_gen_cfg;
+  extern unsigned long runtime_load_native_code_batch;
+  extern unsigned long runtime_set_vtable_slots;
+  extern unsigned long runtime_vtable_region;
 
   tp->mmap = &runtime_rock_mmap;
   tp->mprotect = &runtime_rock_mprotect;
@@ -243,6 +272,12 @@ void install_trampolines(void) {
   tp->move_code = &runtime_move_code;
   tp->patch_at = &runtime_patch_at;
   tp->patch_entry = &runtime_patch_entry;
+  tp->freeze_cfg = &runtime_freeze_cfg;
+  tp->set_gotplt_batch = &runtime_set_gotplt_batch;
+  tp->take_addrs_and_gen_cfg = &runtime_take_addrs_and_gen_cfg;
+  tp->load_native_code_batch = &runtime_load_native_code_batch;
+  tp->set_vtable_slots = &runtime_set_vtable_slots;
+  tp->vtable_region = &runtime_vtable_region;
 
   /* set the first 68KB read-only */
   if (0 != mprotect(table,  BID_SLOT_START, PROT_READ)) {
@@ -450,6 +485,34 @@ static void extract_elf_load_data(int argc, char **argv) {
       MCFI_SDK = lt_envp[i] + strlen(MCFI_SDK_NAME) + 1;
     } else if (!strncmp(lt_envp[i], "HOME", 4)) {
       HOME = lt_envp[i] + 5;
+    } else if (!strncmp(lt_envp[i], MCFI_ACTIVATION_NAME,
+                        strlen(MCFI_ACTIVATION_NAME))) {
+      const char *g = lt_envp[i] + strlen(MCFI_ACTIVATION_NAME);
+      if (!strcmp(g, "function"))
+        ACTIVATION_GRANULARITY = ACTIVATE_FUNCTION;
+      else if (!strcmp(g, "page"))
+        ACTIVATION_GRANULARITY = ACTIVATE_PAGE;
+    } else if (!strncmp(lt_envp[i], MCFI_PROFILE_NAME,
+                        strlen(MCFI_PROFILE_NAME))) {
+      MCFI_PROFILE = lt_envp[i] + strlen(MCFI_PROFILE_NAME);
+    } else if (!strncmp(lt_envp[i], MCFI_PROFILE_OUT_NAME,
+                        strlen(MCFI_PROFILE_OUT_NAME))) {
+      MCFI_PROFILE_OUT = lt_envp[i] + strlen(MCFI_PROFILE_OUT_NAME);
+    } else if (!strncmp(lt_envp[i], MCFI_INLINE_CACHE_NAME,
+                        strlen(MCFI_INLINE_CACHE_NAME))) {
+      INLINE_CACHE = !strcmp(lt_envp[i] + strlen(MCFI_INLINE_CACHE_NAME), "1");
+    } else if (!strncmp(lt_envp[i], MCFI_PERF_NAME, strlen(MCFI_PERF_NAME))) {
+      const char *o = lt_envp[i] + strlen(MCFI_PERF_NAME);
+      if (!strcmp(o, "map"))
+        PERF_OUTPUT = PERF_MAP;
+      else if (!strcmp(o, "jitdump"))
+        PERF_OUTPUT = PERF_JITDUMP;
+      else if (!strcmp(o, "all"))
+        PERF_OUTPUT = PERF_MAP | PERF_JITDUMP;
+    } else if (!strncmp(lt_envp[i], MCFI_TRACE_NAME, strlen(MCFI_TRACE_NAME))) {
+      MCFI_TRACE = lt_envp[i] + strlen(MCFI_TRACE_NAME);
+    } else if (!strncmp(lt_envp[i], MCFI_IIB_OUT_NAME, strlen(MCFI_IIB_OUT_NAME))) {
+      MCFI_IIB_OUT = lt_envp[i] + strlen(MCFI_IIB_OUT_NAME);
     }
     lt_stack_size += (strlen(lt_envp[i]) + 1); /* each envp[i] length */
   }
@@ -497,6 +560,9 @@ static char *eat_hex_and_udscore(char *c) {
   return c;
 }
 
+/* whether a -mprofile-iib module has been loaded */
+static int iib_profiled = FALSE;
+
 unsigned int alloc_bid_slot(void) {
   /* the first page after the first 64KB pointed to by %gs is used for trampolines,
    * so the bid slots start from the second page.
@@ -504,13 +570,19 @@ unsigned int alloc_bid_slot(void) {
    */
   static unsigned int bid_slot = BID_SLOT_START;
   unsigned int rbid_slot = bid_slot;
+  if (iib_profiled && bid_slot >= IIB_COUNTERS_OFFSET) {
+    dprintf(STDERR_FILENO, "[alloc_bid_slot] too many indirect branches "
+            "for -mprofile-iib counters\n");
+    quit(-1);
+  }
   bid_slot += 8; /* 8 bytes */
+  metrics->table_bytes += 8;
   //dprintf(STDERR_FILENO, "%x\n", rbid_slot);
   return rbid_slot;
 }
 
 code_module *load_mcfi_metadata(char *elf, size_t sz) {
-  start_timer("Process MCFI Metadata");
+  trace_begin(TRACE_PHASE_METADATA);
   Elf64_Ehdr *ehdr = (Ehdr *)elf;
   Elf64_Shdr *shdr = (Elf64_Shdr *)(elf + ehdr->e_shoff);
   Elf64_Shdr *shstrtbl = &shdr[ehdr->e_shstrndx];
@@ -537,6 +609,7 @@ code_module *load_mcfi_metadata(char *elf, size_t sz) {
   dict *fats_in_data = 0;
   dict *ctor = 0;
   dict *vtable = 0;
+  graph *vtable_regions = 0;
   dict *flp = 0;
   code_module *cm = alloc_code_module();
 
@@ -592,6 +665,16 @@ code_module *load_mcfi_metadata(char *elf, size_t sz) {
                    &vtable, &stringpool);
       metadata_size += shdr[cnt].sh_size;
       cm->instrumented = 1;
+    } else if (0 == strcmp(shname, ".MCFIVtableRegions")) {
+      parse_vtable_regions(elf + shdr[cnt].sh_offset, /* content */
+                           elf + shdr[cnt].sh_offset + shdr[cnt].sh_size, /* size */
+                           &vtable_regions, &stringpool);
+      metadata_size += shdr[cnt].sh_size;
+      cm->instrumented = 1;
+    } else if (0 == strcmp(shname, ".MCFIShadowStack")) {
+      metadata_size += shdr[cnt].sh_size;
+      cm->instrumented = 1;
+      cm->shadow_stack = 1;
     } else if (0 == strcmp(shname, ".MCFIDtorCxaAtExit")) {
       // TODO: Add handling code here
       metadata_size += shdr[cnt].sh_size;
@@ -615,7 +698,32 @@ code_module *load_mcfi_metadata(char *elf, size_t sz) {
       //dprintf(STDERR_FILENO, ".got.plt = %x\n", shdr[cnt].sh_addr);
       cm->gotplt = shdr[cnt].sh_addr;
       cm->gotpltsz = RoundToPage(shdr[cnt].sh_size);
+    } else if (0 == strcmp(shname, "__mcfi_vtables")) {
+      cm->vtables = shdr[cnt].sh_addr;
+      cm->vtablessz = RoundToPage(shdr[cnt].sh_size);
+    } else if (0 == strcmp(shname, ".note.gnu.build-id")) {
+      Elf64_Nhdr *nhdr = (Elf64_Nhdr*)(elf + shdr[cnt].sh_offset);
+      if (nhdr->n_type == NT_GNU_BUILD_ID) {
+        /* the name "GNU\0" is padded to four bytes */
+        char *desc = (char*)(nhdr + 1) + ((nhdr->n_namesz + 3) & ~3);
+        cm->build_id_len = nhdr->n_descsz < BUILD_ID_MAX ?
+          nhdr->n_descsz : BUILD_ID_MAX;
+        memcpy(cm->build_id, desc, cm->build_id_len);
+      }
+    }
+  }
+
+  /* modules linked without --build-id are identified by the FNV-1a hash of
+     their file content before it is rewritten below */
+  if (!cm->build_id_len && (MCFI_PROFILE || MCFI_PROFILE_OUT || MCFI_IIB_OUT)) {
+    unsigned long h = 0xcbf29ce484222325UL;
+    size_t i;
+    for (i = 0; i < sz; i++) {
+      h ^= (unsigned char)elf[i];
+      h *= 0x100000001b3UL;
     }
+    memcpy(cm->build_id, &h, sizeof(h));
+    cm->build_id_len = sizeof(h);
   }
 
   if (ehdr->e_type == ET_EXEC) {
@@ -653,6 +761,7 @@ code_module *load_mcfi_metadata(char *elf, size_t sz) {
   merge_dicts(&(cm->fats), cm->fats_in_code);
   merge_dicts(&(cm->fats), cm->fats_in_data);
   cm->vtable = vtable;
+  cm->vtable_regions = vtable_regions;
   cm->sz = sz;
 
   graph *aliases_tc = g_transitive_closure(&aliases);
@@ -715,15 +824,29 @@ code_module *load_mcfi_metadata(char *elf, size_t sz) {
       symbol *icfsym = alloc_sym();
       icfsym->name = sp_intern_string(&stringpool, symname + 12);
       unsigned int bid_slot = alloc_bid_slot();
+      char *label = elf + sym[cnt].st_value - cm->base_addr;
+      char *addr = label;
+      size_t disp;
+      unsigned long period;
+      size_t counter = iib_counter((unsigned char*)addr, &disp, &period);
+      if (counter) {
+        if (bid_slot >= IIB_COUNTERS_OFFSET) {
+          dprintf(STDERR_FILENO, "[load_mcfi_metadata] too many indirect "
+                  "branches for -mprofile-iib counters\n");
+          quit(-1);
+        }
+        iib_profiled = TRUE;
+        unsigned int counter_addr = bid_slot + IIB_COUNTERS_OFFSET;
+        memcpy(addr + disp, &counter_addr, sizeof(counter_addr));
+        /* the checks follow the counter, which stays even with NOCFI */
+        addr += counter;
+      }
 #ifndef NOCFI
-      memcpy(elf + sym[cnt].st_value - cm->base_addr - sizeof(unsigned int),
-             &bid_slot,
-             sizeof(unsigned int));
+      memcpy(label - sizeof(unsigned int), &bid_slot, sizeof(unsigned int));
 #else
       /* replace the instrumentation with nop */
-      char *addr = elf + sym[cnt].st_value - cm->base_addr;
       /* 9-byte BID read */
-      memcpy(addr - 9, nine_byte_nop, 9);
+      memcpy(label - 9, nine_byte_nop, 9);
       /* 4/5 byte TID load, only need to check the possible sib byte */
       if (addr[4] == 0 || addr[4] == 0x24) {
         memcpy(addr, five_byte_nop, 5);
@@ -742,6 +865,7 @@ code_module *load_mcfi_metadata(char *elf, size_t sz) {
       }
 #endif
       icfsym->offset = bid_slot;
+      icfsym->site = sym[cnt].st_value - cm->base_addr;
       //dprintf(STDERR_FILENO, "icfsym: %s, %x, %x\n", icfsym->name, icfsym->offset,
       //        sym[cnt].st_value - cm->base_addr);
       DL_APPEND(cm->icfsyms, icfsym);
@@ -893,10 +1017,8 @@ code_module *load_mcfi_metadata(char *elf, size_t sz) {
     }
   }
 #endif
-  stop_timer("Processing MCFI Metadata");
-#ifdef PROFILING
-  dprintf(STDERR_FILENO, "Processed Metadata Size (bytes): %lu\n", metadata_size);
-#endif
+  trace_end(TRACE_PHASE_METADATA);
+  trace(TRACE_METADATA, 0, 0, metadata_size);
   return cm;
 }
 
@@ -935,6 +1057,7 @@ static void remove_trampoline_type(code_module *m) {
     g_add_vertex(&tramps, sp_intern_string(&stringpool, "trampoline_allocset_tcb"));
     g_add_vertex(&tramps, sp_intern_string(&stringpool, "trampoline_free_tcb"));
     g_add_vertex(&tramps, sp_intern_string(&stringpool, "trampoline_load_native_code"));
+    g_add_vertex(&tramps, sp_intern_string(&stringpool, "trampoline_load_native_code_batch"));
     g_add_vertex(&tramps, sp_intern_string(&stringpool, "trampoline_gen_cfg"));
   }
   DL_FOREACH(m->functions, f) {
@@ -943,6 +1066,7 @@ static void remove_trampoline_type(code_module *m) {
   }
 }
 
+extern void use_shadow_stacks(void);
 
 /* create a parallel mapping for insandbox base, and return the mapped
  * pages outside of the sandbox
@@ -991,22 +1115,187 @@ void *create_parallel_mapping(void *base,
   return osb_base;
 }
 
+/* map the file content of a non-code PT_LOAD segment from fd at curpage,
+ * copy-on-write, and zero-fill the rest of its sz bytes. Only code is
+ * patched by load_mcfi_metadata, so the file has what data segments need.
+ * Return FALSE if the segment is not page-aligned in the file.
+ */
+static int map_segment(int fd, uintptr_t curpage, size_t sz, Phdr *phdr) {
+  size_t lead = phdr->p_vaddr & (PAGE_SIZE-1);
+  size_t filesz = RoundToPage(lead + phdr->p_filesz);
+
+  if ((phdr->p_offset & (PAGE_SIZE-1)) != lead || phdr->p_filesz == 0)
+    return FALSE;
+  if (filesz > sz)
+    filesz = sz;
+  if (mmap((char*)curpage, filesz, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fd, phdr->p_offset - lead) !=
+      (char*)curpage) {
+    dprintf(STDERR_FILENO, "[map_segment] mmap failed with %d\n", errn);
+    quit(-1);
+  }
+  /* the rest of the last file page belongs to .bss */
+  if (phdr->p_memsz > phdr->p_filesz)
+    memset((char*)curpage + lead + phdr->p_filesz, 0,
+           filesz - lead - phdr->p_filesz);
+  if (sz > filesz &&
+      mmap((char*)curpage + filesz, sz - filesz, PROT_READ | PROT_WRITE,
+           MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0) !=
+      (char*)curpage + filesz) {
+    dprintf(STDERR_FILENO, "[map_segment] mmap failed for .bss\n");
+    quit(-1);
+  }
+  metrics->load_mapped_bytes += phdr->p_filesz;
+  return TRUE;
+}
+
+/* ask the kernel to read ahead what load_elf reads from the mapped file
+ * elf, i.e. every section but the empty and the debugging ones
+ */
+static void prefetch_elf(char *elf) {
+  Elf64_Ehdr *ehdr = (Ehdr *)elf;
+  Elf64_Shdr *shdr = (Elf64_Shdr *)(elf + ehdr->e_shoff);
+  char *shstrpool = elf + shdr[ehdr->e_shstrndx].sh_offset;
+  size_t cnt;
+
+  for (cnt = 0; cnt < ehdr->e_shnum; cnt++) {
+    if (shdr[cnt].sh_type == SHT_NOBITS || shdr[cnt].sh_size == 0 ||
+        0 == strncmp(shstrpool + shdr[cnt].sh_name, ".debug", 6))
+      continue;
+    uintptr_t start = CurPage(elf + shdr[cnt].sh_offset);
+    uintptr_t end = RoundToPage(elf + shdr[cnt].sh_offset + shdr[cnt].sh_size);
+    madvise((void*)start, end - start, MADV_WILLNEED);
+  }
+}
+
+/* __mcfi_vtables of cm is at vt, and at vaddr in elf, whose dynamic linker
+ * base is dso_base. The range checks of virtual calls trust its contents,
+ * so like .got.plt it is remapped with a parallel mapping that is read-only
+ * in the sandbox before any sandboxed code can reach it. The relative
+ * relocations in it are applied here. The symbolic ones are recorded, and
+ * the dynamic linker binds each of them once through set_vtable_slots.
+ */
+static void seal_vtables(code_module *cm, char *elf, char *vt,
+                         uintptr_t vaddr, unsigned long dso_base) {
+  Elf64_Ehdr *ehdr = (Ehdr *)elf;
+  Elf64_Shdr *shdr = (Elf64_Shdr *)(elf + ehdr->e_shoff);
+  char *shstrpool = elf + shdr[ehdr->e_shstrndx].sh_offset;
+  Elf64_Rela *reladyn = 0;
+  Elf64_Sym *dynsym = 0;
+  char *dynstr = 0;
+  size_t numreladyn = 0;
+  size_t cnt;
+
+  for (cnt = 0; cnt < ehdr->e_shnum; cnt++) {
+    char *shname = shstrpool + shdr[cnt].sh_name;
+    if (0 == strcmp(shname, ".rela.dyn")) {
+      reladyn = (Elf64_Rela*)(elf + shdr[cnt].sh_offset);
+      numreladyn = shdr[cnt].sh_size / sizeof(*reladyn);
+    } else if (0 == strcmp(shname, ".dynsym")) {
+      dynsym = (Elf64_Sym*)(elf + shdr[cnt].sh_offset);
+    } else if (0 == strcmp(shname, ".dynstr")) {
+      dynstr = elf + shdr[cnt].sh_offset;
+    }
+  }
+
+  void *vtables = malloc(cm->vtablessz);
+  if (!vtables) {
+    dprintf(STDERR_FILENO, "[load_elf] vtables malloc failed\n");
+    quit(-1);
+  }
+  memcpy(vtables, vt, cm->vtablessz);
+  if (0 != munmap(vt, cm->vtablessz)) {
+    dprintf(STDERR_FILENO, "[load_elf] __mcfi_vtables unmap failed with %d\n",
+            errn);
+    quit(-1);
+  }
+  char *osb_vt = create_parallel_mapping(vt, cm->vtablessz, PROT_READ);
+  memcpy(osb_vt, vtables, cm->vtablessz);
+  free(vtables);
+
+  for (cnt = 0; cnt < numreladyn; cnt++) {
+    Elf64_Rela *r = &reladyn[cnt];
+    if (r->r_offset < vaddr || r->r_offset >= vaddr + cm->vtablessz)
+      continue;
+    size_t off = r->r_offset - vaddr;
+    Elf64_Sym *rsym = &dynsym[ELF64_R_SYM(r->r_info)];
+    switch (ELF64_R_TYPE(r->r_info)) {
+    case R_X86_64_RELATIVE:
+      *(unsigned long*)(osb_vt + off) = dso_base + r->r_addend;
+      break;
+    case R_X86_64_64:
+      /* a function pointer, or e.g. the type info of a vtable */
+      dict_add(&(cm->vtslots), (void*)off,
+               ELF64_ST_TYPE(rsym->st_info) == STT_FUNC && !r->r_addend ?
+               sp_intern_string(&stringpool, dynstr + rsym->st_name) : 0);
+      break;
+    default:
+      dprintf(STDERR_FILENO, "[load_elf] relocation type %d in "
+              "__mcfi_vtables\n", (int)ELF64_R_TYPE(r->r_info));
+      quit(-1);
+    }
+  }
+  cm->vtables = (uintptr_t)vt;
+  cm->osb_vtables = (uintptr_t)osb_vt;
+}
+
+static void *load_mapped_elf(int fd, char *elf, size_t elf_size,
+                             int is_exe, char **entry);
+
 /* load elf from fd to base,
  * if base == 0, allocate a place to load
  * else, load at base.
  * Return the loaded base address
  */
 void *load_elf(int fd, int is_exe, char **entry) {
-  char *base = 0;
   size_t elf_size = 0;
   /* load elf in a separate position */
   char *elf = load_elf_content(fd, &elf_size);
-  close(fd);
+  return load_mapped_elf(fd, elf, elf_size, is_exe, entry);
+}
+
+/* load the libraries fds[0..n) and store their base addresses in bases.
+ * All of the files are mapped, and their reads started, before the first
+ * one is processed, so that the kernel reads them in parallel while their
+ * metadata is parsed one after the other.
+ */
+void load_elf_batch(const int *fds, size_t n, char **bases) {
+  size_t *elf_size = malloc(n * sizeof(*elf_size));
+  size_t i;
+
+  if (!elf_size) {
+    dprintf(STDERR_FILENO, "[load_elf_batch] malloc failed\n");
+    quit(-1);
+  }
+  for (i = 0; i < n; i++) {
+    bases[i] = load_elf_content(fds[i], &elf_size[i]);
+    prefetch_elf(bases[i]);
+  }
+  for (i = 0; i < n; i++)
+    bases[i] = load_mapped_elf(fds[i], bases[i], elf_size[i], FALSE, 0);
+  free(elf_size);
+}
+
+static void *load_mapped_elf(int fd, char *elf, size_t elf_size,
+                             int is_exe, char **entry) {
+  char *base = 0;
+  Ehdr *ehdr = (Ehdr*)elf;
   /* TODO:
    *
    * CHECK THE LOADED ELF FILE.
    * CHECK THE LOADED ELF FILE.
    */
+  if (elf_size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG)) {
+    dprintf(STDERR_FILENO, "[load_elf] not an ELF file\n");
+    quit(-1);
+  }
+  /* the loader only parses ELF64 x86_64 headers; x32 (ELFCLASS32) modules
+     would need a whole x32 toolchain, which MCFI does not have */
+  if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_X86_64) {
+    dprintf(STDERR_FILENO, "[load_elf] only ELF64 x86_64 modules are supported%s\n",
+            ehdr->e_ident[EI_CLASS] == ELFCLASS32 ? ", not x32" : "");
+    quit(-1);
+  }
   /* elf will be rewritten */
   code_module *cm = load_mcfi_metadata(elf, elf_size);
 
@@ -1014,6 +1303,10 @@ void *load_elf(int fd, int is_exe, char **entry) {
   if (!cm->instrumented)
     COMPAT_MODE = 1;
 
+  /* its returns pop the shadow stack of whichever thread runs them */
+  if (cm->shadow_stack)
+    use_shadow_stacks();
+
   remove_trampoline_type(cm);
   cm->is_exe = is_exe;
   DL_APPEND(modules, cm);
@@ -1061,12 +1354,12 @@ void *load_elf(int fd, int is_exe, char **entry) {
     if (phdr->p_type == PT_LOAD) {
       uintptr_t curpage = CurPage(base + VADDR(phdr->p_vaddr, is_exe));
       size_t sz = RoundToPage(base + VADDR(phdr->p_vaddr, is_exe) + phdr->p_memsz) - curpage;
-      char *content;
+      char *content = 0;
       if (_prot(phdr->p_flags) & PROT_EXEC) {
         content = create_parallel_mapping(base, sz, PROT_EXEC);
         cm->osb_base_addr = (uintptr_t)content;
         cm->sz = sz;
-      } else {
+      } else if (!map_segment(fd, curpage, sz, phdr)) {
         content = mmap((char*)curpage,
                        sz,
                        PROT_READ | PROT_WRITE,
@@ -1077,9 +1370,13 @@ void *load_elf(int fd, int is_exe, char **entry) {
           quit(-1);
         }
       }
-      /* copy the content of the ELF */
-      memcpy(content + (phdr->p_vaddr & (PAGE_SIZE-1)),
-             elf + phdr->p_offset, phdr->p_filesz);
+      /* copy the content of the ELF, i.e. the patched code and segments
+         that could not be mapped from the file */
+      if (content) {
+        memcpy(content + (phdr->p_vaddr & (PAGE_SIZE-1)),
+               elf + phdr->p_offset, phdr->p_filesz);
+        metrics->load_copied_bytes += phdr->p_filesz;
+      }
       VmmapAdd(&VM, curpage >> PAGESHIFT,
                sz >> PAGESHIFT,
                _prot(phdr->p_flags), _prot(phdr->p_flags),
@@ -1108,14 +1405,22 @@ void *load_elf(int fd, int is_exe, char **entry) {
   } else {
     cm->gotplt = (size_t)(base + VADDR(cm->gotplt, is_exe));
   }
+  if (cm->vtablessz)
+    seal_vtables(cm, elf, base + VADDR(cm->vtables, is_exe), cm->vtables,
+                 (unsigned long)base + VADDR(0, is_exe));
 #undef VADDR
   if (entry) {
     *entry = base + ((Ehdr*)elf)->e_entry;
     //dprintf(STDERR_FILENO, "Entry: %x\n", *entry);
   }
   cm->base_addr = (unsigned long)base;
+  cm->map_sz = phdr_vaddr_end - (is_exe ? X64ABIBASE : 0);
+  ++metrics->modules;
+  metrics->table_bytes += cm->sz;
+  perf_module_loaded(elf, cm->base_addr, cm->osb_base_addr, cm->sz, is_exe);
   /* release the elf file */
   munmap(elf, elf_size);
+  close(fd);
   return base;
 }
 
@@ -1161,6 +1466,9 @@ void* runtime_init(int argc, char **argv) {
   /* let's first collect some basic information of this ELF loading */
   extract_elf_load_data(argc, argv);
 
+  /* publish the runtime counters */
+  metrics_init();
+
   /* initialize the sandbox memory pager */
   if (!VmmapCtor(&VM)) {
     dprintf(STDERR_FILENO, "[runtime_init] memory pager init failed\n");
@@ -1194,12 +1502,6 @@ void* runtime_init(int argc, char **argv) {
   /* copy data from kernel-allocated stack to sandbox-stack */
   stack_init();
 
-#ifdef PROFILING
-  {
-    struct timeval tv;
-    gettimeofday(&tv);
-    dprintf(STDERR_FILENO, "[%lu:%lu] Program Started!\n", tv.tv_sec, tv.tv_usec);
-  }
-#endif
+  trace(TRACE_START, 0, 0, 0);
   return stack;
 }
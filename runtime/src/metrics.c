@@ -0,0 +1,82 @@
+#include <def.h>
+#include <syscall.h>
+#include <mm.h>
+#include <io.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <metrics.h>
+
+int snprintf(char *str, size_t size, const char *format, ...);
+
+#define METRICS_SIZE PAGE_SIZE
+
+struct metrics *metrics = 0;
+static struct metrics private_metrics;
+static char metrics_name[64];
+
+/* a fresh segment for this process, or 0 */
+static struct metrics *metrics_map(unsigned int pid) {
+  snprintf(metrics_name, sizeof(metrics_name), "/dev/shm/mcfi-metrics.%u", pid);
+  /* a stale segment of a dead process with the same pid */
+  unlink(metrics_name);
+  /* only the runtime writes, everyone else may read */
+  int fd = shm_open(metrics_name, O_RDWR | O_CREAT | O_EXCL, 0444);
+  if (fd == -1) {
+    dprintf(STDERR_FILENO, "[metrics_map] cannot create %s\n", metrics_name);
+    return 0;
+  }
+  if (0 != ftruncate(fd, METRICS_SIZE)) {
+    dprintf(STDERR_FILENO, "[metrics_map] ftruncate failed with %d\n", errn);
+    close(fd);
+    unlink(metrics_name);
+    return 0;
+  }
+  struct metrics *m = mmap(0, METRICS_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    dprintf(STDERR_FILENO, "[metrics_map] mmap failed with %d\n", errn);
+    unlink(metrics_name);
+    return 0;
+  }
+  return m;
+}
+
+static void metrics_publish(struct metrics *m, const struct metrics *from) {
+  unsigned int pid = __syscall0(SYS_getpid);
+  if (from)
+    *m = *from;
+  else
+    memset(m, 0, sizeof(*m));
+  memset(m->magic, 0, sizeof(m->magic));
+  m->version = METRICS_VERSION;
+  m->pid = pid;
+  m->tsc0 = m->tsc1 = rdtsc();
+  m->ns0 = m->ns1 = monotonic_ns();
+  /* readers check the magic last */
+  __asm__ __volatile__("" ::: "memory");
+  memcpy(m->magic, METRICS_MAGIC, sizeof(m->magic));
+  metrics = m;
+}
+
+void metrics_init(void) {
+  struct metrics *m = metrics_map(__syscall0(SYS_getpid));
+  metrics_publish(m ? m : &private_metrics, 0);
+}
+
+void metrics_fork_child(void) {
+  struct metrics *old = metrics;
+  struct metrics *m = metrics_map(__syscall0(SYS_getpid));
+  if (!m)
+    m = &private_metrics;
+  /* the child starts from the parent's counts */
+  metrics_publish(m, old);
+  if (old != &private_metrics)
+    munmap(old, METRICS_SIZE);
+}
+
+void metrics_exit(void) {
+  if (metrics != &private_metrics)
+    unlink(metrics_name);
+}
@@ -55,24 +55,31 @@ static struct {
 #define IS_MMAPPED(c) !((c)->csize & (C_INUSE))
 
 
-/* Synchronization tools */
+/* Synchronization tools. Most of the runtime runs under the global
+   runtime lock, but the cfg generation computes without it, so the
+   allocator has to protect itself. */
 
 static inline void lock(volatile int *lk)
 {
+  while (a_swap(lk, 1))
+    a_spin();
 }
 
 static inline void unlock(volatile int *lk)
 {
+  a_store(lk, 0);
 }
 
 static inline void lock_bin(int i)
 {
+  lock(mal.bins[i].lock);
   if (!mal.bins[i].head)
     mal.bins[i].head = mal.bins[i].tail = BIN_TO_CHUNK(i);
 }
 
 static inline void unlock_bin(int i)
 {
+  unlock(mal.bins[i].lock);
 }
 
 static int first_set(uint64_t x)
@@ -205,8 +212,7 @@ static int adjust_size(size_t *n)
 static void unbin(struct chunk *c, int i)
 {
   if (c->prev == c->next) {
-    mal.binmap &= ~(1ULL<<i);
-    //a_and_64(&mal.binmap, ~(1ULL<<i));
+    a_and_64(&mal.binmap, ~(1ULL<<i));
   }
   c->prev->next = c->next;
   c->next->prev = c->prev;
@@ -493,8 +499,7 @@ void free(void *p)
   self->prev->next = self;
 
   if (!(mal.binmap & 1ULL<<i)) {
-    mal.binmap |= 1ULL<<i;
-    //a_or_64(&mal.binmap, 1ULL<<i);
+    a_or_64(&mal.binmap, 1ULL<<i);
   }
   unlock_bin(i);
 }
@@ -0,0 +1,410 @@
+/**
+ * Symbols of sandboxed code for Linux perf.
+ *
+ * Module code lives in shm-backed parallel mappings and jit code in code
+ * heaps, so perf cannot symbolize either from the mapped files. With
+ * MCFI_PERF set, the runtime writes what it knows about the code:
+ *
+ *   map     - /tmp/perf-<pid>.map, one "start size name" line per function.
+ *             perf only applies it to anonymous memory, which leaves out
+ *             the shm-backed module code.
+ *   jitdump - /tmp/jit-<pid>.dump, a code load record per function and a
+ *             move record per move_code. Record with perf record -k mono,
+ *             then run perf inject --jit, which covers modules as well.
+ *   all     - both of them.
+ *
+ * Records are buffered and written out after each module load, when a
+ * buffer fills up and at exit.
+ */
+
+#include <def.h>
+#include <syscall.h>
+#include <mm.h>
+#include <io.h>
+#include <string.h>
+#include <elf.h>
+#include <time.h>
+#include <perf.h>
+#include <cfggen/cfggen.h>
+
+int snprintf(char *str, size_t size, const char *format, ...);
+
+#define PERF_BUF_SIZE 0x10000
+
+struct perf_file {
+  int fd;
+  size_t len;
+  char buf[PERF_BUF_SIZE];
+};
+
+static struct perf_file perf_map = {-1, 0};
+static struct perf_file perf_dump = {-1, 0};
+static int perf_opened = FALSE;
+static unsigned int perf_pid = 0;
+
+/* jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+   in the Linux source */
+#define JITDUMP_MAGIC   0x4A695444
+#define JITDUMP_VERSION 1
+#define EM_X86_64_MACH  62
+#define JIT_CODE_LOAD   0
+#define JIT_CODE_MOVE   1
+
+struct jitheader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct jr_prefix {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+struct jr_code_load {
+  struct jr_prefix p;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  /* followed by the nul-terminated name and the code */
+};
+
+struct jr_code_move {
+  struct jr_prefix p;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t old_code_addr;
+  uint64_t new_code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+/* jit code known to perf, keyed by its start address */
+struct jit_code {
+  size_t size;
+  uint64_t index;
+  const char *name; /* interned, or 0 for unnamed code */
+};
+
+static dict *jit_codes = 0;
+static uint64_t code_index = 0;
+
+/* the lines of a module in the map file, keyed by its base address */
+struct map_lines {
+  off_t start;
+  off_t end;
+};
+
+static dict *module_lines = 0;
+
+static void perf_write(struct perf_file *f, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t rc = write(f->fd, p, len);
+    if (rc <= 0) {
+      dprintf(STDERR_FILENO, "[perf_write] write failed with %d\n", errn);
+      close(f->fd);
+      f->fd = -1;
+      return;
+    }
+    p += rc;
+    len -= rc;
+  }
+}
+
+static void perf_buf_flush(struct perf_file *f) {
+  if (f->fd != -1 && f->len > 0)
+    perf_write(f, f->buf, f->len);
+  f->len = 0;
+}
+
+static void perf_append(struct perf_file *f, const void *data, size_t len) {
+  if (f->fd == -1)
+    return;
+  if (f->len + len > PERF_BUF_SIZE) {
+    perf_buf_flush(f);
+    if (len > PERF_BUF_SIZE) {
+      perf_write(f, data, len);
+      return;
+    }
+  }
+  memcpy(f->buf + f->len, data, len);
+  f->len += len;
+}
+
+static void perf_open(void) {
+  char path[64];
+  perf_opened = TRUE;
+  perf_pid = __syscall0(SYS_getpid);
+
+  if (PERF_OUTPUT & PERF_MAP) {
+    snprintf(path, sizeof(path), "/tmp/perf-%u.map", perf_pid);
+    /* read back when the lines of an unloaded module are dropped */
+    perf_map.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (perf_map.fd == -1)
+      dprintf(STDERR_FILENO, "[perf_open] cannot open %s\n", path);
+  }
+
+  if (PERF_OUTPUT & PERF_JITDUMP) {
+    snprintf(path, sizeof(path), "/tmp/jit-%u.dump", perf_pid);
+    perf_dump.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (perf_dump.fd == -1) {
+      dprintf(STDERR_FILENO, "[perf_open] cannot open %s\n", path);
+      return;
+    }
+    struct jitheader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = JITDUMP_MAGIC;
+    hdr.version = JITDUMP_VERSION;
+    hdr.total_size = sizeof(hdr);
+    hdr.elf_mach = EM_X86_64_MACH;
+    hdr.pid = perf_pid;
+    hdr.timestamp = monotonic_ns();
+    perf_write(&perf_dump, &hdr, sizeof(hdr));
+    /* perf record finds the dump file through an executable mapping of it */
+    if (perf_dump.fd != -1 &&
+        mmap(0, PAGE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+             perf_dump.fd, 0) == MAP_FAILED)
+      dprintf(STDERR_FILENO, "[perf_open] cannot map %s\n", path);
+  }
+}
+
+static void emit_code_load(uintptr_t addr, const void *code, size_t size,
+                           const char *name, uint64_t index) {
+  if (!perf_opened)
+    perf_open();
+
+  char namebuf[32];
+  if (!name) {
+    snprintf(namebuf, sizeof(namebuf), "jit_code_%lu", index);
+    name = namebuf;
+  }
+
+  if (perf_map.fd != -1) {
+    /* two 16 digit numbers and their separators */
+    char line[2 * 16 + 3];
+    int n = snprintf(line, sizeof(line), "%lx %lx ", addr, size);
+    perf_append(&perf_map, line, n);
+    perf_append(&perf_map, name, strlen(name));
+    perf_append(&perf_map, "\n", 1);
+  }
+
+  if (perf_dump.fd != -1) {
+    size_t namelen = strlen(name) + 1;
+    struct jr_code_load rec;
+    rec.p.id = JIT_CODE_LOAD;
+    rec.p.total_size = sizeof(rec) + namelen + size;
+    rec.p.timestamp = monotonic_ns();
+    rec.pid = perf_pid;
+    rec.tid = __syscall0(SYS_gettid);
+    rec.vma = addr;
+    rec.code_addr = addr;
+    rec.code_size = size;
+    rec.code_index = index;
+    perf_append(&perf_dump, &rec, sizeof(rec));
+    perf_append(&perf_dump, name, namelen);
+    perf_append(&perf_dump, code, size);
+  }
+}
+
+void perf_module_loaded(char *elf, uintptr_t base, uintptr_t osb_base,
+                        size_t sz, int is_exe) {
+  if (!PERF_OUTPUT)
+    return;
+  if (!perf_opened)
+    perf_open();
+  struct map_lines *ml = 0;
+  if (perf_map.fd != -1) {
+    ml = malloc(sizeof(*ml));
+    if (!ml) oom();
+    ml->start = lseek(perf_map.fd, 0, SEEK_CUR) + perf_map.len;
+  }
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr*)elf;
+  Elf64_Shdr *shdr = (Elf64_Shdr*)(elf + ehdr->e_shoff);
+  size_t cnt;
+  for (cnt = 0; cnt < ehdr->e_shnum; cnt++) {
+    if (shdr[cnt].sh_type != SHT_SYMTAB)
+      continue;
+    Elf64_Sym *sym = (Elf64_Sym*)(elf + shdr[cnt].sh_offset);
+    size_t numsym = shdr[cnt].sh_size / sizeof(*sym);
+    const char *strtab = elf + shdr[shdr[cnt].sh_link].sh_offset;
+    size_t i;
+    for (i = 0; i < numsym; i++) {
+      if (ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC ||
+          sym[i].st_shndx == SHN_UNDEF || sym[i].st_size == 0)
+        continue;
+      uintptr_t offset = sym[i].st_value - (is_exe ? base : 0);
+      if (offset + sym[i].st_size > sz)
+        continue;
+      /* the sandbox view may be execute-only, so read through the
+         parallel mapping */
+      emit_code_load(base + offset, (const void*)(osb_base + offset),
+                     sym[i].st_size, strtab + sym[i].st_name, code_index++);
+    }
+  }
+  perf_flush();
+  if (ml) {
+    ml->end = lseek(perf_map.fd, 0, SEEK_CUR);
+    dict_add(&module_lines, (void*)base, ml);
+  }
+}
+
+void perf_module_unloaded(uintptr_t base) {
+  if (!PERF_OUTPUT)
+    return;
+  keyvalue *kv = dict_find(module_lines, (void*)base);
+  if (!kv)
+    return;
+  struct map_lines *ml = kv->value;
+  HASH_DEL(module_lines, kv);
+  free_kv(kv);
+
+  /* perf reads the map file only after the run, so the module's lines are
+     cut out of it: the lines after them move up through the flushed
+     buffer. The jitdump has no unload record, but perf inject orders its
+     records by timestamp, so later loads at the same addresses win. */
+  perf_buf_flush(&perf_map);
+  off_t from = ml->end, to = ml->start;
+  ssize_t n;
+  while (perf_map.fd != -1 &&
+         lseek(perf_map.fd, from, SEEK_SET) == from &&
+         (n = read(perf_map.fd, perf_map.buf, PERF_BUF_SIZE)) > 0) {
+    lseek(perf_map.fd, to, SEEK_SET);
+    perf_write(&perf_map, perf_map.buf, n);
+    from += n;
+    to += n;
+  }
+  if (perf_map.fd != -1) {
+    ftruncate(perf_map.fd, to);
+    lseek(perf_map.fd, to, SEEK_SET);
+  }
+
+  keyvalue *tmp;
+  HASH_ITER(hh, module_lines, kv, tmp) {
+    struct map_lines *later = kv->value;
+    if (later->start >= ml->end) {
+      later->start -= ml->end - ml->start;
+      later->end -= ml->end - ml->start;
+    }
+  }
+  free(ml);
+}
+
+void perf_code_load(uintptr_t addr, const void *code, size_t size) {
+  if (!PERF_OUTPUT)
+    return;
+  struct jit_code *jc = malloc(sizeof(*jc));
+  if (!jc) oom();
+  jc->size = size;
+  jc->index = code_index++;
+  jc->name = 0;
+  perf_code_delete(addr, size);
+  dict_add(&jit_codes, (void*)addr, jc);
+  emit_code_load(addr, code, size, 0, jc->index);
+}
+
+void perf_code_name(uintptr_t addr, const void *code, const char *name) {
+  if (!PERF_OUTPUT)
+    return;
+  keyvalue *kv = dict_find(jit_codes, (void*)addr);
+  if (!kv) {
+    /* a function in the middle of a piece of code, which is rare enough
+       to look it up the slow way */
+    keyvalue *tmp;
+    HASH_ITER(hh, jit_codes, kv, tmp) {
+      uintptr_t start = (uintptr_t)kv->key;
+      if (addr > start &&
+          addr < start + ((struct jit_code*)kv->value)->size)
+        break;
+    }
+    if (!kv)
+      return;
+    struct jit_code *outer = kv->value;
+    size_t size = (uintptr_t)kv->key + outer->size - addr;
+    struct jit_code *jc = malloc(sizeof(*jc));
+    if (!jc) oom();
+    jc->size = size;
+    jc->index = code_index++;
+    jc->name = name;
+    dict_add(&jit_codes, (void*)addr, jc);
+    emit_code_load(addr, code, size, name, jc->index);
+    return;
+  }
+  struct jit_code *jc = kv->value;
+  jc->name = name;
+  /* a later load record of the same address supersedes the earlier one */
+  emit_code_load(addr, code, jc->size, name, jc->index);
+}
+
+void perf_code_move(uintptr_t target, uintptr_t source, size_t size) {
+  if (!PERF_OUTPUT)
+    return;
+  keyvalue *kv = dict_find(jit_codes, (void*)source);
+  if (!kv)
+    return;
+  struct jit_code *jc = kv->value;
+  HASH_DEL(jit_codes, kv);
+  free_kv(kv);
+  perf_code_delete(target, size);
+  dict_add(&jit_codes, (void*)target, jc);
+
+  if (perf_map.fd != -1) {
+    /* two 16 digit numbers, their separators and a 20 digit index */
+    char line[2 * 16 + 2 + sizeof("jit_code_") + 20];
+    int n = jc->name ?
+      snprintf(line, sizeof(line), "%lx %lx ", target, jc->size) :
+      snprintf(line, sizeof(line), "%lx %lx jit_code_%lu",
+               target, jc->size, jc->index);
+    perf_append(&perf_map, line, n);
+    if (jc->name)
+      perf_append(&perf_map, jc->name, strlen(jc->name));
+    perf_append(&perf_map, "\n", 1);
+  }
+
+  if (perf_dump.fd != -1) {
+    struct jr_code_move rec;
+    rec.p.id = JIT_CODE_MOVE;
+    rec.p.total_size = sizeof(rec);
+    rec.p.timestamp = monotonic_ns();
+    rec.pid = perf_pid;
+    rec.tid = __syscall0(SYS_gettid);
+    rec.vma = target;
+    rec.old_code_addr = source;
+    rec.new_code_addr = target;
+    rec.code_size = jc->size;
+    rec.code_index = jc->index;
+    perf_append(&perf_dump, &rec, sizeof(rec));
+  }
+}
+
+void perf_code_delete(uintptr_t addr, size_t size) {
+  if (!PERF_OUTPUT)
+    return;
+  /* jit code starts 8-byte aligned, so this costs as much as clearing the
+     tary entries of the deleted code. Samples taken before the deletion
+     stay attributed through the record timestamps. */
+  uintptr_t a;
+  for (a = addr & (-8); a < addr + size; a += 8) {
+    keyvalue *kv = dict_find(jit_codes, (void*)a);
+    if (kv) {
+      HASH_DEL(jit_codes, kv);
+      free(kv->value);
+      free_kv(kv);
+    }
+  }
+}
+
+void perf_flush(void) {
+  perf_buf_flush(&perf_map);
+  perf_buf_flush(&perf_dump);
+}
@@ -7,12 +7,26 @@
 #include <errno.h>
 #include "pager.h"
 #include <time.h>
+#include <atomic.h>
+#include <perf.h>
+#include <trace.h>
+#include <metrics.h>
 #include <cfggen/cfggen.h>
+#include <cfggen/icache.h>
+
+int snprintf(char *str, size_t size, const char *format, ...);
 
 static void* prog_brk = 0;
 static void* max_brk = 0;
 #define BRK_LEAP 0x800000
 
+/* upper bound of the .got.plt entries bound by one set_gotplt_batch */
+#define GOTPLT_BATCH_MAX 4096
+/* upper bound of the functions taken by one take_addrs_and_gen_cfg */
+#define TAKE_ADDR_BATCH_MAX 4096
+/* upper bound of the libraries loaded by one load_native_code_batch */
+#define LOAD_BATCH_MAX 64
+
 static TCB *tcb_list = 0;
 
 /* tracks which thread escapes the untrusted space for how many times */
@@ -38,6 +52,9 @@ extern str *stringpool;
 static dict *patch_compensate = 0;
 extern void *table; /* table region defined in main.c */
 extern struct Vmmap VM;
+extern void *create_parallel_mapping(void *base,
+                                     size_t size,
+                                     int prot);
 
 extern unsigned int alloc_bid_slot(void);
 
@@ -52,8 +69,25 @@ void set_tcb(unsigned long sb_tcb) {
   dict_add(&thread_escape_map, tcb, 0);
 }
 
+/* set once a -fmcfi-return=shadow module is loaded, from then on every
+   thread has a shadow stack */
+static int shadow_stacks = FALSE;
+
+void use_shadow_stacks(void) {
+  TCB *tcb;
+  if (shadow_stacks)
+    return;
+  shadow_stacks = TRUE;
+  alloc_shadow_stack(thread_self());
+  for (tcb = tcb_list; tcb; tcb = tcb->next)
+    if (!tcb->remove)
+      alloc_shadow_stack(tcb);
+}
+
 void* allocset_tcb(unsigned long sb_tcb) {
   TCB* tcb = alloc_tcb();
+  if (shadow_stacks)
+    alloc_shadow_stack(tcb);
   
   if (sb_tcb > FourGB) {
     report_error("[set_tcb] sandbox tcb is out of sandbox\n");
@@ -125,22 +159,147 @@ void free_tcb(void *user_tcb) {
 
 static graph *fats_in_code = 0;
 
-void patch_at(unsigned long patchpoint) {
-  //dprintf(STDERR_FILENO, "patched at %lx\n", patchpoint);
-  code_module *m;
-  int found = FALSE;
-  DL_FOREACH(modules, m) {
-    if (patchpoint >= m->base_addr &&
-        patchpoint < m->base_addr + m->sz) {
-      found = TRUE;
-      break;
+#ifndef NO_ONLINE_PATCHING
+/* functions that traps activated while generate_cfg ran without the
+   runtime lock, which it activates again in the tables it publishes */
+static int cfg_gen_unlocked = FALSE;
+static dict *unlocked_activations = 0;
+
+static void record_unlocked_activation(void *name) {
+  if (cfg_gen_unlocked && !dict_find(unlocked_activations, name))
+    dict_add(&unlocked_activations, name, 0);
+}
+#endif
+
+void qsort(void *base, size_t nel, size_t width,
+           int (*cmp)(const void *, const void *));
+
+/* sites activated along with the trapping one, reported by collect_stat */
+#if !defined(NO_ONLINE_PATCHING) || defined(COLLECT_STAT)
+static unsigned int batch_ra_activation_count = 0;
+static unsigned int batch_entry_activation_count = 0;
+#endif
+static unsigned int batch_at_activation_count = 0;
+
+#ifdef COLLECT_STAT
+static struct timeval first_trap, last_trap;
+
+/* remember when the first and the last online patching traps happen */
+static void record_trap(void) {
+  gettimeofday(&last_trap);
+  if (!first_trap.tv_sec && !first_trap.tv_usec)
+    first_trap = last_trap;
+}
+#endif
+
+static int cmp_offset(const void *a, const void *b) {
+  size_t x = *(const size_t*)a;
+  size_t y = *(const size_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* returns the batch that the code at offset of m belongs to */
+static void *batch_of(code_module *m, size_t offset) {
+  if (ACTIVATION_GRANULARITY == ACTIVATE_PAGE)
+    return (void*)(offset & ~(size_t)(PAGE_SIZE - 1));
+  /* the function whose entry is the closest one not above offset */
+  size_t lo = 0, hi = m->batch_funcs_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (m->batch_funcs[mid] <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo ? (void*)m->batch_funcs[lo - 1] : 0;
+}
+
+/**
+ * Groups the online patching sites of m by the activation granularity.
+ * Call sites and address-taking sites are keyed by the byte right before
+ * them, because their offsets point to the end of the patched instruction.
+ */
+static void build_activation_batches(code_module *m) {
+  keyvalue *kv, *tmp;
+  m->batched = TRUE;
+  if (ACTIVATION_GRANULARITY == ACTIVATE_FUNCTION) {
+    symbol *s;
+    size_t n = 0;
+    DL_COUNT(m->funcsyms, s, n);
+    if (n > 0) {
+      m->batch_funcs = malloc(n * sizeof(*(m->batch_funcs)));
+      if (!m->batch_funcs) oom();
+      DL_FOREACH(m->funcsyms, s)
+        m->batch_funcs[m->batch_funcs_count++] = s->offset;
+      qsort(m->batch_funcs, n, sizeof(*(m->batch_funcs)), cmp_offset);
+    }
+  }
+  /* a site whose eight bytes start at a patched function entry cannot be
+     restored before the entry, so it is left to its own trap */
+#ifndef NO_ONLINE_PATCHING
+  HASH_ITER(hh, m->ra_orig, kv, tmp) {
+    if (!dict_find(m->func_orig, (void*)((size_t)kv->key - 8)))
+      g_add_directed_edge(&(m->ra_batches),
+                          batch_of(m, (size_t)kv->key - 1), kv->key);
+  }
+  /* each function has only one entry, so entries are only batched by page */
+  if (ACTIVATION_GRANULARITY == ACTIVATE_PAGE) {
+    HASH_ITER(hh, m->func_orig, kv, tmp) {
+      g_add_directed_edge(&(m->entry_batches),
+                          batch_of(m, (size_t)kv->key), kv->key);
     }
   }
-  assert(found && patchpoint % 8 == 0);
-  patchpoint -= m->base_addr;
-  keyvalue *kv = dict_find(m->at_func, (void*)patchpoint);
+#endif
+  HASH_ITER(hh, m->at_func, kv, tmp) {
+    if (!dict_find(m->func_orig, (void*)((size_t)kv->key - 8)))
+      g_add_directed_edge(&(m->at_batches),
+                          batch_of(m, (size_t)kv->key - 1), kv->key);
+  }
+}
+
+/**
+ * Activates all sites in the batch of the code at offset of m except the
+ * trapped site itself and returns how many of them were activated.
+ */
+static unsigned int activate_batch(code_module *m, graph **batches,
+                                   size_t trapped, size_t offset,
+                                   int (*activate)(code_module *m, size_t offset)) {
+  unsigned int count = 0;
+  if (!m->batched)
+    build_activation_batches(m);
+  void *key = batch_of(m, offset);
+  vertex *v = dict_find(*batches, key);
+  if (v) {
+    vertex *site, *tmp;
+    HASH_ITER(hh, (graph*)(v->value), site, tmp) {
+      if ((size_t)site->key != trapped)
+        count += activate(m, (size_t)site->key);
+    }
+    g_del_vertex(batches, key);
+  }
+  return count;
+}
+
+/* Whether freeze_cfg has patched every site of the modules marked
+   activated, so that a trap from one of them only comes from a core that
+   still ran its unpatched code and has nothing left to patch. Loading
+   does not need to check it: a new module cannot run before its cfg is
+   generated, and that generation thaws the cfg. */
+static int cfg_frozen = FALSE;
+
+#ifndef NO_ONLINE_PATCHING
+static dict *patched_at = 0;
+#endif
+
+static int activate_at_site(code_module *m, size_t offset) {
+  keyvalue *kv = dict_find(m->at_func, (void*)offset);
   assert(kv);
 #ifndef NO_ONLINE_PATCHING
+  if (dict_find(patched_at, (void*)(m->base_addr + offset)))
+    return 0;
+  dict_add(&patched_at, (void*)(m->base_addr + offset), 0);
+  record_unlocked_activation(kv->value);
+
   vertex *v = dict_find(fats_in_code, kv->value);
   if (v) {
     vertex *tmp, *atsite;
@@ -156,14 +315,7 @@ void patch_at(unsigned long patchpoint) {
         //  dict_add(&patch_compensate, table + (unsigned long)atsite->key, 0);
         //}
         //dprintf(STDERR_FILENO, "Patch %x\n", (unsigned long)atsite->key);
-#ifdef PROFILING
-        {
-          struct timeval tv;
-          gettimeofday(&tv);
-          dprintf(STDERR_FILENO, "[%lu:%lu] Activated Function at 0x%x\n",
-                  tv.tv_sec, tv.tv_usec, (unsigned long)atsite->key);
-        }
-#endif
+        trace(TRACE_ACTIVATE_FUNC, 0, (unsigned long)atsite->key, 0);
 #ifdef COLLECT_STAT
         ++func_addr_activation_count;
 #endif
@@ -172,27 +324,22 @@ void patch_at(unsigned long patchpoint) {
     g_del_vertex(&fats_in_code, v->key);
   } /* else the address is also taken in data */
 #endif
-#ifdef COLLECT_STAT
-  ++at_patch_count;
-#endif
 
   /* the patch should be performed after the tary id is set valid */
-  char *p = (char*)(m->osb_base_addr + patchpoint - 8);
+  char *p = (char*)(m->osb_base_addr + offset - 8);
   char patch[8];
   memcpy(patch, p, 3);
   static const char fivebytenop[5] = {0x0f, 0x1f, 0x44, 0x00, 0x00};
   memcpy(patch+3, fivebytenop, 5);
   *(unsigned long*)p = *(unsigned long*)patch;
+  return 1;
 }
 
-static dict* vmtd = 0;
-
-void patch_entry(unsigned long patchpoint) {
-#ifndef NO_ONLINE_PATCHING
-  //dprintf(STDERR_FILENO, "patched entry %x\n", patchpoint);
+void patch_at(unsigned long patchpoint) {
+  ++metrics->at_traps;
+  //dprintf(STDERR_FILENO, "patched at %lx\n", patchpoint);
   code_module *m;
   int found = FALSE;
-
   DL_FOREACH(modules, m) {
     if (patchpoint >= m->base_addr &&
         patchpoint < m->base_addr + m->sz) {
@@ -201,9 +348,34 @@ void patch_entry(unsigned long patchpoint) {
     }
   }
   assert(found && patchpoint % 8 == 0);
+  if (cfg_frozen && m->activated)
+    return;
   patchpoint -= m->base_addr;
-  assert(cfggened);
-  keyvalue *kv_ctor = dict_find(m->ctor, (void*)patchpoint);
+  activate_at_site(m, patchpoint);
+#ifdef COLLECT_STAT
+  ++at_patch_count;
+  record_trap();
+#endif
+  if (ACTIVATION_GRANULARITY != ACTIVATE_SITE) {
+    batch_at_activation_count +=
+      activate_batch(m, &(m->at_batches), patchpoint,
+                     patchpoint - 1, activate_at_site);
+  }
+}
+
+static dict* vmtd = 0;
+
+#ifndef NO_ONLINE_PATCHING
+static dict *patched_entry = 0;
+
+static int activate_entry_site(code_module *m, size_t offset) {
+  /* a restored entry may have been patched again by a later call site
+     patch, so it must never be overwritten twice */
+  if (dict_find(patched_entry, (void*)(m->base_addr + offset)))
+    return 0;
+  dict_add(&patched_entry, (void*)(m->base_addr + offset), 0);
+
+  keyvalue *kv_ctor = dict_find(m->ctor, (void*)offset);
   if (kv_ctor) {
     //dprintf(STDERR_FILENO, "ctor: %s\n", kv_ctor->value);
     // kv_ctor->value is the actual constructor's demangled name
@@ -211,6 +383,7 @@ void patch_entry(unsigned long patchpoint) {
     if (kv_methods) {
       node *n;
       DL_FOREACH((node*)(kv_methods->value), n) {
+        record_unlocked_activation(n->val);
         // for each virtual method, we set its tary id to be valid
         keyvalue *kv_m = dict_find(vmtd, n->val);
         if (kv_m) {
@@ -222,14 +395,7 @@ void patch_entry(unsigned long patchpoint) {
 #ifdef COLLECT_STAT
               ++vmtd_activation_count;
 #endif
-#ifdef PROFILING
-              {
-                struct timeval tv;
-                gettimeofday(&tv);
-                dprintf(STDERR_FILENO, "[%lu:%lu] Activated Virtual Method at 0x%x\n",
-                        tv.tv_sec, tv.tv_usec, (unsigned long)v->key);
-              }
-#endif
+              trace(TRACE_ACTIVATE_VMTD, 0, (unsigned long)v->key, 0);
             }
           }
         }
@@ -239,7 +405,7 @@ void patch_entry(unsigned long patchpoint) {
       dict_del(&(m->vtable), kv_ctor->value);
     }
   }
-  keyvalue *kv_lp = dict_find(m->flp, (void*)patchpoint);
+  keyvalue *kv_lp = dict_find(m->flp, (void*)offset);
   if (kv_lp) {
     keyvalue *v, *tmp;
     HASH_ITER(hh, (dict*)(kv_lp->value), v, tmp) {
@@ -247,34 +413,27 @@ void patch_entry(unsigned long patchpoint) {
 #ifdef COLLECT_STAT
       ++lp_activation_count;
 #endif
-#ifdef PROFILING
-      {
-        struct timeval tv;
-        gettimeofday(&tv);
-        dprintf(STDERR_FILENO, "[%lu:%lu] Activated LandingPad at 0x%x\n",
-                tv.tv_sec, tv.tv_usec, (unsigned long)v->key + m->base_addr);
-      }
-#endif
+      trace(TRACE_ACTIVATE_LP, 0, (unsigned long)v->key + m->base_addr, 0);
     }
     g_del_vertex(&(m->flp), kv_lp->key);
   }
-#ifdef COLLECT_STAT
-  ++func_entry_patch_count;
-#endif
   // kv_methods->value is a list of virtual methods
-  keyvalue *kv = dict_find(m->func_orig, (void*)patchpoint);
+  keyvalue *kv = dict_find(m->func_orig, (void*)offset);
   assert(kv);
-  char *p = (char*)(m->osb_base_addr + patchpoint);
+  char *p = (char*)(m->osb_base_addr + offset);
   *(unsigned long*)p = (unsigned long)(kv->value);
-#endif
+  return 1;
 }
+#endif
 
-void patch_call(unsigned long patchpoint) {
+void patch_entry(unsigned long patchpoint) {
 #ifndef NO_ONLINE_PATCHING
-  //dprintf(STDERR_FILENO, "patched call %lx\n", patchpoint);
-  static dict* patched_ra = 0;
+  trace(TRACE_TRAP_ENTRY, 0, patchpoint, 0);
+  ++metrics->entry_traps;
+  //dprintf(STDERR_FILENO, "patched entry %x\n", patchpoint);
   code_module *m;
   int found = FALSE;
+
   DL_FOREACH(modules, m) {
     if (patchpoint >= m->base_addr &&
         patchpoint < m->base_addr + m->sz) {
@@ -282,28 +441,37 @@ void patch_call(unsigned long patchpoint) {
       break;
     }
   }
-  assert(found);
-  assert(patchpoint % 8 == 0 ||
-         (patchpoint + 3) % 8 == 0||
-         (patchpoint + 2) % 8 == 0);
+  assert(found && patchpoint % 8 == 0);
+  if (cfg_frozen && m->activated)
+    return;
+  patchpoint -= m->base_addr;
+  assert(cfggened);
+  activate_entry_site(m, patchpoint);
+#ifdef COLLECT_STAT
+  ++func_entry_patch_count;
+  record_trap();
+#endif
+  if (ACTIVATION_GRANULARITY == ACTIVATE_PAGE) {
+    batch_entry_activation_count +=
+      activate_batch(m, &(m->entry_batches), patchpoint,
+                     patchpoint, activate_entry_site);
+  }
+#endif
+}
 
+#ifndef NO_ONLINE_PATCHING
+static dict* patched_ra = 0;
+
+static int activate_ra_site(code_module *m, size_t offset) {
   /* Different CPU cores might cache the same unpatched
    * instructions. So any duplicated run will be a nop.
    */
-  if (dict_find(patched_ra, (void*)patchpoint))
-    return;
-
-  dict_add(&patched_ra, (void*)patchpoint, (void*)0);
+  if (dict_find(patched_ra, (void*)(m->base_addr + offset)))
+    return 0;
+  dict_add(&patched_ra, (void*)(m->base_addr + offset), (void*)0);
 
-#ifdef COLLECT_STAT
-  if (patchpoint % 8 == 0)
-    ++radc_patch_count;
-  else
-    ++raic_patch_count;
-#endif
-  patchpoint = (patchpoint + 7) / 8 * 8;
-  //dprintf(STDERR_FILENO, "%x, %x\n", m->base_addr, patchpoint - m->base_addr);
-  keyvalue *patch = dict_find(m->ra_orig, (const void*)(patchpoint - m->base_addr));
+  //dprintf(STDERR_FILENO, "%x, %x\n", m->base_addr, offset);
+  keyvalue *patch = dict_find(m->ra_orig, (const void*)offset);
   assert(patch);
   //dprintf(STDERR_FILENO, "%x, %x, %lx, %x\n",
   //        m->base_addr, patch->key, patch->value, patch_count);
@@ -318,14 +486,446 @@ void patch_call(unsigned long patchpoint) {
   unsigned long *p =
     (unsigned long*)(m->osb_base_addr + (unsigned long)patch->key - 8);
   *p = (unsigned long)patch->value;
-#ifdef PROFILING
-  {
-    struct timeval tv;
-    gettimeofday(&tv);
-    dprintf(STDERR_FILENO, "[%lu:%lu] Activated Return Address at 0x%x\n",
-            tv.tv_sec, tv.tv_usec, patchpoint);
+  trace(TRACE_ACTIVATE_RET, 0, m->base_addr + offset, 0);
+  return 1;
+}
+#endif
+
+void patch_call(unsigned long patchpoint) {
+#ifndef NO_ONLINE_PATCHING
+  trace(TRACE_TRAP_CALL, 0, patchpoint, 0);
+  ++metrics->call_traps;
+  //dprintf(STDERR_FILENO, "patched call %lx\n", patchpoint);
+  code_module *m;
+  int found = FALSE;
+  DL_FOREACH(modules, m) {
+    if (patchpoint >= m->base_addr &&
+        patchpoint < m->base_addr + m->sz) {
+      found = TRUE;
+      break;
+    }
   }
+  assert(found);
+  assert(patchpoint % 8 == 0 ||
+         (patchpoint + 3) % 8 == 0||
+         (patchpoint + 2) % 8 == 0);
+  if (cfg_frozen && m->activated)
+    return;
+
+  unsigned long ra = (patchpoint + 7) / 8 * 8 - m->base_addr;
+  if (!activate_ra_site(m, ra))
+    return;
+
+#ifdef COLLECT_STAT
+  if (patchpoint % 8 == 0)
+    ++radc_patch_count;
+  else
+    ++raic_patch_count;
+  record_trap();
 #endif
+  if (ACTIVATION_GRANULARITY != ACTIVATE_SITE) {
+    batch_ra_activation_count +=
+      activate_batch(m, &(m->ra_batches), ra,
+                     ra - 1, activate_ra_site);
+  }
+#endif
+}
+
+static int write_all(int fd, const void *buf, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, buf, size);
+    if (n <= 0)
+      return FALSE;
+    buf = (const char*)buf + n;
+    size -= n;
+  }
+  return TRUE;
+}
+
+#ifndef NO_ONLINE_PATCHING
+enum { SITE_ENTRY, SITE_RA, SITE_AT, SITE_KINDS };
+
+/**
+ * Activate the sites of m at the offsets sites[kind][0..counts[kind]).
+ * Entries go first, because restoring an entry re-arms the call site patch
+ * that shares its eight bytes. Offsets that are not sites of m are counted
+ * in *skipped. Returns how many sites were activated.
+ */
+static unsigned int activate_sites(code_module *m,
+                                   unsigned int *const sites[SITE_KINDS],
+                                   const unsigned int counts[SITE_KINDS],
+                                   unsigned int *skipped) {
+  unsigned int i, n = 0;
+  for (i = 0; i < counts[SITE_ENTRY]; i++) {
+    if (dict_find(m->func_orig, (void*)(size_t)sites[SITE_ENTRY][i]))
+      n += activate_entry_site(m, sites[SITE_ENTRY][i]);
+    else
+      ++*skipped;
+  }
+  for (i = 0; i < counts[SITE_RA]; i++) {
+    if (dict_find(m->ra_orig, (void*)(size_t)sites[SITE_RA][i]))
+      n += activate_ra_site(m, sites[SITE_RA][i]);
+    else
+      ++*skipped;
+  }
+  for (i = 0; i < counts[SITE_AT]; i++) {
+    if (dict_find(m->at_func, (void*)(size_t)sites[SITE_AT][i]))
+      n += activate_at_site(m, sites[SITE_AT][i]);
+    else
+      ++*skipped;
+  }
+  return n;
+}
+
+/* the offsets that are the keys of d, in a malloc'ed array */
+static unsigned int *site_offsets(dict *d, unsigned int *count) {
+  keyvalue *kv, *tmp;
+  unsigned int *offsets;
+  *count = HASH_COUNT(d);
+  offsets = malloc((*count ? *count : 1) * sizeof(*offsets));
+  if (!offsets) oom();
+  *count = 0;
+  HASH_ITER(hh, d, kv, tmp) {
+    offsets[(*count)++] = (unsigned int)(size_t)kv->key;
+  }
+  return offsets;
+}
+
+/**
+ * An activation profile records which online patching sites have been
+ * patched, so that a later run on the same modules can patch them right
+ * after its first CFG generation instead of trapping on each of them.
+ * The file is a profile_header followed by one profile_module record per
+ * module, each followed by its call site, address-taking site and function
+ * entry offsets.
+ */
+static const char PROFILE_MAGIC[8] = {'M', 'C', 'F', 'I', 'P', 'R', 'F', '1'};
+
+struct profile_header {
+  char magic[8];
+  unsigned int module_count;
+  unsigned int reserved;
+};
+
+struct profile_module {
+  unsigned char build_id[BUILD_ID_MAX];
+  unsigned int build_id_len;
+  unsigned int ra_count;
+  unsigned int at_count;
+  unsigned int entry_count;
+};
+
+static char *profile = 0;
+static size_t profile_size = 0;
+
+/* collect the offsets of m's sites in patched into offsets */
+static unsigned int profile_sites(code_module *m, dict *patched,
+                                  unsigned int *offsets) {
+  unsigned int n = 0;
+  keyvalue *kv, *tmp;
+  HASH_ITER(hh, patched, kv, tmp) {
+    uintptr_t addr = (uintptr_t)kv->key;
+    if (addr >= m->base_addr && addr < m->base_addr + m->sz) {
+      if (offsets)
+        offsets[n] = addr - m->base_addr;
+      ++n;
+    }
+  }
+  return n;
+}
+
+/* every process dumps into MCFI_PROFILE_OUT.<pid>, so that forked and
+   executed children do not clobber the profile of their parent */
+static void dump_profile(void) {
+  char path[256];
+  unsigned int pid = __syscall0(SYS_getpid);
+  snprintf(path, sizeof(path), "%s.%u", MCFI_PROFILE_OUT, pid);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    dprintf(STDERR_FILENO, "[dump_profile] cannot open %s\n", path);
+    return;
+  }
+  struct profile_header hdr;
+  code_module *m;
+  int ok;
+  memcpy(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic));
+  hdr.module_count = 0;
+  hdr.reserved = 0;
+  DL_FOREACH(modules, m) {
+    if (m->build_id_len && !m->code_heap && !m->deleted)
+      ++hdr.module_count;
+  }
+  ok = write_all(fd, &hdr, sizeof(hdr));
+  DL_FOREACH(modules, m) {
+    if (!ok)
+      break;
+    if (!m->build_id_len || m->code_heap || m->deleted)
+      continue;
+    struct profile_module pm;
+    memset(&pm, 0, sizeof(pm));
+    memcpy(pm.build_id, m->build_id, m->build_id_len);
+    pm.build_id_len = m->build_id_len;
+    pm.ra_count = profile_sites(m, patched_ra, 0);
+    pm.at_count = profile_sites(m, patched_at, 0);
+    pm.entry_count = profile_sites(m, patched_entry, 0);
+    size_t count = pm.ra_count + pm.at_count + pm.entry_count;
+    unsigned int *offsets = 0;
+    if (count > 0) {
+      offsets = malloc(count * sizeof(*offsets));
+      if (!offsets) oom();
+      profile_sites(m, patched_ra, offsets);
+      profile_sites(m, patched_at, offsets + pm.ra_count);
+      profile_sites(m, patched_entry, offsets + pm.ra_count + pm.at_count);
+    }
+    ok = write_all(fd, &pm, sizeof(pm)) &&
+      write_all(fd, offsets, count * sizeof(*offsets));
+    if (offsets)
+      free(offsets);
+  }
+  if (!ok)
+    dprintf(STDERR_FILENO, "[dump_profile] failed to write %s\n", path);
+  close(fd);
+}
+
+/* read the whole profile into memory, or return FALSE if it is invalid */
+static int load_profile(void) {
+  struct stat st;
+  int fd = open(MCFI_PROFILE, O_RDONLY, 0);
+  if (fd < 0) {
+    dprintf(STDERR_FILENO, "[load_profile] cannot open %s\n", MCFI_PROFILE);
+    return FALSE;
+  }
+  if (0 != fstat(fd, &st) || st.st_size < sizeof(struct profile_header)) {
+    close(fd);
+    dprintf(STDERR_FILENO, "[load_profile] %s is not a profile\n", MCFI_PROFILE);
+    return FALSE;
+  }
+  profile_size = st.st_size;
+  profile = malloc(profile_size);
+  if (!profile) oom();
+  size_t got = 0;
+  while (got < profile_size) {
+    ssize_t n = read(fd, profile + got, profile_size - got);
+    if (n <= 0)
+      break;
+    got += n;
+  }
+  close(fd);
+  if (got != profile_size ||
+      memcmp(((struct profile_header*)profile)->magic, PROFILE_MAGIC,
+             sizeof(PROFILE_MAGIC))) {
+    dprintf(STDERR_FILENO, "[load_profile] %s is not a profile\n", MCFI_PROFILE);
+    free(profile);
+    profile = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* find the profile record of m, whose build id must match exactly */
+static struct profile_module *find_profile_module(code_module *m) {
+  struct profile_header *hdr = (struct profile_header*)profile;
+  size_t pos = sizeof(*hdr);
+  unsigned int i;
+  for (i = 0; i < hdr->module_count; i++) {
+    if (pos + sizeof(struct profile_module) > profile_size)
+      break;
+    struct profile_module *pm = (struct profile_module*)(profile + pos);
+    size_t count = (size_t)pm->ra_count + pm->at_count + pm->entry_count;
+    pos += sizeof(*pm);
+    if (count > (profile_size - pos) / sizeof(unsigned int))
+      break; /* truncated record */
+    pos += count * sizeof(unsigned int);
+    if (pm->build_id_len == m->build_id_len &&
+        !memcmp(pm->build_id, m->build_id, m->build_id_len))
+      return pm;
+  }
+  return 0;
+}
+
+/**
+ * Patch every site recorded in the profile for modules whose cfg has been
+ * generated. Offsets that are not patching sites of the module are skipped,
+ * so a stale profile can never restore arbitrary code bytes.
+ */
+static void replay_profile(void) {
+  static int loaded = FALSE;
+  if (!loaded) {
+    loaded = TRUE;
+    if (!load_profile())
+      return;
+  }
+  if (!profile)
+    return;
+  code_module *m;
+  DL_FOREACH(modules, m) {
+    if (m->replayed || !m->cfggened || !m->build_id_len)
+      continue;
+    m->replayed = TRUE;
+    struct profile_module *pm = find_profile_module(m);
+    if (!pm)
+      continue;
+    unsigned int *sites[SITE_KINDS], counts[SITE_KINDS];
+    unsigned int n, skipped = 0;
+    sites[SITE_RA] = (unsigned int*)(pm + 1);
+    sites[SITE_AT] = sites[SITE_RA] + pm->ra_count;
+    sites[SITE_ENTRY] = sites[SITE_AT] + pm->at_count;
+    counts[SITE_RA] = pm->ra_count;
+    counts[SITE_AT] = pm->at_count;
+    counts[SITE_ENTRY] = pm->entry_count;
+    n = activate_sites(m, sites, counts, &skipped);
+    trace(TRACE_REPLAY, 0, n, skipped);
+  }
+}
+#endif
+
+/**
+ * The per-branch counts of -mprofile-iib code, which utils/iibprof.py maps
+ * back to functions. The file is an iib_header followed by one iib_module
+ * record per module, each followed by the iib_site records of its profiled
+ * indirect branches. Counts of sampled branches are not scaled up.
+ */
+static const char IIB_MAGIC[8] = {'M', 'C', 'F', 'I', 'I', 'I', 'B', '1'};
+
+struct iib_header {
+  char magic[8];
+  unsigned int module_count;
+  unsigned int reserved;
+};
+
+struct iib_module {
+  unsigned char build_id[BUILD_ID_MAX];
+  unsigned int build_id_len;
+  unsigned int site_count;
+};
+
+struct iib_site {
+  unsigned int site;   /* offset of the __mcfi_bary_ label in the module */
+  unsigned int period;
+  unsigned long count;
+};
+
+/* collect the profiled sites of m into sites */
+static unsigned int iib_sites(code_module *m, struct iib_site *sites) {
+  unsigned int n = 0;
+  symbol *s;
+  DL_FOREACH(m->icfsyms, s) {
+    size_t disp;
+    unsigned long period;
+    if (s->site + 22 > m->sz ||
+        !iib_counter((unsigned char*)(m->base_addr + s->site), &disp, &period))
+      continue;
+    if (sites) {
+      sites[n].site = s->site;
+      sites[n].period = period;
+      sites[n].count = *(unsigned long*)(table + s->offset + IIB_COUNTERS_OFFSET);
+    }
+    ++n;
+  }
+  return n;
+}
+
+static void dump_iib_counts(void) {
+  int fd = open(MCFI_IIB_OUT, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    dprintf(STDERR_FILENO, "[dump_iib_counts] cannot open %s\n", MCFI_IIB_OUT);
+    return;
+  }
+  struct iib_header hdr;
+  code_module *m;
+  int ok;
+  memcpy(hdr.magic, IIB_MAGIC, sizeof(hdr.magic));
+  hdr.module_count = 0;
+  hdr.reserved = 0;
+  DL_FOREACH(modules, m) {
+    if (m->build_id_len && !m->code_heap && !m->deleted)
+      ++hdr.module_count;
+  }
+  ok = write_all(fd, &hdr, sizeof(hdr));
+  DL_FOREACH(modules, m) {
+    if (!ok)
+      break;
+    if (!m->build_id_len || m->code_heap || m->deleted)
+      continue;
+    struct iib_module im;
+    memset(&im, 0, sizeof(im));
+    memcpy(im.build_id, m->build_id, m->build_id_len);
+    im.build_id_len = m->build_id_len;
+    im.site_count = iib_sites(m, 0);
+    struct iib_site *sites = 0;
+    if (im.site_count > 0) {
+      sites = malloc(im.site_count * sizeof(*sites));
+      if (!sites) oom();
+      iib_sites(m, sites);
+    }
+    ok = write_all(fd, &im, sizeof(im)) &&
+      write_all(fd, sites, im.site_count * sizeof(*sites));
+    if (sites)
+      free(sites);
+  }
+  if (!ok)
+    dprintf(STDERR_FILENO, "[dump_iib_counts] failed to write %s\n", MCFI_IIB_OUT);
+  close(fd);
+}
+
+/* set the valid bit of every tary entry that has an id */
+static unsigned int activate_tary_entries(code_module *m, symbol *syms) {
+  unsigned int n = 0;
+  symbol *sym;
+  DL_FOREACH(syms, sym) {
+    unsigned long *ptid = (unsigned long*)(table + m->base_addr + sym->offset);
+    if (*ptid && !(*ptid & 1)) {
+      *ptid |= 1;
+      ++n;
+    }
+  }
+  return n;
+}
+
+/**
+ * Called by the application once its initialization is complete. All
+ * statically valid targets of the loaded modules are activated and all of
+ * their online patching sites are patched, so no more traps are taken.
+ * The next cfg generation, e.g., for a dlopen, thaws the cfg, and modules
+ * loaded afterwards are patched online as usual.
+ * Returns how many targets and sites were activated.
+ */
+int freeze_cfg(void) {
+#ifdef NOCFI
+  return 0;
+#else
+  unsigned int n = 0;
+  code_module *m;
+  /* before the first cfg generation there are no ids to activate */
+  if (cfg_frozen || !cfggened)
+    return 0;
+  trace_begin(TRACE_PHASE_FREEZE);
+  DL_FOREACH(modules, m) {
+    if (m->deleted || !m->cfggened)
+      continue;
+#ifndef NO_ONLINE_PATCHING
+    unsigned int *sites[SITE_KINDS], counts[SITE_KINDS], skipped = 0, k;
+    sites[SITE_ENTRY] = site_offsets(m->func_orig, &counts[SITE_ENTRY]);
+    sites[SITE_RA] = site_offsets(m->ra_orig, &counts[SITE_RA]);
+    sites[SITE_AT] = site_offsets(m->at_func, &counts[SITE_AT]);
+    n += activate_sites(m, sites, counts, &skipped);
+    for (k = 0; k < SITE_KINDS; k++)
+      free(sites[k]);
+#else
+    keyvalue *kv, *tmp;
+    HASH_ITER(hh, m->at_func, kv, tmp) {
+      n += activate_at_site(m, (size_t)kv->key);
+    }
+#endif
+    n += activate_tary_entries(m, m->funcsyms);
+    n += activate_tary_entries(m, m->rad);
+    n += activate_tary_entries(m, m->rai);
+    /* later cfg generations keep all targets of this module active */
+    m->activated = TRUE;
+  }
+  cfg_frozen = TRUE;
+  trace_end(TRACE_PHASE_FREEZE);
+  return n;
 #endif
 }
 
@@ -447,7 +1047,30 @@ static int range_overlap(uintptr_t r1, size_t len1,
   return FALSE;
 }
 
+/* the range checks of virtual calls trust the contents of the vtable
+   regions, which may not be remapped, unmapped or made writable */
+static int insecure_overlap_vtables(uintptr_t start, size_t len) {
+  code_module *m;
+  DL_FOREACH(modules, m) {
+    if (m->vtablessz &&
+        range_overlap(start, len, m->vtables, m->vtablessz))
+      return TRUE;
+  }
+  return FALSE;
+}
+
 static int insecure_overlap_rdonly(uintptr_t start, size_t len, int prot) {
+  /* the inline cache stubs may not be remapped with any protection */
+  if (ic_area && range_overlap(start, len, ic_area, IC_AREA_SIZE)) {
+    dprintf(STDERR_FILENO, "[insecure_overlap_rdonly] 0x%x, 0x%x, %d, 0x%lx\n",
+            start, len, prot, thread_self()->continuation);
+    return TRUE;
+  }
+  if (insecure_overlap_vtables(start, len)) {
+    dprintf(STDERR_FILENO, "[insecure_overlap_rdonly] 0x%x, 0x%x, %d, 0x%lx\n",
+            start, len, prot, thread_self()->continuation);
+    return TRUE;
+  }
   if (prot & PROT_WRITE) {
     code_module *m;
     DL_FOREACH(modules, m) {
@@ -476,6 +1099,10 @@ void *rock_mmap(void *start, size_t len, int prot, int flags, int fd, off_t off)
   uintptr_t page = 0;
   size_t pages = RoundToPage(len) >> PAGESHIFT;
 
+  trace(TRACE_MMAP, prot, (uintptr_t)start, len);
+  ++metrics->mmaps;
+  metrics->mmap_bytes += len;
+
   if ((unsigned long)start & ((1<<PAGESHIFT)-1)) {
     return (void*)-EINVAL;
   }
@@ -550,6 +1177,8 @@ void *rock_mmap(void *start, size_t len, int prot, int flags, int fd, off_t off)
 }
 
 int rock_mprotect(void *addr, size_t len, int prot) {
+  trace(TRACE_MPROTECT, prot, (uintptr_t)addr, len);
+  ++metrics->mprotects;
   if ((unsigned long) addr > FourGB || len > FourGB || (prot & PROT_EXEC)) {
     dprintf(STDERR_FILENO, "[rock_mprotect] mprotect(%lx, %lx, %d) is insecure!\n",
             (size_t)addr, len, prot);
@@ -563,6 +1192,9 @@ int rock_mprotect(void *addr, size_t len, int prot) {
 }
 
 int rock_munmap(void *start, size_t len) {
+  trace(TRACE_MUNMAP, 0, (uintptr_t)start, len);
+  ++metrics->munmaps;
+  metrics->munmap_bytes += len;
   /* return munmap(start, len); */
   if ((unsigned long)start > FourGB ||
       (unsigned long)len > FourGB ||
@@ -571,6 +1203,11 @@ int rock_munmap(void *start, size_t len) {
             (size_t)start, len);
     quit(-1);
   }
+  if (insecure_overlap_vtables((uintptr_t)start, len)) {
+    dprintf(STDERR_FILENO, "[rock_munmap] munmap(%lx, %lx) overlaps vtables\n",
+            (size_t)start, len);
+    quit(-1);
+  }
 
   int rv = munmap(start, len);
   if(!rv) {
@@ -632,8 +1269,54 @@ void *load_native_code(int fd) {
   return load_elf(fd, FALSE, 0);
 }
 
+void load_elf_batch(const int *fds, size_t n, char **bases);
+
+/* quit unless [addr, addr + len) is writable sandbox memory */
+static void check_writable(uintptr_t addr, size_t len, const char *who) {
+  uintptr_t page;
+  for (page = addr >> PAGESHIFT;
+       len && page <= (addr + len - 1) >> PAGESHIFT;
+       page++) {
+    struct VmmapEntry const *e = VmmapFindPage(&VM, page);
+    if (!e || !(e->prot & PROT_WRITE)) {
+      dprintf(STDERR_FILENO, "[%s] %lx is not writable\n", who, addr);
+      quit(-1);
+    }
+  }
+}
+
+/* load n libraries in one escape. slots holds their file descriptors,
+   which are replaced with the base addresses the libraries are loaded at. */
+void load_native_code_batch(unsigned long slots, unsigned long n) {
+  if (n > LOAD_BATCH_MAX || slots % sizeof(unsigned long) != 0 ||
+      slots >= FourGB || slots + n * sizeof(unsigned long) > FourGB) {
+    dprintf(STDERR_FILENO, "[load_native_code_batch] illegal batch %lx, %lu\n",
+            slots, n);
+    quit(-1);
+  }
+  /* the base addresses are written back, so the slots must be writable
+     sandbox memory */
+  check_writable(slots, n * sizeof(unsigned long), "load_native_code_batch");
+  volatile unsigned long *pv = (volatile unsigned long*)slots;
+  int fds[LOAD_BATCH_MAX];
+  char *bases[LOAD_BATCH_MAX];
+  unsigned long i;
+  /* the sandbox may still change the slots, so read each of them once */
+  for (i = 0; i < n; i++)
+    fds[i] = (int)pv[i];
+  load_elf_batch(fds, n, bases);
+  for (i = 0; i < n; i++)
+    pv[i] = (unsigned long)bases[i];
+}
+
 static unsigned long version = 1;
 
+/* ids of the current cfg, kept so that a newly taken function address
+   can be accounted for without rebuilding the graphs */
+static dict *cur_callids = 0;
+static dict *cur_retids = 0;
+static unsigned long cur_id_for_others = 0;
+
 static void print_cfgcc(void *cc) {
   vertex *v, *tmp;
   HASH_ITER(hh, (vertex*)cc, v, tmp) {
@@ -681,72 +1364,8 @@ static int safe(void) {
   return TRUE;
 }
 
-static void compute_fic(dict **fats_in_code,
-                        dict **fats_in_data,
-                        graph *aliases_tc) {
-#define ADD(fats, v) do {                               \
-    if (dict_find(fats, v->key)) {                      \
-      vertex *a, *atmp;                                 \
-      HASH_ITER(hh, (graph*)(v->value), a, atmp) {      \
-        dict_add(&fats, a->key, 0);                     \
-      }                                                 \
-    }                                                   \
-  } while (0);
-  keyvalue *v, *tmp;
-  HASH_ITER(hh, aliases_tc, v, tmp) {
-    ADD(*fats_in_code, v);
-    ADD(*fats_in_data, v);
-  }
-#undef ADD
-  /* for any function whose address is taken in data, remove
-     its name from the set where each function's address is taken in code*/
-  HASH_ITER(hh, *fats_in_code, v, tmp) {
-    if (dict_find(*fats_in_data, v->key)) {
-      HASH_DEL(*fats_in_code, v);
-      free(v);
-    }
-  }
-}
-
 extern dict *vtabletaken;
 
-static dict *get_all_vmtd(dict *vtable, dict *defined_ctors) {
-  dict *all_vmtd = 0;
-  keyvalue *kv, *tmp;
-  HASH_ITER(hh, vtable, kv, tmp) {
-    node *n;
-    if (!dict_find(vtabletaken, kv->key) &&
-        dict_find(defined_ctors, kv->key)) {
-      //dprintf(STDERR_FILENO, "%s\n", kv->key);
-      DL_FOREACH((node*)kv->value, n) {
-        if (!dict_find(all_vmtd, n->val))
-          dict_add(&all_vmtd, n->val, 0);
-      }
-    }
-  }
-  return all_vmtd;
-}
-
-static void compute_tc_vmtd(dict **vmtd,
-                            dict *defined_ctors,
-                            graph *aliases_tc) {
-  code_module *m;
-
-  DL_FOREACH(modules, m) {
-    merge_dicts(vmtd, get_all_vmtd(m->vtable, defined_ctors));
-  }
-
-  keyvalue *v, *tmp;
-  HASH_ITER(hh, aliases_tc, v, tmp) {
-    if (dict_find(*vmtd, v->key)) {
-      vertex *a, *atmp;
-      HASH_ITER(hh, (graph*)(v->value), a, atmp) {
-        dict_add(vmtd, a->key, 0);
-      }
-    }
-  }
-}
-
 /* Version Space
  * We use four 7-bit fields to represent the version, excluding
  * 0xfe and 0xf4 for exception landingpads and dynamic code generation.
@@ -758,22 +1377,52 @@ static void compute_tc_vmtd(dict **vmtd,
 const unsigned int VERSION_SPACE_MAX = 252047376;
 static unsigned int version_space = 0;
 
-/* generate the cfg */
-int gen_cfg(void) {
-#ifdef NOCFI
-  /* don't generate the cfg at all */
-  return 0;
-#endif
+static void *ic_area_content = 0; /* the inline cache stubs saved by rock_fork */
+
+static void cpuid(void);
+
+unsigned long ic_map_area(size_t size, unsigned long *osb) {
+  uintptr_t page = VmmapFindSpace(&VM, size >> PAGESHIFT);
+  if (page == 0)
+    return 0;
+  VmmapAdd(&VM, page, size >> PAGESHIFT,
+           PROT_READ | PROT_EXEC, PROT_READ | PROT_EXEC,
+           VMMAP_ENTRY_ANONYMOUS);
+  *osb = (unsigned long)create_parallel_mapping((void*)(page << PAGESHIFT),
+                                                size, PROT_EXEC);
+  return page << PAGESHIFT;
+}
+
+void ic_serialize(void) {
+  cpuid();
+}
+
+/* Fill the tables with the given ids, which must carry a new version.
+ * The update strategy is the following:
+ * 1. for each module in gen_modules whose cfggened == FALSE, populate
+ *    their tary and bary tables.
+ * 2. for each module whose cfggened == TRUE, populate their tary tables.
+ * 3. for each module whose cfggened == TRUE, populate their bary tables.
+ * 4. mark the modules in gen_modules as cfggened.
+ */
+static void fill_tables(dict *callids, dict *retids,
+                        unsigned long id_for_others, dict *gen_modules) {
+  code_module *m;
+
+  ++version_space;
+
+  if (version_space < VERSION_SPACE_MAX) {
+    /* We still have more versions to explore */
+    if (safe()) /* if it is safe, then we reset the version_space counter */
+      version_space = 0;
+  } else {
+    /* Wait until it is safe. It is good to have an exponential backoff
+     * algorithm here */
+    while (!safe())
+      ;
+    version_space = 0; /* reset the version_space counter */
+  }
 
-  //dprintf(STDERR_FILENO, "[gen_cfg] called, %p\n", table);
-  icf *icfs = 0;
-  function *functions = 0;
-  dict *classes = 0;
-  graph *cha = 0;
-  dict *fats = 0;
-  dict *fats_in_data = 0;
-  dict *defined_ctors = 0;
-  graph *aliases = 0;
 #ifdef COLLECT_STAT
   if (rt_eqc_ids) {
     dict_dtor(&rt_eqc_ids, 0, 0);
@@ -783,29 +1432,168 @@ int gen_cfg(void) {
     dict_dtor(&ict_eqc_ids, 0, 0);
     ict_eqc_ids = 0;
   }
+  ibt_funcs = 0;
+  ibt_radcs = 0;
+  ibt_raics = 0;
+  ict_count = 0;
+  rt_count = 0;
 #endif
-  if (fats_in_code) {
-    g_dtor(&fats_in_code);
-    fats_in_code = 0;
+
+  DL_FOREACH(modules, m) {
+    if (!m->cfggened && dict_find(gen_modules, m)) {
+      gen_tary(m, callids, retids, table, &fats_in_code, &vmtd);
+      gen_bary(m, callids, retids, table, id_for_others);
+#ifdef NO_ONLINE_PATCHING
+      populate_landingpads(m, table);
+#endif
+    }
+  }
+  
+  DL_FOREACH(modules, m) {
+    if (m->cfggened)
+      gen_tary(m, callids, retids, table, &fats_in_code, &vmtd);
   }
 
-  if (vmtd) {
-    g_dtor(&vmtd);
-    vmtd = 0;
+  /* write barrier, if needed */
+  
+  DL_FOREACH(modules, m) {
+    if (m->cfggened)
+      gen_bary(m, callids, retids, table, id_for_others);
+    else if (dict_find(gen_modules, m))
+      m->cfggened = TRUE;
+  }
+
+  ic_update(table, modules, callids, retids);
+}
+
+/* The cfg generation is split into three phases so that threads trapping
+ * into the runtime are not stalled while the graphs are being solved:
+ * 1. with the runtime lock held, merge the metadata of the current modules
+ *    and snapshot what reg_cfg_metadata may change later on;
+ * 2. without the runtime lock, build the graphs and generate the ids;
+ * 3. with the runtime lock held again, fill the tables of the snapshotted
+ *    modules.
+ * Generations are serialized by cfg_gen_lock, which is always taken before
+ * the runtime lock. Sites activated during phase 2 are not lost: gen_tary
+ * keeps the activation bits, before the first cfg they are recorded in
+ * patch_compensate, and the functions they activate are recorded and
+ * activated again in the tables of phase 3.
+ */
+static volatile int cfg_gen_lock = 0;
+
+extern void acquire_runtime_lock(void);
+extern void release_runtime_lock(void);
+
+/* must be called with the runtime lock held */
+static void lock_cfg_gen(void) {
+  release_runtime_lock();
+  if (a_swap(&cfg_gen_lock, 1)) {
+    uint64_t start = rdtsc();
+    while (a_swap(&cfg_gen_lock, 1))
+      a_spin();
+    /* the counters are only written under the runtime lock */
+    acquire_runtime_lock();
+    ++metrics->cfg_lock_waits;
+    metrics->cfg_lock_wait_tsc += rdtsc() - start;
+    return;
+  }
+  acquire_runtime_lock();
+}
+
+static void unlock_cfg_gen(void) {
+  a_store(&cfg_gen_lock, 0);
+}
+
+/* copy the return addresses of all modules into a single module, which
+   is all build_retgraph needs, and remember which modules are covered */
+static code_module *snapshot_modules(code_module *modules,
+                                     /*out*/dict **gen_modules) {
+  code_module *snap = alloc_code_module();
+  code_module *m;
+  symbol *s, *ns;
+  DL_FOREACH(modules, m) {
+    dict_add(gen_modules, m, 0);
+    DL_FOREACH(m->rad, s) {
+      ns = alloc_sym();
+      ns->name = s->name;
+      ns->offset = s->offset;
+      DL_APPEND(snap->rad, ns);
+    }
+    DL_FOREACH(m->rai, s) {
+      ns = alloc_sym();
+      ns->name = s->name;
+      ns->offset = s->offset;
+      DL_APPEND(snap->rai, ns);
+    }
+  }
+  return snap;
+}
+
+static void free_snapshot(code_module *snap) {
+  symbol *s, *tmp;
+  DL_FOREACH_SAFE(snap->rad, s, tmp) {
+    DL_DELETE(snap->rad, s);
+    free(s);
+  }
+  DL_FOREACH_SAFE(snap->rai, s, tmp) {
+    DL_DELETE(snap->rai, s);
+    free(s);
+  }
+  free(snap);
+}
+
+static void activate_func_entries(void *name);
+
+/* generate the cfg, with cfg_gen_lock and the runtime lock held */
+static void generate_cfg(void) {
+  icf *icfs = 0;
+  function *functions = 0;
+  dict *classes = 0;
+  graph *cha = 0;
+  dict *fats = 0;
+  dict *fats_in_data = 0;
+  dict *defined_ctors = 0;
+  graph *aliases = 0;
+  dict *new_fats_in_code = 0;
+  dict *new_vmtd = 0;
+  dict *gen_modules = 0;
+  code_module *m = 0;
+
+  trace_begin(TRACE_PHASE_MERGE);
+  merge_mcfi_metainfo(modules, &icfs, &functions, &classes,
+                      &cha, &fats, &fats_in_data, &new_fats_in_code, &aliases, &defined_ctors);
+  DL_FOREACH(modules, m) {
+    merge_dicts(&new_vmtd, get_all_vmtd(m->vtable, defined_ctors, vtabletaken));
+    if (!m->cfggened && m->vtable_regions) {
+      char *cls = check_vtable_regions(m->vtable_regions, cha);
+      if (cls) {
+        dprintf(STDERR_FILENO,
+                "[generate_cfg] vtable region of module %lx disagrees with "
+                "the class hierarchy at %s\n", m->base_addr, cls);
+        quit(-1);
+      }
+    }
   }
+  dict_clear(&defined_ctors);
+  /* gen_modules keeps raw pointers across the unlocked phase. Modules are
+     only removed by unload_native_code, which takes cfg_gen_lock first, so
+     they stay alive until fill_tables is done with them. */
+  code_module *snapshot = snapshot_modules(modules, &gen_modules);
+  trace_end(TRACE_PHASE_MERGE);
 
-  start_timer("Metadata Merging");
-  merge_mcfi_metainfo(modules, &icfs, &functions, &classes,
-                      &cha, &fats, &fats_in_data, &fats_in_code, &aliases, &defined_ctors);
-  stop_timer("Metadata Merging");
+  /* everything below until the tables are filled works on private data */
+#ifndef NO_ONLINE_PATCHING
+  cfg_gen_unlocked = TRUE;
+#endif
+  release_runtime_lock();
 
   graph *all_funcs_grouped_by_name = 0;
 
-  start_timer("Call Graph Construction");
+  trace_begin(TRACE_PHASE_CALL_GRAPH);
   graph *callgraph =
     build_callgraph(icfs, functions, classes, cha,
                     fats, aliases, &all_funcs_grouped_by_name);
-  stop_timer("Call Graph Construction");
+  trace_end(TRACE_PHASE_CALL_GRAPH);
 
   icfs_clear(&icfs);
   dict_clear(&classes);
@@ -815,109 +1603,91 @@ int gen_cfg(void) {
 
   graph *aliases_tc = g_transitive_closure(&aliases);
   /* build complete fats_in_data and fats_in_code */
-  compute_fic(&fats_in_code, &fats_in_data, aliases_tc);
+  compute_fic(&new_fats_in_code, &fats_in_data, aliases_tc);
   g_dtor(&fats_in_data);
   /* handle vmtd aliases of virtual destructors */
-  compute_tc_vmtd(&vmtd, defined_ctors, aliases_tc);
-  dict_clear(&defined_ctors);
+  compute_tc_vmtd(&new_vmtd, aliases_tc);
   g_free_transitive_closure(&aliases_tc);
 
-  start_timer("Call Graph EQC");
+  trace_begin(TRACE_PHASE_CALL_EQC);
   node *lcg = g_get_lcc(&callgraph);
-  stop_timer("Call Graph EQC");
+  trace_end(TRACE_PHASE_CALL_EQC);
 
-#ifdef COLLECT_STAT
-  unsigned int count;
+  unsigned int lcg_count, lrt_count;
   node *n;
-  DL_COUNT(lcg, n, count);
-  eqc_callgraph_count = count;
-#endif
+  DL_COUNT(lcg, n, lcg_count);
 
-  start_timer("Return Graph Construction");
+  trace_begin(TRACE_PHASE_RET_GRAPH);
   /* based on the callgraph, let's build the return graph on top of it */
-  build_retgraph(&callgraph, all_funcs_grouped_by_name, modules);
-  stop_timer("Return Graph Construction");
+  build_retgraph(&callgraph, all_funcs_grouped_by_name, snapshot);
+  trace_end(TRACE_PHASE_RET_GRAPH);
 
   g_dtor(&all_funcs_grouped_by_name);
   functions_clear(&functions);
+  free_snapshot(snapshot);
 
-  start_timer("Return Graph EQC");
+  trace_begin(TRACE_PHASE_RET_EQC);
   node *lrt = g_get_lcc(&callgraph);
-  stop_timer("Return Graph EQC");
+  trace_end(TRACE_PHASE_RET_EQC);
 
   //l_print(lrt, print_cfgcc);
   g_dtor(&callgraph);
 
-#ifdef COLLECT_STAT
-  DL_COUNT(lrt, n, count);
-  eqc_retgraph_count = count;
-#endif
+  DL_COUNT(lrt, n, lrt_count);
 
-  start_timer("ID Generation and Table Filling");
   unsigned long id_for_others;
   dict *callids = 0, *retids = 0;
+  /* version is only touched here, under cfg_gen_lock */
   gen_mcfi_id(&lcg, &lrt, &version, &id_for_others, &callids, &retids);
 
-  ++version_space;
+  acquire_runtime_lock();
+#ifndef NO_ONLINE_PATCHING
+  cfg_gen_unlocked = FALSE;
+#endif
 
-  if (version_space < VERSION_SPACE_MAX) {
-    /* We still have more versions to explore */
-    if (safe()) /* if it is safe, then we reset the version_space counter */
-      version_space = 0;
-  } else {
-    /* Wait until it is safe. It is good to have an exponential backoff
-     * algorithm here */
-    while (!safe())
-      ;
-    version_space = 0; /* reset the version_space counter */
-  }
+  trace_begin(TRACE_PHASE_ID_GEN);
 
-  /* The CFG generation and update strategy is the following:
-   * 1. generate the new bary and tary tables for all modules.
-   * 2. for each module whose cfggened == FALSE, populate their tary
-   *    and bary tables.
-   * 3. for each module whose cfggened == TRUE, populate their
-   *    tary tables.
-   * 4. for each module whose cfggened == TRUE, populate their bary
-   *    tables.
-   * 5. mark all modules' cfggened field to be one.
-   */
-  code_module *m = 0;
+  /* a new cfg thaws the frozen one */
+  cfg_frozen = FALSE;
+
+  if (fats_in_code)
+    g_dtor(&fats_in_code);
+  fats_in_code = new_fats_in_code;
+
+  if (vmtd)
+    g_dtor(&vmtd);
+  vmtd = new_vmtd;
 
 #ifdef COLLECT_STAT
-  ibt_funcs = 0;
-  ibt_radcs = 0;
-  ibt_raics = 0;
-  ict_count = 0;
-  rt_count = 0;
+  eqc_callgraph_count = lcg_count;
+  eqc_retgraph_count = lrt_count;
 #endif
+  metrics->call_eqcs = lcg_count;
+  metrics->ret_eqcs = lrt_count;
 
-  DL_FOREACH(modules, m) {
-    if (!m->cfggened) {
-      gen_tary(m, callids, retids, table, &fats_in_code, &vmtd);
-      gen_bary(m, callids, retids, table, id_for_others);
-#ifdef NO_ONLINE_PATCHING
-      populate_landingpads(m, table);
-#endif
-    }
-  }
-  
-  DL_FOREACH(modules, m) {
-    if (m->cfggened)
-      gen_tary(m, callids, retids, table, &fats_in_code, &vmtd);
-  }
+  /* modules loaded after the snapshot are left to the next generation */
+  fill_tables(callids, retids, id_for_others, gen_modules);
+  dict_clear(&gen_modules);
 
-  /* write barrier, if needed */
-  
-  DL_FOREACH(modules, m) {
-    if (m->cfggened)
-      gen_bary(m, callids, retids, table, id_for_others);
-    else
-      m->cfggened = TRUE;
+#ifndef NO_ONLINE_PATCHING
+  /* new_vmtd and new_fats_in_code were computed before the traps taken
+     meanwhile, which removed their classes from m->vtable and marked their
+     sites patched, so none of them traps again: activate their functions
+     in the new tables as well */
+  {
+    keyvalue *kv, *tmp;
+    HASH_ITER(hh, unlocked_activations, kv, tmp) {
+      activate_func_entries(kv->key);
+    }
+    dict_clear(&unlocked_activations);
   }
+#endif
 
-  dict_clear(&callids);
-  dict_clear(&retids);
+  dict_clear(&cur_callids);
+  dict_clear(&cur_retids);
+  cur_callids = callids;
+  cur_retids = retids;
+  cur_id_for_others = id_for_others;
 
   if (!cfggened) {
     cfggened = TRUE;
@@ -929,14 +1699,225 @@ int gen_cfg(void) {
     }
     dict_clear(&patch_compensate);
   }
-  stop_timer("ID Generation and Table Filling");
+  trace_end(TRACE_PHASE_ID_GEN);
+
+#ifndef NO_ONLINE_PATCHING
+  if (MCFI_PROFILE) {
+    trace_begin(TRACE_PHASE_REPLAY);
+    replay_profile();
+    trace_end(TRACE_PHASE_REPLAY);
+  }
+#endif
 
   /* update the counters */
   update_thesc();
+}
+
+static void update_gen_cfg_metrics(uint64_t start) {
+  uint64_t ns = monotonic_ns();
+  uint64_t d = ns - start;
+  ++metrics->gen_cfgs;
+  metrics->gen_cfg_ns += d;
+  metrics->gen_cfg_ns_last = d;
+  if (d > metrics->gen_cfg_ns_max)
+    metrics->gen_cfg_ns_max = d;
+  /* rescale the tsc counters */
+  metrics->tsc1 = rdtsc();
+  metrics->ns1 = ns;
+}
+
+int gen_cfg(void) {
+#ifdef NOCFI
+  /* don't generate the cfg at all */
+  return 0;
+#endif
+
+  //dprintf(STDERR_FILENO, "[gen_cfg] called, %p\n", table);
+  lock_cfg_gen();
+  trace_begin(TRACE_PHASE_GEN_CFG);
+  uint64_t start = monotonic_ns();
+  generate_cfg();
+  update_gen_cfg_metrics(start);
+  trace_end(TRACE_PHASE_GEN_CFG);
+  unlock_cfg_gen();
   return 0;
 }
 
-void take_addr_and_gen_cfg(unsigned long func_addr) {
+static int addr_taken(void *name) {
+  code_module *m;
+  DL_FOREACH(modules, m) {
+    if (dict_find(m->fats, name))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static int aliased(void *name) {
+  code_module *m;
+  DL_FOREACH(modules, m) {
+    if (dict_find(m->aliases, name))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static function *find_function(void *name) {
+  code_module *m;
+  function *f;
+  DL_FOREACH(modules, m) {
+    DL_FOREACH(m->functions, f) {
+      if (name == f->name)
+        return f;
+    }
+  }
+  return 0;
+}
+
+/* an address-taken plain function whose type is the same as f's, so that
+   any indirect call that may reach f also reaches it */
+static function *find_same_type_function(function *f) {
+  code_module *m;
+  function *g;
+  DL_FOREACH(modules, m) {
+    DL_FOREACH(m->functions, g) {
+      if (g->type == f->type && g->name != f->name &&
+          !g->class_name && addr_taken(g->name) && !aliased(g->name))
+        return g;
+    }
+  }
+  return 0;
+}
+
+static void relabel_ids(dict *ids, void *from, void *to) {
+  keyvalue *kv, *tmp;
+  HASH_ITER(hh, ids, kv, tmp) {
+    if (kv->value == from)
+      kv->value = to;
+  }
+}
+
+/* activate the entries of a function whose address was so far only
+   taken in code */
+static void activate_func_entries(void *name) {
+#ifndef NO_ONLINE_PATCHING
+  graph **gs[2] = {&fats_in_code, &vmtd};
+  int i;
+  for (i = 0; i < 2; i++) {
+    vertex *v = dict_find(*gs[i], name);
+    if (!v)
+      continue;
+    vertex *e, *tmp;
+    HASH_ITER(hh, (graph*)(v->value), e, tmp) {
+      unsigned long *ptid = (unsigned long*)(table + (unsigned long)e->key);
+      if (!(*ptid & 1)) {
+        *ptid |= 1;
+#ifdef COLLECT_STAT
+        ++func_addr_activation_count;
+#endif
+      }
+    }
+    g_del_vertex(gs[i], v->key);
+  }
+#endif
+}
+
+static void set_func_entries(void *name, void *id) {
+  code_module *m;
+  symbol *s;
+  DL_FOREACH(modules, m) {
+    if (!m->instrumented)
+      continue;
+    DL_FOREACH(m->funcsyms, s) {
+      if (s->name == name)
+        *(unsigned long*)(table + m->base_addr + s->offset) = (unsigned long)id;
+    }
+  }
+}
+
+/* Account for the newly taken addresses of the functions in names without
+ * rebuilding the graphs. This works when each function that was not yet
+ * address-taken is a plain function without aliases and some address-taken
+ * function g of the same type exists: the function then reaches exactly
+ * g's indirect calls, so it joins g's call class and its return class is
+ * merged with g's. *refill is set if classes were merged, in which case
+ * the tables have to be refilled with a new version.
+ * Returns FALSE if a full cfg generation is needed. */
+static int take_addr_in_place(dict *names, int *refill) {
+  code_module *m;
+  keyvalue *fn, *tmp;
+
+  if (!cfggened)
+    return FALSE;
+  DL_FOREACH(modules, m) {
+    if (!m->cfggened)
+      return FALSE;
+  }
+
+  HASH_ITER(hh, names, fn, tmp) {
+    if (addr_taken(fn->key)) {
+      /* the cfg is unaffected, but the entry may not be activated yet */
+      activate_func_entries(fn->key);
+      continue;
+    }
+    function *f = find_function(fn->key);
+    if (!f || f->class_name || aliased(fn->key))
+      return FALSE;
+    if (!f->type)
+      continue; /* no indirect call may reach it anyway */
+    function *g = find_same_type_function(f);
+    if (!g)
+      return FALSE;
+    keyvalue *cg = dict_find(cur_callids, g->name);
+    if (!cg)
+      continue; /* no indirect call of this type */
+
+    keyvalue *cf = dict_find(cur_callids, f->name);
+    if (!cf) {
+      dict_add(&cur_callids, f->name, cg->value);
+      set_func_entries(f->name, cg->value);
+    } else if (cf->value != cg->value) {
+      relabel_ids(cur_callids, cf->value, cg->value);
+      *refill = TRUE;
+#ifdef COLLECT_STAT
+      --eqc_callgraph_count;
+#endif
+    }
+
+    keyvalue *rf = dict_find(cur_retids, f->name);
+    keyvalue *rg = dict_find(cur_retids, g->name);
+    if (!rg)
+      return FALSE;
+    if (rf && rf->value != rg->value) {
+      relabel_ids(cur_retids, rf->value, rg->value);
+      *refill = TRUE;
+#ifdef COLLECT_STAT
+      --eqc_retgraph_count;
+#endif
+    }
+  }
+  return TRUE;
+}
+
+/* move the current ids to a new version and refill the tables with them */
+static void refill_tables(void) {
+  unsigned long v = _convert_to_mcfi_half_id_format(&version);
+  dict *ids[2] = {cur_callids, cur_retids};
+  keyvalue *kv, *tmp;
+  int i;
+  for (i = 0; i < 2; i++) {
+    HASH_ITER(hh, ids[i], kv, tmp) {
+      kv->value = (void*)(((unsigned long)kv->value & ~0xffffffffUL) | v | 1);
+    }
+  }
+  if (!COMPAT_MODE)
+    cur_id_for_others = (cur_id_for_others & ~0xffffffffUL) | v | 1;
+  fill_tables(cur_callids, cur_retids, cur_id_for_others, 0);
+  update_thesc();
+}
+
+/* take the address of the function at func_addr, returns TRUE if the
+   tables could be updated in place */
+static int take_addr(unsigned long func_addr, int *refill) {
   //dprintf(STDERR_FILENO, "[take_addr_and_gen_cfg] %x\n", func_addr);
   code_module *m;
   int found = FALSE;
@@ -956,53 +1937,109 @@ void take_addr_and_gen_cfg(unsigned long func_addr) {
     dprintf(STDERR_FILENO, "[take_addr_and_gen_cfg] cannot find the functions\n");
     quit(-1);
   }
+  int in_place = take_addr_in_place((dict*)(fnl->value), refill);
   /* add the functions' names to fats */
   HASH_ITER(hh, ((dict*)(fnl->value)), fn, tmp) {
-    dict_add(&(m->fats), fn->key, 0);
+    if (!dict_find(m->fats, fn->key))
+      dict_add(&(m->fats), fn->key, 0);
   }
-  /* generate the cfg */
-  gen_cfg();
+  return in_place;
 }
 
-void set_gotplt(unsigned long addr, unsigned long v) {
-  //dprintf(STDERR_FILENO, "[set_gotplt] (%x, %x)\n", addr, v);
-  code_module *m, *am;
-  int foundaddr = FALSE;
-  int foundv = FALSE;
-  unsigned long func_addr = v;
-  keyvalue *fnl, *fn;
-  int weak = FALSE;
+void take_addr_and_gen_cfg(unsigned long func_addr) {
+#ifdef NOCFI
+  return;
+#endif
+  int refill = FALSE;
+  lock_cfg_gen();
+  if (!take_addr(func_addr, &refill))
+    generate_cfg();
+  else if (refill)
+    refill_tables();
+  else
+    ic_update(table, modules, cur_callids, cur_retids);
+  unlock_cfg_gen();
+}
+
+/* the same as take_addr_and_gen_cfg for n function addresses stored at
+   addrs, with at most one cfg generation for all of them */
+void take_addrs_and_gen_cfg(unsigned long addrs, unsigned long n) {
+#ifdef NOCFI
+  return;
+#endif
+  if (n > TAKE_ADDR_BATCH_MAX || addrs % sizeof(unsigned long) != 0 ||
+      addrs >= FourGB || addrs + n * sizeof(unsigned long) > FourGB) {
+    dprintf(STDERR_FILENO, "[take_addrs_and_gen_cfg] illegal batch %lx, %lu\n",
+            addrs, n);
+    quit(-1);
+  }
+  volatile unsigned long *pv = (volatile unsigned long*)addrs;
+  int in_place = TRUE, refill = FALSE;
+  unsigned long i;
+  lock_cfg_gen();
+  for (i = 0; i < n; i++) {
+    if (!take_addr(pv[i], &refill))
+      in_place = FALSE;
+  }
+  if (!in_place)
+    generate_cfg();
+  else if (refill)
+    refill_tables();
+  else
+    ic_update(table, modules, cur_callids, cur_retids);
+  unlock_cfg_gen();
+}
+
+/* check that v may be stored at the .got.plt entry addr and return where
+   to store it. *am caches the module of the previous entry, since batched
+   entries usually belong to the same module. */
+/* the names of the exported function at v, or 0 */
+static keyvalue *dynfunc_names(unsigned long v) {
+  code_module *m;
+  keyvalue *fnl = 0;
+  unsigned long func_addr;
+
   DL_FOREACH(modules, m) {
-    //dprintf(STDERR_FILENO, "gotplt: %x, %x, %x\n", m->gotplt, m->gotpltsz, m->sz);
-    if (addr >= m->gotplt && addr < m->gotplt + m->gotpltsz) {
-      foundaddr = TRUE;
-      am = m;
-    }
-    if (func_addr >= m->base_addr && func_addr < m->base_addr + m->sz) {
-      func_addr -= m->base_addr;
+    if (v >= m->base_addr && v < m->base_addr + m->sz) {
+      func_addr = v - m->base_addr;
       //dprintf(STDERR_FILENO, "%x\n", func_addr);
       fnl = dict_find(m->dynfuncs, (void*)func_addr);
-      if (fnl) {
-        foundv = TRUE;
-        continue;
-      }
       /* let's try weak symbols */
-      fnl = dict_find(m->weakfuncs, (void*)func_addr);
-      if (fnl) {
-        foundv = TRUE;
+      if (!fnl)
+        fnl = dict_find(m->weakfuncs, (void*)func_addr);
+      break;
+    }
+  }
+  return fnl;
+}
+
+static unsigned long *check_gotplt(unsigned long addr, unsigned long v,
+                                   code_module **am) {
+  code_module *m;
+  keyvalue *fnl;
+
+  if (!*am || addr < (*am)->gotplt || addr >= (*am)->gotplt + (*am)->gotpltsz) {
+    *am = 0;
+    DL_FOREACH(modules, m) {
+      //dprintf(STDERR_FILENO, "gotplt: %x, %x, %x\n", m->gotplt, m->gotpltsz, m->sz);
+      if (addr >= m->gotplt && addr < m->gotplt + m->gotpltsz) {
+        *am = m;
+        break;
       }
     }
   }
-  if (!foundaddr) {
+  if (!*am) {
     dprintf(STDERR_FILENO, "[set_gotplt] illegal address\n");
     quit(-1);
   }
-  if (!foundv) {
+
+  fnl = dynfunc_names(v);
+  if (!fnl) {
     dprintf(STDERR_FILENO, "[set_gotplt] illegal value\n");
     quit(-1);
   }
 
-  keyvalue *gpf = dict_find(am->gpfuncs, (void*)(addr - am->gotplt));
+  keyvalue *gpf = dict_find((*am)->gpfuncs, (void*)(addr - (*am)->gotplt));
   if (!gpf) {
     dprintf(STDERR_FILENO, "[set_gotplt] invalid addr\n");
     quit(-1);
@@ -1012,28 +2049,190 @@ void set_gotplt(unsigned long addr, unsigned long v) {
     quit(-1);
   }
 
-  /* change the .got.plt entry atomically */
-  unsigned long *p =
-    (am->instrumented) ?
-    ((unsigned long*)(am->osb_gotplt + addr - am->gotplt)) :
+  return ((*am)->instrumented) ?
+    ((unsigned long*)((*am)->osb_gotplt + addr - (*am)->gotplt)) :
     (unsigned long*)addr;
+}
+
+void set_gotplt(unsigned long addr, unsigned long v) {
+  //dprintf(STDERR_FILENO, "[set_gotplt] (%x, %x)\n", addr, v);
+  code_module *am = 0;
+  unsigned long *p = check_gotplt(addr, v, &am);
+  /* change the .got.plt entry atomically */
   *p = v;
 }
 
-void unload_native_code(const char* code_file_name) {
-  /* TODO: implement library unloading in four steps:
-     1. Mark all TIDs for the library-to-be-deleted as inactive by
-        clearing the least significant bit.
-     2. Update the CFG for all other modules.
-     3. Wait until all threads have executed at least one system call
-        or runtime trampoline call. Note that on some other OSes such
-        as windows that provide querying thread's context, it suffices
-        to know no other thread is in execution of the library.
+/* the same as set_gotplt, but for n (addr, v) pairs stored at pairs, so
+   that the dynamic linker binds a whole module with a single escape */
+void set_gotplt_batch(unsigned long pairs, unsigned long n) {
+  //dprintf(STDERR_FILENO, "[set_gotplt_batch] (%x, %d)\n", pairs, n);
+  if (n > GOTPLT_BATCH_MAX || pairs % sizeof(unsigned long) != 0 ||
+      pairs >= FourGB || pairs + n * 2 * sizeof(unsigned long) > FourGB) {
+    dprintf(STDERR_FILENO, "[set_gotplt_batch] illegal batch %lx, %lu\n",
+            pairs, n);
+    quit(-1);
+  }
+  volatile unsigned long *pv = (volatile unsigned long*)pairs;
+  code_module *am = 0;
+  unsigned long i;
+  for (i = 0; i < n; i++) {
+    /* the sandbox may still change the pairs, so read each of them once */
+    unsigned long addr = pv[2*i];
+    unsigned long v = pv[2*i+1];
+    unsigned long *p = check_gotplt(addr, v, &am);
+    *p = v;
+  }
+}
 
-     // Step 2 and 3 ensure that no thread is executing code in the lib.
+/* tell the dynamic linker where __mcfi_vtables of the module whose dynamic
+   section is at dynv is, in region[0] and its size in region[1], or 0 and
+   0 if it has none. It leaves the relocations inside to the runtime. */
+void vtable_region(unsigned long dynv, unsigned long region) {
+  code_module *m;
+  if (region % sizeof(unsigned long) != 0 || region >= FourGB ||
+      region + 2 * sizeof(unsigned long) > FourGB) {
+    dprintf(STDERR_FILENO, "[vtable_region] illegal region %lx\n", region);
+    quit(-1);
+  }
+  check_writable(region, 2 * sizeof(unsigned long), "vtable_region");
+  volatile unsigned long *pv = (volatile unsigned long*)region;
+  pv[0] = pv[1] = 0;
+  DL_FOREACH(modules, m) {
+    if (!m->code_heap && dynv >= m->base_addr &&
+        dynv < m->base_addr + m->map_sz) {
+      pv[0] = m->vtables;
+      pv[1] = m->vtablessz;
+      break;
+    }
+  }
+}
 
-     4. Reclaim the library's memory for future use.
-  */
+/* bind n symbolic relocations in __mcfi_vtables, given as (address, value)
+   pairs. The load recorded each of them, and each is bound once: to the
+   function it names if it names one, and otherwise to an address within a
+   loaded module, e.g. of type info. */
+void set_vtable_slots(unsigned long pairs, unsigned long n) {
+  if (n > GOTPLT_BATCH_MAX || pairs % sizeof(unsigned long) != 0 ||
+      pairs >= FourGB || pairs + n * 2 * sizeof(unsigned long) > FourGB) {
+    dprintf(STDERR_FILENO, "[set_vtable_slots] illegal batch %lx, %lu\n",
+            pairs, n);
+    quit(-1);
+  }
+  volatile unsigned long *pv = (volatile unsigned long*)pairs;
+  code_module *am = 0, *m;
+  unsigned long i;
+  for (i = 0; i < n; i++) {
+    /* the sandbox may still change the pairs, so read each of them once */
+    unsigned long addr = pv[2*i];
+    unsigned long v = pv[2*i+1];
+    if (!am || addr < am->vtables || addr >= am->vtables + am->vtablessz) {
+      am = 0;
+      DL_FOREACH(modules, m) {
+        if (m->vtablessz &&
+            addr >= m->vtables && addr < m->vtables + m->vtablessz) {
+          am = m;
+          break;
+        }
+      }
+    }
+    keyvalue *slot = am ?
+      dict_find(am->vtslots, (void*)(addr - am->vtables)) : 0;
+    if (!slot) {
+      dprintf(STDERR_FILENO, "[set_vtable_slots] illegal address %lx\n", addr);
+      quit(-1);
+    }
+    if (slot->value) {
+      keyvalue *fnl = dynfunc_names(v);
+      if (!fnl || !dict_find((dict*)(fnl->value), slot->value)) {
+        dprintf(STDERR_FILENO, "[set_vtable_slots] %s not found\n",
+                slot->value);
+        quit(-1);
+      }
+    } else {
+      DL_FOREACH(modules, m) {
+        if (!m->code_heap && v >= m->base_addr &&
+            v < m->base_addr + m->map_sz)
+          break;
+      }
+      if (!m) {
+        dprintf(STDERR_FILENO, "[set_vtable_slots] illegal value %lx\n", v);
+        quit(-1);
+      }
+    }
+    HASH_DEL(am->vtslots, slot);
+    free_kv(slot);
+    *(unsigned long*)(am->osb_vtables + addr - am->vtables) = v;
+  }
+}
+
+/* unload the library loaded at base, which the dynamic linker loaded ahead
+ * of its use and then did not use. Only a library that no cfg has covered
+ * can be unloaded, since its tary entries have never been set; its bary
+ * slots and metadata are not reclaimed. Returns 0, or -1 if the library
+ * stays loaded.
+ *
+ * TODO: implement the unloading of any library in four steps:
+ * 1. Mark all TIDs for the library-to-be-deleted as inactive by
+ *    clearing the least significant bit.
+ * 2. Update the CFG for all other modules.
+ * 3. Wait until all threads have executed at least one system call
+ *    or runtime trampoline call. Note that on some other OSes such
+ *    as windows that provide querying thread's context, it suffices
+ *    to know no other thread is in execution of the library.
+ *
+ *    // Step 2 and 3 ensure that no thread is executing code in the lib.
+ *
+ * 4. Reclaim the library's memory for future use.
+ */
+long unload_native_code(unsigned long base) {
+  code_module *m;
+  long rv = -1;
+
+  /* no generation may be covering it meanwhile */
+  lock_cfg_gen();
+  DL_FOREACH(modules, m) {
+    if (!m->code_heap && !m->is_exe && m->base_addr == base)
+      break;
+  }
+  if (m && !m->cfggened) {
+    DL_DELETE(modules, m);
+    if (m->osb_base_addr)
+      munmap((void*)m->osb_base_addr, m->sz);
+    if (m->osb_gotplt)
+      munmap((void*)m->osb_gotplt, m->gotpltsz);
+    if (m->osb_vtables)
+      munmap((void*)m->osb_vtables, m->vtablessz);
+    /* the sandbox may have unmapped parts of the module and mapped
+       something else there since, so only the pages the Vmmap still
+       records are unmapped, after the checks of rock_munmap */
+    uintptr_t page = m->base_addr >> PAGESHIFT;
+    uintptr_t end = (m->base_addr + m->map_sz) >> PAGESHIFT;
+    while (page < end) {
+      uintptr_t run;
+      for (; page < end && !VmmapFindPage(&VM, page); page++)
+        ;
+      for (run = page; run < end && VmmapFindPage(&VM, run); run++)
+        ;
+      if (run == page)
+        break;
+      if (insecure_overlap_vtables(page << PAGESHIFT,
+                                   (run - page) << PAGESHIFT)) {
+        dprintf(STDERR_FILENO,
+                "[unload_native_code] munmap(%lx, %lx) overlaps vtables\n",
+                page << PAGESHIFT, (run - page) << PAGESHIFT);
+        quit(-1);
+      }
+      if (0 == munmap((void*)(page << PAGESHIFT), (run - page) << PAGESHIFT))
+        VmmapRemove(&VM, page, run - page, VMMAP_ENTRY_ANONYMOUS);
+      page = run;
+    }
+    perf_module_unloaded(m->base_addr);
+    --metrics->modules;
+    metrics->table_bytes -= m->sz;
+    rv = 0;
+  }
+  unlock_cfg_gen();
+  return rv;
 }
 
 void rock_clone(void) {
@@ -1048,10 +2247,6 @@ void rock_shmat(void) {
 void rock_shmdt(void) {
 }
 
-extern void *create_parallel_mapping(void *base,
-                                     size_t size,
-                                     int prot);
-
 void *create_code_heap(void **ph, size_t size, struct verifier_t *verifier) {
   code_module* m = alloc_code_module();
   if (verifier == 0) {
@@ -1082,6 +2277,8 @@ void *create_code_heap(void **ph, size_t size, struct verifier_t *verifier) {
   m->sz = size;
   m->activated = TRUE;
   m->code_heap = TRUE;
+  ++metrics->modules;
+  metrics->table_bytes += size;
   m->verifier = verifier;
   m->code_data_bitmap = mmap(NULL, RoundToPage(size/8), PROT_WRITE,
                              MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
@@ -1211,6 +2408,7 @@ void reg_cfg_metadata(void *h,    /* code heap handle */
                       void *md,   /* metadata, whose semantics depends on the type */
                       void *extra /* extra info, optional */
                       ) {
+  trace(TRACE_JIT_REG, type, (uintptr_t)md, (uintptr_t)extra);
 #ifndef NOCFI
   code_module *m = get_code_heap(h);
 
@@ -1245,6 +2443,8 @@ void reg_cfg_metadata(void *h,    /* code heap handle */
       funcsym->name = name;
       funcsym->offset = new_addr - m->base_addr;
       DL_APPEND(m->funcsyms, funcsym);
+      perf_code_name(new_addr,
+                     (void*)(new_addr - m->base_addr + m->osb_base_addr), name);
     }
     break;
   case ROCK_RET:
@@ -1394,6 +2594,7 @@ void reg_cfg_metadata(void *h,    /* code heap handle */
                 addr);
         quit(-1);
       }
+      ic_revert(addr, 1);
       unsigned long *p = (unsigned long*)(table + addr);
       *p = 0; // invalidate this rai target
       addr -= m->base_addr;
@@ -1418,6 +2619,7 @@ void reg_cfg_metadata(void *h,    /* code heap handle */
                 addr);
         quit(-1);
       }
+      ic_revert(addr, 1);
       unsigned long *p = (unsigned long*)(table + addr);
       *p = 0; // invalidate this rai target
       addr -= m->base_addr;
@@ -1501,6 +2703,9 @@ void delete_code(void *h, /* handle */
   }
   // check whether this region is referenced by other regions
   set_data(m->code_data_bitmap, addr - m->base_addr, length);
+  ic_revert(addr, length);
+  perf_code_delete(addr, length);
+  trace(TRACE_JIT_DELETE, 0, addr, length);
   addr = addr & (-8);
   length = ((length + 7) & (-8));
 
@@ -1546,6 +2751,9 @@ void move_code(void *h,
   }
   set_data(m->code_data_bitmap, source - m->base_addr, length);
   set_code(m->code_data_bitmap, target - m->base_addr, length);
+  ic_revert(source, length);
+  perf_code_move(target, source, length);
+  trace(TRACE_JIT_MOVE, 0, target, source);
 
   target = target & (-8);
   source = source & (-8);
@@ -1637,6 +2845,16 @@ static void save_content(void) {
     }
   }
 
+  if (ic_area) {
+    ic_area_content = mmap(0, IC_AREA_SIZE, PROT_WRITE | PROT_READ,
+                           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ic_area_content == (void*)-1) {
+      dprintf(STDERR_FILENO, "[rock_fork] inline cache allocation failed\n");
+      quit(-1);
+    }
+    memcpy(ic_area_content, (void*)ic_area, IC_AREA_SIZE);
+  }
+
   /* note that we should finish all allocation and then start unmapping
    * the pages, otherwise, strange behaviors appear. */
   DL_FOREACH(modules, m) {
@@ -1647,6 +2865,10 @@ static void save_content(void) {
       munmap((void*)m->osb_gotplt, m->gotpltsz);
     }
   }
+  if (ic_area) {
+    munmap((void*)ic_area, IC_AREA_SIZE);
+    munmap((void*)osb_ic_area, IC_AREA_SIZE);
+  }
 }
 
 static void restore_content(void) {
@@ -1663,17 +2885,36 @@ static void restore_content(void) {
       m->gotpltcontent = 0;
     }
   }
+  if (ic_area) {
+    restore_parallel_mapping((void*)ic_area, (void*)osb_ic_area, IC_AREA_SIZE, PROT_EXEC);
+    memcpy((void*)osb_ic_area, ic_area_content, IC_AREA_SIZE);
+    munmap(ic_area_content, IC_AREA_SIZE);
+    ic_area_content = 0;
+  }
 }
 
 int rock_fork(void) {
   //dprintf(STDERR_FILENO, "[rock_fork]\n");
+  /* no cfg generation may be running off the runtime lock, otherwise the
+     child would inherit its locks */
+  lock_cfg_gen();
 #ifndef NO_ONLINE_PATCHING
   save_content();
 #endif
+  perf_flush();
   int rv = __syscall0(SYS_fork);
 #ifndef NO_ONLINE_PATCHING
   restore_content();
 #endif
+  /* the perf files, trace rings and metrics segment are named after the
+     parent's pid, and the parent writes the iib counts */
+  if (rv == 0) {
+    PERF_OUTPUT = 0;
+    MCFI_IIB_OUT = 0;
+    trace_fork_child();
+    metrics_fork_child();
+  }
+  unlock_cfg_gen();
   return rv;
 }
 
@@ -1822,13 +3063,15 @@ static struct ibe_t ibe_count(void) {
 #endif
 
 void collect_stat(void) {
-#ifdef PROFILING
-  {
-    struct timeval tv;
-    gettimeofday(&tv);
-    dprintf(STDERR_FILENO, "[%lu:%lu] Program Ended!\n", tv.tv_sec, tv.tv_usec);
-  }
+  perf_flush();
+  trace(TRACE_END, 0, 0, 0);
+  metrics_exit();
+#ifndef NO_ONLINE_PATCHING
+  if (MCFI_PROFILE_OUT)
+    dump_profile();
 #endif
+  if (MCFI_IIB_OUT)
+    dump_iib_counts();
 #ifdef COLLECT_STAT
 
   unsigned int lp_count = 0;
@@ -1904,7 +3147,7 @@ void collect_stat(void) {
   dprintf(STDERR_FILENO, "[%u] Total online activated landing pads: %u\n",
           pid, lp_activation_count);
   dprintf(STDERR_FILENO, "[%u] Total online activated return addrs: %u\n",
-          pid, radc_patch_count + raic_patch_count);
+          pid, radc_patch_count + raic_patch_count + batch_ra_activation_count);
   dprintf(STDERR_FILENO, "[%u] Activated Return Addrs of Direct Calls: %u\n",
           pid, radc_patch_count);
   dprintf(STDERR_FILENO, "[%u] Activated Return Addrs of Indirect Calls: %u\n",
@@ -1917,6 +3160,24 @@ void collect_stat(void) {
           pid, func_entry_patch_count);
   dprintf(STDERR_FILENO, "[%u] Total call site patches: %lu\n",
           pid, radc_patch_count + raic_patch_count);
+  {
+    static const char *granularity[] = { "site", "function", "page" };
+    unsigned long warmup = (last_trap.tv_sec - first_trap.tv_sec) * 1000000 +
+      (last_trap.tv_usec - first_trap.tv_usec);
+    dprintf(STDERR_FILENO, "[%u] Activation granularity: %s\n",
+            pid, granularity[ACTIVATION_GRANULARITY]);
+    dprintf(STDERR_FILENO, "[%u] Total online patching traps: %lu\n",
+            pid, radc_patch_count + raic_patch_count +
+            at_patch_count + func_entry_patch_count);
+    dprintf(STDERR_FILENO, "[%u] Call sites activated in batches: %u\n",
+            pid, batch_ra_activation_count);
+    dprintf(STDERR_FILENO, "[%u] Address taking sites patched in batches: %u\n",
+            pid, batch_at_activation_count);
+    dprintf(STDERR_FILENO, "[%u] Function entries patched in batches: %u\n",
+            pid, batch_entry_activation_count);
+    dprintf(STDERR_FILENO, "[%u] Warmup from first to last trap (us): %lu\n",
+            pid, warmup);
+  }
 #endif
   dprintf(STDERR_FILENO, "[%u] Amount of Indirect Branch Edges: %lu (Out:%u, In:%u)\n",
           pid, ibe.ibe_count_wo_activation,
@@ -2117,6 +3378,7 @@ void code_heap_fill(void *h, /* code heap handle */
             h, dst, src, len, extra);
     quit(-1);
   }
+  trace(TRACE_JIT_FILL, flags, (uintptr_t)dst, len);
   void *p = dst - (void*)m->base_addr + (void*)m->osb_base_addr;
   if (data(flags)) {
     /* the entire data should be either in data areas or code areas */
@@ -2169,6 +3431,7 @@ void code_heap_fill(void *h, /* code heap handle */
     if (flags & ROCK_COPY) {
       assert(ROCK_DATA == area);
       memcpy(p, src, len);
+      perf_code_load((uintptr_t)dst, p, len);
       flags |= ROCK_VERIFY;
       flags &= (~ROCK_REPLACE);
     }
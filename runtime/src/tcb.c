@@ -3,6 +3,35 @@
 #include <mm.h>
 #include <io.h>
 #include <syscall.h>
+#include <trace.h>
+
+/* The shadow stack grows down from its end. A guard page at either end
+   stops pushes past the lowest entry and reads past the highest, and the
+   highest entry is a sentinel whose stack slot is above any real one, so
+   that the unwinding done by returns and the pops stop there. Threads only
+   get one once a -fmcfi-return=shadow module is loaded. */
+void alloc_shadow_stack(TCB *tcb) {
+  unsigned long *top;
+  char *ss;
+  if (tcb->shadow_stack)
+    return;
+  ss = mmap(0, SHADOW_STACK_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (MAP_FAILED == (void*)ss) {
+    // report_error
+    quit(-1);
+  }
+  if (0 != mprotect(ss, PAGE_SIZE, PROT_NONE) ||
+      0 != mprotect(ss + SHADOW_STACK_SIZE - PAGE_SIZE, PAGE_SIZE, PROT_NONE)) {
+    // report_error
+    quit(-1);
+  }
+  top = (unsigned long*)(ss + SHADOW_STACK_SIZE - PAGE_SIZE) - 2;
+  top[0] = 0;
+  top[1] = (unsigned long)-1;
+  tcb->shadow_stack = ss;
+  tcb->shadow_sp = (unsigned long)top - (unsigned long)tcb;
+}
 
 TCB* alloc_tcb(void) {
   TCB* tcb = mmap(0, STACK_SIZE, PROT_WRITE,
@@ -24,6 +53,9 @@ TCB* alloc_tcb(void) {
 }
 
 void dealloc_tcb(TCB *p) {
+  trace_close(p->trace);
+  if (p->shadow_stack)
+    munmap(p->shadow_stack, SHADOW_STACK_SIZE);
   munmap(p, STACK_SIZE);
 }
 
@@ -0,0 +1,96 @@
+#include <def.h>
+#include <syscall.h>
+#include <mm.h>
+#include <io.h>
+#include <string.h>
+#include <errno.h>
+#include <tcb.h>
+#include <time.h>
+#include <trace.h>
+
+int snprintf(char *str, size_t size, const char *format, ...);
+
+#define TRACE_CAPACITY ((TRACE_RING_SIZE - PAGE_SIZE) / sizeof(struct trace_record))
+
+static void trace_sync(struct trace_header *h) {
+  h->tsc1 = rdtsc();
+  h->ns1 = monotonic_ns();
+}
+
+static struct trace_header *trace_open(void) {
+  char path[256];
+  unsigned int pid = __syscall0(SYS_getpid);
+  unsigned int tid = __syscall0(SYS_gettid);
+  snprintf(path, sizeof(path), "%s.%u.%u", MCFI_TRACE, pid, tid);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    dprintf(STDERR_FILENO, "[trace_open] cannot open %s\n", path);
+    return 0;
+  }
+  if (0 != ftruncate(fd, TRACE_RING_SIZE)) {
+    dprintf(STDERR_FILENO, "[trace_open] ftruncate failed with %d\n", errn);
+    close(fd);
+    return 0;
+  }
+  struct trace_header *h = mmap(0, TRACE_RING_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    dprintf(STDERR_FILENO, "[trace_open] mmap failed with %d\n", errn);
+    return 0;
+  }
+  memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+  h->version = TRACE_VERSION;
+  h->record_size = sizeof(struct trace_record);
+  h->pid = pid;
+  h->tid = tid;
+  h->capacity = TRACE_CAPACITY;
+  h->head = 0;
+  h->tsc0 = rdtsc();
+  h->ns0 = monotonic_ns();
+  h->tsc1 = h->tsc0;
+  h->ns1 = h->ns0;
+  return h;
+}
+
+void trace_record(uint32_t type, uint32_t a, uint64_t b, uint64_t c) {
+  TCB *self = thread_self();
+  struct trace_header *h = self->trace;
+  if (!h) {
+    h = trace_open();
+    if (!h) {
+      MCFI_TRACE = 0;
+      return;
+    }
+    self->trace = h;
+  }
+  uint64_t head = h->head;
+  struct trace_record *r =
+    (struct trace_record*)((char*)h + PAGE_SIZE) + head % TRACE_CAPACITY;
+  r->tsc = rdtsc();
+  r->type = type;
+  r->a = a;
+  r->b = b;
+  r->c = c;
+  /* the record is complete before a reader sees the new head */
+  __asm__ __volatile__("" ::: "memory");
+  h->head = head + 1;
+  if (type == TRACE_END || (head + 1) % TRACE_SYNC_INTERVAL == 0)
+    trace_sync(h);
+}
+
+void trace_close(void *ring) {
+  if (!ring)
+    return;
+  trace_sync(ring);
+  munmap(ring, TRACE_RING_SIZE);
+}
+
+void trace_fork_child(void) {
+  TCB *self = thread_self();
+  if (self->trace) {
+    munmap(self->trace, TRACE_RING_SIZE);
+    self->trace = 0;
+  }
+}
@@ -143,21 +143,15 @@ int __ilog2_u64(unsigned long n)
  */
 #define do_div(n, base)                                                 \
   ({                                                                    \
-    unsigned long __upper, __low, __high, __mod, __base;                \
+    unsigned long __mod, __base;                                        \
     __base = (base);                                                    \
     if (__builtin_constant_p(__base) && is_power_of_2(__base)) {        \
       __mod = n & (__base - 1);                                         \
       n >>= ilog2(__base);                                              \
     } else {                                                            \
-      asm("" : "=a" (__low), "=d" (__high) : "A" (n));                  \
-      __upper = __high;                                                 \
-      if (__high) {                                                     \
-        __upper = __high % (__base);                                    \
-        __high = __high / (__base);                                     \
-      }                                                                 \
-      asm("divq %2" : "=a" (__low), "=d" (__mod)                        \
-          : "rm" (__base), "0" (__low), "1" (__upper));                 \
-      asm("" : "=A" (n) : "a" (__low), "d" (__high));                   \
+      /* "A" is not the %rdx:%rax pair on x86-64, n is 64-bit anyway */ \
+      __mod = n % __base;                                               \
+      n /= __base;                                                      \
     }                                                                   \
     __mod;                                                              \
   })
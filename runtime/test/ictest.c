@@ -0,0 +1,216 @@
+/*
+ * Offline check of the inline caches of runtime/include/cfggen/icache.h.
+ *
+ * Lays out a module with one indirect call check and a code heap at fixed
+ * addresses, gives the check's class a single target and checks that the
+ * check is specialized, then that it is reverted when the class gains
+ * another target and when its target is deleted, moved or unregistered,
+ * i.e. what gen_cfg, delete_code, move_code and reg_cfg_metadata do in the
+ * runtime. Built by make check, without libc.
+ */
+
+#include <mm.h>
+#include <io.h>
+#include <string.h>
+#include <syscall.h>
+#include <stdarg.h>
+#include <cfggen/cfggen.h>
+#include <cfggen/icache.h>
+
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args);
+
+/* what cfggen.h and icache.h expect from the runtime */
+int COMPAT_MODE = 0;
+int ACTIVATION_GRANULARITY = ACTIVATE_SITE;
+const char *MCFI_PROFILE = 0;
+const char *MCFI_PROFILE_OUT = 0;
+int INLINE_CACHE = TRUE;
+const char *MCFI_IIB_OUT = 0;
+
+#define STDOUT_FILENO 1
+
+/* the table covers every address below TABLE_SIZE, like the runtime's
+   covers the sandbox; untouched pages cost nothing */
+#define TABLE_SIZE  0x60000000UL
+#define MODULE_BASE 0x50000000UL
+#define HEAP_BASE   0x51000000UL
+#define AREA_BASE   0x52000000UL
+#define REGION_SIZE 0x1000UL
+
+#define CHECK_AT 0x100          /* offset of the check in the module */
+#define BID      BID_SLOT_START /* its bary slot */
+
+/* mov %gs:BID, %rax; mov %gs:(%rdi), %rcx; cmp %rax, %rcx; jne +2; call *%rdi */
+static const unsigned char check_code[] = {
+  0x65, 0x48, 0x8b, 0x04, 0x25,
+  BID & 0xff, (BID >> 8) & 0xff, (BID >> 16) & 0xff, BID >> 24,
+  0x65, 0x48, 0x8b, 0x0f,
+  0x48, 0x39, 0xc1,
+  0x75, 0x02,
+  0xff, 0xd7,
+};
+
+static char *table;
+static code_module *modules = 0;
+static code_module *module, *heap;
+static dict *callids = 0;
+static const char *test;
+
+static void die(const char *fmt, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  write(STDERR_FILENO, buf, n);
+  quit(1);
+}
+
+static void *map_fixed(unsigned long addr, size_t size) {
+  void *p = mmap((void*)addr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  if (p != (void*)addr)
+    die("cannot map %lx bytes at %lx\n", size, addr);
+  return p;
+}
+
+unsigned long ic_map_area(size_t size, unsigned long *osb) {
+  *osb = (unsigned long)map_fixed(AREA_BASE, size);
+  return *osb;
+}
+
+void ic_serialize(void) {
+}
+
+static code_module *add_module(unsigned long base, int code_heap) {
+  code_module *m = alloc_code_module();
+  map_fixed(base, REGION_SIZE);
+  m->base_addr = m->osb_base_addr = base;
+  m->sz = REGION_SIZE;
+  m->instrumented = TRUE;
+  m->cfggened = TRUE;
+  m->code_heap = code_heap;
+  DL_APPEND(modules, m);
+  return m;
+}
+
+static symbol *add_sym(symbol **syms, char *name, size_t offset) {
+  symbol *s = alloc_sym();
+  s->name = name;
+  s->offset = offset;
+  DL_APPEND(*syms, s);
+  return s;
+}
+
+/* a function target of the class id, valid in the tables */
+static symbol *add_target(code_module *m, char *name, size_t offset,
+                          unsigned long id) {
+  dict_add(&callids, name, (void*)id);
+  *(unsigned long*)(table + m->base_addr + offset) = id;
+  return add_sym(&m->funcsyms, name, offset);
+}
+
+/* the check now belongs to the class id, as after a cfg generation */
+static void set_class(unsigned long id) {
+  *(unsigned long*)(table + BID) = id;
+}
+
+static ic_site *site(void) {
+  keyvalue *kv = dict_find(ic_sites, (void*)(MODULE_BASE + CHECK_AT));
+  return kv ? kv->value : 0;
+}
+
+static void expect_cached(unsigned long target) {
+  const unsigned char *p = (const unsigned char*)(MODULE_BASE + CHECK_AT);
+  ic_site *ic = site();
+  if (!ic || ic->target != target || p[0] != 0xe9)
+    die("%s: the check is not specialized for %lx\n", test, target);
+  unsigned long stub = MODULE_BASE + CHECK_AT + 5 + *(const int*)(p + 1);
+  /* cmp $target, %edi */
+  const unsigned char *s = (const unsigned char*)stub;
+  if (s[0] != 0x81 || s[1] != 0xff || *(const unsigned int*)(s + 2) != target)
+    die("%s: the stub at %lx does not compare against %lx\n",
+        test, stub, target);
+}
+
+static void expect_reverted(void) {
+  ic_site *ic = site();
+  if (!ic || ic->target ||
+      memcmp((void*)(MODULE_BASE + CHECK_AT), check_code, sizeof(check_code)))
+    die("%s: the check is not reverted\n", test);
+}
+
+static void pass(void) {
+  dprintf(STDOUT_FILENO, "ok %s\n", test);
+}
+
+int main(int argc, char **argv) {
+  static char f[] = "f", g[] = "g", j[] = "j", k[] = "k", l[] = "l";
+  symbol *s;
+
+  table = mmap(0, TABLE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED)
+    die("cannot map a %lx byte table\n", TABLE_SIZE);
+  module = add_module(MODULE_BASE, FALSE);
+  heap = add_module(HEAP_BASE, TRUE);
+  memcpy((void*)(MODULE_BASE + CHECK_AT), check_code, sizeof(check_code));
+  s = add_sym(&module->icfsyms, "icf", BID);
+  s->site = CHECK_AT + 9;
+
+  test = "single target";
+  add_target(module, f, 0x200, 0x11);
+  set_class(0x11);
+  ic_update(table, modules, callids, 0);
+  expect_cached(MODULE_BASE + 0x200);
+  pass();
+
+  test = "class grows";
+  add_target(module, g, 0x208, 0x11);
+  ic_update(table, modules, callids, 0);
+  expect_reverted();
+  pass();
+
+  test = "target deleted";
+  add_target(heap, j, 0x100, 0x21);
+  set_class(0x21);
+  ic_update(table, modules, callids, 0);
+  expect_cached(HEAP_BASE + 0x100);
+  /* delete_code */
+  ic_revert(HEAP_BASE + 0xf8, 0x10);
+  *(unsigned long*)(table + HEAP_BASE + 0x100) = 0;
+  expect_reverted();
+  /* the symbol stays, but its tary entry is invalid */
+  ic_update(table, modules, callids, 0);
+  expect_reverted();
+  pass();
+
+  test = "target moved";
+  s = add_target(heap, k, 0x200, 0x31);
+  set_class(0x31);
+  ic_update(table, modules, callids, 0);
+  expect_cached(HEAP_BASE + 0x200);
+  /* move_code */
+  ic_revert(HEAP_BASE + 0x200, 0x10);
+  *(unsigned long*)(table + HEAP_BASE + 0x400) = 0x31;
+  *(unsigned long*)(table + HEAP_BASE + 0x200) = 0;
+  expect_reverted();
+  /* the jitted code registers the moved function again */
+  s->offset = 0x400;
+  ic_update(table, modules, callids, 0);
+  expect_cached(HEAP_BASE + 0x400);
+  pass();
+
+  test = "target unregistered";
+  add_target(heap, l, 0x600, 0x41);
+  set_class(0x41);
+  ic_update(table, modules, callids, 0);
+  expect_cached(HEAP_BASE + 0x600);
+  /* reg_cfg_metadata(ROCK_FUNC_SYM_UNREG) */
+  ic_revert(HEAP_BASE + 0x600, 1);
+  *(unsigned long*)(table + HEAP_BASE + 0x600) = 0;
+  expect_reverted();
+  pass();
+
+  return 0;
+}
@@ -1,51 +1,46 @@
 #!/usr/bin/python
 
-# This python script parses the profiling results of MCFI-hardened
-# programs and out the growth.
+# This python script parses the trace rings of MCFI-hardened programs
+# (MCFI_TRACE=prefix) and outputs the growth of activated indirect branch
+# targets.
 
+from __future__ import print_function
 import sys
 
-def get_time(s):
-    tm = s.split(']')[0]
-    tm = tm[1:]
-    sec = int(tm.split(':')[0])
-    usec = int(tm.split(':')[1])
-    return sec * 10**6 + usec
+import mcfitrace
 
-def main(prof, period = 10**6):
-    start = 0
-    end = 0
+def main(traces, period = 10**6):
     growth = list()
-    last_prof_point = start
+    last_prof_point = 0
     ibts = 0
 
-    with open(prof) as f:
-        for line in f:
-            line = line.strip()
-            if line.endswith('Started!'):
-                start = get_time(line)
-                last_prof_point = start
-            elif line.endswith('Ended!'):
-                end = get_time(line)
-                ibts += 1
+    rings, events = mcfitrace.load(traces)
+    for ns, ring, rec in events:
+        typ = rec[1]
+        cur = ns / 1000
+        if typ == mcfitrace.START:
+            last_prof_point = cur
+        elif typ == mcfitrace.END:
+            ibts += 1
+            growth.append(ibts)
+            break
+        elif typ in mcfitrace.ACTIVATIONS:
+            interval = cur - last_prof_point
+            while interval > period:
                 growth.append(ibts)
-                break
-            else:
-                cur = get_time(line)
-                interval = cur - last_prof_point
-                while interval > period:
-                    growth.append(ibts)
-                    last_prof_point += period
-                    interval -= period
-                ibts += 1
+                last_prof_point += period
+                interval -= period
+            ibts += 1
 
     for i in range(len(growth)):
-        print '%d %d' % (i, growth[i])
+        print('%d %d' % (i, growth[i]))
 
 if __name__=='__main__':
     if len(sys.argv) < 2:
-        print 'growth.py [profiling.out] [period in microseconds, one second (10^6) by default]'
+        print('growth.py [trace ring]... [period in microseconds, one second (10^6) by default]')
+        sys.exit(1)
     period = 10**6
-    if len(sys.argv) == 3:
-        period = int(sys.argv[2])
-    main(sys.argv[1], period)
+    traces = sys.argv[1:]
+    if traces[-1].isdigit():
+        period = int(traces.pop())
+    main(traces, period)
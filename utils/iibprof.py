@@ -0,0 +1,199 @@
+#!/usr/bin/python
+
+# This python script reads the per-branch counts that the MCFI runtime
+# writes with MCFI_IIB_OUT=file for modules compiled with
+# -Xclang -mprofile-iib, and maps each counted indirect branch back to its
+# function through the __mcfi_bary_ symbols, .MCFIIndirectCalls and
+# .MCFIFuncInfo of the given modules.
+
+from __future__ import print_function
+import struct
+import sys
+
+MAGIC = b'MCFIIIB1'
+HEADER = struct.Struct('<8sII')
+MODULE = struct.Struct('<20sII')
+SITE = struct.Struct('<IIQ')
+# runtime/src/main.c, X64ABIBASE
+EXE_BASE = 0x400000
+ET_EXEC = 2
+STT_FUNC = 2
+NT_GNU_BUILD_ID = 3
+
+# kinds of .MCFIIndirectCalls records
+CALLS = {'N': 'call', 'V': 'virtual call', 'D': 'virtual dtor call',
+         'P': 'method pointer call'}
+
+def cstr(data, off):
+    return data[off:data.index(b'\0', off)].decode('latin-1')
+
+class Module(object):
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            data = f.read()
+        if data[:4] != b'\x7fELF':
+            raise ValueError('%s is not an ELF file' % path)
+        self.path = path
+        e_type = struct.unpack_from('<H', data, 16)[0]
+        self.bias = EXE_BASE if e_type == ET_EXEC else 0
+        shoff, = struct.unpack_from('<Q', data, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from('<HHH', data, 0x3a)
+        shdrs = [struct.unpack_from('<IIQQQQIIQQ', data, shoff + i * shentsize)
+                 for i in range(shnum)]
+        shstr = shdrs[shstrndx][4]
+        sections = {}
+        for sh in shdrs:
+            sections[cstr(data, shstr + sh[0])] = sh
+
+        self.build_id = None
+        if '.note.gnu.build-id' in sections:
+            off = sections['.note.gnu.build-id'][4]
+            namesz, descsz, typ = struct.unpack_from('<III', data, off)
+            if typ == NT_GNU_BUILD_ID:
+                desc = off + 12 + ((namesz + 3) & ~3)
+                self.build_id = data[desc:desc + min(descsz, 20)]
+
+        # __mcfi_bary_ labels by address, __mcfi_icj_ return addresses by
+        # bary id, and functions
+        self.bary = {}
+        self.icj = {}
+        self.funcs = []
+        if '.symtab' in sections:
+            sh = sections['.symtab']
+            strtab = shdrs[sh[6]][4]
+            for i in range(sh[5] // 24):
+                name, info, other, shndx, value, size = \
+                    struct.unpack_from('<IBBHQQ', data, sh[4] + i * 24)
+                name = cstr(data, strtab + name)
+                if name.startswith('__mcfi_bary_'):
+                    self.bary[value] = name[12:]
+                elif name.startswith('__mcfi_icj_'):
+                    bid = name[11:].split('_', 1)[1]
+                    self.icj.setdefault(bid, []).append(value)
+                elif info & 0xf == STT_FUNC and shndx != 0:
+                    self.funcs.append((value, size, name))
+        self.funcs.sort()
+
+        # indirect calls by bary id
+        self.calls = {}
+        for rec in self.records(data, sections, '.MCFIIndirectCalls'):
+            f = rec.split('#')
+            if len(f) > 1:
+                self.calls[f[0]] = (CALLS.get(f[1], 'call'),
+                                    '#'.join(x for x in f[2:] if x))
+        # returns and indirect tail calls by bary id
+        self.returns = {}
+        self.tails = {}
+        for rec in self.records(data, sections, '.MCFIFuncInfo'):
+            lines = rec.split('\n')
+            if not lines[0].startswith('{ '):
+                continue
+            fn = lines[0][2:]
+            for line in lines[1:]:
+                if line.startswith('R '):
+                    for bid in line[2:].split():
+                        self.returns[bid] = fn
+                elif line.startswith('I '):
+                    for bid in line[2:].split():
+                        self.tails[bid] = fn
+
+    @staticmethod
+    def records(data, sections, name):
+        if name not in sections:
+            return []
+        sh = sections[name]
+        raw = data[sh[4]:sh[4] + sh[5]].decode('latin-1')
+        return [r for r in raw.split('\0') if r]
+
+    def function(self, addr):
+        found = None
+        for value, size, name in self.funcs:
+            if value > addr:
+                break
+            if addr < value + max(size, 1):
+                found = name
+        return found or '?'
+
+    def describe(self, site):
+        """kind, function and details of the branch whose bary label is at
+        site"""
+        addr = site + self.bias
+        bid = self.bary.get(addr)
+        fn = self.function(addr)
+        if bid is None:
+            return 'branch', fn, '', addr
+        if bid in self.returns:
+            return 'return', self.returns[bid], '', addr
+        if bid in self.calls:
+            kind, typ = self.calls[bid]
+            if bid in self.tails:
+                kind = 'tail ' + kind
+            # the return address of the call in this function
+            ras = [ra for ra in self.icj.get(bid, []) if ra > addr]
+            detail = typ
+            if ras:
+                detail += ' (returns to %#x)' % min(ras)
+            return kind, fn, detail, addr
+        return 'jump', fn, '', addr
+
+def load(path):
+    """the counts of path as {build id: [(site, period, count)]}"""
+    with open(path, 'rb') as f:
+        data = f.read()
+    magic, module_count, _ = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        raise ValueError('%s is not an MCFI iib count file' % path)
+    off = HEADER.size
+    counts = {}
+    for _ in range(module_count):
+        build_id, build_id_len, site_count = MODULE.unpack_from(data, off)
+        off += MODULE.size
+        sites = []
+        for _ in range(site_count):
+            sites.append(SITE.unpack_from(data, off))
+            off += SITE.size
+        counts[build_id[:build_id_len]] = sites
+    return counts
+
+def main(dump, paths, top):
+    counts = load(dump)
+    rows = []
+    for path in paths:
+        m = Module(path)
+        if m.build_id is None:
+            print('%s: no build id, link it with -Wl,--build-id' % path,
+                  file=sys.stderr)
+            continue
+        if m.build_id not in counts:
+            print('%s: not in %s' % (path, dump), file=sys.stderr)
+            continue
+        for site, period, count in counts.pop(m.build_id):
+            kind, fn, detail, addr = m.describe(site)
+            rows.append((count * period, period > 1, path, addr, kind, fn,
+                         detail))
+    for build_id in counts:
+        print('module %s has no ELF file given' %
+              ''.join('%02x' % c for c in bytearray(build_id)),
+              file=sys.stderr)
+    rows.sort(key=lambda r: -r[0])
+    total = sum(r[0] for r in rows)
+    print('%14s %6s  %-18s %-20s %s' % ('count', '%', 'address', 'kind',
+                                        'function'))
+    for count, sampled, path, addr, kind, fn, detail in rows[:top]:
+        share = 100.0 * count / total if total else 0
+        print('%13d%s %6.2f  %-18s %-20s %s%s' %
+              (count, '~' if sampled else ' ', share, '%s:%#x' % (
+                  path.rsplit('/', 1)[-1], addr), kind, fn,
+               '  ' + detail if detail else ''))
+
+if __name__=='__main__':
+    if len(sys.argv) < 3:
+        print('iibprof.py [count file] [module]... [-n top branches, all by default]')
+        sys.exit(1)
+    args = sys.argv[1:]
+    top = None
+    if '-n' in args:
+        i = args.index('-n')
+        top = int(args[i + 1])
+        del args[i:i + 2]
+    main(args[0], args[1:], top)
@@ -0,0 +1,86 @@
+#!/usr/bin/python
+
+# This python script samples the counters that the MCFI runtime publishes
+# in /dev/shm/mcfi-metrics.<pid>. Without a pid it lists the running
+# MCFI processes; with an interval it prints what changed in each one.
+
+from __future__ import print_function
+import glob
+import mmap
+import os
+import struct
+import sys
+import time
+
+MAGIC = b'MCFIMET1'
+PREFIX = '/dev/shm/mcfi-metrics.'
+# runtime/include/metrics.h
+FIELDS = ['lock_waits', 'lock_wait_tsc', 'cfg_lock_waits', 'cfg_lock_wait_tsc',
+          'call_traps', 'entry_traps', 'at_traps',
+          'gen_cfgs', 'gen_cfg_ns', 'gen_cfg_ns_last', 'gen_cfg_ns_max',
+          'call_eqcs', 'ret_eqcs',
+          'mmaps', 'mmap_bytes', 'munmaps', 'munmap_bytes', 'mprotects',
+          'modules', 'table_bytes', 'load_mapped_bytes', 'load_copied_bytes']
+LAYOUT = struct.Struct('<8sII4Q%dQ' % len(FIELDS))
+# counters that are not running totals
+GAUGES = ('gen_cfg_ns_last', 'gen_cfg_ns_max', 'call_eqcs', 'ret_eqcs',
+          'modules', 'table_bytes')
+
+def alive(pid):
+    return os.path.exists('/proc/%d' % pid)
+
+class Segment(object):
+    def __init__(self, pid):
+        with open(PREFIX + str(pid), 'rb') as f:
+            self.map = mmap.mmap(f.fileno(), LAYOUT.size, mmap.MAP_SHARED,
+                                 mmap.PROT_READ)
+
+    def sample(self):
+        v = LAYOUT.unpack_from(self.map)
+        if v[0] != MAGIC:
+            raise ValueError('not an MCFI metrics segment')
+        s = dict(zip(FIELDS, v[7:]))
+        tsc0, ns0, tsc1, ns1 = v[3:7]
+        # ticks are converted to nanoseconds once a cfg generation has
+        # given the runtime a second clock reading
+        rate = float(ns1 - ns0) / (tsc1 - tsc0) if tsc1 > tsc0 else None
+        for k in ('lock_wait_tsc', 'cfg_lock_wait_tsc'):
+            s[k.replace('_tsc', '_ns')] = s[k] * rate if rate else None
+            del s[k]
+        return s
+
+def show(s, prev = None):
+    for k in sorted(s):
+        v = s[k]
+        if v is None:
+            print('%-20s n/a' % k)
+        elif prev is None or k in GAUGES or prev[k] is None:
+            print('%-20s %d' % (k, v))
+        else:
+            print('%-20s %d (+%d)' % (k, v, v - prev[k]))
+
+def main(argv):
+    if not argv:
+        for path in sorted(glob.glob(PREFIX + '*')):
+            pid = int(path[len(PREFIX):])
+            print('%d%s' % (pid, '' if alive(pid) else ' (exited)'))
+        return
+    pid = int(argv[0])
+    seg = Segment(pid)
+    if len(argv) == 1:
+        show(seg.sample())
+        return
+    interval = float(argv[1])
+    prev = None
+    while alive(pid):
+        s = seg.sample()
+        show(s, prev)
+        print()
+        prev = s
+        time.sleep(interval)
+
+if __name__=='__main__':
+    if len(sys.argv) > 1 and sys.argv[1] in ('-h', '--help'):
+        print('mcfistat.py [pid] [interval in seconds]')
+        sys.exit(0)
+    main(sys.argv[1:])
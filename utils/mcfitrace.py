@@ -0,0 +1,105 @@
+#!/usr/bin/python
+
+# This python script reads the trace rings written by the MCFI runtime
+# with MCFI_TRACE=prefix, one prefix.<pid>.<tid> file per thread, and
+# converts them into Chrome trace JSON (chrome://tracing, Perfetto).
+
+from __future__ import print_function
+import json
+import struct
+import sys
+
+MAGIC = b'MCFITRC1'
+HEADER = struct.Struct('<8sIIIIQQQQQQ')
+RECORD = struct.Struct('<QIIQQ')
+PAGE_SIZE = 4096
+
+# runtime/include/trace.h
+EVENTS = ['start', 'end', 'phase begin', 'phase end',
+          'trap call', 'trap entry',
+          'activate function', 'activate virtual method',
+          'activate landing pad', 'activate return address',
+          'mmap', 'munmap', 'mprotect',
+          'jit fill', 'jit move', 'jit delete', 'jit reg',
+          'metadata', 'profile replay']
+START, END, PHASE_BEGIN, PHASE_END = 0, 1, 2, 3
+ACTIVATIONS = (6, 7, 8, 9)
+PHASES = ['Process MCFI Metadata', 'CFG Generation', 'Metadata Merging',
+          'Call Graph Construction', 'Call Graph EQC',
+          'Return Graph Construction', 'Return Graph EQC',
+          'ID Generation and Table Filling', 'Profile Replay',
+          'CFG Freezing']
+ARGS = {10: ('prot', 'addr', 'len'), 11: (None, 'addr', 'len'),
+        12: ('prot', 'addr', 'len'), 13: ('flags', 'addr', 'len'),
+        14: (None, 'target', 'source'), 15: (None, 'addr', 'len'),
+        16: ('type', 'md', 'extra'), 17: (None, None, 'bytes'),
+        18: (None, 'replayed', 'skipped')}
+
+class Ring(object):
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            data = f.read()
+        (magic, version, record_size, self.pid, self.tid, capacity, head,
+         self.tsc0, self.ns0, self.tsc1, self.ns1) = HEADER.unpack_from(data)
+        if magic != MAGIC or record_size != RECORD.size:
+            raise ValueError('%s is not an MCFI trace' % path)
+        self.path = path
+        self.dropped = max(0, head - capacity)
+        self.records = []
+        for i in range(self.dropped, head):
+            off = PAGE_SIZE + (i % capacity) * RECORD.size
+            self.records.append(RECORD.unpack_from(data, off))
+
+    def rate(self):
+        """nanoseconds per tsc tick, or None if never synchronized"""
+        if self.tsc1 > self.tsc0 and self.ns1 > self.ns0:
+            return float(self.ns1 - self.ns0) / (self.tsc1 - self.tsc0)
+        return None
+
+def load(paths):
+    """the rings of paths and their events as (ns, ring, record), in time
+    order"""
+    rings = [Ring(p) for p in paths]
+    rates = [r.rate() for r in rings if r.rate()]
+    fallback = max(rates) if rates else 1.0
+    events = []
+    for r in rings:
+        if r.dropped:
+            print('%s: %d oldest events were overwritten' % (r.path, r.dropped),
+                  file=sys.stderr)
+        rate = r.rate() or fallback
+        for rec in r.records:
+            ns = r.ns0 + (rec[0] - r.tsc0) * rate
+            events.append((ns, r, rec))
+    events.sort(key=lambda e: e[0])
+    return rings, events
+
+def chrome(paths, out):
+    rings, events = load(paths)
+    trace = []
+    for ns, r, (tsc, typ, a, b, c) in events:
+        ev = {'pid': r.pid, 'tid': r.tid, 'ts': ns / 1000.0}
+        if typ in (PHASE_BEGIN, PHASE_END):
+            ev['ph'] = 'B' if typ == PHASE_BEGIN else 'E'
+            ev['name'] = PHASES[a] if a < len(PHASES) else 'phase %d' % a
+        else:
+            ev['ph'] = 'i'
+            ev['s'] = 't'
+            ev['name'] = EVENTS[typ] if typ < len(EVENTS) else 'event %d' % typ
+            # traps and activations carry an address, start and end nothing
+            names = ARGS.get(typ, (None, 'addr', None) if typ > END else ())
+            args = {}
+            for name, value in zip(names, (a, b, c)):
+                if name:
+                    args[name] = value if name in ('len', 'bytes', 'replayed',
+                                                   'skipped') else hex(value)
+            ev['args'] = args
+        trace.append(ev)
+    with open(out, 'w') as f:
+        json.dump({'traceEvents': trace, 'displayTimeUnit': 'ns'}, f)
+
+if __name__=='__main__':
+    if len(sys.argv) < 3:
+        print('mcfitrace.py [output.json] [trace ring]...')
+        sys.exit(1)
+    chrome(sys.argv[2:], sys.argv[1])